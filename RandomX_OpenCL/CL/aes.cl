@@ -551,12 +551,19 @@ uint get_byte(uint a, uint start_bit) { return (a >> start_bit) & 0xFF; }
 
 #include "randomx_constants.h"
 
+// Work group size of AES kernels, the host sets it with -D (the autotuner tries 64, 128 and 256)
+#ifndef AES_WORKGROUP_SIZE
+#define AES_WORKGROUP_SIZE 64
+#endif
+
 #define fillAes_name fillAes1Rx4_scratchpad
 #define outputSize RANDOMX_SCRATCHPAD_L3
 #define outputSize0 (outputSize + 64)
 #define unroll_factor 8
 #define num_rounds 1
+#define sharded_output
 	#include "fillAes1Rx4.cl"
+#undef sharded_output
 #undef num_rounds
 #undef unroll_factor
 #undef outputSize
@@ -577,8 +584,8 @@ uint get_byte(uint a, uint start_bit) { return (a >> start_bit) & 0xFF; }
 
 #define inputSize RANDOMX_SCRATCHPAD_L3
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-__kernel void hashAes1Rx4(__global const void* input, __global void* hash, uint hashOffsetBytes, uint hashStrideBytes, uint batch_size)
+__attribute__((reqd_work_group_size(AES_WORKGROUP_SIZE, 1, 1)))
+__kernel void hashAes1Rx4(__global const void* input, __global void* hash, uint hashOffsetBytes, uint hashStrideBytes, uint batch_size, __global const void* input1, __global const void* input2, __global const void* input3, uint shard_size)
 {
 	__local uint T[2048];
 
@@ -599,7 +606,7 @@ __kernel void hashAes1Rx4(__global const void* input, __global void* hash, uint
 	const uint s1 = ((sub & 1) == 0) ? 8 : 24;
 	const uint s3 = ((sub & 1) == 0) ? 24 : 8;
 
-	__global const uint4* p = ((__global uint4*) input) + idx * ((inputSize + 64) / sizeof(uint4)) + sub;
+	__global const uint4* p = ((__global uint4*) SCRATCHPAD_SHARD(input, input1, input2, input3, idx, shard_size)) + (idx % shard_size) * ((inputSize + 64) / sizeof(uint4)) + sub;
 
 	__local const uint* const t0 = ((sub & 1) == 0) ? T : (T + 1024);
 	__local const uint* const t1 = ((sub & 1) == 0) ? (T + 256) : (T + 1792);
@@ -633,5 +640,12 @@ __kernel void hashAes1Rx4(__global const void* input, __global void* hash, uint
 	x[2] = t0[get_byte(y[2], 0)] ^ t1[get_byte(y[3], s1)] ^ t2[get_byte(y[0], 16)] ^ t3[get_byte(y[1], s3)] ^ 0xee1043c6;
 	x[3] = t0[get_byte(y[3], 0)] ^ t1[get_byte(y[0], s1)] ^ t2[get_byte(y[1], 16)] ^ t3[get_byte(y[2], s3)] ^ 0xed18f99b;
 
+#if VM_STATE_INTERLEAVE > 1
+	// Words of interleaved VM states aren't adjacent
+	const uint w = hashOffsetBytes / sizeof(ulong) + sub * 2;
+	((__global ulong*)(hash))[VM_STATE_REG(idx, w, hashStrideBytes / sizeof(ulong), VM_STATE_INTERLEAVE)] = ((ulong*)(x))[0];
+	((__global ulong*)(hash))[VM_STATE_REG(idx, w + 1, hashStrideBytes / sizeof(ulong), VM_STATE_INTERLEAVE)] = ((ulong*)(x))[1];
+#else
 	*((__global uint4*)(hash) + idx * (hashStrideBytes / sizeof(uint4)) + sub + (hashOffsetBytes / sizeof(uint4))) = *(uint4*)(x);
+#endif
 }
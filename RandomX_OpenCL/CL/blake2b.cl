@@ -17,6 +17,14 @@ You should have received a copy of the GNU General Public License
 along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "randomx_constants.h"
+
+// Work group size of Blake2b kernels, the host sets it with -D (the autotuner tries 32 and 64)
+#ifndef BLAKE2B_WORKGROUP_SIZE
+#define BLAKE2B_WORKGROUP_SIZE 64
+#endif
+
+// Only used by the benchmark kernels, blake2b_initial_hash takes the blob size as a parameter
 #define BLOCK_TEMPLATE_SIZE 76
 
 __constant static const uchar blake2b_sigma[12 * 16] = {
@@ -94,53 +102,74 @@ void blake2b_512_process_single_block(ulong *h, const ulong* m)
 	h[7] = v[7] ^ v[15] ^ iv7;
 }
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-__kernel void blake2b_initial_hash(__global void *out, __global const void* blockTemplate, uint start_nonce)
+ulong blake2b_get_input_word(__global const ulong* p, uint index, uint size, ulong nonce, uint nonce_offset, ulong nonce_mask)
+{
+	const uint pos = index * sizeof(ulong);
+
+	ulong m = 0;
+	if (pos < size)
+	{
+		m = p[index];
+		if (size - pos < sizeof(ulong))
+			m &= (ulong)(-1) >> (64 - (size - pos) * 8);
+	}
+
+	// Patch in the nonce bytes that fall into this word
+	const int k = (int)(nonce_offset) - (int)(pos);
+	if ((k >= 0) && (k < 8))
+		m = (m & ~(nonce_mask << (k * 8))) | ((nonce & nonce_mask) << (k * 8));
+	else if ((k < 0) && (k > -8))
+		m = (m & ~(nonce_mask >> (-k * 8))) | ((nonce & nonce_mask) >> (-k * 8));
+
+	return m;
+}
+
+__attribute__((reqd_work_group_size(BLAKE2B_WORKGROUP_SIZE, 1, 1)))
+__kernel void blake2b_initial_hash(__global void *out, __global const void* blob, uint blob_size, uint start_nonce, uint nonce_offset, uint nonce_width)
 {
 	const uint global_index = get_global_id(0);
 
-	__global const ulong* p = (__global const ulong*) blockTemplate;
-	ulong m[16] = {
-		(BLOCK_TEMPLATE_SIZE >   0) ? p[ 0] : 0,
-		(BLOCK_TEMPLATE_SIZE >   8) ? p[ 1] : 0,
-		(BLOCK_TEMPLATE_SIZE >  16) ? p[ 2] : 0,
-		(BLOCK_TEMPLATE_SIZE >  24) ? p[ 3] : 0,
-		(BLOCK_TEMPLATE_SIZE >  32) ? p[ 4] : 0,
-		(BLOCK_TEMPLATE_SIZE >  40) ? p[ 5] : 0,
-		(BLOCK_TEMPLATE_SIZE >  48) ? p[ 6] : 0,
-		(BLOCK_TEMPLATE_SIZE >  56) ? p[ 7] : 0,
-		(BLOCK_TEMPLATE_SIZE >  64) ? p[ 8] : 0,
-		(BLOCK_TEMPLATE_SIZE >  72) ? p[ 9] : 0,
-		(BLOCK_TEMPLATE_SIZE >  80) ? p[10] : 0,
-		(BLOCK_TEMPLATE_SIZE >  88) ? p[11] : 0,
-		(BLOCK_TEMPLATE_SIZE >  96) ? p[12] : 0,
-		(BLOCK_TEMPLATE_SIZE > 104) ? p[13] : 0,
-		(BLOCK_TEMPLATE_SIZE > 112) ? p[14] : 0,
-		(BLOCK_TEMPLATE_SIZE > 120) ? p[15] : 0,
-	};
+	__global const ulong* p = (__global const ulong*) blob;
+	const ulong nonce = (ulong)(start_nonce) + global_index;
+	const ulong nonce_mask = (nonce_width < 8) ? (((ulong)(1) << (nonce_width * 8)) - 1) : (ulong)(-1);
 
-	if (BLOCK_TEMPLATE_SIZE % sizeof(ulong))
-		m[BLOCK_TEMPLATE_SIZE / sizeof(ulong)] &= (ulong)(-1) >> (64 - (BLOCK_TEMPLATE_SIZE % sizeof(ulong)) * 8);
+	ulong h[8] = { iv0 ^ 0x01010040, iv1, iv2, iv3, iv4, iv5, iv6, iv7 };
 
-	const ulong nonce = start_nonce + global_index;
-	m[4] = (m[4] & ((ulong)(-1) >>  8)) | (nonce << 56);
-	m[5] = (m[5] & ((ulong)(-1) << 24)) | (nonce >>  8);
+	// Blake2b processes at least one block, even if the input is empty
+	const uint num_blocks = blob_size ? ((blob_size + 127) / 128) : 1;
+	for (uint block = 0; block < num_blocks; ++block)
+	{
+		ulong m[16];
+		for (uint i = 0; i < 16; ++i)
+			m[i] = blake2b_get_input_word(p, block * 16 + i, blob_size, nonce, nonce_offset, nonce_mask);
 
-	ulong hash[8];
-	blake2b_512_process_single_block(hash, m);
+		const bool last = (block == num_blocks - 1);
+		const ulong counter = last ? blob_size : ((block + 1) * 128);
+
+		ulong v[16] =
+		{
+			h[0], h[1], h[2], h[3], h[4]          , h[5], h[6]              , h[7],
+			iv0 , iv1 , iv2 , iv3 , iv4 ^ counter, iv5 , last ? ~iv6 : iv6 , iv7,
+		};
+
+		BLAKE2B_ROUNDS();
+
+		for (uint i = 0; i < 8; ++i)
+			h[i] ^= v[i] ^ v[i + 8];
+	}
 
 	__global ulong* t = ((__global ulong*) out) + global_index * 8;
-	t[0] = hash[0];
-	t[1] = hash[1];
-	t[2] = hash[2];
-	t[3] = hash[3];
-	t[4] = hash[4];
-	t[5] = hash[5];
-	t[6] = hash[6];
-	t[7] = hash[7];
+	t[0] = h[0];
+	t[1] = h[1];
+	t[2] = h[2];
+	t[3] = h[3];
+	t[4] = h[4];
+	t[5] = h[5];
+	t[6] = h[6];
+	t[7] = h[7];
 }
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
+__attribute__((reqd_work_group_size(BLAKE2B_WORKGROUP_SIZE, 1, 1)))
 __kernel void blake2b_512_single_block_bench(__global ulong *out, __global const void* in, ulong start_nonce)
 {
 	const uint global_index = get_global_id(0);
@@ -177,6 +206,13 @@ __kernel void blake2b_512_single_block_bench(__global ulong *out, __global const
 
 #define in_len 256
 
+// First 16 words of VM state registers, see VM_STATE_INTERLEAVE
+#define BLAKE2B_REGISTERS_0_15(p) \
+	(p)[ 0 * VM_STATE_INTERLEAVE], (p)[ 1 * VM_STATE_INTERLEAVE], (p)[ 2 * VM_STATE_INTERLEAVE], (p)[ 3 * VM_STATE_INTERLEAVE], \
+	(p)[ 4 * VM_STATE_INTERLEAVE], (p)[ 5 * VM_STATE_INTERLEAVE], (p)[ 6 * VM_STATE_INTERLEAVE], (p)[ 7 * VM_STATE_INTERLEAVE], \
+	(p)[ 8 * VM_STATE_INTERLEAVE], (p)[ 9 * VM_STATE_INTERLEAVE], (p)[10 * VM_STATE_INTERLEAVE], (p)[11 * VM_STATE_INTERLEAVE], \
+	(p)[12 * VM_STATE_INTERLEAVE], (p)[13 * VM_STATE_INTERLEAVE], (p)[14 * VM_STATE_INTERLEAVE], (p)[15 * VM_STATE_INTERLEAVE]
+
 #define out_len 32
 #define blake2b_512_process_double_block_name blake2b_512_process_double_block_32
 #define blake2b_hash_registers_name blake2b_hash_registers_32
@@ -185,6 +221,40 @@ __kernel void blake2b_512_single_block_bench(__global ulong *out, __global const
 #undef blake2b_512_process_double_block_name
 #undef out_len
 
+__attribute__((reqd_work_group_size(BLAKE2B_WORKGROUP_SIZE, 1, 1)))
+__kernel void blake2b_hash_registers_32_target(__global void *out, __global const void* in, uint inStrideBytes, uint start_nonce, ulong target, __global uint* shares)
+{
+	const uint global_index = get_global_id(0);
+	__global const ulong* p = ((__global const ulong*) in) + VM_STATE_REG(global_index, 0, inStrideBytes / sizeof(ulong), VM_STATE_INTERLEAVE);
+	__global ulong* h = ((__global ulong*) out) + global_index * 4;
+
+	ulong m[16] = { BLAKE2B_REGISTERS_0_15(p) };
+
+	ulong hash[8];
+	blake2b_512_process_double_block_32(hash, m, p, VM_STATE_INTERLEAVE);
+
+	h[0] = hash[0];
+	h[1] = hash[1];
+	h[2] = hash[2];
+	h[3] = hash[3];
+
+	// Same check as the CPU miner does: last 8 bytes of the hash as a little-endian 64-bit number
+	if (hash[3] < target)
+	{
+		const uint k = atomic_inc(shares);
+		if (k < MAX_SHARES)
+		{
+			__global uint* share = shares + 1 + k * (SHARE_SIZE / sizeof(uint));
+			share[0] = start_nonce + global_index;
+			for (uint i = 0; i < 4; ++i)
+			{
+				share[i * 2 + 1] = (uint)(hash[i]);
+				share[i * 2 + 2] = (uint)(hash[i] >> 32);
+			}
+		}
+	}
+}
+
 #define out_len 64
 #define blake2b_512_process_double_block_name blake2b_512_process_double_block_64
 #define blake2b_hash_registers_name blake2b_hash_registers_64
@@ -193,7 +263,7 @@ __kernel void blake2b_512_single_block_bench(__global ulong *out, __global const
 #undef blake2b_512_process_double_block_name
 #undef out_len
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
+__attribute__((reqd_work_group_size(BLAKE2B_WORKGROUP_SIZE, 1, 1)))
 __kernel void blake2b_512_double_block_bench(__global ulong *out, __global const void* in, ulong start_nonce)
 {
 	const uint global_index = get_global_id(0);
@@ -202,7 +272,7 @@ __kernel void blake2b_512_double_block_bench(__global ulong *out, __global const
 	ulong m[16] = { start_nonce + global_index, p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15] };
 
 	ulong hash[8];
-	blake2b_512_process_double_block_64(hash, m, p);
+	blake2b_512_process_double_block_64(hash, m, p, 1);
 
 	if (((uint*) hash)[15] == 0)
 		*out = start_nonce + global_index;
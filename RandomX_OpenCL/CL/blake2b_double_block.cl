@@ -17,7 +17,8 @@ You should have received a copy of the GNU General Public License
 along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 */
 
-void blake2b_512_process_double_block_name(ulong *out, ulong* m, __global const ulong* in)
+// Words of "in" are "in_step" words apart
+void blake2b_512_process_double_block_name(ulong *out, ulong* m, __global const ulong* in, uint in_step)
 {
 	ulong v[16] =
 	{
@@ -45,22 +46,22 @@ void blake2b_512_process_double_block_name(ulong *out, ulong* m, __global const
 	v[14] = ~iv6;
 	v[15] = iv7;
 
-	m[ 0] = (in_len > 128) ? in[16] : 0;
-	m[ 1] = (in_len > 136) ? in[17] : 0;
-	m[ 2] = (in_len > 144) ? in[18] : 0;
-	m[ 3] = (in_len > 152) ? in[19] : 0;
-	m[ 4] = (in_len > 160) ? in[20] : 0;
-	m[ 5] = (in_len > 168) ? in[21] : 0;
-	m[ 6] = (in_len > 176) ? in[22] : 0;
-	m[ 7] = (in_len > 184) ? in[23] : 0;
-	m[ 8] = (in_len > 192) ? in[24] : 0;
-	m[ 9] = (in_len > 200) ? in[25] : 0;
-	m[10] = (in_len > 208) ? in[26] : 0;
-	m[11] = (in_len > 216) ? in[27] : 0;
-	m[12] = (in_len > 224) ? in[28] : 0;
-	m[13] = (in_len > 232) ? in[29] : 0;
-	m[14] = (in_len > 240) ? in[30] : 0;
-	m[15] = (in_len > 248) ? in[31] : 0;
+	m[ 0] = (in_len > 128) ? in[16 * in_step] : 0;
+	m[ 1] = (in_len > 136) ? in[17 * in_step] : 0;
+	m[ 2] = (in_len > 144) ? in[18 * in_step] : 0;
+	m[ 3] = (in_len > 152) ? in[19 * in_step] : 0;
+	m[ 4] = (in_len > 160) ? in[20 * in_step] : 0;
+	m[ 5] = (in_len > 168) ? in[21 * in_step] : 0;
+	m[ 6] = (in_len > 176) ? in[22 * in_step] : 0;
+	m[ 7] = (in_len > 184) ? in[23 * in_step] : 0;
+	m[ 8] = (in_len > 192) ? in[24 * in_step] : 0;
+	m[ 9] = (in_len > 200) ? in[25 * in_step] : 0;
+	m[10] = (in_len > 208) ? in[26 * in_step] : 0;
+	m[11] = (in_len > 216) ? in[27 * in_step] : 0;
+	m[12] = (in_len > 224) ? in[28 * in_step] : 0;
+	m[13] = (in_len > 232) ? in[29 * in_step] : 0;
+	m[14] = (in_len > 240) ? in[30 * in_step] : 0;
+	m[15] = (in_len > 248) ? in[31 * in_step] : 0;
 
 	if (in_len % sizeof(ulong))
 		m[(in_len - 128) / sizeof(ulong)] &= (ulong)(-1) >> (64 - (in_len % sizeof(ulong)) * 8);
@@ -77,17 +78,17 @@ void blake2b_512_process_double_block_name(ulong *out, ulong* m, __global const
 	if (out_len > 56) out[7] = h[7] ^ v[7] ^ v[15];
 }
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
+__attribute__((reqd_work_group_size(BLAKE2B_WORKGROUP_SIZE, 1, 1)))
 __kernel void blake2b_hash_registers_name(__global void *out, __global const void* in, uint inStrideBytes)
 {
 	const uint global_index = get_global_id(0);
-	__global const ulong* p = ((__global const ulong*) in) + global_index * (inStrideBytes / sizeof(ulong));
+	__global const ulong* p = ((__global const ulong*) in) + VM_STATE_REG(global_index, 0, inStrideBytes / sizeof(ulong), VM_STATE_INTERLEAVE);
 	__global ulong* h = ((__global ulong*) out) + global_index * (out_len / sizeof(ulong));
 
-	ulong m[16] = { p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15] };
+	ulong m[16] = { BLAKE2B_REGISTERS_0_15(p) };
 
 	ulong hash[8];
-	blake2b_512_process_double_block_name(hash, m, p);
+	blake2b_512_process_double_block_name(hash, m, p, VM_STATE_INTERLEAVE);
 
 	if (out_len >  0) h[0] = hash[0];
 	if (out_len >  8) h[1] = hash[1];
@@ -17,8 +17,12 @@ You should have received a copy of the GNU General Public License
 along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 */
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-__kernel void fillAes_name(__global void* state, __global void* out, uint batch_size)
+__attribute__((reqd_work_group_size(AES_WORKGROUP_SIZE, 1, 1)))
+__kernel void fillAes_name(__global void* state, __global void* out, uint batch_size
+#ifdef sharded_output
+	, __global void* out1, __global void* out2, __global void* out3, uint shard_size
+#endif
+)
 {
 	__local uint T[2048];
 
@@ -63,7 +67,11 @@ __kernel void fillAes_name(__global void* state, __global void* out, uint batch_
 	const uint s1 = (sub & 1) ? 8 : 24;
 	const uint s3 = (sub & 1) ? 24 : 8;
 
+#ifdef sharded_output
+	__global uint4* p = ((__global uint4*) SCRATCHPAD_SHARD(out, out1, out2, out3, idx, shard_size)) + (idx % shard_size) * (outputSize0 / sizeof(uint4)) + sub;
+#else
 	__global uint4* p = ((__global uint4*) out) + idx * (outputSize0 / sizeof(uint4)) + sub;
+#endif
 
 	const __local uint* const t0 = (sub & 1) ? T : (T + 1024);
 	const __local uint* const t1 = (sub & 1) ? (T + 256) : (T + 1792);
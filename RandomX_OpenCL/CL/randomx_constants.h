@@ -19,6 +19,15 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 
 #pragma once
 
+//Cache size in KiB. Must be a power of 2.
+#define RANDOMX_ARGON_MEMORY       262144
+
+//Number of random Cache accesses per Dataset item. Minimum is 2.
+#define RANDOMX_CACHE_ACCESSES     8
+
+//Target latency for SuperscalarHash (in cycles of the reference CPU).
+#define RANDOMX_SUPERSCALAR_LATENCY   170
+
 //Dataset base size in bytes. Must be a power of 2.
 #define RANDOMX_DATASET_BASE_SIZE  2147483648
 
@@ -92,6 +101,53 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 #define VM_STATE_SIZE (REGISTERS_SIZE + IMM_BUF_SIZE + RANDOMX_PROGRAM_SIZE * 4)
 #define ROUNDING_MODE (RANDOMX_FREQ_CFROUND ? -1 : 0)
 
+// VM states (and GCN registers) of "interleave" consecutive hashes form one block. Registers of the block come first,
+// register-major, so lanes that read the same register of neighbouring hashes touch adjacent addresses.
+// Programs of the block follow one after another. Interleave 1 keeps every hash's state contiguous, GCN code only reads that layout.
+// Indices are in 64-bit words, "stride" is the size of one hash's state in words.
+#ifndef VM_STATE_INTERLEAVE
+#define VM_STATE_INTERLEAVE 1
+#endif
+#define VM_STATE_REG(idx, w, stride, interleave) (((idx) / (interleave)) * (interleave) * (stride) + (w) * (interleave) + ((idx) % (interleave)))
+#define VM_STATE_PROGRAM(idx, stride, interleave) (((idx) / (interleave)) * (interleave) * (stride) + (interleave) * (REGISTERS_SIZE / 8) + ((idx) % (interleave)) * ((stride) - REGISTERS_SIZE / 8))
+
+// Dataset initialization on GPU: cache size in bytes and packed SuperscalarHash program size.
+// Each program is stored as (size, address register) followed by SUPERSCALAR_MAX_SIZE (opcode | dst << 8 | src << 16 | mod << 24, imm32) pairs.
+#define CACHE_SIZE (RANDOMX_ARGON_MEMORY * 1024)
+#define SUPERSCALAR_MAX_SIZE (3 * RANDOMX_SUPERSCALAR_LATENCY + 2)
+#define SUPERSCALAR_PROGRAM_SIZE ((SUPERSCALAR_MAX_SIZE + 1) * 8)
+
+// Hashes that meet the target: share counter followed by up to MAX_SHARES (nonce, 32-byte hash) records
+#define MAX_SHARES 255
+#define SHARE_SIZE (4 + 32)
+#define SHARES_BUFFER_SIZE (4 + MAX_SHARES * SHARE_SIZE)
+
+// Scratchpads of a batch can be split into up to MAX_SCRATCHPAD_SHARDS buffers of "shard_size" scratchpads each, because one buffer
+// can't be larger than CL_DEVICE_MAX_MEM_ALLOC_SIZE. Kernels get all of them as arguments, buffers past the last shard are never accessed.
+#define MAX_SCRATCHPAD_SHARDS 4
+#define SCRATCHPAD_SHARD(s0, s1, s2, s3, idx, shard_size) (((idx) < (shard_size)) ? (s0) : ((idx) < (shard_size) * 2) ? (s1) : ((idx) < (shard_size) * 3) ? (s2) : (s3))
+
+// The dataset can be split into up to MAX_DATASET_PARTS buffers of consecutive items: device memory first, then host memory with a hybrid placement.
+// execute_vm gets all of them and the byte offsets where parts 1, 2 and 3 start, offsets of missing parts are 0xFFFFFFFF.
+#define MAX_DATASET_PARTS 4
+
+// Instrumented execute_vm (-D VM_COUNTERS=1) adds these 32-bit counters of every hash to a buffer of batch_size * VM_COUNTERS_COUNT.
+// Instructions are counted by execute_vm's opcode (16 classes), groups by the number of workers they need (1 to 16).
+// Program slots are instructions in the program, executed slots include the ones replayed by taken branches.
+#define VM_COUNTER_OPCODES 0
+#define VM_COUNTER_GROUP_WIDTHS 16
+#define VM_COUNTER_READS_L1 32
+#define VM_COUNTER_READS_L2 33
+#define VM_COUNTER_READS_L3 34
+#define VM_COUNTER_STORES_L1 35
+#define VM_COUNTER_STORES_L2 36
+#define VM_COUNTER_STORES_L3 37
+#define VM_COUNTER_CBRANCH_TAKEN 38
+#define VM_COUNTER_PROGRAM_SLOTS 39
+#define VM_COUNTER_EXECUTED_SLOTS 40
+#define VM_COUNTER_CFROUND_CHANGES 41
+#define VM_COUNTERS_COUNT 42
+
 // Scratchpad L1/L2/L3 bits
 #define LOC_L1 (32 - 14)
 #define LOC_L2 (32 - 18)
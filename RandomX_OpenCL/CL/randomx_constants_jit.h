@@ -22,4 +22,24 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 #define INITIAL_HASH_SIZE 64
 #define INTERMEDIATE_PROGRAM_SIZE (RANDOMX_PROGRAM_SIZE * 16)
 #define COMPILED_PROGRAM_SIZE 10048
+
+// Compiled programs of a batch share one buffer. Every hash has a slot of COMPILED_PROGRAM_SLOT_SIZE bytes, programs average
+// 4810 bytes and the few that don't fit are compiled again into one of COMPILED_PROGRAM_FALLBACK_SLOTS slots of COMPILED_PROGRAM_SIZE
+// after them. randomx_init stores the program's byte offset in registers[22], randomx_run reads it from there.
+#define COMPILED_PROGRAM_SLOT_SIZE 5888
+#define COMPILED_PROGRAM_FALLBACK_SLOTS(batch_size) ((batch_size) / 64 + 4)
+#define COMPILED_PROGRAM_ARENA_SIZE(batch_size) ((batch_size) * COMPILED_PROGRAM_SLOT_SIZE + COMPILED_PROGRAM_FALLBACK_SLOTS(batch_size) * COMPILED_PROGRAM_SIZE)
+#define COMPILED_PROGRAM_OFFSET_REG 22
+
+// randomx_init's counters, JIT_STATS_COUNT 32-bit values per batch. Fallback slots are handed out per program of a hash,
+// so there's a counter for each of them (RANDOMX_PROGRAM_COUNT). Dropped programs fit into neither slot: they're replaced by
+// an empty program, so hashes of the batch are wrong. Code sizes are counted in JIT_STATS_BUCKET_SIZE byte buckets.
+#define JIT_STATS_PROGRAMS 8
+#define JIT_STATS_FALLBACK_SLOTS 0
+#define JIT_STATS_DROPPED 8
+#define JIT_STATS_CODE_SIZE 9
+#define JIT_STATS_HISTOGRAM 10
+#define JIT_STATS_BUCKET_SIZE 256
+#define JIT_STATS_BUCKETS ((COMPILED_PROGRAM_SIZE + JIT_STATS_BUCKET_SIZE - 1) / JIT_STATS_BUCKET_SIZE)
+#define JIT_STATS_COUNT (JIT_STATS_HISTOGRAM + JIT_STATS_BUCKETS)
 #define NUM_VGPR_REGISTERS 128
@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "randomx_constants.h"
+#include "superscalar_hash.cl"
+
+// Computes dataset items [start_item, end_item) the same way as initDatasetItem() in RandomX.
+// "dataset" holds items starting from "first_item", it's 0 for the full dataset and lets tests compute any range into a small buffer.
+// All work-items execute the same program at the same time, so there's no divergence in the instruction switch.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void init_dataset(__global const ulong* cache, __global ulong* dataset, __global const uint* programs, __global const ulong* reciprocals, uint start_item, uint end_item, uint first_item)
+{
+	// Register "i" of work-item "k" is at i * 64 + k
+	__local ulong registers[8 * 64];
+
+	const uint item = start_item + get_global_id(0);
+	if (item >= end_item)
+		return;
+
+	__local ulong* r = registers + get_local_id(0);
+	superscalar_dataset_item(cache, programs, reciprocals, item, r, 64);
+
+	__global ulong* out = dataset + (ulong)(item - first_item) * (CacheLineSize / sizeof(ulong));
+	out[0] = r[0 * 64];
+	out[1] = r[1 * 64];
+	out[2] = r[2 * 64];
+	out[3] = r[3 * 64];
+	out[4] = r[4 * 64];
+	out[5] = r[5 * 64];
+	out[6] = r[6 * 64];
+	out[7] = r[7 * 64];
+}
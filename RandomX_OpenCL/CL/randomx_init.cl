@@ -1083,7 +1083,9 @@ int jit_prefetch_read(
 	return prefetch_data_count + 1;
 }
 
-__global uint* generate_jit_code(__global uint2* e, __global uint2* p0, __global uint* p, uint batch_size)
+// Finds where scratchpad loads can be prefetched and marks branch targets and ISTOREs in "e". Prefetches are stored in "p0"
+// sorted by the instruction they're moved to, returns their number.
+int jit_prefetch_program(__global uint2* e, __global uint2* p0)
 {
 	int prefetch_data_count;
 
@@ -1518,6 +1520,13 @@ __global uint* generate_jit_code(__global uint2* e, __global uint2* p0, __global
 	}
 	p0[prefetch_data_count].x = RANDOMX_PROGRAM_SIZE;
 
+	return prefetch_data_count;
+}
+
+// Emits GCN code for a program prepared by jit_prefetch_program(). It doesn't change "e" or the prefetch data in "p0",
+// so it can run again for the same program. Returns the end of the code, or 0 if it doesn't fit into "size_limit" bytes.
+__global uint* jit_emit_program(__global uint2* e, __global uint2* p0, const int prefetch_data_count, __global uint* p, const uint size_limit, uint batch_size)
+{
 	__global int* prefecth_vgprs_stack = (__global int*)(p0 + prefetch_data_count + 1);
 
 	// v86 - v127 will be used for global memory loads
@@ -1541,7 +1550,8 @@ __global uint* generate_jit_code(__global uint2* e, __global uint2* p0, __global
 
 	__global uint* last_branch_target = p;
 
-	const uint size_limit = (COMPILED_PROGRAM_SIZE - 200) / sizeof(uint);
+	// One instruction takes less than 200 bytes, they're checked after they're emitted
+	const uint max_size = (size_limit - 200) / sizeof(uint);
 	__global uint* start_p = p;
 
 	#pragma unroll 1
@@ -1600,12 +1610,10 @@ __global uint* generate_jit_code(__global uint2* e, __global uint2* p0, __global
 			}
 
 			p = jit_emit_instruction(p, last_branch_target, jit_inst, jit_prefetch_vgpr_index, jit_vmcnt, batch_size);
-			if (p - start_p > size_limit)
+			if (p - start_p > max_size)
 			{
-				// Code size limit exceeded!!!
-				// Jump back to randomx_run kernel
-				*(p++) = S_SETPC_B64_S12_13; // s_setpc_b64 s[12:13]
-				return p;
+				// Code size limit exceeded
+				return 0;
 			}
 		} while (!done);
 	}
@@ -1615,8 +1623,44 @@ __global uint* generate_jit_code(__global uint2* e, __global uint2* p0, __global
 	return p;
 }
 
+// Compiles the program into the hash's slot, or into a fallback slot if it doesn't fit there (see COMPILED_PROGRAM_SLOT_SIZE).
+// Returns the program's byte offset in "programs".
+uint generate_jit_code(__global uint2* e, __global uint2* p0, __global uint* programs, uint global_index, __global uint* jit_stats, uint program_index, uint batch_size)
+{
+	const int prefetch_data_count = jit_prefetch_program(e, p0);
+
+	uint offset = global_index * COMPILED_PROGRAM_SLOT_SIZE;
+	__global uint* p = jit_emit_program(e, p0, prefetch_data_count, programs + offset / sizeof(uint), COMPILED_PROGRAM_SLOT_SIZE, batch_size);
+
+	if (!p)
+	{
+		const uint fallback_slot = atomic_inc(jit_stats + JIT_STATS_FALLBACK_SLOTS + program_index);
+		if (fallback_slot < COMPILED_PROGRAM_FALLBACK_SLOTS(batch_size))
+		{
+			offset = batch_size * COMPILED_PROGRAM_SLOT_SIZE + fallback_slot * COMPILED_PROGRAM_SIZE;
+			p = jit_emit_program(e, p0, prefetch_data_count, programs + offset / sizeof(uint), COMPILED_PROGRAM_SIZE, batch_size);
+		}
+
+		if (!p)
+		{
+			// Run an empty program instead of a truncated one, the host discards shares of the batch
+			atomic_inc(jit_stats + JIT_STATS_DROPPED);
+			offset = global_index * COMPILED_PROGRAM_SLOT_SIZE;
+			programs[offset / sizeof(uint)] = S_SETPC_B64_S12_13;
+			return offset;
+		}
+	}
+
+	const uint size = (uint)(p - programs) * sizeof(uint) - offset;
+	atomic_add(jit_stats + JIT_STATS_CODE_SIZE, size);
+	atomic_inc(jit_stats + JIT_STATS_HISTOGRAM + min(size / JIT_STATS_BUCKET_SIZE, (uint)(JIT_STATS_BUCKETS - 1)));
+
+	return offset;
+}
+
+// "program_index" is the program of the hash (0 to RANDOMX_PROGRAM_COUNT - 1), "jit_stats" must be cleared when the batch starts
 __attribute__((reqd_work_group_size(64, 1, 1)))
-__kernel void randomx_init(__global ulong* entropy, __global ulong* registers, __global uint2* intermediate_programs, __global uint* programs, uint batch_size)
+__kernel void randomx_init(__global ulong* entropy, __global ulong* registers, __global uint2* intermediate_programs, __global uint* programs, __global uint* jit_stats, uint batch_size, uint program_index)
 {
 	const uint global_index = get_global_id(0) / 32;
 	const uint sub = get_global_id(0) % 32;
@@ -1626,9 +1670,8 @@ __kernel void randomx_init(__global ulong* entropy, __global ulong* registers, _
 
 	__global uint2* e = (__global uint2*)(entropy + global_index * (ENTROPY_SIZE / sizeof(ulong)) + (128 / sizeof(ulong)));
 	__global uint2* p0 = intermediate_programs + global_index * (INTERMEDIATE_PROGRAM_SIZE / sizeof(uint2));
-	__global uint* p = programs + global_index * (COMPILED_PROGRAM_SIZE / sizeof(uint));
 
-	generate_jit_code(e, p0, p, batch_size);
+	const uint program_offset = generate_jit_code(e, p0, programs, global_index, jit_stats, program_index, batch_size);
 
 	__global ulong* R = registers + global_index * 32;
 	entropy += global_index * (ENTROPY_SIZE / sizeof(ulong));
@@ -1674,4 +1717,6 @@ __kernel void randomx_init(__global ulong* entropy, __global ulong* registers, _
 	// eMask
 	R[20] = getFloatMask(entropy[14]);
 	R[21] = getFloatMask(entropy[15]);
+
+	R[COMPILED_PROGRAM_OFFSET_REG] = program_offset;
 }
@@ -59,12 +59,14 @@ __kernel void randomx_run(__global const uchar* dataset, __global uchar* scratch
 	registers += idx * REGISTERS_COUNT;
 	scratchpad += idx * (ulong)(ScratchpadL3Size + 64);
 	rounding_modes += idx;
-	programs += get_group_id(0) * (COMPILED_PROGRAM_SIZE / sizeof(uint));
 
 	// Copy registers (256 bytes) into shared memory: 32 workers, 8 bytes for each worker
 	((__local ulong*) R)[sub] = ((__global ulong*) registers)[sub];
 	barrier(CLK_LOCAL_MEM_FENCE);
 
+	// Byte offset of the compiled program, randomx_init stores it there
+	programs += ((__local uint*)(R + COMPILED_PROGRAM_OFFSET_REG))[0] / sizeof(uint);
+
 	if (sub >= 8)
 		return;
 
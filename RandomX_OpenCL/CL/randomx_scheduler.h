@@ -0,0 +1,1061 @@
+/*
+Copyright (c) 2019 SChernykh
+Portions Copyright (c) 2018-2019 tevador
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Instruction scheduling for init_vm. The host runs the same code on random programs to compare schedulers without a GPU
+// (see scheduler_stats.cpp), so everything here is both OpenCL C and C++.
+//
+// A schedule puts every instruction into slots of execution_plan, "workers" slots per row. Occupied slots that follow each other
+// in a row form a group which inner_loop() runs in one step. FP instructions take 2 adjacent slots and come first in their group.
+// All instructions of a group read registers before any of them writes, so an instruction can share a group with an earlier one
+// that only reads what it writes.
+
+#pragma once
+
+#ifdef __OPENCL_VERSION__
+
+#define SCHEDULER_GLOBAL __global
+#define SCHEDULER_LOCAL __local
+
+#else
+
+// Host build, these come from randomx_vm.cl on GPU
+#define SCHEDULER_GLOBAL
+#define SCHEDULER_LOCAL
+
+#define CacheLineSize 64
+#define ScratchpadL3Mask64 (RANDOMX_SCRATCHPAD_L3 - CacheLineSize)
+#define RegistersCount 8
+#define RegisterCountFlt (RegistersCount / 2)
+#define StoreL3Condition 14
+
+struct uint2
+{
+	uint32_t x, y;
+};
+
+#define set_byte(a, position, value) do { ((uint8_t*)&(a))[(position)] = (value); } while (0)
+inline uint32_t get_byte(uint64_t a, uint32_t position) { return (a >> (position << 3)) & 0xFF; }
+// Both arguments must have the same type, the host build warns about signed/unsigned comparisons
+#define update_max(value, next_value) do { if ((value) < (next_value)) (value) = (next_value); } while (0)
+
+#endif
+
+#if RANDOMX_PROGRAM_SIZE <= 256
+typedef uint8_t exec_t;
+#else
+typedef uint16_t exec_t;
+#endif
+
+// execution_plan stores instruction indices and 0 means an empty slot, so slots of instruction 0 are told apart by first_instruction_slot
+typedef struct
+{
+	int32_t first_instruction_slot;
+	int32_t last_used_slot;
+	bool first_instruction_fp;
+} Schedule;
+
+// Marks FP instructions (src |= 0x20), CBRANCH instructions (src |= 0x10) and instructions they jump to (src |= 0x40)
+void mark_branches(SCHEDULER_GLOBAL uint2* src_program)
+{
+#if RANDOMX_PROGRAM_SIZE <= 256
+	uint64_t registerLastChanged = 0;
+	uint64_t registerWasChanged = 0;
+#else
+	int32_t registerLastChanged[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+#endif
+
+	// Initialize CBRANCH instructions
+	for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
+	{
+		// Clear all src flags (branch target, FP, branch)
+		*(SCHEDULER_GLOBAL uint32_t*)(src_program + i) &= ~(0xF8U << 8);
+
+		const uint2 src_inst = src_program[i];
+		uint2 inst = src_inst;
+
+		uint32_t opcode = inst.x & 0xff;
+		const uint32_t dst = (inst.x >> 8) & 7;
+		const uint32_t src = (inst.x >> 16) & 7;
+
+		if (opcode < RANDOMX_FREQ_IADD_RS + RANDOMX_FREQ_IADD_M + RANDOMX_FREQ_ISUB_R + RANDOMX_FREQ_ISUB_M + RANDOMX_FREQ_IMUL_R + RANDOMX_FREQ_IMUL_M + RANDOMX_FREQ_IMULH_R + RANDOMX_FREQ_IMULH_M + RANDOMX_FREQ_ISMULH_R + RANDOMX_FREQ_ISMULH_M)
+		{
+#if RANDOMX_PROGRAM_SIZE <= 256
+			set_byte(registerLastChanged, dst, i);
+			set_byte(registerWasChanged, dst, 1);
+#else
+			registerLastChanged[dst] = i;
+#endif
+			continue;
+		}
+		opcode -= RANDOMX_FREQ_IADD_RS + RANDOMX_FREQ_IADD_M + RANDOMX_FREQ_ISUB_R + RANDOMX_FREQ_ISUB_M + RANDOMX_FREQ_IMUL_R + RANDOMX_FREQ_IMUL_M + RANDOMX_FREQ_IMULH_R + RANDOMX_FREQ_IMULH_M + RANDOMX_FREQ_ISMULH_R + RANDOMX_FREQ_ISMULH_M;
+
+		if (opcode < RANDOMX_FREQ_IMUL_RCP)
+		{
+			if (inst.y & (inst.y - 1))
+			{
+#if RANDOMX_PROGRAM_SIZE <= 256
+				set_byte(registerLastChanged, dst, i);
+				set_byte(registerWasChanged, dst, 1);
+#else
+				registerLastChanged[dst] = i;
+#endif
+			}
+			continue;
+		}
+		opcode -= RANDOMX_FREQ_IMUL_RCP;
+
+		if (opcode < RANDOMX_FREQ_INEG_R + RANDOMX_FREQ_IXOR_R + RANDOMX_FREQ_IXOR_M + RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R)
+		{
+#if RANDOMX_PROGRAM_SIZE <= 256
+			set_byte(registerLastChanged, dst, i);
+			set_byte(registerWasChanged, dst, 1);
+#else
+			registerLastChanged[dst] = i;
+#endif
+			continue;
+		}
+		opcode -= RANDOMX_FREQ_INEG_R + RANDOMX_FREQ_IXOR_R + RANDOMX_FREQ_IXOR_M + RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R;
+
+		if (opcode < RANDOMX_FREQ_ISWAP_R)
+		{
+			if (src != dst)
+			{
+#if RANDOMX_PROGRAM_SIZE <= 256
+				set_byte(registerLastChanged, dst, i);
+				set_byte(registerWasChanged, dst, 1);
+				set_byte(registerLastChanged, src, i);
+				set_byte(registerWasChanged, src, 1);
+#else
+				registerLastChanged[dst] = i;
+				registerLastChanged[src] = i;
+#endif
+			}
+			continue;
+		}
+		opcode -= RANDOMX_FREQ_ISWAP_R;
+
+		if (opcode < RANDOMX_FREQ_FSWAP_R + RANDOMX_FREQ_FADD_R + RANDOMX_FREQ_FADD_M + RANDOMX_FREQ_FSUB_R + RANDOMX_FREQ_FSUB_M + RANDOMX_FREQ_FSCAL_R + RANDOMX_FREQ_FMUL_R + RANDOMX_FREQ_FDIV_M + RANDOMX_FREQ_FSQRT_R)
+		{
+			// Mark FP instruction (src |= 0x20)
+			*(SCHEDULER_GLOBAL uint32_t*)(src_program + i) |= 0x20 << 8;
+			continue;
+		}
+		opcode -= RANDOMX_FREQ_FSWAP_R + RANDOMX_FREQ_FADD_R + RANDOMX_FREQ_FADD_M + RANDOMX_FREQ_FSUB_R + RANDOMX_FREQ_FSUB_M + RANDOMX_FREQ_FSCAL_R + RANDOMX_FREQ_FMUL_R + RANDOMX_FREQ_FDIV_M + RANDOMX_FREQ_FSQRT_R;
+
+		if (opcode < RANDOMX_FREQ_CBRANCH)
+		{
+			const uint32_t creg = dst;
+#if RANDOMX_PROGRAM_SIZE <= 256
+			const uint32_t change = get_byte(registerLastChanged, dst);
+			const int32_t lastChanged = (get_byte(registerWasChanged, dst) == 0) ? -1 : (int32_t)(change);
+
+			// Store condition register and branch target in CBRANCH instruction
+			*(SCHEDULER_GLOBAL uint32_t*)(src_program + i) = (src_inst.x & 0xFF0000FFU) | ((creg | ((lastChanged == -1) ? 0x90 : 0x10)) << 8) | (((uint32_t)(lastChanged) & 0xFF) << 16);
+#else
+			const int32_t lastChanged = registerLastChanged[dst];
+
+			// Store condition register in CBRANCH instruction
+			*(SCHEDULER_GLOBAL uint32_t*)(src_program + i) = (src_inst.x & 0xFF0000FFU) | ((creg | 0x10) << 8);
+#endif
+
+			// Mark branch target instruction (src |= 0x40)
+			*(SCHEDULER_GLOBAL uint32_t*)(src_program + lastChanged + 1) |= 0x40 << 8;
+
+#if RANDOMX_PROGRAM_SIZE <= 256
+			uint32_t tmp = i | (i << 8);
+			registerLastChanged = tmp | (tmp << 16);
+			registerLastChanged = registerLastChanged | (registerLastChanged << 32);
+
+			registerWasChanged = 0x0101010101010101UL;
+#else
+			registerLastChanged[0] = i;
+			registerLastChanged[1] = i;
+			registerLastChanged[2] = i;
+			registerLastChanged[3] = i;
+			registerLastChanged[4] = i;
+			registerLastChanged[5] = i;
+			registerLastChanged[6] = i;
+			registerLastChanged[7] = i;
+#endif
+		}
+	}
+}
+
+// In-order scheduler: every instruction takes the first free slot its registers, memory accesses and rounding mode allow.
+// Branch targets and CBRANCH instructions can't move before anything scheduled earlier.
+Schedule schedule_in_order(SCHEDULER_GLOBAL uint2* src_program, SCHEDULER_LOCAL exec_t* execution_plan, const int32_t workers)
+{
+	uint64_t registerLatency = 0;
+	uint64_t registerReadCycle = 0;
+	uint64_t registerLatencyFP = 0;
+	uint64_t registerReadCycleFP = 0;
+	uint32_t ScratchpadHighLatency = 0;
+	volatile uint32_t ScratchpadLatency = 0;
+
+	int32_t first_available_slot = 0;
+	int32_t first_allowed_slot_cfround = 0;
+	int32_t last_used_slot = -1;
+	int32_t last_memory_op_slot = -1;
+
+	uint32_t num_slots_used = 0;
+	uint32_t num_instructions = 0;
+
+	int32_t first_instruction_slot = -1;
+	bool first_instruction_fp = false;
+
+	//if (global_index == 0)
+	//{
+	//	for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
+	//	{
+	//		print_inst(src_program[j]);
+	//		printf("\n");
+	//	}
+	//	printf("\n");
+	//}
+
+	// Schedule instructions
+	bool update_branch_target_mark = false;
+	bool first_available_slot_is_branch_target = false;
+	for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
+	{
+		const uint2 inst = src_program[i];
+
+		uint32_t opcode = inst.x & 0xff;
+		uint32_t dst = (inst.x >> 8) & 7;
+		const uint32_t src = (inst.x >> 16) & 7;
+		const uint32_t mod = (inst.x >> 24);
+
+		bool is_branch_target = (inst.x & (0x40 << 8)) != 0;
+		if (is_branch_target)
+		{
+			// If an instruction is a branch target, we can't move it before any previous instructions
+			first_available_slot = last_used_slot + 1;
+
+			// Mark this slot as a branch target
+			// Whatever instruction takes this slot will receive branch target flag
+			first_available_slot_is_branch_target = true;
+		}
+
+		const uint32_t dst_latency = get_byte(registerLatency, dst);
+		const uint32_t src_latency = get_byte(registerLatency, src);
+		const uint32_t reg_read_latency = (dst_latency > src_latency) ? dst_latency : src_latency;
+		const uint32_t mem_read_latency = ((dst == src) && ((inst.y & ScratchpadL3Mask64) >= RANDOMX_SCRATCHPAD_L2)) ? ScratchpadHighLatency : ScratchpadLatency;
+
+		uint32_t full_read_latency = mem_read_latency;
+		update_max(full_read_latency, reg_read_latency);
+
+		uint32_t latency = 0;
+		bool is_memory_op = false;
+		bool is_memory_store = false;
+		bool is_nop = false;
+		bool is_branch = false;
+		bool is_swap = false;
+		bool is_src_read = true;
+		bool is_fp = false;
+		bool is_cfround = false;
+
+		do {
+			if (opcode < RANDOMX_FREQ_IADD_RS)
+			{
+				latency = reg_read_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IADD_RS;
+
+			if (opcode < RANDOMX_FREQ_IADD_M)
+			{
+				latency = full_read_latency;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IADD_M;
+
+			if (opcode < RANDOMX_FREQ_ISUB_R)
+			{
+				latency = reg_read_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_ISUB_R;
+
+			if (opcode < RANDOMX_FREQ_ISUB_M)
+			{
+				latency = full_read_latency;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_ISUB_M;
+
+			if (opcode < RANDOMX_FREQ_IMUL_R)
+			{
+				latency = reg_read_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IMUL_R;
+
+			if (opcode < RANDOMX_FREQ_IMUL_M)
+			{
+				latency = full_read_latency;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IMUL_M;
+
+			if (opcode < RANDOMX_FREQ_IMULH_R)
+			{
+				latency = reg_read_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IMULH_R;
+
+			if (opcode < RANDOMX_FREQ_IMULH_M)
+			{
+				latency = full_read_latency;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IMULH_M;
+
+			if (opcode < RANDOMX_FREQ_ISMULH_R)
+			{
+				latency = reg_read_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_ISMULH_R;
+
+			if (opcode < RANDOMX_FREQ_ISMULH_M)
+			{
+				latency = full_read_latency;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_ISMULH_M;
+
+			if (opcode < RANDOMX_FREQ_IMUL_RCP)
+			{
+				is_src_read = false;
+				if (inst.y & (inst.y - 1))
+					latency = dst_latency;
+				else
+					is_nop = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IMUL_RCP;
+
+			if (opcode < RANDOMX_FREQ_INEG_R)
+			{
+				is_src_read = false;
+				latency = dst_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_INEG_R;
+
+			if (opcode < RANDOMX_FREQ_IXOR_R)
+			{
+				latency = reg_read_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IXOR_R;
+
+			if (opcode < RANDOMX_FREQ_IXOR_M)
+			{
+				latency = full_read_latency;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IXOR_M;
+
+			if (opcode < RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R)
+			{
+				latency = reg_read_latency;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R;
+
+			if (opcode < RANDOMX_FREQ_ISWAP_R)
+			{
+				is_swap = true;
+				if (dst != src)
+					latency = reg_read_latency;
+				else
+					is_nop = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_ISWAP_R;
+
+			if (opcode < RANDOMX_FREQ_FSWAP_R)
+			{
+				latency = get_byte(registerLatencyFP, dst);
+				is_fp = true;
+				is_src_read = false;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FSWAP_R;
+
+			if (opcode < RANDOMX_FREQ_FADD_R)
+			{
+				dst %= RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				is_fp = true;
+				is_src_read = false;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FADD_R;
+
+			if (opcode < RANDOMX_FREQ_FADD_M)
+			{
+				dst %= RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				update_max(latency, src_latency);
+				update_max(latency, ScratchpadLatency);
+				is_fp = true;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FADD_M;
+
+			if (opcode < RANDOMX_FREQ_FSUB_R)
+			{
+				dst %= RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				is_fp = true;
+				is_src_read = false;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FSUB_R;
+
+			if (opcode < RANDOMX_FREQ_FSUB_M)
+			{
+				dst %= RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				update_max(latency, src_latency);
+				update_max(latency, ScratchpadLatency);
+				is_fp = true;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FSUB_M;
+
+			if (opcode < RANDOMX_FREQ_FSCAL_R)
+			{
+				dst %= RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				is_fp = true;
+				is_src_read = false;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FSCAL_R;
+
+			if (opcode < RANDOMX_FREQ_FMUL_R)
+			{
+				dst = (dst % RegisterCountFlt) + RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				is_fp = true;
+				is_src_read = false;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FMUL_R;
+
+			if (opcode < RANDOMX_FREQ_FDIV_M)
+			{
+				dst = (dst % RegisterCountFlt) + RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				update_max(latency, src_latency);
+				update_max(latency, ScratchpadLatency);
+				is_fp = true;
+				is_memory_op = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FDIV_M;
+
+			if (opcode < RANDOMX_FREQ_FSQRT_R)
+			{
+				dst = (dst % RegisterCountFlt) + RegisterCountFlt;
+				latency = get_byte(registerLatencyFP, dst);
+				is_fp = true;
+				is_src_read = false;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_FSQRT_R;
+
+			if (opcode < RANDOMX_FREQ_CBRANCH)
+			{
+				is_src_read = false;
+				is_branch = true;
+				latency = dst_latency;
+
+				// We can't move CBRANCH before any previous instructions
+				first_available_slot = last_used_slot + 1;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_CBRANCH;
+
+			if (opcode < RANDOMX_FREQ_CFROUND)
+			{
+				latency = src_latency;
+				is_cfround = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_CFROUND;
+
+			if (opcode < RANDOMX_FREQ_ISTORE)
+			{
+				latency = reg_read_latency;
+				update_max(latency, (uint32_t)((last_memory_op_slot + workers) / workers));
+				is_memory_op = true;
+				is_memory_store = true;
+				break;
+			}
+			opcode -= RANDOMX_FREQ_ISTORE;
+
+			is_nop = true;
+		} while (false);
+
+		if (is_nop)
+		{
+			if (is_branch_target)
+			{
+				// Mark next non-NOP instruction as the branch target instead of this NOP
+				update_branch_target_mark = true;
+			}
+			continue;
+		}
+
+		if (update_branch_target_mark)
+		{
+			*(SCHEDULER_GLOBAL uint32_t*)(src_program + i) |= 0x40 << 8;
+			update_branch_target_mark = false;
+			is_branch_target = true;
+		}
+
+		int32_t first_allowed_slot = first_available_slot;
+		update_max(first_allowed_slot, (int32_t)latency * workers);
+		if (is_cfround)
+			update_max(first_allowed_slot, first_allowed_slot_cfround);
+		else
+			update_max(first_allowed_slot, (int32_t)get_byte(is_fp ? registerReadCycleFP : registerReadCycle, dst) * workers);
+
+		if (is_swap)
+			update_max(first_allowed_slot, (int32_t)get_byte(registerReadCycle, src) * workers);
+
+		int32_t slot_to_use = last_used_slot + 1;
+		update_max(slot_to_use, first_allowed_slot);
+
+		if (is_fp)
+		{
+			slot_to_use = -1;
+			for (int32_t j = first_allowed_slot; slot_to_use < 0; ++j)
+			{
+				if ((execution_plan[j] == 0) && (execution_plan[j + 1] == 0) && ((j + 1) % workers))
+				{
+					bool blocked = false;
+					for (int32_t k = (j / workers) * workers; k < j; ++k)
+					{
+						if (execution_plan[k] || (k == first_instruction_slot))
+						{
+							const uint32_t inst = src_program[execution_plan[k]].x;
+
+							// If there is an integer instruction which is a branch target or a branch, or this FP instruction is a branch target itself, we can't reorder it to add more FP instructions to this cycle
+							if (((inst & (0x20 << 8)) == 0) && (((inst & (0x50 << 8)) != 0) || is_branch_target))
+							{
+								blocked = true;
+								continue;
+							}
+						}
+					}
+
+					if (!blocked)
+					{
+						for (int32_t k = (j / workers) * workers; k < j; ++k)
+						{
+							if (execution_plan[k] || (k == first_instruction_slot))
+							{
+								const uint32_t inst = src_program[execution_plan[k]].x;
+								if ((inst & (0x20 << 8)) == 0)
+								{
+									execution_plan[j] = execution_plan[k];
+									execution_plan[j + 1] = execution_plan[k + 1];
+									if (first_instruction_slot == k) first_instruction_slot = j;
+									if (first_instruction_slot == k + 1) first_instruction_slot = j + 1;
+									slot_to_use = k;
+									break;
+								}
+							}
+						}
+
+						if (slot_to_use < 0)
+						{
+							slot_to_use = j;
+						}
+
+						break;
+					}
+				}
+			}
+		}
+		else
+		{
+			for (int32_t j = first_allowed_slot; j <= last_used_slot; ++j)
+			{
+				if (execution_plan[j] == 0)
+				{
+					slot_to_use = j;
+					break;
+				}
+			}
+		}
+
+		if (i == 0)
+		{
+			first_instruction_slot = slot_to_use;
+			first_instruction_fp = is_fp;
+		}
+
+		if (is_cfround)
+		{
+			first_allowed_slot_cfround = slot_to_use - (slot_to_use % workers) + workers;
+		}
+
+		++num_instructions;
+
+		execution_plan[slot_to_use] = i;
+		++num_slots_used;
+
+		if (is_fp)
+		{
+			execution_plan[slot_to_use + 1] = i;
+			++num_slots_used;
+		}
+
+		const uint32_t next_latency = (slot_to_use / workers) + 1;
+
+		if (is_src_read)
+		{
+			int32_t value = get_byte(registerReadCycle, src);
+			update_max(value, slot_to_use / workers);
+			set_byte(registerReadCycle, src, value);
+		}
+
+		if (is_memory_op)
+		{
+			update_max(last_memory_op_slot, slot_to_use);
+		}
+
+		if (is_cfround)
+		{
+			const uint32_t t = next_latency | (next_latency << 8);
+			registerLatencyFP = t | (t << 16);
+			registerLatencyFP = registerLatencyFP | (registerLatencyFP << 32);
+		}
+		else if (is_fp)
+		{
+			set_byte(registerLatencyFP, dst, next_latency);
+
+			int32_t value = get_byte(registerReadCycleFP, dst);
+			update_max(value, slot_to_use / workers);
+			set_byte(registerReadCycleFP, dst, value);
+		}
+		else
+		{
+			if (!is_memory_store && !is_nop)
+			{
+				set_byte(registerLatency, dst, next_latency);
+				if (is_swap)
+					set_byte(registerLatency, src, next_latency);
+
+				int32_t value = get_byte(registerReadCycle, dst);
+				update_max(value, slot_to_use / workers);
+				set_byte(registerReadCycle, dst, value);
+			}
+
+			if (is_branch)
+			{
+				const uint32_t t = next_latency | (next_latency << 8);
+				registerLatency = t | (t << 16);
+				registerLatency = registerLatency | (registerLatency << 32);
+			}
+
+			if (is_memory_store)
+			{
+				int32_t value = get_byte(registerReadCycle, dst);
+				update_max(value, slot_to_use / workers);
+				set_byte(registerReadCycle, dst, value);
+				ScratchpadLatency = (slot_to_use / workers) + 1;
+				if ((mod >> 4) >= StoreL3Condition)
+					ScratchpadHighLatency = (slot_to_use / workers) + 1;
+			}
+		}
+
+		if (execution_plan[first_available_slot] || (first_available_slot == first_instruction_slot))
+		{
+			if (first_available_slot_is_branch_target)
+			{
+				src_program[i].x |= 0x40 << 8;
+				first_available_slot_is_branch_target = false;
+			}
+
+			if (is_fp)
+				++first_available_slot;
+
+			do {
+				++first_available_slot;
+			} while ((first_available_slot < RANDOMX_PROGRAM_SIZE * workers) && (execution_plan[first_available_slot] != 0));
+		}
+
+		if (is_branch_target)
+		{
+			update_max(first_available_slot, is_fp ? (slot_to_use + 2) : (slot_to_use + 1));
+		}
+
+		update_max(last_used_slot, is_fp ? (slot_to_use + 1) : slot_to_use);
+		while (execution_plan[last_used_slot] || (last_used_slot == first_instruction_slot) || ((last_used_slot == first_instruction_slot + 1) && first_instruction_fp))
+		{
+			++last_used_slot;
+		}
+		--last_used_slot;
+
+		if (is_fp && (last_used_slot >= first_allowed_slot_cfround))
+			first_allowed_slot_cfround = last_used_slot + 1;
+
+		//if (global_index == 0)
+		//{
+		//	printf("slot_to_use = %d, first_available_slot = %d, last_used_slot = %d\n", slot_to_use, first_available_slot, last_used_slot);
+		//	for (int j = 0; j <= last_used_slot; ++j)
+		//	{
+		//		if (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp))
+		//		{
+		//			print_inst(src_program[execution_plan[j]]);
+		//			printf(" | ");
+		//		}
+		//		else
+		//		{
+		//			printf("                      | ");
+		//		}
+		//		if (((j + 1) % workers) == 0) printf("\n");
+		//	}
+		//	printf("\n\n");
+		//}
+	}
+
+	//if (global_index == 0)
+	//{
+	//	printf("IPC = %.3f, WPC = %.3f, num_instructions = %u, num_slots_used = %u, first_instruction_slot = %d, last_used_slot = %d, registerLatency = %016llx, registerLatencyFP = %016llx \n",
+	//		num_instructions / static_cast<double>(last_used_slot / workers + 1),
+	//		num_slots_used / static_cast<double>(last_used_slot / workers + 1),
+	//		num_instructions,
+	//		num_slots_used,
+	//		first_instruction_slot,
+	//		last_used_slot,
+	//		registerLatency,
+	//		registerLatencyFP
+	//	);
+
+	//	//for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
+	//	//{
+	//	//	print_inst(src_program[j]);
+	//	//	printf("\n");
+	//	//}
+	//	//printf("\n");
+
+	//	for (int j = 0; j <= last_used_slot; ++j)
+	//	{
+	//		if (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp))
+	//		{
+	//			print_inst(src_program[execution_plan[j]]);
+	//			printf(" | ");
+	//		}
+	//		else
+	//		{
+	//			printf("                      | ");
+	//		}
+	//		if (((j + 1) % workers) == 0) printf("\n");
+	//	}
+	//	printf("\n\n");
+	//}
+
+	//atomicAdd((uint32_t*)num_vm_cycles, (last_used_slot / workers) + 1);
+	//atomicAdd((uint32_t*)(num_vm_cycles) + 1, num_slots_used);
+
+	Schedule result;
+	result.first_instruction_slot = first_instruction_slot;
+	result.last_used_slot = last_used_slot;
+	result.first_instruction_fp = first_instruction_fp;
+	return result;
+}
+
+// Critical-path scheduler.
+//
+// Instructions between branch targets and CBRANCH instructions can be reordered freely as long as dependencies are kept,
+// so the program is split into such regions and every region is scheduled row by row: each row gets the ready instruction
+// with the longest chain of dependent instructions after it, until nothing else fits. Rows are packed without gaps,
+// so every row is one inner_loop step. A region can start in the last row of the previous one unless it ended with CBRANCH.
+// Regions longer than SCHEDULER_WINDOW instructions are scheduled in parts.
+
+#define SCHEDULER_WINDOW 32
+
+// What an instruction reads and writes: integer registers read (bits 0-7) and written (bits 8-15), FP register (bits 16-23) and flags
+#define SCHED_FP (1U << 24)
+#define SCHED_LOAD (1U << 25)
+#define SCHED_LOAD_HIGH (1U << 26)
+#define SCHED_STORE (1U << 27)
+#define SCHED_STORE_L3 (1U << 28)
+#define SCHED_CFROUND (1U << 29)
+#define SCHED_BRANCH (1U << 30)
+#define SCHED_NOP (1U << 31)
+
+#define SCHED_CASE(freq, result) if (opcode < (freq)) return (result); opcode -= (freq);
+
+// "inst" comes from a program marked by mark_branches()
+uint32_t schedule_decode(uint2 inst)
+{
+	uint32_t opcode = inst.x & 0xff;
+	const uint32_t dst = (inst.x >> 8) & 7;
+	const uint32_t src = (inst.x >> 16) & 7;
+	const uint32_t mod = (inst.x >> 24);
+
+	const uint32_t dst_rw = (1U << dst) | (1U << (dst + 8));
+	const uint32_t src_r = 1U << src;
+	const uint32_t src_rw = src_r | (1U << (src + 8));
+
+	// Loads from a fixed address above L2 (dst == src) can only read what L3 stores wrote
+	const uint32_t load = SCHED_LOAD | (((dst == src) && ((inst.y & ScratchpadL3Mask64) >= RANDOMX_SCRATCHPAD_L2)) ? SCHED_LOAD_HIGH : 0);
+
+	const uint32_t fp_f = SCHED_FP | (1U << (16 + (dst % RegisterCountFlt)));
+	const uint32_t fp_e = SCHED_FP | (1U << (16 + (dst % RegisterCountFlt) + RegisterCountFlt));
+
+	SCHED_CASE(RANDOMX_FREQ_IADD_RS, dst_rw | src_r);
+	SCHED_CASE(RANDOMX_FREQ_IADD_M, dst_rw | src_r | load);
+	SCHED_CASE(RANDOMX_FREQ_ISUB_R, dst_rw | src_r);
+	SCHED_CASE(RANDOMX_FREQ_ISUB_M, dst_rw | src_r | load);
+	SCHED_CASE(RANDOMX_FREQ_IMUL_R, dst_rw | src_r);
+	SCHED_CASE(RANDOMX_FREQ_IMUL_M, dst_rw | src_r | load);
+	SCHED_CASE(RANDOMX_FREQ_IMULH_R, dst_rw | src_r);
+	SCHED_CASE(RANDOMX_FREQ_IMULH_M, dst_rw | src_r | load);
+	SCHED_CASE(RANDOMX_FREQ_ISMULH_R, dst_rw | src_r);
+	SCHED_CASE(RANDOMX_FREQ_ISMULH_M, dst_rw | src_r | load);
+	SCHED_CASE(RANDOMX_FREQ_IMUL_RCP, (inst.y & (inst.y - 1)) ? dst_rw : SCHED_NOP);
+	SCHED_CASE(RANDOMX_FREQ_INEG_R, dst_rw);
+	SCHED_CASE(RANDOMX_FREQ_IXOR_R, dst_rw | src_r);
+	SCHED_CASE(RANDOMX_FREQ_IXOR_M, dst_rw | src_r | load);
+	SCHED_CASE(RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R, dst_rw | src_r);
+	SCHED_CASE(RANDOMX_FREQ_ISWAP_R, (src != dst) ? (dst_rw | src_rw) : SCHED_NOP);
+	SCHED_CASE(RANDOMX_FREQ_FSWAP_R, SCHED_FP | (1U << (16 + dst)));
+	SCHED_CASE(RANDOMX_FREQ_FADD_R, fp_f);
+	SCHED_CASE(RANDOMX_FREQ_FADD_M, fp_f | src_r | SCHED_LOAD);
+	SCHED_CASE(RANDOMX_FREQ_FSUB_R, fp_f);
+	SCHED_CASE(RANDOMX_FREQ_FSUB_M, fp_f | src_r | SCHED_LOAD);
+	SCHED_CASE(RANDOMX_FREQ_FSCAL_R, fp_f);
+	SCHED_CASE(RANDOMX_FREQ_FMUL_R, fp_e);
+	SCHED_CASE(RANDOMX_FREQ_FDIV_M, fp_e | src_r | SCHED_LOAD);
+	SCHED_CASE(RANDOMX_FREQ_FSQRT_R, fp_e);
+
+	// mark_branches() replaced CBRANCH's src with the branch target
+	SCHED_CASE(RANDOMX_FREQ_CBRANCH, dst_rw | SCHED_BRANCH);
+	SCHED_CASE(RANDOMX_FREQ_CFROUND, src_r | SCHED_CFROUND);
+	SCHED_CASE(RANDOMX_FREQ_ISTORE, (1U << dst) | src_r | SCHED_STORE | (((mod >> 4) >= StoreL3Condition) ? SCHED_STORE_L3 : 0));
+
+	return SCHED_NOP;
+}
+
+// Dependency of "b" on an earlier instruction "a": 2 if "b" must run in a later step, 1 if it can run in the same step, 0 if none.
+// Either of them can also be several instructions ORed together.
+uint32_t schedule_dependency(uint32_t a, uint32_t b)
+{
+	if (a & SCHED_BRANCH)
+		return 2;
+
+	// Read after write and write after write of registers (all instructions that write also read), FP registers
+	if (((a >> 8) & (b | (b >> 8)) & 0xFF) || ((a >> 16) & (b >> 16) & 0xFF))
+		return 2;
+
+	// Scratchpad: stores go after all earlier accesses, loads after earlier stores that can write where they read
+	if ((b & SCHED_STORE) && (a & (SCHED_LOAD | SCHED_STORE)))
+		return 2;
+	if ((a & SCHED_STORE) && (b & SCHED_LOAD) && (!(b & SCHED_LOAD_HIGH) || (a & SCHED_STORE_L3)))
+		return 2;
+
+	// Rounding mode changes after the group, so FP instructions that used the old one can share a group with CFROUND
+	if ((a & SCHED_CFROUND) && (b & (SCHED_FP | SCHED_CFROUND)))
+		return 2;
+	if ((a & SCHED_FP) && (b & SCHED_CFROUND))
+		return 1;
+
+	// Write after read, and CBRANCH which can't run before anything earlier
+	if ((a & (b >> 8) & 0xFF) || (a && (b & SCHED_BRANCH)))
+		return 1;
+
+	return 0;
+}
+
+Schedule schedule_critical_path(SCHEDULER_GLOBAL uint2* src_program, SCHEDULER_LOCAL exec_t* execution_plan, const int32_t workers)
+{
+	Schedule result;
+	result.first_instruction_slot = -1;
+	result.last_used_slot = -1;
+	result.first_instruction_fp = false;
+
+	uint32_t desc[SCHEDULER_WINDOW];
+	uint32_t height[SCHEDULER_WINDOW];
+	uint32_t index[SCHEDULER_WINDOW];
+
+	// Current row: first slot, slots taken by earlier windows, slots taken in total, everything in it ORed together,
+	// and whether earlier windows put integer instructions in it (FP instructions can't go after them)
+	int32_t row = 0;
+	int32_t row_committed = 0;
+	int32_t row_used = 0;
+	uint32_t row_desc = 0;
+	bool row_has_int = false;
+
+	// The next window starts a region that CBRANCH jumps to, its first instruction in the plan gets the branch target mark
+	bool target_pending = false;
+
+	uint32_t i = 0;
+	while (i < RANDOMX_PROGRAM_SIZE)
+	{
+		// Collect the next window: up to the next branch target, after CBRANCH, or SCHEDULER_WINDOW instructions
+		uint32_t n = 0;
+		do {
+			const uint2 inst = src_program[i];
+			if (inst.x & (0x40 << 8))
+			{
+				if (n > 0)
+					break;
+
+				src_program[i].x &= ~(0x40U << 8);
+				target_pending = true;
+			}
+
+			const uint32_t d = schedule_decode(inst);
+			++i;
+
+			if (d & SCHED_NOP)
+				continue;
+
+			desc[n] = d;
+			index[n] = i - 1;
+			++n;
+
+			if (d & SCHED_BRANCH)
+				break;
+		} while ((i < RANDOMX_PROGRAM_SIZE) && (n < SCHEDULER_WINDOW));
+
+		// Longest chain of dependent instructions starting from each one, in steps
+		for (int32_t k = (int32_t)(n) - 1; k >= 0; --k)
+		{
+			uint32_t h = 1;
+			for (uint32_t j = k + 1; j < n; ++j)
+			{
+				const uint32_t dep = schedule_dependency(desc[k], desc[j]);
+				if (dep)
+					update_max(h, height[j] + dep - 1);
+			}
+			height[k] = h;
+		}
+
+		uint32_t unscheduled = (n < 32) ? ((1U << n) - 1) : 0xFFFFFFFFU;
+		uint32_t row_picks = 0;
+
+		while (unscheduled || row_picks)
+		{
+			// Pick the ready instruction with the longest chain, the earliest one if there's a tie. It's ready if it doesn't
+			// depend on earlier unscheduled instructions and doesn't have to run after anything in this row.
+			int32_t best = -1;
+			uint32_t earlier = 0;
+			for (uint32_t k = 0; k < n; ++k)
+			{
+				if (!(unscheduled & (1U << k)))
+					continue;
+
+				const uint32_t d = desc[k];
+				const int32_t size = (d & SCHED_FP) ? 2 : 1;
+
+				if ((row_used + size <= workers) && !((d & SCHED_FP) && row_has_int) &&
+					(schedule_dependency(earlier, d) == 0) && (schedule_dependency(row_desc, d) < 2) &&
+					((best < 0) || (height[k] > height[best])))
+				{
+					best = k;
+				}
+
+				earlier |= d;
+			}
+
+			if (best >= 0)
+			{
+				unscheduled &= ~(1U << best);
+				row_picks |= 1U << best;
+				row_desc |= desc[best];
+				row_used += (desc[best] & SCHED_FP) ? 2 : 1;
+
+				// Nothing after CBRANCH can run in its group
+				if (desc[best] & SCHED_BRANCH)
+					row_used = workers;
+
+				if (unscheduled)
+					continue;
+			}
+
+			// The row is done or the window is: write its instructions after what earlier windows put there, FP instructions first
+			int32_t slot = row + row_committed;
+			for (uint32_t fp = 0; fp < 2; ++fp)
+			{
+				for (uint32_t k = 0; k < n; ++k)
+				{
+					if (!(row_picks & (1U << k)) || (((desc[k] & SCHED_FP) != 0) != (fp == 0)))
+						continue;
+
+					if (target_pending)
+					{
+						src_program[index[k]].x |= 0x40 << 8;
+						target_pending = false;
+					}
+
+					if (index[k] == 0)
+					{
+						result.first_instruction_slot = slot;
+						result.first_instruction_fp = (fp == 0);
+					}
+
+					execution_plan[slot] = index[k];
+					if (fp == 0)
+						execution_plan[++slot] = index[k];
+
+					result.last_used_slot = slot++;
+
+					if (fp == 1)
+						row_has_int = true;
+				}
+			}
+
+			row_committed = slot - row;
+			row_picks = 0;
+
+			// A full row, or one that nothing from the window fits into, is closed. The last row stays open for the next window.
+			if (unscheduled || (row_used >= workers))
+			{
+				row += workers;
+				row_committed = 0;
+				row_used = 0;
+				row_desc = 0;
+				row_has_int = false;
+			}
+		}
+	}
+
+	return result;
+}
@@ -45,6 +45,57 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 
 #define RegisterNeedsDisplacement 5
 
+// Light mode: execute_vm gets the 256 MB cache instead of the dataset and computes dataset items on demand
+#ifndef LIGHT_MODE
+#define LIGHT_MODE 0
+#endif
+
+#if LIGHT_MODE
+#include "superscalar_hash.cl"
+#endif
+
+// Instrumented build, see VM_COUNTERS_COUNT
+#ifndef VM_COUNTERS
+#define VM_COUNTERS 0
+#endif
+
+#if VM_COUNTERS
+#define VM_COUNT(counter, n) atomic_add(counters + (counter), (n))
+#else
+#define VM_COUNT(counter, n) do {} while (0)
+#endif
+
+// Instruction scheduler of init_vm: 0 = in program order, 1 = critical path first (see randomx_scheduler.h)
+#ifndef VM_SCHEDULER
+#define VM_SCHEDULER 1
+#endif
+
+// Workers of a hash synchronize inner_loop steps with sub-group functions instead of work-group barriers:
+// 0 = off, 1 = sub-group barriers (cl_khr_subgroups), 2 = also shuffles for instruction fetch (cl_intel_subgroups or cl_khr_subgroup_shuffle).
+// Registers stay in local memory because instructions address them by index.
+#ifndef VM_SUBGROUPS
+#define VM_SUBGROUPS 0
+#endif
+
+#if VM_SUBGROUPS
+#ifdef cl_intel_subgroups
+#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+#define vm_shuffle(value, lane) intel_sub_group_shuffle(value, lane)
+#else
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+#ifdef cl_khr_subgroup_shuffle
+#pragma OPENCL EXTENSION cl_khr_subgroup_shuffle : enable
+#endif
+#define vm_shuffle(value, lane) sub_group_shuffle(value, lane)
+#endif
+#endif
+
+// Word "w" of hash "idx" registers and the start of its program in vm_states, see VM_STATE_INTERLEAVE
+#define VM_REG(idx, w) VM_STATE_REG(idx, w, VM_STATE_SIZE / sizeof(uint64_t), VM_STATE_INTERLEAVE)
+#define VM_PROGRAM(idx) VM_STATE_PROGRAM(idx, VM_STATE_SIZE / sizeof(uint64_t), VM_STATE_INTERLEAVE)
+
 //
 // VM state:
 //
@@ -155,15 +206,11 @@ uint64_t imul_rcp_value(uint32_t divisor)
 uint32_t get_byte(uint64_t a, uint32_t position) { return (a >> (position << 3)) & 0xFF; }
 #define update_max(value, next_value) do { if ((value) < (next_value)) (value) = (next_value); } while (0)
 
+#include "randomx_scheduler.h"
+
 __attribute__((reqd_work_group_size(32, 1, 1)))
 __kernel void init_vm(__global const void* entropy_data, __global void* vm_states)
 {
-#if RANDOMX_PROGRAM_SIZE <= 256
-	typedef uint8_t exec_t;
-#else
-	typedef uint16_t exec_t;
-#endif
-
 	__local uint32_t execution_plan_buf[RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH * (32 / 8) * sizeof(exec_t) / sizeof(uint32_t)];
 
 	set_buffer(execution_plan_buf, sizeof(execution_plan_buf) / sizeof(uint32_t), 0);
@@ -175,730 +222,28 @@ __kernel void init_vm(__global const void* entropy_data, __global void* vm_state
 
 	__local exec_t* execution_plan = (__local exec_t*)(execution_plan_buf + (get_local_id(0) / 8) * RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH * sizeof(exec_t) / sizeof(uint32_t));
 
-	__global uint64_t* R = ((__global uint64_t*)vm_states) + idx * VM_STATE_SIZE / sizeof(uint64_t);
-	R[sub] = 0;
+	__global uint64_t* states = (__global uint64_t*)vm_states;
+	states[VM_REG(idx, sub)] = 0;
 
 	const __global uint64_t* entropy = ((const __global uint64_t*)entropy_data) + idx * ENTROPY_SIZE / sizeof(uint64_t);
 
-	__global double* A = (__global double*)(R + 24);
-	A[sub] = getSmallPositiveFloatBits(entropy[sub]);
+	states[VM_REG(idx, sub + 24)] = as_ulong(getSmallPositiveFloatBits(entropy[sub]));
 
 	if (sub == 0)
 	{
 		__global uint2* src_program = (__global uint2*)(entropy + 128 / sizeof(uint64_t));
 
-#if RANDOMX_PROGRAM_SIZE <= 256
-		uint64_t registerLastChanged = 0;
-		uint64_t registerWasChanged = 0;
-#else
-		int32_t registerLastChanged[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
-#endif
-
-		// Initialize CBRANCH instructions
-		for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
-		{
-			// Clear all src flags (branch target, FP, branch)
-			*(__global uint32_t*)(src_program + i) &= ~(0xF8U << 8);
+		mark_branches(src_program);
 
-			const uint2 src_inst = src_program[i];
-			uint2 inst = src_inst;
-
-			uint32_t opcode = inst.x & 0xff;
-			const uint32_t dst = (inst.x >> 8) & 7;
-			const uint32_t src = (inst.x >> 16) & 7;
-
-			if (opcode < RANDOMX_FREQ_IADD_RS + RANDOMX_FREQ_IADD_M + RANDOMX_FREQ_ISUB_R + RANDOMX_FREQ_ISUB_M + RANDOMX_FREQ_IMUL_R + RANDOMX_FREQ_IMUL_M + RANDOMX_FREQ_IMULH_R + RANDOMX_FREQ_IMULH_M + RANDOMX_FREQ_ISMULH_R + RANDOMX_FREQ_ISMULH_M)
-			{
-#if RANDOMX_PROGRAM_SIZE <= 256
-				set_byte(registerLastChanged, dst, i);
-				set_byte(registerWasChanged, dst, 1);
-#else
-				registerLastChanged[dst] = i;
-#endif
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IADD_RS + RANDOMX_FREQ_IADD_M + RANDOMX_FREQ_ISUB_R + RANDOMX_FREQ_ISUB_M + RANDOMX_FREQ_IMUL_R + RANDOMX_FREQ_IMUL_M + RANDOMX_FREQ_IMULH_R + RANDOMX_FREQ_IMULH_M + RANDOMX_FREQ_ISMULH_R + RANDOMX_FREQ_ISMULH_M;
-
-			if (opcode < RANDOMX_FREQ_IMUL_RCP)
-			{
-				if (inst.y & (inst.y - 1))
-				{
-#if RANDOMX_PROGRAM_SIZE <= 256
-					set_byte(registerLastChanged, dst, i);
-					set_byte(registerWasChanged, dst, 1);
+#if VM_SCHEDULER
+		const Schedule schedule = schedule_critical_path(src_program, execution_plan, WORKERS_PER_HASH);
 #else
-					registerLastChanged[dst] = i;
+		const Schedule schedule = schedule_in_order(src_program, execution_plan, WORKERS_PER_HASH);
 #endif
-				}
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_IMUL_RCP;
-
-			if (opcode < RANDOMX_FREQ_INEG_R + RANDOMX_FREQ_IXOR_R + RANDOMX_FREQ_IXOR_M + RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R)
-			{
-#if RANDOMX_PROGRAM_SIZE <= 256
-				set_byte(registerLastChanged, dst, i);
-				set_byte(registerWasChanged, dst, 1);
-#else
-				registerLastChanged[dst] = i;
-#endif
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_INEG_R + RANDOMX_FREQ_IXOR_R + RANDOMX_FREQ_IXOR_M + RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R;
-
-			if (opcode < RANDOMX_FREQ_ISWAP_R)
-			{
-				if (src != dst)
-				{
-#if RANDOMX_PROGRAM_SIZE <= 256
-					set_byte(registerLastChanged, dst, i);
-					set_byte(registerWasChanged, dst, 1);
-					set_byte(registerLastChanged, src, i);
-					set_byte(registerWasChanged, src, 1);
-#else
-					registerLastChanged[dst] = i;
-					registerLastChanged[src] = i;
-#endif
-				}
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_ISWAP_R;
-
-			if (opcode < RANDOMX_FREQ_FSWAP_R + RANDOMX_FREQ_FADD_R + RANDOMX_FREQ_FADD_M + RANDOMX_FREQ_FSUB_R + RANDOMX_FREQ_FSUB_M + RANDOMX_FREQ_FSCAL_R + RANDOMX_FREQ_FMUL_R + RANDOMX_FREQ_FDIV_M + RANDOMX_FREQ_FSQRT_R)
-			{
-				// Mark FP instruction (src |= 0x20)
-				*(__global uint32_t*)(src_program + i) |= 0x20 << 8;
-				continue;
-			}
-			opcode -= RANDOMX_FREQ_FSWAP_R + RANDOMX_FREQ_FADD_R + RANDOMX_FREQ_FADD_M + RANDOMX_FREQ_FSUB_R + RANDOMX_FREQ_FSUB_M + RANDOMX_FREQ_FSCAL_R + RANDOMX_FREQ_FMUL_R + RANDOMX_FREQ_FDIV_M + RANDOMX_FREQ_FSQRT_R;
-
-			if (opcode < RANDOMX_FREQ_CBRANCH)
-			{
-				const uint32_t creg = dst;
-#if RANDOMX_PROGRAM_SIZE <= 256
-				const uint32_t change = get_byte(registerLastChanged, dst);
-				const int32_t lastChanged = (get_byte(registerWasChanged, dst) == 0) ? -1 : (int32_t)(change);
-
-				// Store condition register and branch target in CBRANCH instruction
-				*(__global uint32_t*)(src_program + i) = (src_inst.x & 0xFF0000FFU) | ((creg | ((lastChanged == -1) ? 0x90 : 0x10)) << 8) | (((uint32_t)(lastChanged) & 0xFF) << 16);
-#else
-				const int32_t lastChanged = registerLastChanged[dst];
-
-				// Store condition register in CBRANCH instruction
-				*(__global uint32_t*)(src_program + i) = (src_inst.x & 0xFF0000FFU) | ((creg | 0x10) << 8);
-#endif
-
-				// Mark branch target instruction (src |= 0x40)
-				*(__global uint32_t*)(src_program + lastChanged + 1) |= 0x40 << 8;
-
-#if RANDOMX_PROGRAM_SIZE <= 256
-				uint32_t tmp = i | (i << 8);
-				registerLastChanged = tmp | (tmp << 16);
-				registerLastChanged = registerLastChanged | (registerLastChanged << 32);
-
-				registerWasChanged = 0x0101010101010101UL;
-#else
-				registerLastChanged[0] = i;
-				registerLastChanged[1] = i;
-				registerLastChanged[2] = i;
-				registerLastChanged[3] = i;
-				registerLastChanged[4] = i;
-				registerLastChanged[5] = i;
-				registerLastChanged[6] = i;
-				registerLastChanged[7] = i;
-#endif
-			}
-		}
-
-		uint64_t registerLatency = 0;
-		uint64_t registerReadCycle = 0;
-		uint64_t registerLatencyFP = 0;
-		uint64_t registerReadCycleFP = 0;
-		uint32_t ScratchpadHighLatency = 0;
-		volatile uint32_t ScratchpadLatency = 0;
-
-		int32_t first_available_slot = 0;
-		int32_t first_allowed_slot_cfround = 0;
-		int32_t last_used_slot = -1;
-		int32_t last_memory_op_slot = -1;
-
-		uint32_t num_slots_used = 0;
-		uint32_t num_instructions = 0;
-
-		int32_t first_instruction_slot = -1;
-		bool first_instruction_fp = false;
 
-		//if (global_index == 0)
-		//{
-		//	for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
-		//	{
-		//		print_inst(src_program[j]);
-		//		printf("\n");
-		//	}
-		//	printf("\n");
-		//}
-
-		// Schedule instructions
-		bool update_branch_target_mark = false;
-		bool first_available_slot_is_branch_target = false;
-		for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
-		{
-			const uint2 inst = src_program[i];
-
-			uint32_t opcode = inst.x & 0xff;
-			uint32_t dst = (inst.x >> 8) & 7;
-			const uint32_t src = (inst.x >> 16) & 7;
-			const uint32_t mod = (inst.x >> 24);
-
-			bool is_branch_target = (inst.x & (0x40 << 8)) != 0;
-			if (is_branch_target)
-			{
-				// If an instruction is a branch target, we can't move it before any previous instructions
-				first_available_slot = last_used_slot + 1;
-
-				// Mark this slot as a branch target
-				// Whatever instruction takes this slot will receive branch target flag
-				first_available_slot_is_branch_target = true;
-			}
-
-			const uint32_t dst_latency = get_byte(registerLatency, dst);
-			const uint32_t src_latency = get_byte(registerLatency, src);
-			const uint32_t reg_read_latency = (dst_latency > src_latency) ? dst_latency : src_latency;
-			const uint32_t mem_read_latency = ((dst == src) && ((inst.y & ScratchpadL3Mask64) >= RANDOMX_SCRATCHPAD_L2)) ? ScratchpadHighLatency : ScratchpadLatency;
-
-			uint32_t full_read_latency = mem_read_latency;
-			update_max(full_read_latency, reg_read_latency);
-
-			uint32_t latency = 0;
-			bool is_memory_op = false;
-			bool is_memory_store = false;
-			bool is_nop = false;
-			bool is_branch = false;
-			bool is_swap = false;
-			bool is_src_read = true;
-			bool is_fp = false;
-			bool is_cfround = false;
-
-			do {
-				if (opcode < RANDOMX_FREQ_IADD_RS)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IADD_RS;
-
-				if (opcode < RANDOMX_FREQ_IADD_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IADD_M;
-
-				if (opcode < RANDOMX_FREQ_ISUB_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISUB_R;
-
-				if (opcode < RANDOMX_FREQ_ISUB_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISUB_M;
-
-				if (opcode < RANDOMX_FREQ_IMUL_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMUL_R;
-
-				if (opcode < RANDOMX_FREQ_IMUL_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMUL_M;
-
-				if (opcode < RANDOMX_FREQ_IMULH_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMULH_R;
-
-				if (opcode < RANDOMX_FREQ_IMULH_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMULH_M;
-
-				if (opcode < RANDOMX_FREQ_ISMULH_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISMULH_R;
-
-				if (opcode < RANDOMX_FREQ_ISMULH_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISMULH_M;
-
-				if (opcode < RANDOMX_FREQ_IMUL_RCP)
-				{
-					is_src_read = false;
-					if (inst.y & (inst.y - 1))
-						latency = dst_latency;
-					else
-						is_nop = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IMUL_RCP;
-
-				if (opcode < RANDOMX_FREQ_INEG_R)
-				{
-					is_src_read = false;
-					latency = dst_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_INEG_R;
-
-				if (opcode < RANDOMX_FREQ_IXOR_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IXOR_R;
-
-				if (opcode < RANDOMX_FREQ_IXOR_M)
-				{
-					latency = full_read_latency;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IXOR_M;
-
-				if (opcode < RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R)
-				{
-					latency = reg_read_latency;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_IROR_R + RANDOMX_FREQ_IROL_R;
-
-				if (opcode < RANDOMX_FREQ_ISWAP_R)
-				{
-					is_swap = true;
-					if (dst != src)
-						latency = reg_read_latency;
-					else
-						is_nop = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISWAP_R;
-
-				if (opcode < RANDOMX_FREQ_FSWAP_R)
-				{
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSWAP_R;
-
-				if (opcode < RANDOMX_FREQ_FADD_R)
-				{
-					dst %= RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FADD_R;
-
-				if (opcode < RANDOMX_FREQ_FADD_M)
-				{
-					dst %= RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					update_max(latency, src_latency);
-					update_max(latency, ScratchpadLatency);
-					is_fp = true;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FADD_M;
-
-				if (opcode < RANDOMX_FREQ_FSUB_R)
-				{
-					dst %= RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSUB_R;
-
-				if (opcode < RANDOMX_FREQ_FSUB_M)
-				{
-					dst %= RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					update_max(latency, src_latency);
-					update_max(latency, ScratchpadLatency);
-					is_fp = true;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSUB_M;
-
-				if (opcode < RANDOMX_FREQ_FSCAL_R)
-				{
-					dst %= RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSCAL_R;
-
-				if (opcode < RANDOMX_FREQ_FMUL_R)
-				{
-					dst = (dst % RegisterCountFlt) + RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FMUL_R;
-
-				if (opcode < RANDOMX_FREQ_FDIV_M)
-				{
-					dst = (dst % RegisterCountFlt) + RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					update_max(latency, src_latency);
-					update_max(latency, ScratchpadLatency);
-					is_fp = true;
-					is_memory_op = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FDIV_M;
-
-				if (opcode < RANDOMX_FREQ_FSQRT_R)
-				{
-					dst = (dst % RegisterCountFlt) + RegisterCountFlt;
-					latency = get_byte(registerLatencyFP, dst);
-					is_fp = true;
-					is_src_read = false;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_FSQRT_R;
-
-				if (opcode < RANDOMX_FREQ_CBRANCH)
-				{
-					is_src_read = false;
-					is_branch = true;
-					latency = dst_latency;
-
-					// We can't move CBRANCH before any previous instructions
-					first_available_slot = last_used_slot + 1;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_CBRANCH;
-
-				if (opcode < RANDOMX_FREQ_CFROUND)
-				{
-					latency = src_latency;
-					is_cfround = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_CFROUND;
-
-				if (opcode < RANDOMX_FREQ_ISTORE)
-				{
-					latency = reg_read_latency;
-					update_max(latency, (last_memory_op_slot + WORKERS_PER_HASH) / WORKERS_PER_HASH);
-					is_memory_op = true;
-					is_memory_store = true;
-					break;
-				}
-				opcode -= RANDOMX_FREQ_ISTORE;
-
-				is_nop = true;
-			} while (false);
-
-			if (is_nop)
-			{
-				if (is_branch_target)
-				{
-					// Mark next non-NOP instruction as the branch target instead of this NOP
-					update_branch_target_mark = true;
-				}
-				continue;
-			}
-
-			if (update_branch_target_mark)
-			{
-				*(__global uint32_t*)(src_program + i) |= 0x40 << 8;
-				update_branch_target_mark = false;
-				is_branch_target = true;
-			}
-
-			int32_t first_allowed_slot = first_available_slot;
-			update_max(first_allowed_slot, latency * WORKERS_PER_HASH);
-			if (is_cfround)
-				update_max(first_allowed_slot, first_allowed_slot_cfround);
-			else
-				update_max(first_allowed_slot, get_byte(is_fp ? registerReadCycleFP : registerReadCycle, dst) * WORKERS_PER_HASH);
-
-			if (is_swap)
-				update_max(first_allowed_slot, get_byte(registerReadCycle, src) * WORKERS_PER_HASH);
-
-			int32_t slot_to_use = last_used_slot + 1;
-			update_max(slot_to_use, first_allowed_slot);
-
-			if (is_fp)
-			{
-				slot_to_use = -1;
-				for (int32_t j = first_allowed_slot; slot_to_use < 0; ++j)
-				{
-					if ((execution_plan[j] == 0) && (execution_plan[j + 1] == 0) && ((j + 1) % WORKERS_PER_HASH))
-					{
-						bool blocked = false;
-						for (int32_t k = (j / WORKERS_PER_HASH) * WORKERS_PER_HASH; k < j; ++k)
-						{
-							if (execution_plan[k] || (k == first_instruction_slot))
-							{
-								const uint32_t inst = src_program[execution_plan[k]].x;
-
-								// If there is an integer instruction which is a branch target or a branch, or this FP instruction is a branch target itself, we can't reorder it to add more FP instructions to this cycle
-								if (((inst & (0x20 << 8)) == 0) && (((inst & (0x50 << 8)) != 0) || is_branch_target))
-								{
-									blocked = true;
-									continue;
-								}
-							}
-						}
-
-						if (!blocked)
-						{
-							for (int32_t k = (j / WORKERS_PER_HASH) * WORKERS_PER_HASH; k < j; ++k)
-							{
-								if (execution_plan[k] || (k == first_instruction_slot))
-								{
-									const uint32_t inst = src_program[execution_plan[k]].x;
-									if ((inst & (0x20 << 8)) == 0)
-									{
-										execution_plan[j] = execution_plan[k];
-										execution_plan[j + 1] = execution_plan[k + 1];
-										if (first_instruction_slot == k) first_instruction_slot = j;
-										if (first_instruction_slot == k + 1) first_instruction_slot = j + 1;
-										slot_to_use = k;
-										break;
-									}
-								}
-							}
-
-							if (slot_to_use < 0)
-							{
-								slot_to_use = j;
-							}
-
-							break;
-						}
-					}
-				}
-			}
-			else
-			{
-				for (int32_t j = first_allowed_slot; j <= last_used_slot; ++j)
-				{
-					if (execution_plan[j] == 0)
-					{
-						slot_to_use = j;
-						break;
-					}
-				}
-			}
-
-			if (i == 0)
-			{
-				first_instruction_slot = slot_to_use;
-				first_instruction_fp = is_fp;
-			}
-
-			if (is_cfround)
-			{
-				first_allowed_slot_cfround = slot_to_use - (slot_to_use % WORKERS_PER_HASH) + WORKERS_PER_HASH;
-			}
-
-			++num_instructions;
-
-			execution_plan[slot_to_use] = i;
-			++num_slots_used;
-
-			if (is_fp)
-			{
-				execution_plan[slot_to_use + 1] = i;
-				++num_slots_used;
-			}
-
-			const uint32_t next_latency = (slot_to_use / WORKERS_PER_HASH) + 1;
-
-			if (is_src_read)
-			{
-				int32_t value = get_byte(registerReadCycle, src);
-				update_max(value, slot_to_use / WORKERS_PER_HASH);
-				set_byte(registerReadCycle, src, value);
-			}
-
-			if (is_memory_op)
-			{
-				update_max(last_memory_op_slot, slot_to_use);
-			}
-
-			if (is_cfround)
-			{
-				const uint32_t t = next_latency | (next_latency << 8);
-				registerLatencyFP = t | (t << 16);
-				registerLatencyFP = registerLatencyFP | (registerLatencyFP << 32);
-			}
-			else if (is_fp)
-			{
-				set_byte(registerLatencyFP, dst, next_latency);
-
-				int32_t value = get_byte(registerReadCycleFP, dst);
-				update_max(value, slot_to_use / WORKERS_PER_HASH);
-				set_byte(registerReadCycleFP, dst, value);
-			}
-			else
-			{
-				if (!is_memory_store && !is_nop)
-				{
-					set_byte(registerLatency, dst, next_latency);
-					if (is_swap)
-						set_byte(registerLatency, src, next_latency);
-
-					int32_t value = get_byte(registerReadCycle, dst);
-					update_max(value, slot_to_use / WORKERS_PER_HASH);
-					set_byte(registerReadCycle, dst, value);
-				}
-
-				if (is_branch)
-				{
-					const uint32_t t = next_latency | (next_latency << 8);
-					registerLatency = t | (t << 16);
-					registerLatency = registerLatency | (registerLatency << 32);
-				}
-
-				if (is_memory_store)
-				{
-					int32_t value = get_byte(registerReadCycle, dst);
-					update_max(value, slot_to_use / WORKERS_PER_HASH);
-					set_byte(registerReadCycle, dst, value);
-					ScratchpadLatency = (slot_to_use / WORKERS_PER_HASH) + 1;
-					if ((mod >> 4) >= StoreL3Condition)
-						ScratchpadHighLatency = (slot_to_use / WORKERS_PER_HASH) + 1;
-				}
-			}
-
-			if (execution_plan[first_available_slot] || (first_available_slot == first_instruction_slot))
-			{
-				if (first_available_slot_is_branch_target)
-				{
-					src_program[i].x |= 0x40 << 8;
-					first_available_slot_is_branch_target = false;
-				}
-
-				if (is_fp)
-					++first_available_slot;
-
-				do {
-					++first_available_slot;
-				} while ((first_available_slot < RANDOMX_PROGRAM_SIZE * WORKERS_PER_HASH) && (execution_plan[first_available_slot] != 0));
-			}
-
-			if (is_branch_target)
-			{
-				update_max(first_available_slot, is_fp ? (slot_to_use + 2) : (slot_to_use + 1));
-			}
-
-			update_max(last_used_slot, is_fp ? (slot_to_use + 1) : slot_to_use);
-			while (execution_plan[last_used_slot] || (last_used_slot == first_instruction_slot) || ((last_used_slot == first_instruction_slot + 1) && first_instruction_fp))
-			{
-				++last_used_slot;
-			}
-			--last_used_slot;
-
-			if (is_fp && (last_used_slot >= first_allowed_slot_cfround))
-				first_allowed_slot_cfround = last_used_slot + 1;
-
-			//if (global_index == 0)
-			//{
-			//	printf("slot_to_use = %d, first_available_slot = %d, last_used_slot = %d\n", slot_to_use, first_available_slot, last_used_slot);
-			//	for (int j = 0; j <= last_used_slot; ++j)
-			//	{
-			//		if (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp))
-			//		{
-			//			print_inst(src_program[execution_plan[j]]);
-			//			printf(" | ");
-			//		}
-			//		else
-			//		{
-			//			printf("                      | ");
-			//		}
-			//		if (((j + 1) % WORKERS_PER_HASH) == 0) printf("\n");
-			//	}
-			//	printf("\n\n");
-			//}
-		}
-
-		//if (global_index == 0)
-		//{
-		//	printf("IPC = %.3f, WPC = %.3f, num_instructions = %u, num_slots_used = %u, first_instruction_slot = %d, last_used_slot = %d, registerLatency = %016llx, registerLatencyFP = %016llx \n",
-		//		num_instructions / static_cast<double>(last_used_slot / WORKERS_PER_HASH + 1),
-		//		num_slots_used / static_cast<double>(last_used_slot / WORKERS_PER_HASH + 1),
-		//		num_instructions,
-		//		num_slots_used,
-		//		first_instruction_slot,
-		//		last_used_slot,
-		//		registerLatency,
-		//		registerLatencyFP
-		//	);
-
-		//	//for (int j = 0; j < RANDOMX_PROGRAM_SIZE; ++j)
-		//	//{
-		//	//	print_inst(src_program[j]);
-		//	//	printf("\n");
-		//	//}
-		//	//printf("\n");
-
-		//	for (int j = 0; j <= last_used_slot; ++j)
-		//	{
-		//		if (execution_plan[j] || (j == first_instruction_slot) || ((j == first_instruction_slot + 1) && first_instruction_fp))
-		//		{
-		//			print_inst(src_program[execution_plan[j]]);
-		//			printf(" | ");
-		//		}
-		//		else
-		//		{
-		//			printf("                      | ");
-		//		}
-		//		if (((j + 1) % WORKERS_PER_HASH) == 0) printf("\n");
-		//	}
-		//	printf("\n\n");
-		//}
-
-		//atomicAdd((uint32_t*)num_vm_cycles, (last_used_slot / WORKERS_PER_HASH) + 1);
-		//atomicAdd((uint32_t*)(num_vm_cycles) + 1, num_slots_used);
+		const int32_t first_instruction_slot = schedule.first_instruction_slot;
+		const int32_t last_used_slot = schedule.last_used_slot;
+		const bool first_instruction_fp = schedule.first_instruction_fp;
 
 		uint32_t ma = (uint32_t)(entropy[8]) & CacheLineAlignMask;
 		uint32_t mx = (uint32_t)(entropy[10]) & CacheLineAlignMask;
@@ -912,16 +257,17 @@ __kernel void init_vm(__global const void* entropy_data, __global void* vm_state
 		eMask.x = getFloatMask(eMask.x);
 		eMask.y = getFloatMask(eMask.y);
 
-		((__global uint32_t*)(R + 16))[0] = ma;
-		((__global uint32_t*)(R + 16))[1] = mx;
-		((__global uint32_t*)(R + 16))[2] = addressRegisters;
-		((__global uint32_t*)(R + 16))[3] = datasetOffset;
-		((__global ulong2*)(R + 18))[0] = eMask;
+		// Words of interleaved registers aren't adjacent, so they're written one by one
+		states[VM_REG(idx, 16)] = ma | ((uint64_t)(mx) << 32);
+		states[VM_REG(idx, 17)] = addressRegisters | ((uint64_t)(datasetOffset) << 32);
+		states[VM_REG(idx, 18)] = eMask.x;
+		states[VM_REG(idx, 19)] = eMask.y;
 
-		__global uint32_t* imm_buf = (__global uint32_t*)(R + REGISTERS_SIZE / sizeof(uint64_t));
+		__global uint64_t* program = states + VM_PROGRAM(idx);
+		__global uint32_t* imm_buf = (__global uint32_t*)(program);
 		uint32_t imm_index = 0;
 		int32_t imm_index_fscal_r = -1;
-		__global uint32_t* compiled_program = (__global uint32_t*)(R + (REGISTERS_SIZE + IMM_BUF_SIZE) / sizeof(uint64_t));
+		__global uint32_t* compiled_program = (__global uint32_t*)(program + IMM_BUF_SIZE / sizeof(uint64_t));
 
 		// Generate opcodes for execute_vm
 		int32_t branch_target_slot = -1;
@@ -1374,7 +720,7 @@ __kernel void init_vm(__global const void* entropy_data, __global void* vm_state
 			*(compiled_program++) = inst.x | num_workers;
 		}
 
-		((__global uint32_t*)(R + 20))[0] = (uint32_t)(compiled_program - (__global uint32_t*)(R + (REGISTERS_SIZE + IMM_BUF_SIZE) / sizeof(uint64_t)));
+		*(__global uint32_t*)(states + VM_REG(idx, 20)) = (uint32_t)(compiled_program - (__global uint32_t*)(program + IMM_BUF_SIZE / sizeof(uint64_t)));
 	}
 }
 
@@ -1393,6 +739,31 @@ void load_buffer(__local uint64_t *dst_buf, size_t N, __global const void* src_b
 	}
 }
 
+#if VM_STATE_INTERLEAVE > 1
+// VM states of the work group's 2 hashes, each of them contiguous in local memory like in the non-interleaved layout
+void load_vm_states(__local uint64_t* dst, __global const uint64_t* states)
+{
+	enum { STATE_WORDS = VM_STATE_SIZE / sizeof(uint64_t), REGISTER_WORDS = REGISTERS_SIZE / sizeof(uint64_t), PROGRAM_WORDS = STATE_WORDS - REGISTER_WORDS };
+
+	const uint32_t first_idx = get_group_id(0) * 2;
+
+	// Neighbouring lanes read the same register of both hashes
+	for (uint32_t i = get_local_id(0); i < REGISTER_WORDS * 2; i += get_local_size(0))
+	{
+		const uint32_t k = i % 2;
+		const uint32_t w = i / 2;
+		dst[k * STATE_WORDS + w] = states[VM_REG(first_idx + k, w)];
+	}
+
+	for (uint32_t i = get_local_id(0); i < PROGRAM_WORDS * 2; i += get_local_size(0))
+	{
+		const uint32_t k = i / PROGRAM_WORDS;
+		const uint32_t w = i % PROGRAM_WORDS;
+		dst[k * STATE_WORDS + REGISTER_WORDS + w] = states[VM_PROGRAM(first_idx + k) + w];
+	}
+}
+#endif
+
 double load_F_E_groups(int value, uint64_t andMask, uint64_t orMask)
 {
 	double t = convert_double_rtn(value);
@@ -1641,6 +1012,42 @@ double sqrt_rnd(double x, uint32_t fprc)
 	return result;
 }
 
+// FP operations of inner_loop. The rounding mode only changes between groups, so "round_to_nearest" (fprc == 0) is computed once
+// per group. Native operations are correctly rounded in this mode, which is what CFROUND leaves in effect most of the time,
+// the other modes are emulated.
+double fma_fprc(double a, double b, double c, uint32_t fprc, bool round_to_nearest)
+{
+	return round_to_nearest ? fma(a, b, c) : fma_soft(a, b, c, fprc);
+}
+
+double div_fprc(double a, double b, uint32_t fprc, bool round_to_nearest)
+{
+	return round_to_nearest ? (a / b) : div_rnd(a, b, fprc);
+}
+
+double sqrt_fprc(double x, uint32_t fprc, bool round_to_nearest)
+{
+	return round_to_nearest ? sqrt(x) : sqrt_rnd(x, fprc);
+}
+
+// FADD_R, FMUL_R, FDIV_M and FSQRT_R as inner_loop computes them with rounding mode "fprc", for the tests.
+// Every 4 inputs are 2 operands of FADD_R (F group, any sign) and 2 positive ones of the others (E group).
+__kernel void fp_ops_test(__global const double* inputs, __global double* results, uint32_t fprc)
+{
+	const uint32_t i = get_global_id(0) * 4;
+	const bool round_to_nearest = (fprc == 0);
+
+	const double f0 = inputs[i + 0];
+	const double f1 = inputs[i + 1];
+	const double e0 = inputs[i + 2];
+	const double e1 = inputs[i + 3];
+
+	results[i + 0] = fma_fprc(f0, 1.0, f1, fprc, round_to_nearest);
+	results[i + 1] = fma_fprc(e0, e1, 0.0, fprc, round_to_nearest);
+	results[i + 2] = div_fprc(e0, e1, fprc, round_to_nearest);
+	results[i + 3] = sqrt_fprc(e0, fprc, round_to_nearest);
+}
+
 uint32_t inner_loop(
 	const uint32_t program_length,
 	__local const uint32_t* compiled_program,
@@ -1654,27 +1061,58 @@ uint32_t inner_loop(
 	uint32_t fprc,
 	const uint32_t fp_workers_mask,
 	const uint64_t xexponentMask,
-	const uint32_t workers_mask
+	const uint32_t workers_mask,
+	const bool sub_group_sync
+#if VM_COUNTERS
+	, __local uint32_t* counters
+#endif
 )
 {
 	const int32_t sub2 = sub >> 1;
 	imm_buf[IMM_INDEX_COUNT + 1] = fprc;
 
+	// Without CFROUND it's always round to nearest, and the emulation is removed by the compiler
+	bool round_to_nearest = (ROUNDING_MODE == 0) || (fprc == 0);
+
+#if VM_SUBGROUPS > 1
+	// Sub-group lane of this hash's worker 0
+	const uint32_t lane0 = sub_group_sync ? (get_sub_group_local_id() - sub) : 0;
+#endif
+
+	if (sub == 0)
+		VM_COUNT(VM_COUNTER_PROGRAM_SLOTS, program_length);
+
 	#pragma unroll(1)
 	for (int32_t ip = 0; ip < program_length;)
 	{
 		imm_buf[IMM_INDEX_COUNT] = ip;
 
+#if VM_SUBGROUPS > 1
+		// Every worker reads one word of the group, the group's first word and each worker's instruction are shuffled from there.
+		// Words past the end of the program are never used.
+		const uint32_t word = sub_group_sync ? compiled_program[min(ip + sub, (int32_t)(program_length) - 1)] : 0;
+		uint32_t inst = sub_group_sync ? vm_shuffle(word, lane0) : compiled_program[ip];
+#else
 		uint32_t inst = compiled_program[ip];
+#endif
 		const int32_t num_workers = (inst >> NUM_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
 		const int32_t num_fp_insts = (inst >> NUM_FP_INSTS_OFFSET) & (WORKERS_PER_HASH - 1);
 		const int32_t num_insts = num_workers - num_fp_insts;
 
+		const int32_t inst_offset = sub - num_fp_insts;
+		const bool is_fp = inst_offset < num_fp_insts;
+		const int32_t inst_index = is_fp ? sub2 : inst_offset;
+
+#if VM_SUBGROUPS > 1
+		// Shuffles must be reached by all workers, so it's done before workers without an instruction drop out
+		if (sub_group_sync)
+			inst = vm_shuffle(word, lane0 + inst_index);
+#endif
+
 		if (sub <= num_workers)
 		{
-			const int32_t inst_offset = sub - num_fp_insts;
-			const bool is_fp = inst_offset < num_fp_insts;
-			inst = compiled_program[ip + (is_fp ? sub2 : inst_offset)];
+			if ((VM_SUBGROUPS < 2) || !sub_group_sync)
+				inst = compiled_program[ip + inst_index];
 			//if ((idx == 0) && (ic == 0))
 			//{
 			//	printf("num_fp_insts = %u, sub = %u, ip = %u, inst = %08x\n", num_fp_insts, sub, ip + ((sub < num_fp_insts * 2) ? (sub / 2) : (sub - num_fp_insts)), inst);
@@ -1685,6 +1123,13 @@ uint32_t inner_loop(
 			uint32_t opcode = (inst >> OPCODE_OFFSET) & 15;
 			const uint32_t location = (inst >> LOC_OFFSET) & 1;
 
+#if VM_COUNTERS
+			// FP instructions run on 2 workers, only the first of them counts
+			const bool counted = !is_fp || ((sub & 1) == 0);
+			if (counted)
+				VM_COUNT(VM_COUNTER_OPCODES + opcode, 1);
+#endif
+
 			const uint32_t reg_size_shift = is_fp ? 4 : 3;
 			const uint32_t reg_base_offset = is_fp ? fp_reg_offset : 0;
 			const uint32_t reg_base_src_offset = is_fp ? fp_reg_group_A_offset : 0;
@@ -1717,6 +1162,11 @@ uint32_t inner_loop(
 				const uint32_t mask = (0xFFFFFFFFU >> loc_shift) - 7;
 
 				const bool is_read = (opcode != 10);
+#if VM_COUNTERS
+				if (counted)
+					VM_COUNT((is_read ? VM_COUNTER_READS_L1 : VM_COUNTER_STORES_L1) + ((loc_shift == LOC_L1) ? 0 : ((loc_shift == LOC_L2) ? 1 : 2)), 1);
+#endif
+
 				uint32_t addr = is_read ? ((loc_shift == LOC_L3) ? 0 : (uint32_t)(src)) : (uint32_t)(dst);
 				addr += (int32_t)(imm.x);
 				addr &= mask;
@@ -1766,7 +1216,7 @@ uint32_t inner_loop(
 					const double a = as_double(dst);
 					const double b = as_double(src);
 
-					dst = as_ulong(fma_soft(a, is_mul ? b : 1.0, is_mul ? 0.0 : b, fprc));
+					dst = as_ulong(fma_fprc(a, is_mul ? b : 1.0, is_mul ? 0.0 : b, fprc, round_to_nearest));
 
 					//asm("// <------ FADD_R, FADD_M, FSUB_R, FSUB_M, FMUL_R (74/256)");
 				}
@@ -1777,6 +1227,7 @@ uint32_t inner_loop(
 					if (((uint32_t)(dst) & (ConditionMask << (imm.y & 31))) == 0)
 					{
 						imm_buf[IMM_INDEX_COUNT] = (uint32_t)(((int32_t)(imm.y) >> 5) - num_insts);
+						VM_COUNT(VM_COUNTER_CBRANCH_TAKEN, 1);
 					}
 					//asm("// <------ CBRANCH (16/256)");
 				}
@@ -1796,7 +1247,7 @@ uint32_t inner_loop(
 				else if (opcode == 14)
 				{
 					//asm("// FSQRT_R (6/256) ------>");
-					dst = as_ulong(sqrt_rnd(as_double(dst), fprc));
+					dst = as_ulong(sqrt_fprc(as_double(dst), fprc, round_to_nearest));
 					//asm("// <------ FSQRT_R (6/256)");
 				}
 				else if (opcode == 6)
@@ -1830,7 +1281,7 @@ uint32_t inner_loop(
 					src = as_ulong(convert_double_rtn((int32_t)(src >> ((sub & 1) * 32))));
 					src &= dynamicMantissaMask;
 					src |= xexponentMask;
-					dst = as_ulong(div_rnd(as_double(dst), as_double(src), fprc));
+					dst = as_ulong(div_fprc(as_double(dst), as_double(src), fprc, round_to_nearest));
 					//asm("// <------ FDIV_M (4/256)");
 				}
 				else if (opcode == 5)
@@ -1857,9 +1308,26 @@ uint32_t inner_loop(
 		{
 			//asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE BEGIN");
 
-			barrier(CLK_LOCAL_MEM_FENCE);
+#if VM_SUBGROUPS
+			if (sub_group_sync)
+				sub_group_barrier(CLK_LOCAL_MEM_FENCE);
+			else
+#endif
+				barrier(CLK_LOCAL_MEM_FENCE);
 			ip = imm_buf[IMM_INDEX_COUNT];
+
+#if VM_COUNTERS
+			if (sub == 0)
+			{
+				VM_COUNT(VM_COUNTER_GROUP_WIDTHS + num_workers, 1);
+				VM_COUNT(VM_COUNTER_EXECUTED_SLOTS, num_insts + 1);
+				if (imm_buf[IMM_INDEX_COUNT + 1] != fprc)
+					VM_COUNT(VM_COUNTER_CFROUND_CHANGES, 1);
+			}
+#endif
+
 			fprc = imm_buf[IMM_INDEX_COUNT + 1];
+			round_to_nearest = (ROUNDING_MODE == 0) || (fprc == 0);
 
 			//asm("// SYNCHRONIZATION OF INSTRUCTION POINTER AND ROUNDING MODE END");
 
@@ -1875,12 +1343,39 @@ __attribute__((reqd_work_group_size(32, 1, 1)))
 #else
 __attribute__((reqd_work_group_size(16, 1, 1)))
 #endif
-__kernel void execute_vm(__global void* vm_states, __global void* rounding, __global void* scratchpads, __global const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, uint32_t first, uint32_t last)
+#if VM_SUBGROUPS && defined(cl_intel_required_subgroup_size)
+__attribute__((intel_reqd_sub_group_size(16)))
+#endif
+__kernel void execute_vm(__global void* vm_states, __global void* rounding, __global void* scratchpads, __global const void* dataset_ptr, uint32_t batch_size, uint32_t num_iterations, uint32_t first, uint32_t last
+#if LIGHT_MODE
+	, __global const uint32_t* programs, __global const uint64_t* reciprocals
+#endif
+	, __global void* scratchpads1, __global void* scratchpads2, __global void* scratchpads3, uint32_t shard_size
+	, __global const void* dataset1, __global const void* dataset2, __global const void* dataset3, uint32_t dataset_split1, uint32_t dataset_split2, uint32_t dataset_split3
+#if VM_COUNTERS
+	, __global uint32_t* counters
+#endif
+)
 {
 	// 2 hashes per warp, 4 KB shared memory for VM states
 	__local uint64_t vm_states_local[(VM_STATE_SIZE * 2) / sizeof(uint64_t)];
 
+#if VM_COUNTERS
+	// Counted in local memory with cheap atomics and added to "counters" when the launch is finished
+	__local uint32_t counters_local[VM_COUNTERS_COUNT * 2];
+	set_buffer(counters_local, VM_COUNTERS_COUNT * 2, 0);
+#endif
+
+#if LIGHT_MODE
+	// Dataset item for each of 2 hashes
+	__local uint64_t dataset_items_local[8 * 2];
+#endif
+
+#if VM_STATE_INTERLEAVE > 1
+	load_vm_states(vm_states_local, (__global const uint64_t*)vm_states);
+#else
 	load_buffer(vm_states_local, sizeof(vm_states_local) / sizeof(uint64_t), vm_states);
+#endif
 
 	barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -1904,7 +1399,9 @@ __kernel void execute_vm(__global void* vm_states, __global void* rounding, __gl
 	__local const uint32_t* readReg3 = (__local uint32_t*)(((__local uint8_t*)R) + (addressRegisters >> 24));
 
 	const uint32_t datasetOffset = ((__local uint32_t*)(R + 16))[3];
-	__global const uint8_t* dataset = ((__global const uint8_t*)dataset_ptr) + datasetOffset;
+#if LIGHT_MODE
+	__local uint64_t* dataset_item = dataset_items_local + (get_local_id(0) / IDX_WIDTH) * 8;
+#endif
 
 	const uint32_t fp_reg_offset = 64 + ((global_index & 1) << 3);
 	const uint32_t fp_reg_group_A_offset = 192 + ((global_index & 1) << 3);
@@ -1917,7 +1414,7 @@ __kernel void execute_vm(__global void* vm_states, __global void* rounding, __gl
 	uint32_t spAddr0 = first ? mx : 0;
 	uint32_t spAddr1 = first ? ma : 0;
 
-	__global uint8_t* scratchpad = ((__global uint8_t*)scratchpads) + idx * (uint64_t)(RANDOMX_SCRATCHPAD_L3 + 64);
+	__global uint8_t* scratchpad = ((__global uint8_t*)SCRATCHPAD_SHARD(scratchpads, scratchpads1, scratchpads2, scratchpads3, (uint32_t)idx, shard_size)) + (idx % shard_size) * (uint64_t)(RANDOMX_SCRATCHPAD_L3 + 64);
 
 	const bool f_group = (sub < 4);
 
@@ -1936,6 +1433,16 @@ __kernel void execute_vm(__global void* vm_states, __global void* rounding, __gl
 	const uint32_t workers_mask = ((1 << WORKERS_PER_HASH) - 1) << ((get_local_id(0) / IDX_WIDTH) * IDX_WIDTH);
 	const uint32_t fp_workers_mask = 3 << (((sub >> 1) << 1) + (get_local_id(0) / IDX_WIDTH) * IDX_WIDTH);
 
+#if VM_SUBGROUPS
+	// Sub-group functions only synchronize workers of a hash if all of them are in one sub-group. That holds if the work-group
+	// is split into full sub-groups of the same size and that size is a multiple of IDX_WIDTH. The result must be the same for
+	// every work-item (they all take the same barriers), so devices with other sub-groups use work-group barriers and local memory.
+	const bool full_sub_groups = (get_num_sub_groups() * get_max_sub_group_size() == get_local_size(0));
+	const bool sub_group_sync = full_sub_groups && ((get_sub_group_size() % IDX_WIDTH) == 0);
+#else
+	const bool sub_group_sync = false;
+#endif
+
 	#pragma unroll(1)
 	for (int ic = 0; ic < num_iterations; ++ic)
 	{
@@ -1972,8 +1479,13 @@ __kernel void execute_vm(__global void* vm_states, __global void* rounding, __gl
 		//	printf("\n");
 		//}
 
-		if ((WORKERS_PER_HASH == IDX_WIDTH) || (sub < WORKERS_PER_HASH))
-			fprc = inner_loop(program_length, compiled_program, sub, scratchpad, fp_reg_offset, fp_reg_group_A_offset, R, imm_buf, batch_size, fprc, fp_workers_mask, xexponentMask, workers_mask);
+		// With sub-group functions all workers run inner_loop, extra ones just don't get instructions
+		if ((WORKERS_PER_HASH == IDX_WIDTH) || (sub < WORKERS_PER_HASH) || sub_group_sync)
+			fprc = inner_loop(program_length, compiled_program, sub, scratchpad, fp_reg_offset, fp_reg_group_A_offset, R, imm_buf, batch_size, fprc, fp_workers_mask, xexponentMask, workers_mask, sub_group_sync
+#if VM_COUNTERS
+				, counters_local + (get_local_id(0) / IDX_WIDTH) * VM_COUNTERS_COUNT
+#endif
+			);
 
 		//if ((global_index == 0) && (ic == RANDOMX_PROGRAM_ITERATIONS - 1))
 		//{
@@ -1987,12 +1499,35 @@ __kernel void execute_vm(__global void* vm_states, __global void* rounding, __gl
 		//	printf("\n");
 		//}
 
+#if LIGHT_MODE
+		// One worker per hash computes the whole item, it's outside of the branch below so all work-items reach the barrier.
+		// SuperscalarHash instructions read and write all 8 registers in a dependency chain, so splitting them over workers
+		// would need a local memory round trip and a barrier after almost every instruction.
+		// The next item is written only after inner_loop's barriers, when all workers have read this one.
+		if (sub == 0)
+			superscalar_dataset_item((__global const uint64_t*)dataset_ptr, programs, reciprocals, (datasetOffset + ma) / CacheLineSize, dataset_item, 1);
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
 		if ((WORKERS_PER_HASH <= 8) || (sub < 8))
 		{
 			mx ^= *readReg2 ^ *readReg3;
 			mx &= CacheLineAlignMask;
 
-			const uint64_t next_r = *r ^ *(__global const uint64_t*)(dataset + ma + sub * 8);
+#if LIGHT_MODE
+			const uint64_t next_r = *r ^ dataset_item[sub];
+#else
+			// Dataset items never cross parts, so the part is chosen once per item
+			const uint32_t offset = datasetOffset + ma;
+			__global const uint8_t* dataset =
+				(offset < dataset_split1) ? ((__global const uint8_t*)dataset_ptr + offset) :
+				(offset < dataset_split2) ? ((__global const uint8_t*)dataset1 + (offset - dataset_split1)) :
+				(offset < dataset_split3) ? ((__global const uint8_t*)dataset2 + (offset - dataset_split2)) :
+				((__global const uint8_t*)dataset3 + (offset - dataset_split3));
+
+			const uint64_t next_r = *r ^ *(__global const uint64_t*)(dataset + sub * 8);
+#endif
 			*r = next_r;
 
 			*p1 = next_r;
@@ -2016,11 +1551,19 @@ __kernel void execute_vm(__global void* vm_states, __global void* rounding, __gl
 	//	printf("\n");
 	//}
 
+#if VM_COUNTERS
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Only this work group runs the hash, so no atomics are needed
+	for (uint32_t i = sub; i < VM_COUNTERS_COUNT; i += IDX_WIDTH)
+		counters[idx * VM_COUNTERS_COUNT + i] += counters_local[(get_local_id(0) / IDX_WIDTH) * VM_COUNTERS_COUNT + i];
+#endif
+
 	if ((WORKERS_PER_HASH > 8) && (sub >= 8))
 		return;
 
-	__global uint64_t* p = ((__global uint64_t*)vm_states) + idx * (VM_STATE_SIZE / sizeof(uint64_t));
-	p[sub] = R[sub];
+	__global uint64_t* states = (__global uint64_t*)vm_states;
+	states[VM_REG(idx, sub)] = R[sub];
 
 	if (sub == 0)
 	{
@@ -2029,12 +1572,11 @@ __kernel void execute_vm(__global void* vm_states, __global void* rounding, __gl
 
 	if (last)
 	{
-		p[sub + 8] = as_ulong(F[sub]) ^ as_ulong(E[sub]);
-		p[sub + 16] = as_ulong(E[sub]);
+		states[VM_REG(idx, sub + 8)] = as_ulong(F[sub]) ^ as_ulong(E[sub]);
+		states[VM_REG(idx, sub + 16)] = as_ulong(E[sub]);
 	}
 	else if (sub == 0)
 	{
-		((__global uint32_t*)(p + 16))[0] = ma;
-		((__global uint32_t*)(p + 16))[1] = mx;
+		states[VM_REG(idx, 16)] = ma | ((uint64_t)(mx) << 32);
 	}
 }
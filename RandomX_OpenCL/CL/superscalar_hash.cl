@@ -0,0 +1,152 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// SuperscalarHash dataset item computation, shared by init_dataset and light mode execute_vm
+
+#define CacheLineSize 64
+#define CacheLineMask (CACHE_SIZE / CacheLineSize - 1)
+
+#define superscalarMul0 6364136223846793005UL
+#define superscalarAdd1 9298411001130361340UL
+#define superscalarAdd2 12065312585734608966UL
+#define superscalarAdd3 9306329213124626780UL
+#define superscalarAdd4 5281919268842080866UL
+#define superscalarAdd5 10536153434571861004UL
+#define superscalarAdd6 3398623926847679864UL
+#define superscalarAdd7 9549104520008361294UL
+
+enum SuperscalarInstructionType
+{
+	S_ISUB_R = 0,
+	S_IXOR_R = 1,
+	S_IADD_RS = 2,
+	S_IMUL_R = 3,
+	S_IROR_C = 4,
+	S_IADD_C7 = 5,
+	S_IXOR_C7 = 6,
+	S_IADD_C8 = 7,
+	S_IXOR_C8 = 8,
+	S_IADD_C9 = 9,
+	S_IXOR_C9 = 10,
+	S_IMULH_R = 11,
+	S_ISMULH_R = 12,
+	S_IMUL_RCP = 13,
+};
+
+// Computes dataset item "item" the same way as initDatasetItem() in RandomX, the result is left in r[0], r[stride], ..., r[7 * stride].
+// Registers are indexed by instruction operands, so they're kept in local memory: private arrays with dynamic indexing end up in scratch memory on most GPUs.
+// SuperscalarHash programs are generated on the host by randomx_init_cache() and packed as described in randomx_constants.h.
+void superscalar_dataset_item(__global const ulong* cache, __global const uint* programs, __global const ulong* reciprocals, uint item, __local ulong* r, uint stride)
+{
+#define R(i) r[(i) * stride]
+
+	const ulong r0 = (item + 1UL) * superscalarMul0;
+	R(0) = r0;
+	R(1) = r0 ^ superscalarAdd1;
+	R(2) = r0 ^ superscalarAdd2;
+	R(3) = r0 ^ superscalarAdd3;
+	R(4) = r0 ^ superscalarAdd4;
+	R(5) = r0 ^ superscalarAdd5;
+	R(6) = r0 ^ superscalarAdd6;
+	R(7) = r0 ^ superscalarAdd7;
+
+	ulong register_value = item;
+
+	for (uint i = 0; i < RANDOMX_CACHE_ACCESSES; ++i)
+	{
+		__global const ulong* mix_block = cache + (register_value & CacheLineMask) * (CacheLineSize / sizeof(ulong));
+		__global const uint* p = programs + i * (SUPERSCALAR_PROGRAM_SIZE / sizeof(uint));
+
+		const uint program_size = p[0];
+		const uint address_reg = p[1];
+		p += 2;
+
+		for (uint j = 0; j < program_size; ++j, p += 2)
+		{
+			const uint inst = p[0];
+			const uint imm32 = p[1];
+
+			const uint opcode = inst & 0xFF;
+			const uint dst = (inst >> 8) & 7;
+			const uint src = (inst >> 16) & 7;
+			const uint mod = inst >> 24;
+
+			switch (opcode)
+			{
+			case S_ISUB_R:
+				R(dst) -= R(src);
+				break;
+
+			case S_IXOR_R:
+				R(dst) ^= R(src);
+				break;
+
+			case S_IADD_RS:
+				R(dst) += R(src) << ((mod >> 2) % 4);
+				break;
+
+			case S_IMUL_R:
+				R(dst) *= R(src);
+				break;
+
+			case S_IROR_C:
+				R(dst) = rotate(R(dst), (ulong)(64 - (imm32 & 63)));
+				break;
+
+			case S_IADD_C7:
+			case S_IADD_C8:
+			case S_IADD_C9:
+				R(dst) += (ulong)(long)(int)(imm32);
+				break;
+
+			case S_IXOR_C7:
+			case S_IXOR_C8:
+			case S_IXOR_C9:
+				R(dst) ^= (ulong)(long)(int)(imm32);
+				break;
+
+			case S_IMULH_R:
+				R(dst) = mul_hi(R(dst), R(src));
+				break;
+
+			case S_ISMULH_R:
+				R(dst) = (ulong)(mul_hi((long)(R(dst)), (long)(R(src))));
+				break;
+
+			case S_IMUL_RCP:
+				// imm32 is an index into the reciprocal cache, see initCache() in RandomX
+				R(dst) *= reciprocals[imm32];
+				break;
+			}
+		}
+
+		R(0) ^= mix_block[0];
+		R(1) ^= mix_block[1];
+		R(2) ^= mix_block[2];
+		R(3) ^= mix_block[3];
+		R(4) ^= mix_block[4];
+		R(5) ^= mix_block[5];
+		R(6) ^= mix_block[6];
+		R(7) ^= mix_block[7];
+
+		register_value = R(address_reg);
+	}
+
+#undef R
+}
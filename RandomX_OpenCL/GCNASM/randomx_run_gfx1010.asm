@@ -158,6 +158,7 @@ begin:
     v_lshlrev_b32   v0, 3, v0
     ds_read2_b64    v[25:28], v5 offset0:16 offset1:17
     ds_read_b32     v11, v5 offset:152
+    ds_read_b32     v51, v5 offset:176
     ds_read_b64     v[35:36], v5 offset:168
     ds_read2_b64    v[20:23], v5 offset0:18 offset1:20
     v_cndmask_b32   v4, 0xffffff, -1, vcc_lo
@@ -184,12 +185,16 @@ begin:
     s_lshl_b32      s24, 1, s24
 
     v_mov_b32       v12, s10
-    v_mad_u64_u32   v[6:7], s2, 10048, s6, v[6:7]
 
     # s[4:5] - pointer to current program
     v_readlane_b32  s4, v6, 0
     v_readlane_b32  s5, v7, 0
 
+    # compiled program offset (registers[22])
+    v_readlane_b32  s2, v51, 0
+    s_add_u32       s4, s4, s2
+    s_addc_u32      s5, s5, 0
+
     s_lshl_b32      s2, 1, s0
     v_add_co_u32    v14, s0, s8, v11
     v_cndmask_b32   v34, v36, 0, vcc_lo
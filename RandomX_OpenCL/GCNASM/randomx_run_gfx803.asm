@@ -143,6 +143,7 @@ begin:
 		v_mov_b32       v44, 0
 
 		ds_read_b32     v6, v0 offset:152
+		ds_read_b32     v51, v0 offset:176
 		v_cmp_lt_u32    s[2:3], v1, 4
 		ds_read2_b64    v[34:37], v0 offset0:18 offset1:16
 		ds_read_b64     v[11:12], v0 offset:136
@@ -155,10 +156,6 @@ begin:
 		v_mov_b32       v14, 0
 		s_mov_b64       exec, s[6:7]
 
-		# compiled program size
-		s_mov_b64       s[6:7], s[8:9]
-		s_mulk_i32      s6, 10048
-
 		v_add_u32       v5, vcc, v0, v5
 		v_add_u32       v5, vcc, v5, 64
 		s_mov_b64       s[8:9], exec
@@ -185,6 +182,9 @@ begin:
 		v_mov_b32       v20, s9
 		v_addc_u32      v20, vcc, v20, 0, vcc
 		ds_read_b64     v[21:22], v17
+		# compiled program offset (registers[22])
+		v_readlane_b32  s6, v51, 0
+		s_mov_b32       s7, 0
 		s_add_u32       s4, s4, s6
 		s_addc_u32      s5, s5, s7
 		v_cndmask_b32   v19, v19, -1, s[2:3]
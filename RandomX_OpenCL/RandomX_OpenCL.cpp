@@ -22,33 +22,94 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <stdlib.h>
 #include "tests.h"
+#include "scheduler_stats.h"
+#include "gcn_emulator.h"
 #include "miner.h"
+#include "job.h"
+#include "definitions.h"
+#include "opencl_helpers.h"
 
 int main(int argc, char** argv)
 {
 	if (argc < 2)
 	{
-		printf("Usage: %s --mine [--validate] [--platform_id N] [--device_id N] [--intensity N] [--portable] [--workers N] [--bfactor N] [--dataset_host]\n\n", argv[0]);
+		printf("Usage: %s --mine [--validate] [--validate_rate N] [--platform_id N] [--device_id N] [--device_type gpu|cpu|all] [--devices LIST] [--intensity N] [--memory_reserve N] [--max_alloc N] [--portable] [--workers N] [--bfactor N] [--vm_interleave N] [--kernel_ms N] [--autotune] [--dataset_host] [--dataset_hybrid PERCENT|auto] [--dataset_gpu] [--light] [--vm_counters] [--no_subgroups] [--store DIR] [--no_store] [--kernel_cache DIR] [--no_kernel_cache] [--pipeline] [--difficulty N] [--trace FILE] [--metrics ADDRESS] [--metrics_json FILE] [--metrics_interval N] [--blob HEX] [--nonce_offset N] [--nonce_width N]\n", argv[0]);
+		printf("       %s --scheduler_stats [--programs N] [--workers N]\n", argv[0]);
+		printf("       %s --gcn_emulator [--platform_id N] [--device_id N] [--device_type gpu|cpu|all] [--gcn_version N] [--hashes N] [--nonce N] [--seed HEX] [--blob HEX]\n\n", argv[0]);
 		printf("platform_id  0 if you have only 1 OpenCL platform\n");
 		printf("device_id    0 if you have only 1 GPU\n");
-		printf("intensity    number of scratchpads to allocate, if it's not set then as many as possible will be allocated.\n\n");
+		printf("device_type  which OpenCL devices device_id counts: gpu (default), cpu or all. CPU runtimes like PoCL can run --test\n");
+		printf("             and portable mode to check results, they're not meant for mining.\n");
+		printf("devices      mine on several GPUs at once, comma-separated device IDs. Use platform:device to mix OpenCL platforms, for example 0,1,2 or 0:0,1:0\n");
+		printf("             GPUs share the dataset in host memory, each of them gets its own part of the nonce range.\n");
+		printf("intensity    number of scratchpads to allocate, if it's not set then as many as possible will be allocated.\n");
+		printf("memory_reserve MB of GPU memory to leave free for the driver and other programs, default is 1/32 of it (at least 128 MB).\n");
+		printf("             Intensity is computed from what's left after datasets and this reserve, the plan is printed at startup.\n");
+		printf("max_alloc    largest buffer in MB. Below the device's limit it splits scratchpads and the dataset into more buffers,\n");
+		printf("             use it with --validate to check them on GPUs that don't need it.\n\n");
 		printf("portable     use generic OpenCL code that works on all GPUs.\n\n");
-		printf("workers      number of parallel workers per hash to run in portable mode. Can be 2,4,8,16, default is 8.\n\n");
-		printf("bfactor      splits main loop into multiple sub-steps. Use it to improve screen responsiveness. Can be 0-10, default is 5.\n\n");
+		printf("workers      number of parallel workers per hash to run in portable mode. Can be 2,4,8,16, default is 8 or the tuning profile's value.\n\n");
+		printf("bfactor      splits main loop into multiple sub-steps. Use it to improve screen responsiveness. Can be 0-10, default is 5 or the tuning profile's value.\n\n");
+		printf("vm_interleave store VM states of N neighbouring hashes register-major, so kernels that read registers of many hashes access\n");
+		printf("             adjacent memory. Can be 1,2,4,...,64, portable mode only. Default is 1 (every state contiguous) or the tuning profile's value.\n\n");
+		printf("kernel_ms    split main loop into launches of about N milliseconds, measured on the GPU and adjusted while mining. Replaces bfactor,\n");
+		printf("             use it instead of bfactor to stay responsive or below a driver watchdog limit. GCN code can't be split, it's only measured.\n\n");
+		printf("autotune     benchmark intensity, workers, bfactor and kernel work group sizes on the current dataset and save the fastest stable\n");
+		printf("             configuration to a tuning profile for this GPU and driver. Later runs load it automatically, command line values override it.\n\n");
 		printf("dataset_host allocate dataset on host. This is required for 2 GB GPUs.\n\n");
+		printf("dataset_hybrid keep PERCENT of the dataset in GPU memory and read the rest from host memory, for GPUs that can't fit all of it.\n");
+		printf("             \"auto\" benchmarks splits from 100%% down to 10%% and uses the fastest one. Implies portable.\n\n");
+		printf("dataset_gpu  build dataset on GPU from the RandomX cache instead of the CPU. Ignored with dataset_host.\n\n");
+		printf("store        directory for initialized datasets and caches, one file per seed. Default is the current directory.\n");
+		printf("no_store     don't load or save datasets, always build them.\n\n");
+		printf("kernel_cache directory for compiled OpenCL binaries, default is \"cache\". Binaries are keyed by a hash of kernel sources, build options,\n");
+		printf("             device, driver and platform, so they never have to be deleted by hand.\n");
+		printf("no_kernel_cache always compile kernels from source.\n\n");
+		printf("light        don't allocate the dataset, compute its items from the 256 MB cache on the fly. Much slower, for verification on GPUs with little memory. Implies portable.\n\n");
+		printf("vm_counters  count opcodes, CBRANCH jumps, instruction group widths, rounding mode changes and L1/L2/L3 scratchpad accesses\n");
+		printf("             of every hash in an instrumented execute_vm, and print them per hash when mining ends. Much slower. Implies portable.\n\n");
+		printf("no_subgroups synchronize portable mode workers with work-group barriers and local memory even if the GPU has sub-group functions\n");
+		printf("             (cl_khr_subgroups, cl_intel_subgroups, cl_khr_subgroup_shuffle). Both give the same hashes, use it with --validate to compare.\n\n");
+		printf("pipeline     split scratchpads into 2 batches and overlap their execution with validation and kernel launches on the host.\n\n");
+		printf("validate_rate with --validate, check 1 in N hashes of every batch on the CPU, default is 1 (all of them). Shares are always checked.\n");
+		printf("             0 checks as many as the CPU keeps up with. Validation runs in background and never slows down the GPU.\n\n");
+		printf("difficulty   check hashes against this difficulty on GPU and count the ones that meet it, 0 (default) disables it.\n\n");
+		printf("trace        profile every GPU command and host phase, write the timeline to FILE (open it in chrome://tracing or Perfetto)\n");
+		printf("             and print which share of batch time every stage takes when mining ends.\n\n");
+		printf("metrics      serve hashrate, batch latency, validation, dataset and memory metrics in Prometheus format on http://ADDRESS/metrics\n");
+		printf("             ADDRESS is PORT (localhost), HOST:PORT or unix:PATH, /metrics.json returns the same metrics as JSON\n");
+		printf("metrics_json write a JSON snapshot of the metrics to FILE every N seconds (--metrics_interval, default 10)\n\n");
+		printf("blob         hashing blob in hex, any length. Default is a built-in 76 byte block template.\n");
+		printf("nonce_offset byte offset of the nonce in the blob, default is 39.\n");
+		printf("nonce_width  nonce size in bytes (1-8), default is 4.\n\n");
+		printf("seed         RandomX seed (key) in hex. Default is \"RandomX example seed\".\n");
+		printf("next_seed    seed of the next epoch in hex. Its dataset is built in background while mining.\n");
+		printf("seed_switch  switch to next_seed after N seconds of mining, to test epoch changes.\n\n");
+		printf("scheduler_stats schedule N random programs (--programs, default 1000000) with every instruction scheduler of portable mode on the CPU,\n");
+		printf("             check the schedules and compare how many steps they take. Uses all supported --workers values if it's not set.\n\n");
+		printf("gcn_emulator compile randomx_init for --gcn_version (12, 14 or 15, all of them if it's not set) on any OpenCL device and run\n");
+		printf("             the GCN code it generates on the CPU for --hashes nonces (default 64). Registers and scratchpads are compared\n");
+		printf("             with the RandomX VM after every program, missing s_waitcnt and out-of-scratchpad accesses are reported too.\n");
+		printf("             A recorded GCN program is checked against known-good results first. Use --device_type cpu to run it without a GPU.\n\n");
 		printf("Examples:\n%s --mine --validate --intensity 1984\n", argv[0]);
 		return 0;
 	}
 
 	uint32_t platform_id = 0;
 	uint32_t device_id = 0;
-	size_t intensity = 0;
-	uint32_t start_nonce = 0;
-	uint32_t workers_per_hash = 8;
-	uint32_t bfactor = 5;
-	bool portable = false;
-	bool dataset_host_allocated = false;
-	bool validate = false;
+	const char* devices = nullptr;
+	MinerSettings settings;
+
+	Job job;
+	job.blob.assign(blockTemplate, blockTemplate + sizeof(blockTemplate));
+
+	const char default_seed[] = "RandomX example seed";
+	job.seed.assign(default_seed, default_seed + sizeof(default_seed));
+
+	uint32_t seed_switch = 0;
+	uint64_t num_programs = 1000000;
+	int gcn_version = 0;
+	uint32_t num_hashes = 64;
 
 	for (int i = 1; i < argc; ++i)
 	{
@@ -56,26 +117,180 @@ int main(int argc, char** argv)
 			platform_id = atoi(argv[i + 1]);
 		else if ((strcmp(argv[i], "--device_id") == 0) && (i + 1 < argc))
 			device_id = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--device_type") == 0) && (i + 1 < argc))
+		{
+			if (strcmp(argv[i + 1], "gpu") == 0)
+				settings.device_type = CL_DEVICE_TYPE_GPU;
+			else if (strcmp(argv[i + 1], "cpu") == 0)
+				settings.device_type = CL_DEVICE_TYPE_CPU;
+			else if (strcmp(argv[i + 1], "all") == 0)
+				settings.device_type = CL_DEVICE_TYPE_ALL;
+			else
+			{
+				fprintf(stderr, "Invalid --device_type, use gpu, cpu or all\n");
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "--devices") == 0) && (i + 1 < argc))
+			devices = argv[i + 1];
 		else if ((strcmp(argv[i], "--intensity") == 0) && (i + 1 < argc))
-			intensity = atoi(argv[i + 1]);
+			settings.intensity = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--memory_reserve") == 0) && (i + 1 < argc))
+			settings.memory_reserve = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--max_alloc") == 0) && (i + 1 < argc))
+			settings.max_alloc = atoi(argv[i + 1]);
 		else if ((strcmp(argv[i], "--nonce") == 0) && (i + 1 < argc))
-			start_nonce = atoi(argv[i + 1]);
+			settings.start_nonce = atoi(argv[i + 1]);
 		else if ((strcmp(argv[i], "--workers") == 0) && (i + 1 < argc))
-			workers_per_hash = atoi(argv[i + 1]);
+			settings.workers_per_hash = atoi(argv[i + 1]);
 		else if ((strcmp(argv[i], "--bfactor") == 0) && (i + 1 < argc))
-			bfactor = atoi(argv[i + 1]);
+			settings.bfactor = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--vm_interleave") == 0) && (i + 1 < argc))
+			settings.vm_state_interleave = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--kernel_ms") == 0) && (i + 1 < argc))
+			settings.kernel_ms = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "--autotune") == 0)
+			settings.autotune = true;
 		else if (strcmp(argv[i], "--portable") == 0)
-			portable = true;
+			settings.portable = true;
 		else if (strcmp(argv[i], "--dataset_host") == 0)
-			dataset_host_allocated = true;
+			settings.dataset_host_allocated = true;
+		else if ((strcmp(argv[i], "--dataset_hybrid") == 0) && (i + 1 < argc))
+		{
+			// "auto" and anything else that isn't a number benchmark the split
+			settings.dataset_hybrid = true;
+			const int percent = atoi(argv[i + 1]);
+			settings.dataset_vram_percent = (percent > 100) ? 100 : ((percent > 0) ? percent : 0);
+		}
+		else if (strcmp(argv[i], "--dataset_gpu") == 0)
+			settings.dataset_gpu = true;
+		else if (strcmp(argv[i], "--light") == 0)
+			settings.light_mode = true;
+		else if (strcmp(argv[i], "--vm_counters") == 0)
+			settings.vm_counters = true;
+		else if (strcmp(argv[i], "--no_subgroups") == 0)
+			settings.subgroups = false;
+		else if ((strcmp(argv[i], "--store") == 0) && (i + 1 < argc))
+			settings.store_dir = argv[i + 1];
+		else if (strcmp(argv[i], "--no_store") == 0)
+			settings.store_dir.clear();
+		else if ((strcmp(argv[i], "--kernel_cache") == 0) && (i + 1 < argc))
+			settings.kernel_cache_dir = argv[i + 1];
+		else if (strcmp(argv[i], "--no_kernel_cache") == 0)
+			settings.kernel_cache_dir.clear();
+		else if ((strcmp(argv[i], "--validate_rate") == 0) && (i + 1 < argc))
+			settings.validate_rate = atoi(argv[i + 1]);
 		else if (strcmp(argv[i], "--validate") == 0)
-			validate = true;
+			settings.validate = true;
+		else if (strcmp(argv[i], "--pipeline") == 0)
+			settings.pipeline = true;
+		else if ((strcmp(argv[i], "--difficulty") == 0) && (i + 1 < argc))
+			settings.difficulty = strtoull(argv[i + 1], nullptr, 10);
+		else if ((strcmp(argv[i], "--trace") == 0) && (i + 1 < argc))
+			settings.trace_file = argv[i + 1];
+		else if ((strcmp(argv[i], "--metrics") == 0) && (i + 1 < argc))
+			settings.metrics_address = argv[i + 1];
+		else if ((strcmp(argv[i], "--metrics_json") == 0) && (i + 1 < argc))
+			settings.metrics_json = argv[i + 1];
+		else if ((strcmp(argv[i], "--metrics_interval") == 0) && (i + 1 < argc))
+			settings.metrics_interval = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--blob") == 0) && (i + 1 < argc))
+		{
+			if (!Job::ParseHex(argv[i + 1], job.blob))
+			{
+				fprintf(stderr, "Invalid hex string in --blob\n");
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "--seed") == 0) && (i + 1 < argc))
+		{
+			if (!Job::ParseHex(argv[i + 1], job.seed))
+			{
+				fprintf(stderr, "Invalid hex string in --seed\n");
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "--next_seed") == 0) && (i + 1 < argc))
+		{
+			if (!Job::ParseHex(argv[i + 1], job.next_seed))
+			{
+				fprintf(stderr, "Invalid hex string in --next_seed\n");
+				return 1;
+			}
+		}
+		else if ((strcmp(argv[i], "--seed_switch") == 0) && (i + 1 < argc))
+			seed_switch = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--nonce_offset") == 0) && (i + 1 < argc))
+			job.nonce_offset = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--nonce_width") == 0) && (i + 1 < argc))
+			job.nonce_width = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--programs") == 0) && (i + 1 < argc))
+			num_programs = strtoull(argv[i + 1], nullptr, 10);
+		else if ((strcmp(argv[i], "--gcn_version") == 0) && (i + 1 < argc))
+			gcn_version = atoi(argv[i + 1]);
+		else if ((strcmp(argv[i], "--hashes") == 0) && (i + 1 < argc))
+			num_hashes = atoi(argv[i + 1]);
+	}
+
+	if (!job.IsValid())
+	{
+		fprintf(stderr, "Nonce (offset %u, %u bytes) doesn't fit into a %zu byte blob\n", job.nonce_offset, job.nonce_width, job.blob.size());
+		return 1;
+	}
+
+	// "--devices 0,1" or "--devices 0:0,1:0", device IDs without a platform are on --platform_id
+	if (devices)
+	{
+		for (const char* p = devices; *p;)
+		{
+			char* end;
+			DeviceID id = { platform_id, static_cast<uint32_t>(strtoul(p, &end, 10)) };
+			if (*end == ':')
+			{
+				id.platform_id = id.device_id;
+				id.device_id = static_cast<uint32_t>(strtoul(end + 1, &end, 10));
+			}
+
+			if ((end == p) || ((*end != ',') && (*end != '\0')))
+			{
+				fprintf(stderr, "Invalid device list in --devices\n");
+				return 1;
+			}
+
+			settings.devices.push_back(id);
+			p = (*end == ',') ? (end + 1) : end;
+		}
+	}
+	else
+	{
+		settings.devices.push_back({ platform_id, device_id });
+	}
+
+	JobSource jobs(job);
+
+	// Simulates a new epoch: the job's seed becomes next_seed, like a pool would send it at the epoch's first block
+	std::vector<SThread> seed_switch_thread;
+	if (seed_switch && !job.next_seed.empty())
+	{
+		seed_switch_thread.emplace_back([&jobs, job, seed_switch]()
+		{
+			std::this_thread::sleep_for(std::chrono::seconds(seed_switch));
+
+			Job new_job = job;
+			new_job.seed = job.next_seed;
+			new_job.next_seed.clear();
+			jobs.Set(new_job);
+		});
 	}
 
 	if (strcmp(argv[1], "--mine") == 0)
-		return test_mining(platform_id, device_id, intensity, start_nonce, workers_per_hash, bfactor, portable, dataset_host_allocated, validate) ? 0 : 1;
+		return test_mining(settings, jobs) ? 0 : 1;
 	else if (strcmp(argv[1], "--test") == 0)
-		return tests(platform_id, device_id, intensity) ? 0 : 1;
+		return tests(platform_id, device_id, settings.device_type, settings.intensity) ? 0 : 1;
+	else if (strcmp(argv[1], "--scheduler_stats") == 0)
+		return scheduler_stats(num_programs, (settings.workers_per_hash != TUNABLE_AUTO) ? settings.workers_per_hash : 0) ? 0 : 1;
+	else if (strcmp(argv[1], "--gcn_emulator") == 0)
+		return gcn_emulator_test(platform_id, device_id, settings.device_type, gcn_version, num_hashes, settings.start_nonce, job) ? 0 : 1;
 
 	return 0;
 }
@@ -0,0 +1,306 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include "autotune.h"
+#include "opencl_helpers.h"
+
+std::string TuningParams::ToString() const
+{
+	std::stringstream s;
+	s << "intensity " << intensity << ", workers " << workers_per_hash << ", bfactor " << bfactor << ", AES local size " << aes_local_size << ", Blake2b local size " << blake2b_local_size;
+	if (vm_state_interleave > 1)
+		s << ", VM state interleave " << vm_state_interleave;
+	return s.str();
+}
+
+// Device names and driver versions become part of a file name
+static std::string sanitize(const std::vector<char>& s)
+{
+	std::string result;
+	for (char c : s)
+	{
+		if (!c)
+			break;
+
+		if (isalnum(static_cast<unsigned char>(c)) || (c == '.') || (c == '-'))
+			result += c;
+		else if (result.empty() || (result.back() != '_'))
+			result += '_';
+	}
+
+	while (!result.empty() && (result.back() == '_'))
+		result.pop_back();
+
+	return result.empty() ? "unknown" : result;
+}
+
+std::string tuning_profile_path(const OpenCLContext& ctx, const std::string& mode)
+{
+	return "tuning_" + sanitize(ctx.device_name) + "_" + sanitize(ctx.device_driver_version) + "_" + mode + ".txt";
+}
+
+bool load_tuning_profile(const OpenCLContext& ctx, const std::string& mode, TuningParams& params)
+{
+	std::ifstream f(tuning_profile_path(ctx, mode));
+	if (!f.is_open())
+		return false;
+
+	TuningParams result;
+	uint32_t found = 0;
+
+	std::string line;
+	while (std::getline(f, line))
+	{
+		const size_t k = line.find('=');
+		if ((k == std::string::npos) || line.empty() || (line[0] == '#'))
+			continue;
+
+		const std::string key = line.substr(0, k);
+		const unsigned long long value = strtoull(line.c_str() + k + 1, nullptr, 10);
+
+		if (key == "intensity")
+			result.intensity = static_cast<size_t>(value);
+		else if (key == "workers")
+			result.workers_per_hash = static_cast<uint32_t>(value);
+		else if (key == "bfactor")
+			result.bfactor = static_cast<uint32_t>(value);
+		else if (key == "aes_local_size")
+			result.aes_local_size = static_cast<uint32_t>(value);
+		else if (key == "blake2b_local_size")
+			result.blake2b_local_size = static_cast<uint32_t>(value);
+		else if (key == "vm_state_interleave")
+		{
+			// Profiles saved before it was tuned don't have it, they were tuned with the contiguous layout
+			result.vm_state_interleave = static_cast<uint32_t>(value);
+			continue;
+		}
+		else
+			continue;
+
+		++found;
+	}
+
+	// Profiles are written by save_tuning_profile() only, so anything incomplete is ignored instead of half-applied
+	if ((found < 5) || !result.intensity)
+	{
+		std::cerr << "Ignoring invalid tuning profile " << tuning_profile_path(ctx, mode) << std::endl;
+		return false;
+	}
+
+	params = result;
+	return true;
+}
+
+bool save_tuning_profile(const OpenCLContext& ctx, const std::string& mode, const TuningParams& params, double hashrate)
+{
+	const std::string path = tuning_profile_path(ctx, mode);
+
+	std::ofstream f(path);
+	if (!f.is_open())
+	{
+		std::cerr << "Couldn't create " << path << std::endl;
+		return false;
+	}
+
+	f << "# Generated by --autotune for " << ctx.device_name.data() << ", driver " << ctx.device_driver_version.data() << std::endl;
+	f << "intensity=" << params.intensity << std::endl;
+	f << "workers=" << params.workers_per_hash << std::endl;
+	f << "bfactor=" << params.bfactor << std::endl;
+	f << "aes_local_size=" << params.aes_local_size << std::endl;
+	f << "blake2b_local_size=" << params.blake2b_local_size << std::endl;
+	f << "vm_state_interleave=" << params.vm_state_interleave << std::endl;
+	f << "hashrate=" << static_cast<uint64_t>(hashrate) << std::endl;
+
+	if (!f.good())
+	{
+		std::cerr << "Couldn't write " << path << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+Autotuner::Autotuner(const TuningParams& start, size_t max_intensity, size_t intensity_step, bool portable, const std::string& prefix)
+	: stage(STAGE_WORKERS)
+	, best(start)
+	, best_hashrate(0.0)
+	, best_stable(false)
+	, max_intensity(max_intensity)
+	, intensity_step(intensity_step)
+	, portable(portable)
+	, prefix(prefix)
+{
+	if (!best.intensity || (best.intensity > max_intensity))
+		best.intensity = max_intensity;
+
+	best.intensity -= best.intensity % intensity_step;
+
+	StartStage();
+}
+
+void Autotuner::StartStage()
+{
+	for (; stage != STAGE_DONE; stage = static_cast<Stage>(stage + 1))
+	{
+		std::vector<TuningParams> stage_candidates;
+
+		auto add = [this, &stage_candidates](const TuningParams& p)
+		{
+			if (!Tested(p) && (std::find(stage_candidates.begin(), stage_candidates.end(), p) == stage_candidates.end()))
+				stage_candidates.emplace_back(p);
+		};
+
+		TuningParams p = best;
+		switch (stage)
+		{
+		case STAGE_WORKERS:
+			// GCN assembly code doesn't use workers or bfactor, but the starting point itself must always be measured
+			add(best);
+			if (portable)
+			{
+				for (uint32_t w : { 2U, 4U, 8U, 16U })
+				{
+					p.workers_per_hash = w;
+					add(p);
+				}
+			}
+			break;
+
+		case STAGE_INTENSITY:
+			// Less scratchpads than VRAM allows can be faster when they fit into TLB or L2 cache better
+			for (size_t i = 4; i <= 8; ++i)
+			{
+				p.intensity = (max_intensity * i / 8) / intensity_step * intensity_step;
+				if (p.intensity)
+					add(p);
+			}
+			break;
+
+		case STAGE_BFACTOR:
+			if (portable)
+			{
+				for (uint32_t b = 0; b <= 8; ++b)
+				{
+					p.bfactor = b;
+					add(p);
+				}
+			}
+			break;
+
+		case STAGE_VM_LAYOUT:
+			// Registers are read with large strides by init_vm, hashAes1Rx4 and Blake2b when every hash's state is contiguous,
+			// execute_vm prefers that layout. GCN assembly code reads only contiguous registers.
+			if (portable)
+			{
+				for (uint32_t n : { 1U, 16U, 64U })
+				{
+					p.vm_state_interleave = n;
+					add(p);
+				}
+			}
+			break;
+
+		case STAGE_AES:
+			for (uint32_t s : { 64U, 128U, 256U })
+			{
+				p.aes_local_size = s;
+				add(p);
+			}
+			break;
+
+		case STAGE_BLAKE2B:
+			for (uint32_t s : { 32U, 64U })
+			{
+				p.blake2b_local_size = s;
+				add(p);
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		if (!stage_candidates.empty())
+		{
+			candidates = std::move(stage_candidates);
+			return;
+		}
+	}
+}
+
+bool Autotuner::Tested(const TuningParams& params) const
+{
+	return std::find(tested.begin(), tested.end(), params) != tested.end();
+}
+
+bool Autotuner::Next(TuningParams& candidate)
+{
+	if (candidates.empty())
+	{
+		if (stage == STAGE_DONE)
+			return false;
+
+		stage = static_cast<Stage>(stage + 1);
+		StartStage();
+
+		if (candidates.empty())
+			return false;
+	}
+
+	candidate = candidates.front();
+	candidates.erase(candidates.begin());
+	return true;
+}
+
+void Autotuner::Report(const TuningParams& candidate, const std::vector<double>& hashrates)
+{
+	tested.emplace_back(candidate);
+
+	if (hashrates.empty())
+	{
+		std::cout << (prefix + candidate.ToString() + ": failed\n") << std::flush;
+		return;
+	}
+
+	std::vector<double> sorted = hashrates;
+	std::sort(sorted.begin(), sorted.end());
+
+	const double median = sorted[sorted.size() / 2];
+	const double spread = (median > 0.0) ? ((sorted.back() - sorted.front()) / median) : 1.0;
+	const bool stable = (spread <= TUNING_MAX_SPREAD);
+
+	std::stringstream s;
+	s << prefix << candidate.ToString() << ": " << static_cast<uint64_t>(median) << " h/s";
+	if (!stable)
+		s << " (unstable, " << static_cast<uint32_t>(spread * 100.0) << "% spread)";
+	s << "\n";
+	std::cout << s.str() << std::flush;
+
+	// A stable configuration always wins over an unstable one, even a faster one: unstable usually means thermal or memory trouble
+	if ((stable && !best_stable) || ((stable == best_stable) && (median > best_hashrate)))
+	{
+		best = candidate;
+		best_hashrate = median;
+		best_stable = stable;
+	}
+}
@@ -0,0 +1,116 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct OpenCLContext;
+
+// Number of batches every candidate configuration is timed over, after one warm-up batch per pipelined slot
+static constexpr uint32_t TUNING_BATCHES = 5;
+
+// Candidate is stable if its slowest batch is within this fraction of its median
+static constexpr double TUNING_MAX_SPREAD = 0.1;
+
+// Launch configuration of one device: everything --autotune searches for and tuning profiles store.
+// Local sizes of init_vm, execute_vm (16 or 32 depending on workers_per_hash) and GCN kernels are fixed by their code.
+struct TuningParams
+{
+	TuningParams()
+		: intensity(0)
+		, workers_per_hash(8)
+		, bfactor(5)
+		, aes_local_size(64)
+		, blake2b_local_size(64)
+		, vm_state_interleave(1)
+	{}
+
+	bool operator==(const TuningParams& other) const
+	{
+		return (intensity == other.intensity) && (workers_per_hash == other.workers_per_hash) && (bfactor == other.bfactor) &&
+			(aes_local_size == other.aes_local_size) && (blake2b_local_size == other.blake2b_local_size) &&
+			(vm_state_interleave == other.vm_state_interleave);
+	}
+
+	std::string ToString() const;
+
+	size_t intensity;
+	uint32_t workers_per_hash;
+	uint32_t bfactor;
+	uint32_t aes_local_size;
+	uint32_t blake2b_local_size;
+
+	// Hashes per block of the VM state layout (VM_STATE_INTERLEAVE), portable code only
+	uint32_t vm_state_interleave;
+};
+
+// Tuning profiles are text files in the current directory, one per device name, driver version and "mode" (the kernel set and
+// memory layout, see tuning_mode() in miner.cpp), because the best configuration for one of them says nothing about the others.
+std::string tuning_profile_path(const OpenCLContext& ctx, const std::string& mode);
+bool load_tuning_profile(const OpenCLContext& ctx, const std::string& mode, TuningParams& params);
+bool save_tuning_profile(const OpenCLContext& ctx, const std::string& mode, const TuningParams& params, double hashrate);
+
+// Searches for the fastest stable configuration one parameter at a time, in order of their impact:
+// workers per hash, intensity, bfactor, VM state layout, AES and Blake2b work group sizes. Every stage starts from the best configuration found so far.
+class Autotuner
+{
+public:
+	// "max_intensity" is what fits into VRAM, intensities are multiples of "intensity_step". Results are printed with "prefix".
+	Autotuner(const TuningParams& start, size_t max_intensity, size_t intensity_step, bool portable, const std::string& prefix);
+
+	// Returns false when the search is finished
+	bool Next(TuningParams& candidate);
+
+	// Hashrates of all timed batches, empty if the candidate failed
+	void Report(const TuningParams& candidate, const std::vector<double>& hashrates);
+
+	const TuningParams& Best() const { return best; }
+	double BestHashrate() const { return best_hashrate; }
+
+private:
+	enum Stage
+	{
+		STAGE_WORKERS,
+		STAGE_INTENSITY,
+		STAGE_BFACTOR,
+		STAGE_VM_LAYOUT,
+		STAGE_AES,
+		STAGE_BLAKE2B,
+		STAGE_DONE,
+	};
+
+	void StartStage();
+	bool Tested(const TuningParams& params) const;
+
+	Stage stage;
+	std::vector<TuningParams> candidates;
+	std::vector<TuningParams> tested;
+
+	TuningParams best;
+	double best_hashrate;
+	bool best_stable;
+
+	size_t max_intensity;
+	size_t intensity_step;
+	bool portable;
+	std::string prefix;
+};
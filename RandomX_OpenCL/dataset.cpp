@@ -0,0 +1,1052 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include "dataset.h"
+#include "definitions.h"
+#include "trace.h"
+
+#include "../RandomX/src/dataset.hpp"
+
+static_assert(CACHE_SIZE == randomx::CacheSize, "CACHE_SIZE must match RandomX configuration");
+static_assert(SUPERSCALAR_MAX_SIZE == randomx::SuperscalarMaxSize, "SUPERSCALAR_MAX_SIZE must match RandomX configuration");
+
+// Number of dataset items computed by one init_dataset launch, so a long running kernel doesn't block the GPU for too long
+static constexpr uint32_t DATASET_INIT_CHUNK = 1 << 18;
+
+// Dataset items built and uploaded as one piece (16 MB) and the number of pinned staging buffers uploads rotate through
+static constexpr uint32_t DATASET_UPLOAD_CHUNK = 1 << 18;
+static constexpr uint32_t DATASET_STAGING_BUFFERS = 4;
+
+using namespace std::chrono;
+
+static double seconds_between(high_resolution_clock::time_point t1, high_resolution_clock::time_point t2)
+{
+	return duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+}
+
+// Pinned host memory which stays mapped while the dataset is uploaded. Writes from it are DMA transfers,
+// writes from pageable memory are staged by the driver with an extra copy and usually block.
+struct StagingBuffer
+{
+	StagingBuffer() : mem(nullptr), ptr(nullptr), event(nullptr), queue(nullptr) {}
+
+	~StagingBuffer()
+	{
+		Wait();
+
+		if (ptr)
+		{
+			clEnqueueUnmapMemObject(queue, mem, ptr, 0, nullptr, nullptr);
+			clFinish(queue);
+		}
+
+		if (mem)
+			clReleaseMemObject(mem);
+	}
+
+	bool Init(cl_context context, cl_command_queue map_queue, size_t size)
+	{
+		queue = map_queue;
+
+		cl_int err;
+		mem = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &err);
+		CL_CHECK_RESULT(clCreateBuffer);
+
+		ptr = clEnqueueMapBuffer(queue, mem, CL_TRUE, CL_MAP_WRITE, 0, size, 0, nullptr, nullptr, &err);
+		CL_CHECK_RESULT(clEnqueueMapBuffer);
+
+		return true;
+	}
+
+	// Waits until the previous upload from this buffer is finished, so it can be overwritten
+	bool Wait()
+	{
+		if (!event)
+			return true;
+
+		cl_int err = clWaitForEvents(1, &event);
+		clReleaseEvent(event);
+		event = nullptr;
+		CL_CHECK_RESULT(clWaitForEvents);
+
+		return true;
+	}
+
+	cl_mem mem;
+	void* ptr;
+	cl_event event;
+	cl_command_queue queue;
+};
+
+void pack_superscalar_programs(randomx_cache* cache, std::vector<uint32_t>& programs, std::vector<uint64_t>& reciprocals)
+{
+	programs.assign(RANDOMX_CACHE_ACCESSES * SUPERSCALAR_PROGRAM_SIZE / sizeof(uint32_t), 0);
+
+	for (uint32_t i = 0; i < RANDOMX_CACHE_ACCESSES; ++i)
+	{
+		randomx::SuperscalarProgram& prog = cache->programs[i];
+
+		uint32_t* p = programs.data() + i * (SUPERSCALAR_PROGRAM_SIZE / sizeof(uint32_t));
+		p[0] = prog.getSize();
+		p[1] = static_cast<uint32_t>(prog.getAddressRegister());
+		p += 2;
+
+		for (uint32_t j = 0, n = prog.getSize(); j < n; ++j, p += 2)
+		{
+			const randomx::Instruction& instr = prog(j);
+			p[0] = instr.opcode | (instr.dst << 8) | (instr.src << 16) | (instr.mod << 24);
+
+			// IMUL_RCP's imm32 is already replaced with an index into reciprocalCache by randomx_init_cache()
+			p[1] = instr.getImm32();
+		}
+	}
+
+	reciprocals = cache->reciprocalCache;
+}
+
+HostDataset::HostDataset(const DatasetSettings& settings, const std::vector<uint8_t>& seed)
+	: seed(seed)
+	, dataset(nullptr)
+	, cache(nullptr)
+	, cache_memory(nullptr)
+	, stored(false)
+	, build_time(0.0)
+	, settings(settings)
+	, commit_threads(1)
+	, cache_ready(false)
+	, dataset_ready(false)
+	, failed(false)
+	, readback_claimed(false)
+{
+}
+
+HostDataset::~HostDataset()
+{
+	builder.clear();
+	committer.clear();
+
+	if (cache)
+		randomx_release_cache(cache);
+
+	// With the store, dataset memory belongs to the file mapping
+	if (dataset && !settings.store_dir.empty())
+		delete dataset;
+	else if (dataset)
+		randomx_release_dataset(dataset);
+}
+
+uint32_t HostDataset::NumChunks()
+{
+	return static_cast<uint32_t>((randomx_dataset_item_count() + DATASET_UPLOAD_CHUNK - 1) / DATASET_UPLOAD_CHUNK);
+}
+
+void HostDataset::Start(uint32_t num_threads, std::atomic<bool>& large_pages_available)
+{
+	commit_threads = std::max(num_threads, 1U);
+
+	builder.emplace_back([this, num_threads, &large_pages_available]()
+	{
+		if (!Build(num_threads, large_pages_available))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			failed = true;
+			state_changed.notify_all();
+		}
+	});
+}
+
+bool HostDataset::Build(uint32_t num_threads, std::atomic<bool>& large_pages_available)
+{
+	TraceScope trace("host dataset build");
+
+	build_start = high_resolution_clock::now();
+
+	const bool with_dataset = !settings.light;
+
+	// GPU initialization computes the dataset on the GPU, host memory is only needed to validate or store it
+	const bool need_dataset = with_dataset && (!settings.gpu_init || settings.host_copy || !settings.store_dir.empty());
+
+	if (!settings.store_dir.empty())
+	{
+		if (file.Open(settings.store_dir, seed, with_dataset, num_threads))
+		{
+			stored = true;
+
+			cache_memory = file.CacheMemory();
+			programs.assign(file.Programs(), file.Programs() + RANDOMX_CACHE_ACCESSES * SUPERSCALAR_PROGRAM_SIZE / sizeof(uint32_t));
+			reciprocals.assign(file.Reciprocals(), file.Reciprocals() + file.num_reciprocals);
+
+			if (need_dataset)
+			{
+				dataset = new randomx_dataset();
+				dataset->memory = file.DatasetMemory();
+			}
+
+			// Light mode CPU validation needs a real randomx_cache, it can't be restored from the file
+			if (settings.light && settings.host_copy && !InitCache(large_pages_available))
+			{
+				return false;
+			}
+
+			SetBuildTime();
+			SetCacheReady();
+
+			if (with_dataset)
+			{
+				for (uint32_t chunk = 0, n = NumChunks(); chunk < n; ++chunk)
+					SetChunkReady(chunk);
+			}
+
+			SetDatasetReady();
+			return true;
+		}
+
+		if (!file.Create(settings.store_dir, seed, with_dataset))
+		{
+			return false;
+		}
+
+		// Memory is set to the file mapping. GPU initialization reads the dataset back to store it.
+		if (need_dataset)
+		{
+			dataset = new randomx_dataset();
+			dataset->memory = file.DatasetMemory();
+		}
+	}
+	else if (need_dataset && !AllocDataset(large_pages_available))
+	{
+		return false;
+	}
+
+	if (!InitCache(large_pages_available))
+	{
+		return false;
+	}
+
+	if (file.IsOpen())
+	{
+		memcpy(file.CacheMemory(), cache->memory, CACHE_SIZE);
+		std::copy(programs.begin(), programs.end(), file.Programs());
+		std::copy(reciprocals.begin(), reciprocals.end(), file.Reciprocals());
+		file.num_reciprocals = static_cast<uint32_t>(reciprocals.size());
+	}
+
+	// Light mode and GPU initialization need nothing else from the CPU
+	if (settings.light || settings.gpu_init)
+	{
+		SetBuildTime();
+		SetCacheReady();
+
+		if (settings.light)
+		{
+			if (file.IsOpen() && !file.Commit(num_threads))
+				return false;
+
+			SetDatasetReady();
+		}
+		else if (!dataset)
+		{
+			SetDatasetReady();
+		}
+
+		// Otherwise the dataset is complete after ReadbackDone()
+		return true;
+	}
+
+	SetCacheReady();
+
+	// Worker threads take chunks in order, devices upload every chunk as soon as it's finished, see DatasetBuffer::StreamDataset()
+	const uint32_t item_count = static_cast<uint32_t>(randomx_dataset_item_count());
+	const uint32_t num_chunks = NumChunks();
+	std::atomic<uint32_t> next_chunk(0);
+	{
+		std::vector<SThread> threads;
+		for (uint32_t i = 0, n = std::max(num_threads, 1U); i < n; ++i)
+		{
+			threads.emplace_back([this, &next_chunk, item_count, num_chunks]()
+			{
+				for (uint32_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++)
+				{
+					const uint32_t start_item = chunk * DATASET_UPLOAD_CHUNK;
+					randomx_init_dataset(dataset, cache, start_item, std::min(DATASET_UPLOAD_CHUNK, item_count - start_item));
+					SetChunkReady(chunk);
+				}
+			});
+		}
+	}
+
+	// The cache isn't needed anymore, devices upload the dataset
+	randomx_release_cache(cache);
+	cache = nullptr;
+	cache_memory = file.IsOpen() ? file.CacheMemory() : nullptr;
+
+	SetBuildTime();
+	SetDatasetReady();
+
+	// Mining can start while the file is being checksummed
+	if (file.IsOpen() && !file.Commit(num_threads))
+	{
+		std::cerr << "Couldn't save dataset to " << settings.store_dir << std::endl;
+	}
+
+	return true;
+}
+
+bool HostDataset::InitCache(std::atomic<bool>& large_pages_available)
+{
+	// JIT speeds up CPU dataset initialization and light mode CPU validation, GPU initialization only needs cache memory and SuperscalarHash programs
+	const randomx_flags flags = settings.gpu_init ? RANDOMX_FLAG_DEFAULT : RANDOMX_FLAG_JIT;
+
+	cache = randomx_alloc_cache((randomx_flags)(flags | (large_pages_available ? RANDOMX_FLAG_LARGE_PAGES : 0)));
+	if (!cache && large_pages_available)
+	{
+		std::cout << "\nCouldn't allocate cache using large pages" << std::endl;
+		cache = randomx_alloc_cache(flags);
+		large_pages_available = false;
+	}
+
+	if (!cache)
+	{
+		std::cerr << "Couldn't allocate cache" << std::endl;
+		return false;
+	}
+
+	randomx_init_cache(cache, seed.data(), seed.size());
+
+	// Light mode validation initializes the cache even when everything else comes from the store
+	if (!stored)
+	{
+		cache_memory = cache->memory;
+		pack_superscalar_programs(cache, programs, reciprocals);
+	}
+
+	return true;
+}
+
+bool HostDataset::AllocDataset(std::atomic<bool>& large_pages_available)
+{
+	dataset = randomx_alloc_dataset(large_pages_available ? RANDOMX_FLAG_LARGE_PAGES : RANDOMX_FLAG_DEFAULT);
+	if (!dataset && large_pages_available)
+	{
+		std::cout << "Couldn't allocate dataset using large pages" << std::endl;
+		dataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+		large_pages_available = false;
+	}
+
+	if (!dataset)
+	{
+		std::cerr << "Couldn't allocate dataset" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+void HostDataset::SetBuildTime()
+{
+	build_end = high_resolution_clock::now();
+	build_time = seconds_between(build_start, build_end);
+}
+
+void HostDataset::SetCacheReady()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	cache_ready = true;
+	state_changed.notify_all();
+}
+
+void HostDataset::SetChunkReady(uint32_t chunk)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	ready_chunks.push_back(chunk);
+	state_changed.notify_all();
+}
+
+void HostDataset::SetDatasetReady()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	dataset_ready = true;
+	state_changed.notify_all();
+}
+
+bool HostDataset::WaitForCache()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	state_changed.wait(lock, [this]() { return cache_ready || failed; });
+	return !failed;
+}
+
+bool HostDataset::WaitForDataset()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	state_changed.wait(lock, [this]() { return dataset_ready || failed; });
+	return !failed;
+}
+
+int32_t HostDataset::WaitForChunk(uint32_t n)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	state_changed.wait(lock, [this, n]() { return (ready_chunks.size() > n) || failed; });
+	return failed ? -1 : static_cast<int32_t>(ready_chunks[n]);
+}
+
+bool HostDataset::IsDatasetReady()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return dataset_ready;
+}
+
+bool HostDataset::Failed()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return failed;
+}
+
+bool HostDataset::ClaimReadback()
+{
+	return settings.gpu_init && dataset && !stored && !readback_claimed.exchange(true);
+}
+
+void HostDataset::ReadbackDone(bool success)
+{
+	if (!success)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		failed = true;
+		state_changed.notify_all();
+		return;
+	}
+
+	SetDatasetReady();
+
+	if (file.IsOpen())
+	{
+		committer.emplace_back([this]() { file.Commit(commit_threads); });
+	}
+}
+
+// Only GPU initialization and light mode read the cache, and neither of them works with host memory datasets
+static DatasetSettings normalized(DatasetSettings settings)
+{
+	if (settings.light)
+	{
+		settings.gpu_init = false;
+		settings.host_memory = false;
+		settings.hybrid = false;
+	}
+
+	if (settings.host_memory)
+	{
+		settings.gpu_init = false;
+		settings.hybrid = false;
+	}
+
+	// The host part is read from the host dataset, so it's built on the CPU
+	if (settings.hybrid)
+	{
+		settings.gpu_init = false;
+	}
+
+	return settings;
+}
+
+HostDatasetPool::HostDatasetPool(const DatasetSettings& settings)
+	: settings(normalized(settings))
+	, large_pages_available(true)
+{
+}
+
+std::shared_ptr<HostDataset> HostDatasetPool::Get(const std::vector<uint8_t>& seed, uint32_t num_threads)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (auto it = datasets.begin(); it != datasets.end(); ++it)
+	{
+		if ((*it)->seed != seed)
+			continue;
+
+		std::shared_ptr<HostDataset> result = *it;
+		datasets.erase(it);
+
+		// A failed build is started again
+		if (!result->Failed())
+		{
+			datasets.push_back(result);
+			return result;
+		}
+		break;
+	}
+
+	if (datasets.size() >= 2)
+		datasets.erase(datasets.begin());
+
+	std::shared_ptr<HostDataset> result = std::make_shared<HostDataset>(settings, seed);
+	result->Start(num_threads, large_pages_available);
+	datasets.push_back(result);
+	return result;
+}
+
+DatasetBuffer::DatasetBuffer()
+	: host_allocated(false)
+	, light(false)
+	, programs_gpu(nullptr)
+	, reciprocals_gpu(nullptr)
+	, state(EMPTY)
+	, stored(false)
+	, build_time(0.0)
+	, upload_time(0.0)
+	, context(nullptr)
+	, build_result(0)
+	, upload_event(nullptr)
+	, streamed(false)
+	, readback(false)
+	, init_kernel(nullptr)
+	, cache_gpu(nullptr)
+{
+}
+
+DatasetBuffer::~DatasetBuffer()
+{
+	builder.clear();
+
+	if (upload_event)
+	{
+		const cl_int err = clWaitForEvents(1, &upload_event);
+		clReleaseEvent(upload_event);
+		FinishReadback(err == CL_SUCCESS);
+	}
+
+	// Devices waiting for the read back dataset must not wait forever
+	FinishReadback(false);
+
+	ReleaseInitData();
+
+	if (programs_gpu)
+		clReleaseMemObject(programs_gpu);
+
+	if (reciprocals_gpu)
+		clReleaseMemObject(reciprocals_gpu);
+
+	for (Part& p : parts)
+		clReleaseMemObject(p.mem);
+
+	for (cl_command_queue queue : upload_queues)
+		clReleaseCommandQueue(queue);
+}
+
+uint32_t DatasetBuffer::DeviceItems(uint32_t percent)
+{
+	const uint32_t item_count = static_cast<uint32_t>(randomx_dataset_item_count());
+	if (percent >= 100)
+		return item_count;
+
+	const uint32_t n = static_cast<uint32_t>(static_cast<uint64_t>(item_count) * percent / 100);
+	return n - n % DATASET_UPLOAD_CHUNK;
+}
+
+bool DatasetBuffer::Alloc(const OpenCLContext& ctx, const DatasetSettings& settings, cl_kernel gpu_init_kernel, uint32_t device_items)
+{
+	light = settings.light;
+	host_allocated = !light && settings.host_memory;
+
+	// Host memory dataset is always built on the CPU, there's no point in computing it on GPU and copying it back
+	init_kernel = (settings.gpu_init && !light && !host_allocated) ? gpu_init_kernel : nullptr;
+
+	context = ctx.context;
+
+	cl_int err;
+
+	if (light)
+	{
+		cl_mem mem = clCreateBuffer(context, CL_MEM_READ_ONLY, CACHE_SIZE, nullptr, &err);
+		CL_CHECK_RESULT(clCreateBuffer);
+		parts.push_back({ mem, 0, 0, false });
+		return true;
+	}
+
+	// Host memory part is created after the dataset is built, see CreateHostPart()
+	if (!host_allocated)
+	{
+		const uint32_t item_count = static_cast<uint32_t>(randomx_dataset_item_count());
+		if (!settings.hybrid)
+			device_items = item_count;
+		device_items = std::min(device_items, item_count);
+
+		// Parts are whole upload chunks, so every chunk goes to one part and the host part starts at a page boundary
+		const uint64_t max_part_items = ctx.device_max_alloc_size / RANDOMX_DATASET_ITEM_SIZE;
+		uint32_t part_items = static_cast<uint32_t>(std::min<uint64_t>(max_part_items - max_part_items % DATASET_UPLOAD_CHUNK, item_count));
+		if ((settings.max_parts <= 1) || !part_items)
+			part_items = item_count;
+
+		const uint32_t max_device_parts = std::min<uint32_t>(settings.max_parts, MAX_DATASET_PARTS) - ((device_items < item_count) ? 1 : 0);
+		if ((device_items + part_items - 1) / part_items > std::max(max_device_parts, 1U))
+		{
+			std::cerr << "Dataset doesn't fit into " << max_device_parts << " buffers of " << ((static_cast<uint64_t>(part_items) * RANDOMX_DATASET_ITEM_SIZE) >> 20) << " MB" << std::endl;
+			return false;
+		}
+
+		for (uint32_t first_item = 0; first_item < device_items; first_item += part_items)
+		{
+			const uint32_t n = std::min(part_items, device_items - first_item);
+			cl_mem mem = clCreateBuffer(context, CL_MEM_READ_ONLY, static_cast<size_t>(n) * RANDOMX_DATASET_ITEM_SIZE, nullptr, &err);
+			CL_CHECK_RESULT(clCreateBuffer);
+			parts.push_back({ mem, first_item, n, false });
+		}
+
+		// OpenCL can't tell how many DMA engines a device has. Discrete GPUs have at least two, so uploads alternate between two queues
+		// and can run in parallel. Integrated GPUs share memory with the host, one queue is enough there.
+		cl_bool unified_memory = CL_FALSE;
+		CL_CHECKED_CALL(clGetDeviceInfo, ctx.device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified_memory), &unified_memory, nullptr);
+
+		for (uint32_t i = 0, n = unified_memory ? 1 : 2; i < n; ++i)
+		{
+			cl_command_queue queue = clCreateCommandQueue(context, ctx.device, 0, &err);
+			CL_CHECK_RESULT(clCreateCommandQueue);
+			upload_queues.push_back(queue);
+		}
+	}
+
+	return true;
+}
+
+void DatasetBuffer::Start(HostDatasetPool& pool, const std::vector<uint8_t>& new_seed, uint32_t num_threads)
+{
+	builder.clear();
+
+	// CL_MEM_USE_HOST_PTR buffer points to the old HostDataset's memory, it can't outlive it
+	ReleaseHostPart();
+
+	state = BUILDING;
+	seed = new_seed;
+	build_result = 0;
+	streamed = false;
+	upload_time = 0.0;
+
+	source = pool.Get(seed, num_threads);
+}
+
+bool DatasetBuffer::Build(cl_command_queue queue, HostDatasetPool& pool, const std::vector<uint8_t>& new_seed, uint32_t num_threads)
+{
+	Start(pool, new_seed, num_threads);
+
+	if (!Prepare())
+	{
+		return false;
+	}
+
+	if (host_allocated)
+	{
+		if (!CreateHostPart())
+		{
+			return false;
+		}
+
+		Finish();
+		return true;
+	}
+
+	if (!streamed)
+	{
+		cl_event event;
+		if (!EnqueueUpload(queue, &event))
+		{
+			FinishReadback(false);
+			return false;
+		}
+
+		cl_int err = clWaitForEvents(1, &event);
+		clReleaseEvent(event);
+		FinishReadback(err == CL_SUCCESS);
+		CL_CHECK_RESULT(clWaitForEvents);
+
+		upload_time = seconds_between(upload_start, high_resolution_clock::now());
+
+		// With GPU initialization, validation needs the dataset that's read back by the first GPU
+		if (!source->WaitForDataset())
+		{
+			return false;
+		}
+	}
+
+	Finish();
+	return true;
+}
+
+bool DatasetBuffer::Prepare()
+{
+	if (!source->WaitForCache())
+	{
+		return false;
+	}
+
+	stored = source->stored;
+
+	if (host_allocated)
+	{
+		if (!source->WaitForDataset())
+			return false;
+	}
+	else if (!light && (!init_kernel || stored))
+	{
+		return StreamDataset();
+	}
+
+	build_time = source->build_time;
+	return true;
+}
+
+// Chunks are taken in the order the host dataset finishes them: every chunk is copied into the next free staging buffer
+// and uploaded with a non-blocking write from it. Building, copying and DMA transfers overlap, only the last few chunks
+// are uploaded after the build is finished. All GPUs do this in parallel from the same host dataset.
+bool DatasetBuffer::StreamDataset()
+{
+	TraceScope trace("dataset upload");
+
+	const uint32_t item_count = static_cast<uint32_t>(randomx_dataset_item_count());
+	const uint32_t num_chunks = HostDataset::NumChunks();
+	const uint8_t* dataset_memory = reinterpret_cast<const uint8_t*>(randomx_get_dataset_memory(source->dataset));
+
+	StagingBuffer staging[DATASET_STAGING_BUFFERS];
+	for (StagingBuffer& s : staging)
+	{
+		if (!s.Init(context, upload_queues[0], static_cast<size_t>(DATASET_UPLOAD_CHUNK) * RANDOMX_DATASET_ITEM_SIZE))
+			return false;
+	}
+
+	for (uint32_t i = 0; i < num_chunks; ++i)
+	{
+		const int32_t chunk = source->WaitForChunk(i);
+		if (chunk < 0)
+		{
+			return false;
+		}
+
+		StagingBuffer& s = staging[i % DATASET_STAGING_BUFFERS];
+		if (!s.Wait())
+		{
+			return false;
+		}
+
+		// Chunks past the device parts stay in host memory
+		const uint32_t start_item = static_cast<uint32_t>(chunk) * DATASET_UPLOAD_CHUNK;
+		const Part& part = PartOf(start_item);
+		if (part.host || (start_item >= part.first_item + part.num_items))
+		{
+			continue;
+		}
+
+		const size_t offset = static_cast<size_t>(start_item) * RANDOMX_DATASET_ITEM_SIZE;
+		const size_t size = static_cast<size_t>(std::min(DATASET_UPLOAD_CHUNK, item_count - start_item)) * RANDOMX_DATASET_ITEM_SIZE;
+		memcpy(s.ptr, dataset_memory + offset, size);
+
+		cl_command_queue queue = upload_queues[i % upload_queues.size()];
+
+		cl_int err;
+		CL_CHECKED_CALL(clEnqueueWriteBuffer, queue, part.mem, CL_FALSE, offset - static_cast<size_t>(part.first_item) * RANDOMX_DATASET_ITEM_SIZE, size, s.ptr, 0, nullptr, &s.event);
+		CL_CHECKED_CALL(clFlush, queue);
+	}
+
+	for (StagingBuffer& s : staging)
+	{
+		if (!s.Wait())
+			return false;
+	}
+
+	if (!CreateHostPart())
+	{
+		return false;
+	}
+
+	// All chunks are finished at this point, so the host dataset's build time is known
+	build_time = source->build_time;
+	upload_time = std::max(seconds_between(source->build_end, high_resolution_clock::now()), 0.0);
+	streamed = true;
+
+	return true;
+}
+
+bool DatasetBuffer::EnqueueUpload(cl_command_queue queue, cl_event* event)
+{
+	upload_start = high_resolution_clock::now();
+
+	if (light)
+	{
+		return EnqueueCacheUpload(queue, parts[0].mem, event);
+	}
+
+	return EnqueueGpuInit(queue, event);
+}
+
+void DatasetBuffer::FinishReadback(bool success)
+{
+	if (readback)
+	{
+		readback = false;
+		source->ReadbackDone(success);
+	}
+}
+
+void DatasetBuffer::Finish()
+{
+	ReleaseInitData();
+	state = READY;
+}
+
+bool DatasetBuffer::CreateHostPart()
+{
+	// The driver is allowed to cache CL_MEM_USE_HOST_PTR buffers, so the buffer is recreated every time host memory changes
+	ReleaseHostPart();
+
+	const uint32_t item_count = static_cast<uint32_t>(randomx_dataset_item_count());
+	const uint32_t first_item = parts.empty() ? 0 : (parts.back().first_item + parts.back().num_items);
+	if (first_item >= item_count)
+	{
+		return true;
+	}
+
+	uint8_t* memory = reinterpret_cast<uint8_t*>(randomx_get_dataset_memory(source->dataset)) + static_cast<size_t>(first_item) * RANDOMX_DATASET_ITEM_SIZE;
+
+	cl_int err;
+	cl_mem mem = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, static_cast<size_t>(item_count - first_item) * RANDOMX_DATASET_ITEM_SIZE, memory, &err);
+	CL_CHECK_RESULT(clCreateBuffer);
+	parts.push_back({ mem, first_item, item_count - first_item, true });
+
+	return true;
+}
+
+void DatasetBuffer::ReleaseHostPart()
+{
+	if (!parts.empty() && parts.back().host)
+	{
+		clReleaseMemObject(parts.back().mem);
+		parts.pop_back();
+	}
+}
+
+DatasetBuffer::Part& DatasetBuffer::PartOf(uint32_t item)
+{
+	for (Part& p : parts)
+	{
+		if (item < p.first_item + p.num_items)
+			return p;
+	}
+	return parts.back();
+}
+
+bool DatasetBuffer::EnqueueCacheUpload(cl_command_queue queue, cl_mem cache_buffer, cl_event* event)
+{
+	cl_int err;
+
+	// Maximal sizes, so the buffers can be reused for every seed
+	if (!programs_gpu)
+	{
+		programs_gpu = clCreateBuffer(context, CL_MEM_READ_ONLY, RANDOMX_CACHE_ACCESSES * SUPERSCALAR_PROGRAM_SIZE, nullptr, &err);
+		CL_CHECK_RESULT(clCreateBuffer);
+	}
+
+	if (!reciprocals_gpu)
+	{
+		reciprocals_gpu = clCreateBuffer(context, CL_MEM_READ_ONLY, RANDOMX_CACHE_ACCESSES * SUPERSCALAR_MAX_SIZE * sizeof(uint64_t), nullptr, &err);
+		CL_CHECK_RESULT(clCreateBuffer);
+	}
+
+	// Host copies belong to the HostDataset, which stays alive while it's this buffer's source
+	CL_CHECKED_CALL(clEnqueueWriteBuffer, queue, cache_buffer, CL_FALSE, 0, CACHE_SIZE, source->cache_memory, 0, nullptr, nullptr);
+	CL_CHECKED_CALL(clEnqueueWriteBuffer, queue, programs_gpu, CL_FALSE, 0, source->programs.size() * sizeof(uint32_t), source->programs.data(), 0, nullptr, nullptr);
+	if (!source->reciprocals.empty())
+	{
+		CL_CHECKED_CALL(clEnqueueWriteBuffer, queue, reciprocals_gpu, CL_FALSE, 0, source->reciprocals.size() * sizeof(uint64_t), source->reciprocals.data(), 0, nullptr, nullptr);
+	}
+
+	if (event)
+	{
+		CL_CHECKED_CALL(clEnqueueMarkerWithWaitList, queue, 0, nullptr, event);
+		CL_CHECKED_CALL(clFlush, queue);
+	}
+
+	return true;
+}
+
+bool DatasetBuffer::EnqueueGpuInit(cl_command_queue queue, cl_event* event)
+{
+	cl_int err;
+
+	cache_gpu = clCreateBuffer(context, CL_MEM_READ_ONLY, CACHE_SIZE, nullptr, &err);
+	CL_CHECK_RESULT(clCreateBuffer);
+
+	if (!EnqueueCacheUpload(queue, cache_gpu, nullptr))
+	{
+		return false;
+	}
+
+	// Only one GPU reads its dataset back, the others just wait for it before they're READY
+	readback = source->ClaimReadback();
+
+	// GPU initialization isn't used with a host memory part, so every item is in a device part
+	const uint32_t item_count = static_cast<uint32_t>(randomx_dataset_item_count());
+	for (const Part& part : parts)
+	{
+		const uint32_t part_end = part.first_item + part.num_items;
+		for (uint32_t start_item = part.first_item; start_item < part_end; start_item += DATASET_INIT_CHUNK)
+		{
+			const uint32_t end_item = std::min(start_item + DATASET_INIT_CHUNK, part_end);
+			if (!clSetKernelArgs(init_kernel, cache_gpu, part.mem, programs_gpu, reciprocals_gpu, start_item, end_item, part.first_item))
+			{
+				return false;
+			}
+
+			const size_t global_work_size = ((end_item - start_item) + 63) & ~size_t(63);
+			const size_t local_work_size = 64;
+			const bool last = (end_item == item_count) && !readback;
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, init_kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, last ? event : nullptr);
+		}
+	}
+
+	if (readback)
+	{
+		uint8_t* dataset_memory = reinterpret_cast<uint8_t*>(randomx_get_dataset_memory(source->dataset));
+		for (const Part& part : parts)
+		{
+			const bool last = (part.first_item + part.num_items == item_count);
+			const size_t offset = static_cast<size_t>(part.first_item) * RANDOMX_DATASET_ITEM_SIZE;
+			CL_CHECKED_CALL(clEnqueueReadBuffer, queue, part.mem, CL_FALSE, 0, static_cast<size_t>(part.num_items) * RANDOMX_DATASET_ITEM_SIZE, dataset_memory + offset, 0, nullptr, last ? event : nullptr);
+		}
+	}
+
+	CL_CHECKED_CALL(clFlush, queue);
+	return true;
+}
+
+// Releases GPU memory that's only needed while the dataset is built. Light mode keeps the programs, execute_vm uses them.
+void DatasetBuffer::ReleaseInitData()
+{
+	if (cache_gpu)
+	{
+		clReleaseMemObject(cache_gpu);
+		cache_gpu = nullptr;
+	}
+
+	if (light)
+	{
+		return;
+	}
+
+	if (programs_gpu)
+	{
+		clReleaseMemObject(programs_gpu);
+		programs_gpu = nullptr;
+	}
+
+	if (reciprocals_gpu)
+	{
+		clReleaseMemObject(reciprocals_gpu);
+		reciprocals_gpu = nullptr;
+	}
+}
+
+void DatasetBuffer::BuildAsync(HostDatasetPool& pool, const std::vector<uint8_t>& new_seed, uint32_t num_threads)
+{
+	Start(pool, new_seed, num_threads);
+
+	builder.emplace_back([this]()
+	{
+		build_result = Prepare() ? 1 : -1;
+	});
+}
+
+bool DatasetBuffer::Update(cl_command_queue queue)
+{
+	cl_int err;
+
+	if ((state == BUILDING) && build_result)
+	{
+		builder.clear();
+
+		if (build_result < 0)
+		{
+			state = EMPTY;
+			return false;
+		}
+
+		if (host_allocated)
+		{
+			if (!CreateHostPart())
+			{
+				return false;
+			}
+
+			Finish();
+			return true;
+		}
+
+		if (streamed)
+		{
+			Finish();
+			return true;
+		}
+
+		if (!EnqueueUpload(queue, &upload_event))
+		{
+			FinishReadback(false);
+			return false;
+		}
+		state = UPLOADING;
+	}
+
+	if (state == UPLOADING)
+	{
+		if (upload_event)
+		{
+			cl_int status;
+			CL_CHECKED_CALL(clGetEventInfo, upload_event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+			if (status < 0)
+			{
+				FinishReadback(false);
+				err = status;
+				CL_CHECK_RESULT(clEnqueueWriteBuffer);
+			}
+
+			if (status == CL_COMPLETE)
+			{
+				clReleaseEvent(upload_event);
+				upload_event = nullptr;
+				upload_time = seconds_between(upload_start, high_resolution_clock::now());
+				FinishReadback(true);
+			}
+		}
+
+		// With GPU initialization, validation needs the dataset that's read back by the first GPU
+		if (!upload_event)
+		{
+			if (source->Failed())
+			{
+				state = EMPTY;
+				return false;
+			}
+
+			if (source->IsDatasetReady())
+				Finish();
+		}
+	}
+
+	return true;
+}
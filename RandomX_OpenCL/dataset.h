@@ -0,0 +1,265 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "opencl_helpers.h"
+#include "dataset_store.h"
+
+#include "../RandomX/src/randomx.h"
+
+// Packs SuperscalarHash programs of an initialized cache for the init_dataset kernel (layout is described in CL/randomx_constants.h)
+void pack_superscalar_programs(randomx_cache* cache, std::vector<uint32_t>& programs, std::vector<uint64_t>& reciprocals);
+
+// --dataset_hybrid auto benchmarks splits with 100%, 90%, ... of the dataset in device memory
+static constexpr uint32_t DATASET_HYBRID_STEP = 10;
+
+// How datasets are built and where they live, the same for all devices of the process
+struct DatasetSettings
+{
+	DatasetSettings()
+		: light(false)
+		, gpu_init(false)
+		, host_memory(false)
+		, hybrid(false)
+		, max_parts(1)
+		, host_copy(true)
+	{}
+
+	// No dataset at all: GPUs get the cache and execute_vm computes dataset items from it
+	bool light;
+
+	// The dataset is computed by the init_dataset kernel on every GPU, only the cache is built on the CPU (ignored with host_memory)
+	bool gpu_init;
+
+	// GPUs read the dataset directly from host memory
+	bool host_memory;
+
+	// Hybrid placement: GPUs keep a part of the dataset in device memory and read the rest from host memory, see DatasetBuffer::Alloc()
+	bool hybrid;
+
+	// Device buffers the dataset can be split into (at most MAX_DATASET_PARTS), GCN code reads it from one buffer
+	uint32_t max_parts;
+
+	// CPU-side data is kept for validation
+	bool host_copy;
+
+	// Directory for DatasetFile, empty if datasets are never stored
+	std::string store_dir;
+};
+
+// CPU side of the dataset for one seed: the cache, SuperscalarHash programs and the dataset in host memory.
+// It's built (or loaded from the store) once in background and shared by all GPUs, which upload chunks of it as soon as they're ready.
+// With GPU initialization there's nothing to build on the CPU except the cache. The first GPU to finish its dataset reads it back
+// for validation and the store, see ClaimReadback().
+class HostDataset
+{
+public:
+	HostDataset(const DatasetSettings& settings, const std::vector<uint8_t>& seed);
+	~HostDataset();
+
+	// The dataset is built and uploaded in chunks of 16 MB
+	static uint32_t NumChunks();
+
+	void Start(uint32_t num_threads, std::atomic<bool>& large_pages_available);
+
+	// Block until the cache and programs (or the whole dataset) are ready, return false if the build failed
+	bool WaitForCache();
+	bool WaitForDataset();
+
+	bool IsDatasetReady();
+	bool Failed();
+
+	// Blocks until "n" chunks are finished and returns the index of the n-th one (chunks can finish out of order), -1 if the build failed
+	int32_t WaitForChunk(uint32_t n);
+
+	// GPU initialization: returns true only once, for the device that reads its dataset back into host memory
+	bool ClaimReadback();
+	void ReadbackDone(bool success);
+
+	const std::vector<uint8_t> seed;
+
+	// Host memory dataset, nullptr if it's not needed (light mode, GPU initialization without validation and store)
+	randomx_dataset* dataset;
+
+	// Kept for light mode CPU validation, released after the dataset is built otherwise
+	randomx_cache* cache;
+
+	const uint8_t* cache_memory;
+	std::vector<uint32_t> programs;
+	std::vector<uint64_t> reciprocals;
+
+	// True if everything was loaded from the store
+	bool stored;
+
+	// Time it took to build or load everything the CPU builds, and when it was done
+	double build_time;
+	std::chrono::high_resolution_clock::time_point build_end;
+
+private:
+	bool Build(uint32_t num_threads, std::atomic<bool>& large_pages_available);
+	bool InitCache(std::atomic<bool>& large_pages_available);
+	bool AllocDataset(std::atomic<bool>& large_pages_available);
+
+	// Must be called before the state change that makes the CPU part of the build complete
+	void SetBuildTime();
+
+	void SetCacheReady();
+	void SetChunkReady(uint32_t chunk);
+	void SetDatasetReady();
+
+	const DatasetSettings settings;
+	DatasetFile file;
+	uint32_t commit_threads;
+	std::chrono::high_resolution_clock::time_point build_start;
+
+	std::mutex mutex;
+	std::condition_variable state_changed;
+	bool cache_ready;
+	bool dataset_ready;
+	bool failed;
+	std::vector<uint32_t> ready_chunks;
+
+	std::atomic<bool> readback_claimed;
+
+	// Must be the last members: they're joined first when the object is destroyed
+	std::vector<SThread> committer;
+	std::vector<SThread> builder;
+};
+
+// Shares host datasets between devices, so every seed is built only once per process.
+// The two most recently requested seeds (current and next epoch) are kept, older ones are released when no device uses them anymore.
+class HostDatasetPool
+{
+public:
+	explicit HostDatasetPool(const DatasetSettings& settings);
+
+	// Returns the dataset for "seed", starting its build with "num_threads" threads if it's not there yet
+	std::shared_ptr<HostDataset> Get(const std::vector<uint8_t>& seed, uint32_t num_threads);
+
+	const DatasetSettings settings;
+
+private:
+	std::mutex mutex;
+	std::vector<std::shared_ptr<HostDataset>> datasets;
+	std::atomic<bool> large_pages_available;
+};
+
+// One GPU's copy of the dataset (or the cache in light mode), filled from a shared HostDataset.
+// The miner keeps two of them per GPU when memory allows it, so the next epoch's dataset can be prepared while the current one is in use.
+// A dataset built (or loaded) on the CPU is streamed to the GPU in chunks while it's being built, see StreamDataset().
+struct DatasetBuffer
+{
+	enum State
+	{
+		EMPTY,
+		BUILDING,
+		UPLOADING,
+		READY,
+	};
+
+	DatasetBuffer();
+	~DatasetBuffer();
+
+	// "gpu_init_kernel" is used when settings.gpu_init is set (it's ignored for host memory datasets).
+	// With a hybrid placement the first "device_items" items are in device memory, see DeviceItems().
+	bool Alloc(const OpenCLContext& ctx, const DatasetSettings& settings, cl_kernel gpu_init_kernel = nullptr, uint32_t device_items = 0xFFFFFFFFU);
+
+	// Items in device memory when "percent" of the dataset is kept there, in whole upload chunks
+	static uint32_t DeviceItems(uint32_t percent);
+
+	// Blocking build + upload, used when nothing is mining yet or when there's no second buffer to build into
+	bool Build(cl_command_queue queue, HostDatasetPool& pool, const std::vector<uint8_t>& new_seed, uint32_t num_threads);
+
+	// Background build: BuildAsync() starts it, Update() moves it through BUILDING -> UPLOADING -> READY without blocking
+	void BuildAsync(HostDatasetPool& pool, const std::vector<uint8_t>& new_seed, uint32_t num_threads);
+	bool Update(cl_command_queue queue);
+
+	// CPU side of the current dataset: CPU validation uses its dataset, or its cache in light mode
+	std::shared_ptr<HostDataset> source;
+
+	// Consecutive dataset items in one buffer. The cache is the only part in light mode.
+	struct Part
+	{
+		cl_mem mem;
+		uint32_t first_item;
+		uint32_t num_items;
+		bool host;
+	};
+
+	// Device parts come first, each of them within the device's largest allocation. Items past them are in one host memory part.
+	std::vector<Part> parts;
+	bool host_allocated;
+
+	// Light mode only: SuperscalarHash programs are execute_vm's arguments
+	bool light;
+	cl_mem programs_gpu;
+	cl_mem reciprocals_gpu;
+
+	State state;
+	std::vector<uint8_t> seed;
+
+	// True if the last build was loaded from the store
+	bool stored;
+
+	// Timings of the last build in seconds: CPU part (building or loading, shared by all GPUs) and the part of the upload that didn't overlap with it.
+	// With GPU initialization, upload time is the time the GPU spent computing the dataset.
+	double build_time;
+	double upload_time;
+
+private:
+	void Start(HostDatasetPool& pool, const std::vector<uint8_t>& new_seed, uint32_t num_threads);
+
+	// Waits for the CPU part of the build and streams the dataset to the GPU if it comes from the host
+	bool Prepare();
+	bool StreamDataset();
+
+	// GPU part of the build: uploads the cache or runs GPU initialization, the dataset itself is already uploaded by StreamDataset()
+	bool EnqueueUpload(cl_command_queue queue, cl_event* event);
+	void FinishReadback(bool success);
+	void Finish();
+
+	// Host memory part: a CL_MEM_USE_HOST_PTR buffer of the host dataset's items past the device parts
+	bool CreateHostPart();
+	void ReleaseHostPart();
+
+	// Part that "item" is in
+	Part& PartOf(uint32_t item);
+
+	bool EnqueueCacheUpload(cl_command_queue queue, cl_mem cache_buffer, cl_event* event);
+	bool EnqueueGpuInit(cl_command_queue queue, cl_event* event);
+	void ReleaseInitData();
+
+	cl_context context;
+	std::vector<cl_command_queue> upload_queues;
+	std::vector<SThread> builder;
+	std::atomic<int> build_result;
+	cl_event upload_event;
+	bool streamed;
+	bool readback;
+	std::chrono::high_resolution_clock::time_point upload_start;
+
+	cl_kernel init_kernel;
+	cl_mem cache_gpu;
+};
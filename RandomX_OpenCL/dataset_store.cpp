@@ -0,0 +1,411 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include "dataset_store.h"
+#include "definitions.h"
+#include "opencl_helpers.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "../RandomX/src/randomx.h"
+#include "../RandomX/src/configuration.h"
+#include "../RandomX/src/blake2/blake2.h"
+
+static constexpr uint32_t STORE_VERSION = 1;
+static const char STORE_MAGIC[8] = { 'R', 'X', 'O', 'C', 'L', 'D', 'S', 'T' };
+
+static constexpr size_t STORE_PAGE_SIZE = 4096;
+static constexpr size_t CACHE_OFFSET = STORE_PAGE_SIZE;
+static constexpr size_t PROGRAMS_OFFSET = CACHE_OFFSET + CACHE_SIZE;
+static constexpr size_t RECIPROCALS_OFFSET = PROGRAMS_OFFSET + RANDOMX_CACHE_ACCESSES * SUPERSCALAR_PROGRAM_SIZE;
+static constexpr size_t MAX_RECIPROCALS = RANDOMX_CACHE_ACCESSES * SUPERSCALAR_MAX_SIZE;
+static constexpr size_t DATASET_OFFSET = (RECIPROCALS_OFFSET + MAX_RECIPROCALS * sizeof(uint64_t) + STORE_PAGE_SIZE - 1) & ~(STORE_PAGE_SIZE - 1);
+
+// Checksum is a hash of per-chunk hashes, so it can be computed by multiple threads
+static constexpr size_t CHECKSUM_CHUNK_SIZE = 64 << 20;
+
+struct DatasetFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t has_dataset;
+	uint64_t cache_size;
+	uint64_t dataset_size;
+	uint32_t num_reciprocals;
+	uint32_t reserved;
+	uint8_t config_hash[32];
+	uint8_t seed_hash[32];
+	uint8_t checksum[32];
+};
+
+static_assert(sizeof(DatasetFileHeader) <= STORE_PAGE_SIZE, "Header doesn't fit into the first page");
+
+// Every parameter that changes the cache or the dataset, so files from a different RandomX configuration are never loaded
+static std::vector<uint8_t> config_hash()
+{
+	std::stringstream s;
+	s << STORE_VERSION << ' ' << RANDOMX_ARGON_MEMORY << ' ' << RANDOMX_ARGON_ITERATIONS << ' ' << RANDOMX_ARGON_LANES << ' ' << RANDOMX_ARGON_SALT << ' '
+		<< RANDOMX_CACHE_ACCESSES << ' ' << RANDOMX_SUPERSCALAR_LATENCY << ' ' << RANDOMX_DATASET_BASE_SIZE << ' ' << RANDOMX_DATASET_EXTRA_SIZE;
+
+	const std::string str = s.str();
+	std::vector<uint8_t> hash(32);
+	blake2b(hash.data(), hash.size(), str.data(), str.size(), nullptr, 0);
+	return hash;
+}
+
+static size_t store_file_size(bool with_dataset)
+{
+	return with_dataset ? (DATASET_OFFSET + randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE) : DATASET_OFFSET;
+}
+
+DatasetFile::DatasetFile()
+	: num_reciprocals(0)
+	, has_dataset(false)
+	, data(nullptr)
+	, size(0)
+#ifdef _WIN32
+	, file_handle(INVALID_HANDLE_VALUE)
+	, mapping_handle(nullptr)
+#else
+	, fd(-1)
+#endif
+{
+}
+
+DatasetFile::~DatasetFile()
+{
+	Close();
+}
+
+std::string DatasetFile::Path(const std::string& directory, const std::vector<uint8_t>& seed, bool with_dataset)
+{
+	std::vector<uint8_t> key = config_hash();
+	key.insert(key.end(), seed.begin(), seed.end());
+
+	uint8_t hash[8];
+	blake2b(hash, sizeof(hash), key.data(), key.size(), nullptr, 0);
+
+	std::stringstream s;
+	s << (directory.empty() ? "." : directory) << "/rx_";
+	for (uint8_t b : hash)
+		s << std::hex << std::setw(2) << std::setfill('0') << static_cast<uint32_t>(b);
+	s << (with_dataset ? ".dataset" : ".cache");
+
+	return s.str();
+}
+
+bool DatasetFile::Open(const std::string& directory, const std::vector<uint8_t>& seed, bool with_dataset, uint32_t num_threads)
+{
+	Close();
+
+	if (!Map(Path(directory, seed, with_dataset), store_file_size(with_dataset), false))
+	{
+		return false;
+	}
+
+	seed_hash.resize(32);
+	blake2b(seed_hash.data(), seed_hash.size(), seed.data(), seed.size(), nullptr, 0);
+	has_dataset = with_dataset;
+
+	const DatasetFileHeader* header = reinterpret_cast<const DatasetFileHeader*>(data);
+
+	const bool header_ok =
+		(memcmp(header->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0) &&
+		(header->version == STORE_VERSION) &&
+		(header->has_dataset == (with_dataset ? 1U : 0U)) &&
+		(header->cache_size == CACHE_SIZE) &&
+		(header->dataset_size == (with_dataset ? randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE : 0)) &&
+		(header->num_reciprocals <= MAX_RECIPROCALS) &&
+		(memcmp(header->config_hash, config_hash().data(), 32) == 0) &&
+		(memcmp(header->seed_hash, seed_hash.data(), 32) == 0);
+
+	if (!header_ok)
+	{
+		std::cout << "\n" << path << " doesn't match the seed or RandomX parameters, it will be rebuilt" << std::endl;
+		Close();
+		return false;
+	}
+
+	uint8_t checksum[32];
+	ComputeChecksum(checksum, num_threads);
+	if (memcmp(header->checksum, checksum, sizeof(checksum)) != 0)
+	{
+		std::cout << "\n" << path << " is corrupted, it will be rebuilt" << std::endl;
+		Close();
+		return false;
+	}
+
+	num_reciprocals = header->num_reciprocals;
+	return true;
+}
+
+bool DatasetFile::Create(const std::string& directory, const std::vector<uint8_t>& seed, bool with_dataset)
+{
+	Close();
+
+	if (!Map(Path(directory, seed, with_dataset), store_file_size(with_dataset), true))
+	{
+		return false;
+	}
+
+	seed_hash.resize(32);
+	blake2b(seed_hash.data(), seed_hash.size(), seed.data(), seed.size(), nullptr, 0);
+	has_dataset = with_dataset;
+	num_reciprocals = 0;
+
+	return true;
+}
+
+bool DatasetFile::Commit(uint32_t num_threads)
+{
+	if (!data)
+	{
+		return false;
+	}
+
+	DatasetFileHeader header = {};
+	memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+	header.version = STORE_VERSION;
+	header.has_dataset = has_dataset ? 1 : 0;
+	header.cache_size = CACHE_SIZE;
+	header.dataset_size = has_dataset ? randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE : 0;
+	header.num_reciprocals = num_reciprocals;
+	memcpy(header.config_hash, config_hash().data(), 32);
+	memcpy(header.seed_hash, seed_hash.data(), 32);
+	ComputeChecksum(header.checksum, num_threads);
+
+	// Contents must be on disk before the header that makes them valid
+#ifdef _WIN32
+	bool ok = FlushViewOfFile(data, size) != 0;
+	memcpy(data, &header, sizeof(header));
+	ok = ok && (FlushViewOfFile(data, STORE_PAGE_SIZE) != 0) && (FlushFileBuffers(file_handle) != 0);
+#else
+	bool ok = (msync(data, size, MS_SYNC) == 0);
+	memcpy(data, &header, sizeof(header));
+	ok = ok && (msync(data, STORE_PAGE_SIZE, MS_SYNC) == 0);
+#endif
+
+	if (!ok)
+	{
+		std::cerr << "Couldn't write " << path << std::endl;
+		return false;
+	}
+
+	// The file was built under a temporary name, so other processes only ever see a complete file at "path"
+#ifdef _WIN32
+	ok = MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	ok = (std::rename(tmp_path.c_str(), path.c_str()) == 0);
+#endif
+
+	if (!ok)
+	{
+		std::cerr << "Couldn't rename " << tmp_path << " to " << path << std::endl;
+		return false;
+	}
+
+	tmp_path.clear();
+	return true;
+}
+
+void DatasetFile::Close()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+
+	mapping_handle = nullptr;
+	file_handle = INVALID_HANDLE_VALUE;
+#else
+	if (data)
+		munmap(data, size);
+
+	if (fd >= 0)
+		close(fd);
+
+	fd = -1;
+#endif
+
+	// A file that was never committed is incomplete
+	if (!tmp_path.empty())
+	{
+		std::remove(tmp_path.c_str());
+		tmp_path.clear();
+	}
+
+	data = nullptr;
+	size = 0;
+	num_reciprocals = 0;
+}
+
+uint8_t* DatasetFile::CacheMemory() const { return data + CACHE_OFFSET; }
+uint32_t* DatasetFile::Programs() const { return reinterpret_cast<uint32_t*>(data + PROGRAMS_OFFSET); }
+uint64_t* DatasetFile::Reciprocals() const { return reinterpret_cast<uint64_t*>(data + RECIPROCALS_OFFSET); }
+uint8_t* DatasetFile::DatasetMemory() const { return has_dataset ? (data + DATASET_OFFSET) : nullptr; }
+
+bool DatasetFile::Map(const std::string& file_path, size_t file_size, bool create)
+{
+	path = file_path;
+
+	// New files are built under a temporary name and renamed by Commit()
+	if (create)
+	{
+		std::stringstream tmp;
+#ifdef _WIN32
+		tmp << path << ".tmp" << GetCurrentProcessId();
+#else
+		tmp << path << ".tmp" << getpid();
+#endif
+		tmp_path = tmp.str();
+	}
+	const std::string& open_path = create ? tmp_path : path;
+
+#ifdef _WIN32
+	// Large pages can't be used for file mappings on Windows
+	// DELETE access and FILE_SHARE_DELETE let Commit() rename the file while it's mapped
+	file_handle = CreateFileA(open_path.c_str(), create ? (GENERIC_READ | GENERIC_WRITE | DELETE) : GENERIC_READ, create ? (FILE_SHARE_READ | FILE_SHARE_DELETE) : FILE_SHARE_READ, nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+	{
+		if (create)
+		{
+			std::cerr << "Couldn't create " << open_path << std::endl;
+			tmp_path.clear();
+		}
+		return false;
+	}
+
+	LARGE_INTEGER existing_size;
+	if (!create && (!GetFileSizeEx(file_handle, &existing_size) || (static_cast<uint64_t>(existing_size.QuadPart) != file_size)))
+	{
+		Close();
+		return false;
+	}
+
+	mapping_handle = CreateFileMappingA(file_handle, nullptr, create ? PAGE_READWRITE : PAGE_WRITECOPY, static_cast<DWORD>(static_cast<uint64_t>(file_size) >> 32), static_cast<DWORD>(file_size), nullptr);
+	if (!mapping_handle)
+	{
+		std::cerr << "CreateFileMapping failed for " << path << std::endl;
+		Close();
+		return false;
+	}
+
+	data = static_cast<uint8_t*>(MapViewOfFile(mapping_handle, create ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, file_size));
+	if (!data)
+	{
+		std::cerr << "MapViewOfFile failed for " << path << std::endl;
+		Close();
+		return false;
+	}
+#else
+	fd = open(open_path.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+	if (fd < 0)
+	{
+		if (create)
+		{
+			std::cerr << "Couldn't create " << open_path << std::endl;
+			tmp_path.clear();
+		}
+		return false;
+	}
+
+	if (create)
+	{
+		if (ftruncate(fd, static_cast<off_t>(file_size)) != 0)
+		{
+			std::cerr << "Couldn't resize " << path << std::endl;
+			Close();
+			return false;
+		}
+	}
+	else
+	{
+		struct stat st;
+		if ((fstat(fd, &st) != 0) || (static_cast<uint64_t>(st.st_size) != file_size))
+		{
+			Close();
+			return false;
+		}
+	}
+
+	void* p = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, create ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		std::cerr << "mmap failed for " << path << std::endl;
+		Close();
+		return false;
+	}
+	data = static_cast<uint8_t*>(p);
+
+#ifdef MADV_HUGEPAGE
+	// Transparent huge pages for file mappings depend on the file system and kernel config, it's just a hint
+	madvise(data, file_size, MADV_HUGEPAGE);
+#endif
+#endif
+
+	size = file_size;
+	return true;
+}
+
+void DatasetFile::ComputeChecksum(uint8_t (&out)[32], uint32_t num_threads) const
+{
+	const uint8_t* begin = data + STORE_PAGE_SIZE;
+	const size_t total_size = size - STORE_PAGE_SIZE;
+	const size_t num_chunks = (total_size + CHECKSUM_CHUNK_SIZE - 1) / CHECKSUM_CHUNK_SIZE;
+
+	std::vector<uint8_t> chunk_hashes(num_chunks * 32);
+
+	std::vector<SThread> threads;
+	for (uint32_t i = 0, n = std::max(num_threads, 1U); i < n; ++i)
+	{
+		threads.emplace_back([&, i, n]()
+		{
+			for (size_t j = i; j < num_chunks; j += n)
+			{
+				const size_t offset = j * CHECKSUM_CHUNK_SIZE;
+				blake2b(chunk_hashes.data() + j * 32, 32, begin + offset, std::min(CHECKSUM_CHUNK_SIZE, total_size - offset), nullptr, 0);
+			}
+		});
+	}
+
+	for (auto& t : threads)
+		t.join();
+
+	blake2b(out, 32, chunk_hashes.data(), chunk_hashes.size(), nullptr, 0);
+}
@@ -0,0 +1,77 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Persistent store of initialized datasets: one memory-mapped file per seed and RandomX configuration in "directory".
+//
+// File layout (offsets are 4 KB aligned, so the mapping can be bound with CL_MEM_USE_HOST_PTR):
+// header | cache memory | packed SuperscalarHash programs | reciprocals | dataset (files for light mode don't have it)
+//
+// The header has the seed hash, the hash of RandomX parameters and the checksum of everything after it.
+// It's written last and the file is built under a temporary name, so a file from an interrupted build is never loaded.
+class DatasetFile
+{
+public:
+	DatasetFile();
+	~DatasetFile();
+
+	static std::string Path(const std::string& directory, const std::vector<uint8_t>& seed, bool with_dataset);
+
+	// Maps an existing file and checks its header and checksum. The mapping is copy-on-write, so the file is never modified.
+	bool Open(const std::string& directory, const std::vector<uint8_t>& seed, bool with_dataset, uint32_t num_threads);
+
+	// Creates a file and maps it for writing. The contents are written by the caller, then Commit() makes the file valid.
+	bool Create(const std::string& directory, const std::vector<uint8_t>& seed, bool with_dataset);
+	bool Commit(uint32_t num_threads);
+
+	void Close();
+
+	bool IsOpen() const { return data != nullptr; }
+
+	uint8_t* CacheMemory() const;
+	uint32_t* Programs() const;
+	uint64_t* Reciprocals() const;
+	uint8_t* DatasetMemory() const;
+
+	uint32_t num_reciprocals;
+
+private:
+	bool Map(const std::string& path, size_t size, bool create);
+	void ComputeChecksum(uint8_t (&out)[32], uint32_t num_threads) const;
+
+	std::string path;
+	std::string tmp_path;
+	std::vector<uint8_t> seed_hash;
+	bool has_dataset;
+
+	uint8_t* data;
+	size_t size;
+
+#ifdef _WIN32
+	void* file_handle;
+	void* mapping_handle;
+#else
+	int fd;
+#endif
+};
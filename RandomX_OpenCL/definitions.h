@@ -32,6 +32,7 @@ static const std::string BLAKE2B_CL = "CL/blake2b.cl";
 static const std::string CL_BLAKE2B_INITIAL_HASH = "blake2b_initial_hash";
 static const std::string CL_BLAKE2B_HASH_REGISTERS_32 = "blake2b_hash_registers_32";
 static const std::string CL_BLAKE2B_HASH_REGISTERS_64 = "blake2b_hash_registers_64";
+static const std::string CL_BLAKE2B_HASH_REGISTERS_32_TARGET = "blake2b_hash_registers_32_target";
 static const std::string CL_BLAKE2B_512_SINGLE_BLOCK_BENCH = "blake2b_512_single_block_bench";
 static const std::string CL_BLAKE2B_512_DOUBLE_BLOCK_BENCH = "blake2b_512_double_block_bench";
 
@@ -44,6 +45,10 @@ static const std::string CL_RANDOMX_RUN = "randomx_run";
 static const std::string RANDOMX_VM_CL = "CL/randomx_vm.cl";
 static const std::string CL_INIT_VM = "init_vm";
 static const std::string CL_EXECUTE_VM = "execute_vm";
+static const std::string CL_FP_OPS_TEST = "fp_ops_test";
+
+static const std::string RANDOMX_DATASET_CL = "CL/randomx_dataset.cl";
+static const std::string CL_INIT_DATASET = "init_dataset";
 
 static uint8_t blockTemplate[] = {
 		0x07, 0x07, 0xf7, 0xa4, 0xf0, 0xd6, 0x05, 0xb3, 0x03, 0x26, 0x08, 0x16, 0xba, 0x3f, 0x10, 0x90, 0x2e, 0x1a, 0x14,
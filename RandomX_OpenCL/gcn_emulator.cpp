@@ -0,0 +1,1862 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cfenv>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include "gcn_emulator.h"
+#include "opencl_helpers.h"
+#include "definitions.h"
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 4804)
+#endif
+
+#include "../RandomX/src/randomx.h"
+#include "../RandomX/src/configuration.h"
+#include "../RandomX/src/blake2/blake2.h"
+#include "../RandomX/src/aes_hash.hpp"
+#include "../RandomX/src/dataset.hpp"
+#include "../RandomX/src/intrin_portable.h"
+#include "../RandomX/src/virtual_machine.hpp"
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+// Addresses the emulated code sees. The scratchpad crosses a 4 GB boundary, so carries in 64-bit address math are exercised.
+static constexpr uint64_t CODE_ADDRESS = 0x0000100000000000ULL;
+static constexpr uint64_t SCRATCHPAD_ADDRESS = 0x00002000FFF00000ULL;
+static constexpr uint64_t RETURN_ADDRESS = 0x0000300000000000ULL;
+
+// FSQRT_R (0-3), FDIV_M (4-7), ISMULH_R (8) and IMULH_R (9), randomx_run keeps their addresses in s[40:59]
+static constexpr uint64_t SUBROUTINE_ADDRESS = 0x0000400000000000ULL;
+static constexpr uint64_t SUBROUTINE_STRIDE = 0x100;
+static constexpr uint32_t NUM_SUBROUTINES = 10;
+
+static constexpr uint32_t PROGRAM_DWORDS = COMPILED_PROGRAM_SIZE / sizeof(uint32_t);
+
+// JIT code that runs longer than this in one iteration doesn't return
+static constexpr uint32_t MAX_INSTRUCTIONS_PER_CALL = 1 << 20;
+
+static constexpr uint32_t VCC_LO = 106;
+static constexpr uint32_t VCC_HI = 107;
+static constexpr uint32_t EXEC_LO = 126;
+static constexpr uint32_t EXEC_HI = 127;
+static constexpr uint32_t LITERAL = 255;
+static constexpr uint32_t VGPR0 = 256;
+
+// FLAT saddr values from here on mean "off" (0x7F on gfx900, 0x7D on gfx1010)
+static constexpr uint32_t SADDR_OFF = 0x7C;
+
+static constexpr uint32_t HW_REG_MODE = 1;
+
+static constexpr uint64_t SIGN_BIT = 1ULL << 63;
+static constexpr uint64_t DYNAMIC_MANTISSA_MASK = (1ULL << 56) - 1;
+static constexpr uint32_t CACHE_LINE_ALIGN_MASK = ((1U << 31) - 1) & ~(RANDOMX_DATASET_ITEM_SIZE - 1);
+static constexpr uint32_t SCRATCHPAD_L3_MASK64 = RANDOMX_SCRATCHPAD_L3 - 64;
+
+// Hashes per randomx_init launch, every one of them gets its own RandomX VM
+static constexpr uint32_t GCN_EMULATOR_BATCH = 64;
+
+enum Encoding { SOP2, SOP1, SOPK, SOPP, VOP1, VOP2, VOP3, DS, FLAT };
+
+enum Op
+{
+	OP_NONE,
+	S_ADD_U32, S_SUB_U32, S_ADD_I32, S_ADDC_U32, S_SUBB_U32, S_AND_B32, S_OR_B32, S_OR_B64, S_XOR_B32, S_XOR_B64,
+	S_LSHL_B32, S_LSHL_B64, S_LSHR_B32, S_LSHR_B64, S_MUL_I32, S_BFE_U64, S_MUL_HI_U32,
+	S_MOV_B32, S_MOV_B64, S_BREV_B32, S_SETPC_B64, S_SWAPPC_B64,
+	S_SETREG_B32,
+	S_NOP, S_CBRANCH_SCC0, S_WAITCNT,
+	V_MOV_B32, V_CVT_F64_I32,
+	V_AND_B32, V_XOR_B32, V_ADD_CO_U32, V_ADDC_CO_U32, V_ADD_U32,
+	V_ADDC_CO_U32_E64, V_ADD_F64, V_MUL_F64, V_MUL_HI_U32, V_READLANE_B32,
+	DS_SWIZZLE_B32,
+	LOAD_DWORD, LOAD_DWORDX2, STORE_DWORDX2,
+	NUM_OPS
+};
+
+static constexpr uint32_t NA = 0xFFFF;
+
+// Opcodes for GCN_VERSION 12, 14 and 15
+static const struct
+{
+	Encoding encoding;
+	uint32_t opcode[3];
+	const char* name;
+} OPCODES[NUM_OPS] = {
+	{ SOP2, { NA, NA, NA }, "" },
+	{ SOP2, { 0, 0, 0 }, "s_add_u32" },
+	{ SOP2, { 1, 1, 1 }, "s_sub_u32" },
+	{ SOP2, { 2, 2, 2 }, "s_add_i32" },
+	{ SOP2, { 4, 4, 4 }, "s_addc_u32" },
+	{ SOP2, { 5, 5, 5 }, "s_subb_u32" },
+	{ SOP2, { 12, 12, 14 }, "s_and_b32" },
+	{ SOP2, { 14, 14, 16 }, "s_or_b32" },
+	{ SOP2, { 15, 15, 17 }, "s_or_b64" },
+	{ SOP2, { 16, 16, 18 }, "s_xor_b32" },
+	{ SOP2, { 17, 17, 19 }, "s_xor_b64" },
+	{ SOP2, { 28, 28, 30 }, "s_lshl_b32" },
+	{ SOP2, { 29, 29, 31 }, "s_lshl_b64" },
+	{ SOP2, { 30, 30, 32 }, "s_lshr_b32" },
+	{ SOP2, { 31, 31, 33 }, "s_lshr_b64" },
+	{ SOP2, { 36, 36, 38 }, "s_mul_i32" },
+	{ SOP2, { 39, 39, 41 }, "s_bfe_u64" },
+	{ SOP2, { NA, 44, 53 }, "s_mul_hi_u32" },
+	{ SOP1, { 0, 0, 3 }, "s_mov_b32" },
+	{ SOP1, { 1, 1, 4 }, "s_mov_b64" },
+	{ SOP1, { 8, 8, 11 }, "s_brev_b32" },
+	{ SOP1, { 29, 29, 32 }, "s_setpc_b64" },
+	{ SOP1, { 30, 30, 33 }, "s_swappc_b64" },
+	{ SOPK, { 18, 18, 19 }, "s_setreg_b32" },
+	{ SOPP, { 0, 0, 0 }, "s_nop" },
+	{ SOPP, { 4, 4, 4 }, "s_cbranch_scc0" },
+	{ SOPP, { 12, 12, 12 }, "s_waitcnt" },
+	{ VOP1, { 1, 1, 1 }, "v_mov_b32" },
+	{ VOP1, { 4, 4, 4 }, "v_cvt_f64_i32" },
+	{ VOP2, { 19, 19, 27 }, "v_and_b32" },
+	{ VOP2, { 21, 21, 29 }, "v_xor_b32" },
+	{ VOP2, { 25, 25, NA }, "v_add_co_u32" },
+	{ VOP2, { 28, 28, NA }, "v_addc_co_u32" },
+	{ VOP2, { NA, 52, 37 }, "v_add_u32" },
+	{ VOP3, { 0x11c, 0x11c, NA }, "v_addc_co_u32_e64" },
+	{ VOP3, { 0x280, 0x280, 0x164 }, "v_add_f64" },
+	{ VOP3, { 0x281, 0x281, 0x165 }, "v_mul_f64" },
+	{ VOP3, { 0x286, 0x286, 0x16a }, "v_mul_hi_u32" },
+	{ VOP3, { 0x289, 0x289, 0x360 }, "v_readlane_b32" },
+	{ DS, { 61, 61, 53 }, "ds_swizzle_b32" },
+	{ FLAT, { 20, 20, 12 }, "load_dword" },
+	{ FLAT, { 21, 21, 13 }, "load_dwordx2" },
+	{ FLAT, { 29, 29, 29 }, "store_dwordx2" },
+};
+
+static uint32_t find_op(Encoding encoding, uint32_t opcode, uint32_t version_index)
+{
+	for (uint32_t i = 1; i < NUM_OPS; ++i)
+	{
+		if ((OPCODES[i].encoding == encoding) && (OPCODES[i].opcode[version_index] == opcode))
+			return i;
+	}
+	return OP_NONE;
+}
+
+// MODE's round field to RandomX's fprc, they have round up and round down the other way around
+static uint32_t randomx_rounding_mode(uint32_t mode)
+{
+	return ((mode & 1) << 1) | ((mode >> 1) & 1);
+}
+
+static uint64_t double_bits(double x)
+{
+	uint64_t result;
+	memcpy(&result, &x, sizeof(result));
+	return result;
+}
+
+static uint64_t read64(const uint8_t* p)
+{
+	uint64_t result;
+	memcpy(&result, p, sizeof(result));
+	return result;
+}
+
+static void write64(uint8_t* p, uint64_t value)
+{
+	memcpy(p, &value, sizeof(value));
+}
+
+GcnEmulator::GcnEmulator(int gcn_version)
+	: gcn_version(gcn_version)
+	, version_index((gcn_version >= 15) ? 2 : ((gcn_version == 14) ? 1 : 0))
+	, program(nullptr)
+	, scratchpad(nullptr)
+	, decoded(PROGRAM_DWORDS)
+	, pc(0)
+	, scc(false)
+	, scc_set(false)
+	, mode(0)
+	, s66(0)
+	, executed(0)
+{
+	memset(sgpr, 0, sizeof(sgpr));
+	memset(sgpr_set, 0, sizeof(sgpr_set));
+	memset(vgpr, 0, sizeof(vgpr));
+	std::fill(vgpr_state, vgpr_state + NUM_VGPRS, VGPR_UNDEFINED);
+
+	// Registers the JIT code can change, everything else belongs to randomx_run
+	memset(sgpr_writable, 0, sizeof(sgpr_writable));
+	for (uint32_t i : { 14, 15, 32, 33, 34, 35, 38, 39, 60, 61, 62, 66, 106, 107 })
+		sgpr_writable[i] = true;
+	for (uint32_t i = 16; i < 32; ++i)
+		sgpr_writable[i] = true;
+
+	memset(vgpr_writable, 0, sizeof(vgpr_writable));
+	for (uint32_t i : { 28, 29, 42, 43, 48, 49 })
+		vgpr_writable[i] = true;
+	for (uint32_t i = 60; i < 76; ++i)
+		vgpr_writable[i] = true;
+	for (uint32_t i = 86; i < NUM_VGPRS; ++i)
+		vgpr_writable[i] = true;
+}
+
+bool GcnEmulator::Run(const uint32_t* code, uint8_t* registers, uint8_t* spad, uint32_t& rounding_mode, const DatasetItemReader& dataset_item)
+{
+	program = code;
+	scratchpad = spad;
+	std::fill(decoded.begin(), decoded.end(), Instruction());
+	pc = 0;
+	error.clear();
+
+	uint64_t R[REGISTERS_SIZE / sizeof(uint64_t)];
+	memcpy(R, registers, sizeof(R));
+
+	uint32_t ma = static_cast<uint32_t>(R[16]);
+	uint32_t mx = static_cast<uint32_t>(R[16] >> 32);
+
+	const uint32_t readReg0 = static_cast<uint32_t>(R[17]) & 7;
+	const uint32_t readReg1 = static_cast<uint32_t>(R[17] >> 32) & 7;
+	const uint32_t readReg2 = static_cast<uint32_t>(R[18]) & 7;
+	const uint32_t readReg3 = static_cast<uint32_t>(R[18] >> 32) & 7;
+
+	const uint32_t datasetOffset = static_cast<uint32_t>(R[19]);
+	const uint64_t e_mask[NUM_LANES] = { R[20], R[21] };
+
+	uint64_t r[8], f[8], e[8], a[8];
+	memcpy(r, R, sizeof(r));
+	memcpy(a, R + 24, sizeof(a));
+
+	mode = rounding_mode & 3;
+	s66 = rounding_mode;
+
+	// FP instructions change the rounding mode of this thread
+	fenv_t fenv;
+	fegetenv(&fenv);
+
+	bool result = true;
+	uint32_t spAddr0 = mx;
+	uint32_t spAddr1 = ma;
+
+	for (uint32_t ic = 0; ic < RANDOMX_PROGRAM_ITERATIONS; ++ic)
+	{
+		const uint64_t spMix = r[readReg0] ^ r[readReg1];
+		spAddr0 = (spAddr0 ^ static_cast<uint32_t>(spMix)) & SCRATCHPAD_L3_MASK64;
+		spAddr1 = (spAddr1 ^ static_cast<uint32_t>(spMix >> 32)) & SCRATCHPAD_L3_MASK64;
+
+		uint8_t* p0 = scratchpad + spAddr0;
+		uint8_t* p1 = scratchpad + spAddr1;
+
+		for (uint32_t i = 0; i < 8; ++i)
+			r[i] ^= read64(p0 + i * 8);
+
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			int32_t q;
+			memcpy(&q, p1 + i * 4, sizeof(q));
+			f[i] = double_bits(q);
+
+			memcpy(&q, p1 + 32 + i * 4, sizeof(q));
+			e[i] = (double_bits(q) & DYNAMIC_MANTISSA_MASK) | e_mask[i % 2];
+		}
+
+		uint8_t item[RANDOMX_DATASET_ITEM_SIZE];
+		dataset_item((datasetOffset + ma) / RANDOMX_DATASET_ITEM_SIZE, item);
+
+		if (!Call(r, f, e, a, e_mask))
+		{
+			result = false;
+			break;
+		}
+
+		mx ^= static_cast<uint32_t>(r[readReg2]) ^ static_cast<uint32_t>(r[readReg3]);
+		mx &= CACHE_LINE_ALIGN_MASK;
+
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			r[i] ^= read64(item + i * 8);
+			write64(p1 + i * 8, r[i]);
+		}
+
+		for (uint32_t i = 0; i < 8; ++i)
+			write64(p0 + i * 8, f[i] ^ e[i]);
+
+		std::swap(ma, mx);
+		spAddr0 = 0;
+		spAddr1 = 0;
+	}
+
+	fesetenv(&fenv);
+
+	if (!result)
+		return false;
+
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		R[i] = r[i];
+		R[i + 8] = f[i] ^ e[i];
+		R[i + 16] = e[i];
+	}
+	memcpy(registers, R, sizeof(uint64_t) * 24);
+
+	rounding_mode = s66;
+	return true;
+}
+
+// One call of the JIT code from randomx_run's main loop. Registers are set up the way randomx_run leaves them,
+// everything else is undefined so that reading it fails.
+bool GcnEmulator::Call(uint64_t (&r)[8], uint64_t (&f)[8], uint64_t (&e)[8], const uint64_t (&a)[8], const uint64_t (&e_mask)[2])
+{
+	memset(sgpr_set, 0, sizeof(sgpr_set));
+	std::fill(vgpr_state, vgpr_state + NUM_VGPRS, VGPR_UNDEFINED);
+	scc_set = false;
+	vm_queue.clear();
+	lgkm_queue.clear();
+
+	auto set_sgpr = [this](uint32_t index, uint32_t value)
+	{
+		sgpr[index] = value;
+		sgpr_set[index] = true;
+	};
+
+	auto set_sgpr64 = [&set_sgpr](uint32_t index, uint64_t value)
+	{
+		set_sgpr(index, static_cast<uint32_t>(value));
+		set_sgpr(index + 1, static_cast<uint32_t>(value >> 32));
+	};
+
+	auto set_vgpr = [this](uint32_t index, uint32_t lane0, uint32_t lane1)
+	{
+		vgpr[index][0] = lane0;
+		vgpr[index][1] = lane1;
+		vgpr_state[index] = VGPR_SET;
+	};
+
+	// 128-bit registers have their low half in lane 0 and high half in lane 1
+	auto set_vgpr64 = [&set_vgpr](uint32_t index, uint64_t lane0, uint64_t lane1)
+	{
+		set_vgpr(index, static_cast<uint32_t>(lane0), static_cast<uint32_t>(lane1));
+		set_vgpr(index + 1, static_cast<uint32_t>(lane0 >> 32), static_cast<uint32_t>(lane1 >> 32));
+	};
+
+	set_sgpr64(0, SCRATCHPAD_ADDRESS);
+	set_sgpr64(12, RETURN_ADDRESS);
+	for (uint32_t i = 0; i < 8; ++i)
+		set_sgpr64(16 + i * 2, r[i]);
+	for (uint32_t i = 0; i < NUM_SUBROUTINES; ++i)
+		set_sgpr64(40 + i * 2, SUBROUTINE_ADDRESS + i * SUBROUTINE_STRIDE);
+	set_sgpr(63, 0xFFFFFFFFU);
+	set_sgpr(66, s66);
+	set_sgpr(67, 0);
+	set_sgpr64(68, 256);
+	for (uint32_t i = 0; i < 16; ++i)
+		set_sgpr(70 + i, 0xFFU << (8 + i));
+	set_sgpr(86, SCRATCHPAD_L3_MASK64);
+
+	set_vgpr(2, static_cast<uint32_t>(SCRATCHPAD_ADDRESS), static_cast<uint32_t>(SCRATCHPAD_ADDRESS));
+	set_vgpr(3, static_cast<uint32_t>(SCRATCHPAD_ADDRESS >> 32), static_cast<uint32_t>(SCRATCHPAD_ADDRESS >> 32));
+	set_vgpr(38, RANDOMX_SCRATCHPAD_L1 - 8, RANDOMX_SCRATCHPAD_L1 - 8);
+	set_vgpr(39, RANDOMX_SCRATCHPAD_L2 - 8, RANDOMX_SCRATCHPAD_L2 - 8);
+	set_vgpr(50, RANDOMX_SCRATCHPAD_L3 - 8, RANDOMX_SCRATCHPAD_L3 - 8);
+	set_vgpr(44, 0, 4);
+	set_vgpr(51, 0x80F00000U, 0x80F00000U);
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		set_vgpr64(52 + i * 2, a[i * 2], a[i * 2 + 1]);
+		set_vgpr64(60 + i * 2, f[i * 2], f[i * 2 + 1]);
+		set_vgpr64(68 + i * 2, e[i * 2], e[i * 2 + 1]);
+	}
+	set_vgpr(77, (1U << 24) - 1, (1U << 24) - 1);
+	set_vgpr64(78, e_mask[0], e_mask[1]);
+
+	// randomx_run loads the dataset item before the call and only the JIT code waits for it
+	PendingWrite dataset_load = {};
+	dataset_load.vgpr = 21;
+	dataset_load.count = 2;
+	vgpr_state[21] = VGPR_LOADING;
+	vgpr_state[22] = VGPR_LOADING;
+	vm_queue.push_back(dataset_load);
+
+	if (!Execute())
+		return false;
+
+	// randomx_run uses these right after the call without waiting
+	for (const std::deque<PendingWrite>* queue : { &vm_queue, &lgkm_queue })
+	{
+		for (const PendingWrite& w : *queue)
+		{
+			for (uint32_t i = w.vgpr; i < w.vgpr + w.count; ++i)
+			{
+				if ((i == 21) || (i == 22) || (i == 28) || (i == 29) || ((i >= 60) && (i < 76)))
+					return Fail("returns while " + Name(VGPR0 + i) + " is still loading");
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < 16; ++i)
+	{
+		if (!sgpr_set[16 + i])
+			return Fail("returns without setting " + Name(16 + i));
+	}
+	for (uint32_t i = 60; i < 76; ++i)
+	{
+		if (vgpr_state[i] != VGPR_SET)
+			return Fail("returns without setting " + Name(VGPR0 + i));
+	}
+	if (!sgpr_set[66])
+		return Fail("returns without setting s66");
+
+	for (uint32_t i = 0; i < 8; ++i)
+		r[i] = sgpr[16 + i * 2] | (static_cast<uint64_t>(sgpr[17 + i * 2]) << 32);
+
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		const uint32_t lane = i % 2;
+		f[i] = vgpr[60 + (i / 2) * 2][lane] | (static_cast<uint64_t>(vgpr[61 + (i / 2) * 2][lane]) << 32);
+		e[i] = vgpr[68 + (i / 2) * 2][lane] | (static_cast<uint64_t>(vgpr[69 + (i / 2) * 2][lane]) << 32);
+	}
+
+	s66 = sgpr[66];
+	return true;
+}
+
+bool GcnEmulator::Execute()
+{
+	pc = 0;
+	for (uint32_t n = 0; n < MAX_INSTRUCTIONS_PER_CALL; ++n)
+	{
+		if (pc >= PROGRAM_DWORDS)
+			return Fail("runs past the end of the compiled program");
+
+		Instruction& inst = decoded[pc];
+		if (!inst.op && !Decode(pc, inst))
+			return false;
+
+		++executed;
+
+		uint32_t next_pc = pc + inst.size;
+		uint64_t target = 0;
+		bool jump = false;
+
+		switch (inst.op)
+		{
+		case S_ADD_U32:
+		case S_SUB_U32:
+		case S_ADD_I32:
+		case S_ADDC_U32:
+		case S_SUBB_U32:
+			{
+				const uint64_t x = ReadScalar(inst.src[0], inst);
+				const uint64_t y = ReadScalar(inst.src[1], inst);
+				const uint64_t carry = ((inst.op == S_ADDC_U32) || (inst.op == S_SUBB_U32)) ? ReadSCC() : 0;
+
+				uint64_t result;
+				if (inst.op == S_ADD_I32)
+				{
+					const int64_t sum = static_cast<int64_t>(static_cast<int32_t>(x)) + static_cast<int32_t>(y);
+					result = static_cast<uint64_t>(sum);
+					scc = (sum != static_cast<int32_t>(sum));
+				}
+				else if ((inst.op == S_ADD_U32) || (inst.op == S_ADDC_U32))
+				{
+					result = x + y + carry;
+					scc = (result >> 32) != 0;
+				}
+				else
+				{
+					result = x - y - carry;
+					scc = (y + carry > x);
+				}
+				scc_set = true;
+
+				WriteScalar(inst.dst, static_cast<uint32_t>(result));
+			}
+			break;
+
+		case S_AND_B32:
+		case S_OR_B32:
+		case S_XOR_B32:
+		case S_LSHL_B32:
+		case S_LSHR_B32:
+			{
+				const uint32_t x = ReadScalar(inst.src[0], inst);
+				const uint32_t y = ReadScalar(inst.src[1], inst);
+
+				uint32_t result;
+				switch (inst.op)
+				{
+				case S_AND_B32: result = x & y; break;
+				case S_OR_B32: result = x | y; break;
+				case S_XOR_B32: result = x ^ y; break;
+				case S_LSHL_B32: result = x << (y & 31); break;
+				default: result = x >> (y & 31); break;
+				}
+				scc = (result != 0);
+				scc_set = true;
+
+				WriteScalar(inst.dst, result);
+			}
+			break;
+
+		case S_OR_B64:
+		case S_XOR_B64:
+		case S_LSHL_B64:
+		case S_LSHR_B64:
+		case S_BFE_U64:
+			{
+				const uint64_t x = ReadScalar64(inst.src[0], inst);
+				const uint64_t y = ((inst.op == S_OR_B64) || (inst.op == S_XOR_B64)) ? ReadScalar64(inst.src[1], inst) : ReadScalar(inst.src[1], inst);
+
+				uint64_t result;
+				switch (inst.op)
+				{
+				case S_OR_B64: result = x | y; break;
+				case S_XOR_B64: result = x ^ y; break;
+				case S_LSHL_B64: result = x << (y & 63); break;
+				case S_LSHR_B64: result = x >> (y & 63); break;
+				default:
+					{
+						const uint32_t width = (y >> 16) & 127;
+						result = width ? ((x >> (y & 63)) & ((width < 64) ? ((1ULL << width) - 1) : ~0ULL)) : 0;
+					}
+					break;
+				}
+				scc = (result != 0);
+				scc_set = true;
+
+				WriteScalar64(inst.dst, result);
+			}
+			break;
+
+		case S_MUL_I32:
+			WriteScalar(inst.dst, ReadScalar(inst.src[0], inst) * ReadScalar(inst.src[1], inst));
+			break;
+
+		case S_MUL_HI_U32:
+			WriteScalar(inst.dst, static_cast<uint32_t>((static_cast<uint64_t>(ReadScalar(inst.src[0], inst)) * ReadScalar(inst.src[1], inst)) >> 32));
+			break;
+
+		case S_MOV_B32:
+			WriteScalar(inst.dst, ReadScalar(inst.src[0], inst));
+			break;
+
+		case S_MOV_B64:
+			WriteScalar64(inst.dst, ReadScalar64(inst.src[0], inst));
+			break;
+
+		case S_BREV_B32:
+			{
+				const uint32_t x = ReadScalar(inst.src[0], inst);
+				uint32_t result = 0;
+				for (uint32_t i = 0; i < 32; ++i)
+					result |= ((x >> i) & 1) << (31 - i);
+				WriteScalar(inst.dst, result);
+			}
+			break;
+
+		case S_SETPC_B64:
+			target = ReadScalar64(inst.src[0], inst);
+			jump = true;
+			break;
+
+		case S_SWAPPC_B64:
+			target = ReadScalar64(inst.src[0], inst);
+			WriteScalar64(inst.dst, CODE_ADDRESS + next_pc * sizeof(uint32_t));
+			jump = true;
+			break;
+
+		case S_SETREG_B32:
+			{
+				const uint32_t id = inst.imm & 63;
+				const uint32_t offset = (inst.imm >> 6) & 31;
+				const uint32_t size = ((inst.imm >> 11) & 31) + 1;
+				if ((id != HW_REG_MODE) || (offset != 2) || (size != 2))
+					Fail("only hwreg(mode, 2, 2) is supported");
+				else
+					mode = ReadScalar(inst.dst, inst) & 3;
+			}
+			break;
+
+		case S_NOP:
+			break;
+
+		case S_CBRANCH_SCC0:
+			if (!ReadSCC())
+				next_pc = pc + 1 + inst.imm;
+			break;
+
+		case S_WAITCNT:
+			WaitCount(inst.imm & 0xFFFF);
+			break;
+
+		case V_MOV_B32:
+			for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+				WriteVector(inst.dst, lane, ReadVector(inst.src[0], lane, inst));
+			break;
+
+		case V_CVT_F64_I32:
+			for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+			{
+				const uint64_t result = double_bits(static_cast<int32_t>(ReadVector(inst.src[0], lane, inst)));
+				WriteVector(inst.dst, lane, static_cast<uint32_t>(result));
+				WriteVector(inst.dst + 1, lane, static_cast<uint32_t>(result >> 32));
+			}
+			break;
+
+		case V_AND_B32:
+		case V_XOR_B32:
+		case V_ADD_U32:
+		case V_MUL_HI_U32:
+			for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+			{
+				const uint32_t x = ReadVector(inst.src[0], lane, inst);
+				const uint32_t y = ReadVector(inst.src[1], lane, inst);
+
+				uint32_t result;
+				switch (inst.op)
+				{
+				case V_AND_B32: result = x & y; break;
+				case V_XOR_B32: result = x ^ y; break;
+				case V_ADD_U32: result = x + y; break;
+				default: result = static_cast<uint32_t>((static_cast<uint64_t>(x) * y) >> 32); break;
+				}
+				WriteVector(inst.dst, lane, result);
+			}
+			break;
+
+		case V_ADD_CO_U32:
+		case V_ADDC_CO_U32:
+		case V_ADDC_CO_U32_E64:
+			{
+				uint64_t carry_in = 0;
+				if (inst.op == V_ADDC_CO_U32)
+					carry_in = ReadScalar64(VCC_LO, inst);
+				else if (inst.op == V_ADDC_CO_U32_E64)
+					carry_in = ReadScalar64(inst.src[2], inst);
+
+				uint64_t carry_out = 0;
+				for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+				{
+					const uint64_t sum = static_cast<uint64_t>(ReadVector(inst.src[0], lane, inst)) + ReadVector(inst.src[1], lane, inst) + ((carry_in >> lane) & 1);
+					WriteVector(inst.dst, lane, static_cast<uint32_t>(sum));
+					carry_out |= (sum >> 32) << lane;
+				}
+
+				WriteScalar64((inst.op == V_ADDC_CO_U32_E64) ? inst.sdst : VCC_LO, carry_out);
+			}
+			break;
+
+		case V_ADD_F64:
+		case V_MUL_F64:
+			{
+				uint64_t x[NUM_LANES], y[NUM_LANES];
+				for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+				{
+					x[lane] = ReadDouble(inst.src[0], lane, inst);
+					y[lane] = ReadDouble(inst.src[1], lane, inst);
+
+					if (inst.abs & 1) x[lane] &= ~SIGN_BIT;
+					if (inst.abs & 2) y[lane] &= ~SIGN_BIT;
+					if (inst.neg & 1) x[lane] ^= SIGN_BIT;
+					if (inst.neg & 2) y[lane] ^= SIGN_BIT;
+				}
+
+				rx_set_rounding_mode(randomx_rounding_mode(mode));
+
+				const rx_vec_f128 a = rx_set_vec_f128(x[1], x[0]);
+				const rx_vec_f128 b = rx_set_vec_f128(y[1], y[0]);
+
+				double result[NUM_LANES];
+				rx_store_vec_f128(result, (inst.op == V_ADD_F64) ? rx_add_vec_f128(a, b) : rx_mul_vec_f128(a, b));
+
+				for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+				{
+					const uint64_t bits = double_bits(result[lane]);
+					WriteVector(inst.dst, lane, static_cast<uint32_t>(bits));
+					WriteVector(inst.dst + 1, lane, static_cast<uint32_t>(bits >> 32));
+				}
+			}
+			break;
+
+		case V_READLANE_B32:
+			{
+				const uint32_t lane = ReadScalar(inst.src[1], inst);
+				if (inst.src[0] < VGPR0)
+					Fail("reads a lane of " + Name(inst.src[0]));
+				else if (lane >= NUM_LANES)
+					Fail("reads lane " + std::to_string(lane) + ", only lanes 0 and 1 are active in JIT code");
+				else
+					WriteScalar(inst.dst, ReadVector(inst.src[0], lane, inst));
+			}
+			break;
+
+		case DS_SWIZZLE_B32:
+			{
+				PendingWrite w = {};
+				w.vgpr = inst.dst;
+				w.count = 1;
+
+				for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+				{
+					uint32_t src_lane;
+					if (inst.imm & 0x8000)
+					{
+						// Quad permute, 2 bits per lane
+						src_lane = (lane & ~3U) | ((inst.imm >> ((lane & 3) * 2)) & 3);
+					}
+					else
+					{
+						const uint32_t and_mask = inst.imm & 31;
+						const uint32_t or_mask = (inst.imm >> 5) & 31;
+						const uint32_t xor_mask = (inst.imm >> 10) & 31;
+						src_lane = (((lane & and_mask) | or_mask) ^ xor_mask) | (lane & ~31U);
+					}
+
+					if (src_lane >= NUM_LANES)
+					{
+						Fail("reads lane " + std::to_string(src_lane) + ", only lanes 0 and 1 are active in JIT code");
+						break;
+					}
+					w.data[lane][0] = ReadVector(inst.src[0], src_lane, inst);
+				}
+
+				Issue(lgkm_queue, w);
+			}
+			break;
+
+		case LOAD_DWORD:
+		case LOAD_DWORDX2:
+			{
+				PendingWrite w = {};
+				w.vgpr = inst.dst;
+				w.count = (inst.op == LOAD_DWORDX2) ? 2 : 1;
+
+				for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+				{
+					w.address[lane] = Address(inst, lane);
+					const uint8_t* p = Memory(w.address[lane], w.count * sizeof(uint32_t));
+					if (p)
+						memcpy(w.data[lane], p, w.count * sizeof(uint32_t));
+				}
+
+				Issue(vm_queue, w);
+			}
+			break;
+
+		case STORE_DWORDX2:
+			{
+				uint64_t address[NUM_LANES];
+				uint32_t data[NUM_LANES][2];
+				for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+				{
+					address[lane] = Address(inst, lane);
+					data[lane][0] = ReadVector(inst.src[1], lane, inst);
+					data[lane][1] = ReadVector(inst.src[1] + 1, lane, inst);
+				}
+
+				for (uint32_t lane = 0; (lane < NUM_LANES) && error.empty(); ++lane)
+				{
+					uint8_t* p = Memory(address[lane], sizeof(data[lane]));
+					if (!p)
+						break;
+
+					// RDNA doesn't count stores in vmcnt, a store can pass loads that are still in flight
+					if (gcn_version >= 15)
+					{
+						for (const PendingWrite& w : vm_queue)
+						{
+							for (uint32_t i = 0; i < NUM_LANES; ++i)
+							{
+								if ((w.address[i] < address[lane] + sizeof(data[lane])) && (address[lane] < w.address[i] + w.count * sizeof(uint32_t)))
+									Fail("stores to an address " + Name(VGPR0 + w.vgpr) + " is still loading from");
+							}
+						}
+					}
+
+					memcpy(p, data[lane], sizeof(data[lane]));
+				}
+
+				if (gcn_version < 15)
+				{
+					PendingWrite w = {};
+					vm_queue.push_back(w);
+				}
+			}
+			break;
+		}
+
+		if (!error.empty())
+			return false;
+
+		if (jump)
+		{
+			// Subroutines return with s_setpc_b64 s[60:61]
+			if ((target >= SUBROUTINE_ADDRESS) && (target < SUBROUTINE_ADDRESS + NUM_SUBROUTINES * SUBROUTINE_STRIDE) && !(target % SUBROUTINE_STRIDE))
+			{
+				CallSubroutine(static_cast<uint32_t>((target - SUBROUTINE_ADDRESS) / SUBROUTINE_STRIDE));
+				target = ReadScalar64(60, inst);
+				if (!error.empty())
+					return false;
+			}
+
+			if (target == RETURN_ADDRESS)
+				return true;
+
+			if ((target < CODE_ADDRESS) || (target >= CODE_ADDRESS + COMPILED_PROGRAM_SIZE) || (target % sizeof(uint32_t)))
+			{
+				std::stringstream s;
+				s << "jumps to 0x" << std::hex << target;
+				return Fail(s.str());
+			}
+
+			next_pc = static_cast<uint32_t>((target - CODE_ADDRESS) / sizeof(uint32_t));
+		}
+
+		pc = next_pc;
+	}
+
+	return Fail("doesn't return to randomx_run after " + std::to_string(MAX_INSTRUCTIONS_PER_CALL) + " instructions");
+}
+
+bool GcnEmulator::Decode(uint32_t index, Instruction& inst)
+{
+	const uint32_t w = program[index];
+	auto word = [this, index](uint32_t i) { return (index + i < PROGRAM_DWORDS) ? program[index + i] : 0U; };
+
+	inst = Instruction();
+	inst.size = 1;
+
+	Encoding encoding;
+	uint32_t opcode;
+	bool literal_allowed = true;
+
+	if ((w >> 23) == 0x17D)
+	{
+		encoding = SOP1;
+		opcode = (w >> 8) & 0xFF;
+		inst.dst = (w >> 16) & 0x7F;
+		inst.src[0] = w & 0xFF;
+	}
+	else if ((w >> 23) == 0x17F)
+	{
+		encoding = SOPP;
+		opcode = (w >> 16) & 0x7F;
+		inst.imm = static_cast<int16_t>(w & 0xFFFF);
+	}
+	else if ((w >> 23) == 0x17E)
+	{
+		return Fail("SOPC instructions aren't supported");
+	}
+	else if ((w >> 28) == 0xB)
+	{
+		encoding = SOPK;
+		opcode = (w >> 23) & 0x1F;
+		inst.dst = (w >> 16) & 0x7F;
+		inst.imm = w & 0xFFFF;
+	}
+	else if ((w >> 30) == 2)
+	{
+		encoding = SOP2;
+		opcode = (w >> 23) & 0x7F;
+		inst.dst = (w >> 16) & 0x7F;
+		inst.src[0] = w & 0xFF;
+		inst.src[1] = (w >> 8) & 0xFF;
+	}
+	else if ((w >> 25) == 0x3F)
+	{
+		encoding = VOP1;
+		opcode = (w >> 9) & 0xFF;
+		inst.dst = (w >> 17) & 0xFF;
+		inst.src[0] = w & 0x1FF;
+	}
+	else if ((w >> 25) == 0x3E)
+	{
+		return Fail("VOPC instructions aren't supported");
+	}
+	else if ((w >> 31) == 0)
+	{
+		encoding = VOP2;
+		opcode = (w >> 25) & 0x3F;
+		inst.dst = (w >> 17) & 0xFF;
+		inst.src[0] = w & 0x1FF;
+		inst.src[1] = VGPR0 + ((w >> 9) & 0xFF);
+	}
+	else if ((w >> 26) == ((gcn_version >= 15) ? 0x35U : 0x34U))
+	{
+		const uint32_t w1 = word(1);
+		encoding = VOP3;
+		opcode = (w >> 16) & 0x3FF;
+		inst.size = 2;
+		inst.dst = w & 0xFF;
+		inst.sdst = (w >> 8) & 0x7F;
+		inst.abs = (w >> 8) & 7;
+		inst.src[0] = w1 & 0x1FF;
+		inst.src[1] = (w1 >> 9) & 0x1FF;
+		inst.src[2] = (w1 >> 18) & 0x1FF;
+		inst.neg = w1 >> 29;
+		literal_allowed = (gcn_version >= 15);
+
+		if ((w & 0x8000) || (w1 & 0x18000000) || ((gcn_version >= 15) && (w & 0x7800)))
+			return Fail("clamp, output modifiers and op_sel aren't supported");
+	}
+	else if ((w >> 26) == 0x36)
+	{
+		const uint32_t w1 = word(1);
+		encoding = DS;
+		opcode = (gcn_version >= 15) ? ((w >> 18) & 0xFF) : ((w >> 17) & 0xFF);
+		inst.size = 2;
+		inst.dst = w1 >> 24;
+		inst.src[0] = VGPR0 + (w1 & 0xFF);
+		inst.imm = w & 0xFFFF;
+
+		if ((gcn_version >= 15) ? (w & 0x20000) : (w & 0x10000))
+			return Fail("GDS isn't supported");
+	}
+	else if ((w >> 26) == 0x37)
+	{
+		const uint32_t w1 = word(1);
+		encoding = FLAT;
+		opcode = (w >> 18) & 0x7F;
+		inst.size = 2;
+		inst.dst = w1 >> 24;
+		inst.src[0] = VGPR0 + (w1 & 0xFF);
+		inst.src[1] = VGPR0 + ((w1 >> 8) & 0xFF);
+		inst.saddr = SADDR_OFF;
+
+		if (gcn_version >= 14)
+		{
+			const uint32_t segment = (w >> 14) & 3;
+			if ((segment != 0) && (segment != 2))
+				return Fail("only flat and global segments are supported");
+
+			inst.saddr = (w1 >> 16) & 0x7F;
+
+			// Signed offset, 13 bits on gfx900 and 12 bits on gfx1010
+			const uint32_t offset_bits = (gcn_version >= 15) ? 12 : 13;
+			inst.imm = static_cast<int32_t>((w & ((1U << offset_bits) - 1)) << (32 - offset_bits)) >> (32 - offset_bits);
+		}
+	}
+	else
+	{
+		return Fail("unsupported instruction encoding");
+	}
+
+	inst.op = find_op(encoding, opcode, version_index);
+	if (!inst.op)
+	{
+		std::stringstream s;
+		s << "unsupported opcode " << opcode << " for GCN_VERSION " << gcn_version;
+		return Fail(s.str());
+	}
+
+	if ((encoding == VOP3) && (inst.op != V_ADD_F64) && (inst.op != V_MUL_F64))
+	{
+		// VOP3b has sdst where VOP3a has abs
+		if (inst.neg || ((inst.op != V_ADDC_CO_U32_E64) && inst.abs))
+			return Fail("input modifiers on an integer instruction");
+	}
+
+	// At most one literal dword follows the instruction, all sources that use it read the same value
+	if ((encoding == SOP1) || (encoding == SOP2) || (encoding == VOP1) || (encoding == VOP2) || (encoding == VOP3))
+	{
+		if ((inst.src[0] == LITERAL) || (inst.src[1] == LITERAL) || (inst.src[2] == LITERAL))
+		{
+			if (!literal_allowed)
+				return Fail("literal constants aren't allowed in VOP3 before gfx1010");
+
+			inst.literal = word(inst.size);
+			++inst.size;
+		}
+	}
+
+	if (index + inst.size > PROGRAM_DWORDS)
+		return Fail("runs past the end of the compiled program");
+
+	return true;
+}
+
+// IMULH_R, ISMULH_R, FDIV_M and FSQRT_R are subroutines in randomx_run. They're emulated by what they compute
+// and leave their temporary registers undefined.
+void GcnEmulator::CallSubroutine(uint32_t index)
+{
+	const Instruction none = {};
+
+	if (index >= 8)
+	{
+		const uint64_t x = ReadScalar64(14, none);
+		const uint64_t y = ReadScalar64(38, none);
+		if (!error.empty())
+			return;
+
+		const uint64_t result = (index == 9) ? mulh(x, y) : static_cast<uint64_t>(smulh(static_cast<int64_t>(x), static_cast<int64_t>(y)));
+		sgpr[14] = static_cast<uint32_t>(result);
+		sgpr[15] = static_cast<uint32_t>(result >> 32);
+
+		for (uint32_t i : { 32, 33, 34, 35, 106, 107 })
+			sgpr_set[i] = false;
+		if (index == 8)
+			scc_set = false;
+
+		for (uint32_t i : { 40, 42, 43, 45, 46, 47 })
+			Clobber(i);
+		return;
+	}
+
+	const uint32_t dst = 68 + (index % 4) * 2;
+	const uint32_t rounding_mode = ReadScalar(66, none) & 3;
+	ReadScalar(67, none);
+
+	uint64_t x[NUM_LANES], y[NUM_LANES];
+	for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+	{
+		x[lane] = ReadDouble(VGPR0 + dst, lane, none);
+
+		// FDIV_M's divisor gets the E group's exponent and mantissa mask
+		if (index >= 4)
+			y[lane] = (ReadDouble(VGPR0 + 28, lane, none) & DYNAMIC_MANTISSA_MASK) | (vgpr[78][lane] | (static_cast<uint64_t>(vgpr[79][lane]) << 32));
+	}
+
+	for (uint32_t i : { 28, 29, 42, 43, 46, 47, 48, 49, 80, 81 })
+		Clobber(i);
+
+	if (!error.empty())
+		return;
+
+	rx_set_rounding_mode(randomx_rounding_mode(rounding_mode));
+
+	double result[NUM_LANES];
+	const rx_vec_f128 a = rx_set_vec_f128(x[1], x[0]);
+	if (index >= 4)
+	{
+		rx_store_vec_f128(result, rx_div_vec_f128(a, rx_set_vec_f128(y[1], y[0])));
+	}
+	else
+	{
+		// Only positive normal values are replaced, like v_cmpx_class_f64 does in the subroutine
+		rx_store_vec_f128(result, rx_sqrt_vec_f128(a));
+		for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+		{
+			const uint64_t exponent = (x[lane] >> 52) & 2047;
+			if ((x[lane] & SIGN_BIT) || (exponent == 0) || (exponent == 2047))
+				memcpy(&result[lane], &x[lane], sizeof(double));
+		}
+	}
+
+	for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+	{
+		const uint64_t bits = double_bits(result[lane]);
+		vgpr[dst][lane] = static_cast<uint32_t>(bits);
+		vgpr[dst + 1][lane] = static_cast<uint32_t>(bits >> 32);
+
+		if (index >= 4)
+		{
+			vgpr[28][lane] = static_cast<uint32_t>(y[lane]);
+			vgpr[29][lane] = static_cast<uint32_t>(y[lane] >> 32);
+		}
+	}
+
+	if (index >= 4)
+	{
+		vgpr_state[28] = VGPR_SET;
+		vgpr_state[29] = VGPR_SET;
+	}
+
+	sgpr_set[14] = false;
+	sgpr_set[15] = false;
+	mode = rounding_mode;
+}
+
+uint32_t GcnEmulator::ReadScalar(uint32_t code, const Instruction& inst)
+{
+	if (code < NUM_SGPRS)
+	{
+		if (!sgpr_set[code])
+			Fail("reads " + Name(code) + " which isn't set");
+		return sgpr[code];
+	}
+
+	if (code == EXEC_LO)
+		return 3;
+	if (code == EXEC_HI)
+		return 0;
+
+	// Inline integer constants 0..64 and -1..-16
+	if ((code >= 128) && (code <= 192))
+		return code - 128;
+	if ((code >= 193) && (code <= 208))
+		return 192 - code;
+
+	if (code == LITERAL)
+		return inst.literal;
+
+	Fail("unsupported scalar operand " + Name(code));
+	return 0;
+}
+
+uint64_t GcnEmulator::ReadScalar64(uint32_t code, const Instruction& inst)
+{
+	if ((code < NUM_SGPRS) || (code == EXEC_LO))
+	{
+		if (code & 1)
+		{
+			Fail("64-bit operand " + Name(code) + " isn't aligned");
+			return 0;
+		}
+
+		const uint64_t lo = ReadScalar(code, inst);
+		const uint64_t hi = ReadScalar(code + 1, inst);
+		return lo | (hi << 32);
+	}
+
+	if ((code >= 128) && (code <= 208))
+		return static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(ReadScalar(code, inst))));
+
+	Fail("unsupported 64-bit scalar operand " + Name(code));
+	return 0;
+}
+
+void GcnEmulator::WriteScalar(uint32_t index, uint32_t value)
+{
+	if ((index >= NUM_SGPRS) || !sgpr_writable[index])
+	{
+		Fail("writes " + Name(index) + " which belongs to randomx_run");
+		return;
+	}
+
+	sgpr[index] = value;
+	sgpr_set[index] = true;
+}
+
+void GcnEmulator::WriteScalar64(uint32_t index, uint64_t value)
+{
+	if (index & 1)
+	{
+		Fail("64-bit destination " + Name(index) + " isn't aligned");
+		return;
+	}
+
+	WriteScalar(index, static_cast<uint32_t>(value));
+	WriteScalar(index + 1, static_cast<uint32_t>(value >> 32));
+}
+
+bool GcnEmulator::ReadSCC()
+{
+	if (!scc_set)
+		Fail("reads SCC which isn't set");
+	return scc;
+}
+
+uint32_t GcnEmulator::ReadVector(uint32_t code, uint32_t lane, const Instruction& inst)
+{
+	if (code < VGPR0)
+		return ReadScalar(code, inst);
+
+	const uint32_t index = code - VGPR0;
+	if (index >= NUM_VGPRS)
+	{
+		Fail("reads " + Name(code) + ", randomx_run has " + std::to_string(NUM_VGPRS) + " VGPRs");
+		return 0;
+	}
+
+	if (vgpr_state[index] == VGPR_UNDEFINED)
+		Fail("reads " + Name(code) + " which isn't set");
+	else if (vgpr_state[index] == VGPR_LOADING)
+		Fail("reads " + Name(code) + " before s_waitcnt for its load");
+
+	return vgpr[index][lane];
+}
+
+uint64_t GcnEmulator::ReadDouble(uint32_t code, uint32_t lane, const Instruction& inst)
+{
+	// Inline constants 0.5, -0.5, 1.0, -1.0, 2.0, -2.0, 4.0, -4.0
+	if ((code >= 240) && (code <= 247))
+	{
+		const double value = static_cast<double>(1 << ((code - 240) / 2)) * (((code - 240) & 1) ? -0.5 : 0.5);
+		return double_bits(value);
+	}
+
+	if ((code >= 128) && (code <= 208))
+		return double_bits(static_cast<int32_t>(ReadScalar(code, inst)));
+
+	// 64-bit FP literals are the high half of the value
+	if (code == LITERAL)
+		return static_cast<uint64_t>(inst.literal) << 32;
+
+	if ((code < VGPR0) && (code & 1))
+	{
+		Fail("64-bit operand " + Name(code) + " isn't aligned");
+		return 0;
+	}
+
+	const uint64_t lo = ReadVector(code, lane, inst);
+	const uint64_t hi = ReadVector(code + 1, lane, inst);
+	return lo | (hi << 32);
+}
+
+void GcnEmulator::WriteVector(uint32_t index, uint32_t lane, uint32_t value)
+{
+	if ((index >= NUM_VGPRS) || !vgpr_writable[index])
+	{
+		Fail("writes " + Name(VGPR0 + index) + " which belongs to randomx_run");
+		return;
+	}
+
+	if (vgpr_state[index] == VGPR_LOADING)
+	{
+		Fail("writes " + Name(VGPR0 + index) + " while it's still loading");
+		return;
+	}
+
+	vgpr[index][lane] = value;
+	vgpr_state[index] = VGPR_SET;
+}
+
+void GcnEmulator::Clobber(uint32_t index)
+{
+	if (vgpr_state[index] == VGPR_LOADING)
+		Fail("calls a subroutine that overwrites " + Name(VGPR0 + index) + " while it's still loading");
+
+	vgpr_state[index] = VGPR_UNDEFINED;
+}
+
+uint64_t GcnEmulator::Address(const Instruction& inst, uint32_t lane)
+{
+	if ((gcn_version >= 14) && (inst.saddr < SADDR_OFF))
+		return ReadScalar64(inst.saddr, inst) + ReadVector(inst.src[0], lane, inst) + static_cast<int64_t>(inst.imm);
+
+	const uint64_t lo = ReadVector(inst.src[0], lane, inst);
+	const uint64_t hi = ReadVector(inst.src[0] + 1, lane, inst);
+	return (lo | (hi << 32)) + static_cast<int64_t>(inst.imm);
+}
+
+uint8_t* GcnEmulator::Memory(uint64_t address, uint32_t size)
+{
+	if ((address < SCRATCHPAD_ADDRESS) || (address + size > SCRATCHPAD_ADDRESS + RANDOMX_SCRATCHPAD_L3) || (address % sizeof(uint32_t)))
+	{
+		std::stringstream s;
+		s << "accesses 0x" << std::hex << address << ", the scratchpad is at 0x" << SCRATCHPAD_ADDRESS << std::dec << " (" << RANDOMX_SCRATCHPAD_L3 << " bytes)";
+		Fail(s.str());
+		return nullptr;
+	}
+
+	return scratchpad + (address - SCRATCHPAD_ADDRESS);
+}
+
+void GcnEmulator::Issue(std::deque<PendingWrite>& queue, const PendingWrite& w)
+{
+	for (uint32_t i = w.vgpr; i < w.vgpr + w.count; ++i)
+	{
+		if ((i >= NUM_VGPRS) || !vgpr_writable[i])
+		{
+			Fail("writes " + Name(VGPR0 + i) + " which belongs to randomx_run");
+			return;
+		}
+
+		if (vgpr_state[i] == VGPR_LOADING)
+		{
+			Fail("loads into " + Name(VGPR0 + i) + " while it's still loading");
+			return;
+		}
+
+		vgpr_state[i] = VGPR_LOADING;
+	}
+
+	queue.push_back(w);
+}
+
+void GcnEmulator::WaitCount(uint32_t simm16)
+{
+	uint32_t vmcnt = simm16 & 15;
+	if (gcn_version >= 14)
+		vmcnt |= ((simm16 >> 14) & 3) << 4;
+
+	const uint32_t lgkmcnt = (simm16 >> 8) & ((gcn_version >= 15) ? 63 : 15);
+
+	while (vm_queue.size() > vmcnt)
+		Retire(vm_queue);
+
+	while (lgkm_queue.size() > lgkmcnt)
+		Retire(lgkm_queue);
+}
+
+// Loads and LDS operations finish in order
+void GcnEmulator::Retire(std::deque<PendingWrite>& queue)
+{
+	const PendingWrite& w = queue.front();
+	for (uint32_t i = 0; i < w.count; ++i)
+	{
+		for (uint32_t lane = 0; lane < NUM_LANES; ++lane)
+			vgpr[w.vgpr + i][lane] = w.data[lane][i];
+		vgpr_state[w.vgpr + i] = VGPR_SET;
+	}
+	queue.pop_front();
+}
+
+bool GcnEmulator::Fail(const std::string& message)
+{
+	if (!error.empty())
+		return false;
+
+	std::stringstream s;
+	s << "offset 0x" << std::hex << std::setw(4) << std::setfill('0') << (pc * sizeof(uint32_t)) << std::dec;
+	if (pc < PROGRAM_DWORDS)
+	{
+		const Instruction& inst = decoded[pc];
+		if (inst.op)
+			s << " (" << ((OPCODES[inst.op].encoding == FLAT) ? ((gcn_version >= 14) ? "global_" : "flat_") : "") << OPCODES[inst.op].name << ")";
+		else
+			s << " (0x" << std::hex << std::setw(8) << std::setfill('0') << program[pc] << std::dec << ")";
+	}
+	s << ": " << message;
+
+	error = s.str();
+	return false;
+}
+
+std::string GcnEmulator::Name(uint32_t code) const
+{
+	if (code >= VGPR0)
+		return "v" + std::to_string(code - VGPR0);
+	if (code < VCC_LO)
+		return "s" + std::to_string(code);
+
+	switch (code)
+	{
+	case VCC_LO: return "vcc_lo";
+	case VCC_HI: return "vcc_hi";
+	case EXEC_LO: return "exec_lo";
+	case EXEC_HI: return "exec_hi";
+	case LITERAL: return "literal";
+	}
+
+	return "operand " + std::to_string(code);
+}
+
+// Runs func(0) .. func(n - 1) on all CPU cores
+static void parallel_for(uint32_t n, const std::function<void(uint32_t)>& func)
+{
+	std::atomic<uint32_t> next(0);
+	std::vector<SThread> threads;
+
+	const uint32_t num_threads = std::min(std::max(std::thread::hardware_concurrency(), 1U), n);
+	for (uint32_t i = 0; i < num_threads; ++i)
+	{
+		threads.emplace_back([&next, n, &func]()
+		{
+			for (uint32_t k = next++; k < n; k = next++)
+				func(k);
+		});
+	}
+}
+
+static std::string register_name(uint32_t index)
+{
+	static const char* groups[] = { "r", "f", "e", "a" };
+
+	std::stringstream s;
+	s << groups[index / 8];
+	if (index < 8)
+		s << index;
+	else
+		s << ((index % 8) / 2) << (((index % 8) & 1) ? ".hi" : ".lo");
+	return s.str();
+}
+
+// One hash checked against the RandomX VM. Both sides keep their own temporary hash, so a mismatch in one program doesn't
+// hide behind a mismatch in an earlier one.
+struct EmulatedHash
+{
+	explicit EmulatedHash(int gcn_version)
+		: emulator(gcn_version)
+		, vm(nullptr, randomx_destroy_vm)
+		, scratchpad(RANDOMX_SCRATCHPAD_L3)
+		, registers(REGISTERS_SIZE)
+		, rounding_mode(0)
+	{
+	}
+
+	GcnEmulator emulator;
+	std::unique_ptr<randomx_vm, void(*)(randomx_vm*)> vm;
+	fenv_t vm_fenv;
+
+	uint64_t gpu_temp_hash[8];
+	uint64_t vm_temp_hash[8];
+
+	std::vector<uint8_t> scratchpad;
+	std::vector<uint8_t> registers;
+	uint32_t rounding_mode;
+
+	// Current compiled program, padded with zeroes to COMPILED_PROGRAM_SIZE
+	std::vector<uint32_t> program;
+
+	std::string error;
+};
+
+// Copies the program randomx_init stored for a hash (offset in COMPILED_PROGRAM_OFFSET_REG) out of its slot, so code
+// that runs past the slot ends up in zeroes instead of the next program. Returns false if the offset isn't a slot.
+static bool copy_program(const std::vector<uint8_t>& compiled_programs, const uint8_t* registers, uint32_t batch_size, std::vector<uint32_t>& program)
+{
+	const uint64_t offset = reinterpret_cast<const uint64_t*>(registers)[COMPILED_PROGRAM_OFFSET_REG];
+	const uint64_t fallback_begin = static_cast<uint64_t>(batch_size) * COMPILED_PROGRAM_SLOT_SIZE;
+
+	size_t size;
+	if (offset < fallback_begin)
+	{
+		if (offset % COMPILED_PROGRAM_SLOT_SIZE)
+			return false;
+		size = COMPILED_PROGRAM_SLOT_SIZE;
+	}
+	else
+	{
+		if (((offset - fallback_begin) % COMPILED_PROGRAM_SIZE) || (offset + COMPILED_PROGRAM_SIZE > compiled_programs.size()))
+			return false;
+		size = COMPILED_PROGRAM_SIZE;
+	}
+
+	program.assign(PROGRAM_DWORDS, 0);
+	memcpy(program.data(), compiled_programs.data() + offset, size);
+	return true;
+}
+
+// Recorded JIT-style code for the self-test, for GCN_VERSION 12, 14 and 15:
+//   s_waitcnt vmcnt(0) expcnt(0) lgkmcnt(0)                  dataset item
+//   s_add_u32 s16, s16, s18 / s_addc_u32 s17, s17, s19        IADD_RS r0, r1 (shift 0)
+//   s_xor_b64 s[20:21], s[20:21], s[22:23]                    IXOR_R r2, r3
+//   v_add_f64 v[60:61], v[60:61], v[52:53]                    FADD_R f0, a0
+//   v_and_b32 v86, s26, v38                                   ISTORE L1[r5], r4
+//   v_mov_b32 v88, s24 / v_mov_b32 v89, s25
+//   flat_store_dwordx2 v[86:87], v[88:89] after adding the scratchpad address (gfx803)
+//   global_store_dwordx2 v86, v[88:89], s[0:1] (gfx900, gfx1010)
+//   s_setpc_b64 s[12:13]
+static const uint32_t SELF_TEST_PROGRAM_GCN12[] = {
+	0xBF8C0000, 0x80101210, 0x82111311, 0x88941614, 0xD280003C, 0x0002693C, 0x26AC4C1A, 0x7EB00218, 0x7EB20219,
+	0x32AC0556, 0x38AE0680, 0xDC740000, 0x00005856, 0xBE801D0C,
+};
+
+static const uint32_t SELF_TEST_PROGRAM_GCN14[] = {
+	0xBF8C0000, 0x80101210, 0x82111311, 0x88941614, 0xD280003C, 0x0002693C, 0x26AC4C1A, 0x7EB00218, 0x7EB20219,
+	0xDC748000, 0x00005856, 0xBE801D0C,
+};
+
+static const uint32_t SELF_TEST_PROGRAM_GCN15[] = {
+	0xBF8C0000, 0x80101210, 0x82111311, 0x89941614, 0xD564003C, 0x0002693C, 0x36AC4C1A, 0x7EB00218, 0x7EB20219,
+	0xDC748000, 0x00005856, 0xBE80200C,
+};
+
+static uint64_t self_test_value(uint64_t& state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static void self_test_dataset_item(uint64_t item, uint8_t* out)
+{
+	uint64_t state = item;
+	for (uint32_t i = 0; i < RANDOMX_DATASET_ITEM_SIZE / sizeof(uint64_t); ++i)
+		write64(out + i * sizeof(uint64_t), self_test_value(state));
+}
+
+// What the recorded program does to registers and the scratchpad, written from the RandomX specification without GcnEmulator.
+// Rounding mode stays at round to nearest.
+static void self_test_reference(uint64_t (&R)[REGISTERS_SIZE / sizeof(uint64_t)], uint8_t* scratchpad)
+{
+	uint32_t ma = static_cast<uint32_t>(R[16]);
+	uint32_t mx = static_cast<uint32_t>(R[16] >> 32);
+	const uint32_t read_reg[4] = { static_cast<uint32_t>(R[17]) & 7, static_cast<uint32_t>(R[17] >> 32) & 7, static_cast<uint32_t>(R[18]) & 7, static_cast<uint32_t>(R[18] >> 32) & 7 };
+	const uint32_t dataset_offset = static_cast<uint32_t>(R[19]);
+	const uint64_t e_mask[2] = { R[20], R[21] };
+
+	uint64_t r[8], e[8];
+	double f[8], a[8];
+	memcpy(r, R, sizeof(r));
+	memcpy(a, R + 24, sizeof(a));
+
+	uint32_t sp_addr0 = mx;
+	uint32_t sp_addr1 = ma;
+
+	for (uint32_t ic = 0; ic < RANDOMX_PROGRAM_ITERATIONS; ++ic)
+	{
+		const uint64_t sp_mix = r[read_reg[0]] ^ r[read_reg[1]];
+		sp_addr0 = (sp_addr0 ^ static_cast<uint32_t>(sp_mix)) & SCRATCHPAD_L3_MASK64;
+		sp_addr1 = (sp_addr1 ^ static_cast<uint32_t>(sp_mix >> 32)) & SCRATCHPAD_L3_MASK64;
+
+		for (uint32_t i = 0; i < 8; ++i)
+			r[i] ^= read64(scratchpad + sp_addr0 + i * 8);
+
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			int32_t q;
+			memcpy(&q, scratchpad + sp_addr1 + i * 4, sizeof(q));
+			f[i] = q;
+
+			memcpy(&q, scratchpad + sp_addr1 + 32 + i * 4, sizeof(q));
+			e[i] = (double_bits(q) & DYNAMIC_MANTISSA_MASK) | e_mask[i % 2];
+		}
+
+		r[0] += r[1];
+		r[2] ^= r[3];
+		f[0] += a[0];
+		f[1] += a[1];
+		write64(scratchpad + (static_cast<uint32_t>(r[5]) & (RANDOMX_SCRATCHPAD_L1 - 8)), r[4]);
+
+		mx ^= static_cast<uint32_t>(r[read_reg[2]]) ^ static_cast<uint32_t>(r[read_reg[3]]);
+		mx &= CACHE_LINE_ALIGN_MASK;
+
+		uint8_t item[RANDOMX_DATASET_ITEM_SIZE];
+		self_test_dataset_item((dataset_offset + ma) / RANDOMX_DATASET_ITEM_SIZE, item);
+
+		for (uint32_t i = 0; i < 8; ++i)
+		{
+			r[i] ^= read64(item + i * 8);
+			write64(scratchpad + sp_addr1 + i * 8, r[i]);
+		}
+
+		for (uint32_t i = 0; i < 8; ++i)
+			write64(scratchpad + sp_addr0 + i * 8, double_bits(f[i]) ^ e[i]);
+
+		std::swap(ma, mx);
+		sp_addr0 = 0;
+		sp_addr1 = 0;
+	}
+
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		R[i] = r[i];
+		R[i + 8] = double_bits(f[i]) ^ e[i];
+		R[i + 16] = e[i];
+	}
+}
+
+bool gcn_emulator_self_test(int gcn_version)
+{
+	std::vector<uint32_t> program(PROGRAM_DWORDS, 0);
+	switch (gcn_version)
+	{
+	case 12: std::copy(std::begin(SELF_TEST_PROGRAM_GCN12), std::end(SELF_TEST_PROGRAM_GCN12), program.begin()); break;
+	case 14: std::copy(std::begin(SELF_TEST_PROGRAM_GCN14), std::end(SELF_TEST_PROGRAM_GCN14), program.begin()); break;
+	default: std::copy(std::begin(SELF_TEST_PROGRAM_GCN15), std::end(SELF_TEST_PROGRAM_GCN15), program.begin()); break;
+	}
+
+	uint64_t state = 0;
+
+	uint64_t R[REGISTERS_SIZE / sizeof(uint64_t)] = {};
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		R[i] = self_test_value(state);
+		R[24 + i] = double_bits(1.0 + static_cast<double>(self_test_value(state) >> 12) / (1ULL << 52));
+	}
+	R[16] = (self_test_value(state) & CACHE_LINE_ALIGN_MASK) | ((self_test_value(state) & CACHE_LINE_ALIGN_MASK) << 32);
+	R[17] = 0 | (2ULL << 32);
+	R[18] = 4 | (7ULL << 32);
+	R[19] = 12345 * RANDOMX_DATASET_ITEM_SIZE;
+	R[20] = 0x3A00000000000000ULL;
+	R[21] = 0x3C80000000000000ULL;
+
+	std::vector<uint8_t> scratchpad(RANDOMX_SCRATCHPAD_L3);
+	for (size_t i = 0; i < scratchpad.size(); i += sizeof(uint64_t))
+		write64(scratchpad.data() + i, self_test_value(state));
+
+	std::vector<uint8_t> registers(reinterpret_cast<const uint8_t*>(R), reinterpret_cast<const uint8_t*>(R) + REGISTERS_SIZE);
+	std::vector<uint8_t> expected_scratchpad = scratchpad;
+	self_test_reference(R, expected_scratchpad.data());
+
+	GcnEmulator emulator(gcn_version);
+	uint32_t rounding_mode = 0;
+	if (!emulator.Run(program.data(), registers.data(), scratchpad.data(), rounding_mode, self_test_dataset_item))
+	{
+		std::cerr << "GCN_VERSION " << gcn_version << " self-test: " << emulator.Error() << std::endl;
+		return false;
+	}
+
+	const uint64_t* result = reinterpret_cast<const uint64_t*>(registers.data());
+	for (uint32_t k = 0; k < REGISTERS_SIZE / sizeof(uint64_t); ++k)
+	{
+		if (result[k] != R[k])
+		{
+			std::cerr << "GCN_VERSION " << gcn_version << " self-test: " << register_name(k) << " is 0x" << std::hex << std::setw(16) << std::setfill('0') << result[k];
+			std::cerr << " instead of 0x" << std::setw(16) << R[k] << std::dec << std::endl;
+			return false;
+		}
+	}
+
+	const auto mismatch = std::mismatch(scratchpad.begin(), scratchpad.end(), expected_scratchpad.begin());
+	if (mismatch.first != scratchpad.end())
+	{
+		std::cerr << "GCN_VERSION " << gcn_version << " self-test: scratchpad differs at offset " << (mismatch.first - scratchpad.begin()) << std::endl;
+		return false;
+	}
+
+	if (rounding_mode != 0)
+	{
+		std::cerr << "GCN_VERSION " << gcn_version << " self-test: rounding mode changed to " << rounding_mode << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+static bool gcn_emulator_test_version(OpenCLContext& ctx, randomx_cache* cache, int gcn_version, uint32_t num_hashes, uint32_t start_nonce, const Job& job)
+{
+	std::stringstream options;
+	options << "-D GCN_VERSION=" << gcn_version;
+
+	std::stringstream binary_name;
+	binary_name << "randomx_init_gcn" << gcn_version << ".bin";
+
+	if (!ctx.Compile(binary_name.str().c_str(), { RANDOMX_INIT_CL }, { CL_RANDOMX_INIT }, options.str(), ALWAYS_COMPILE))
+	{
+		return false;
+	}
+
+	// randomx_init works on pairs of hashes
+	const uint32_t batch_size = std::min(num_hashes + (num_hashes & 1), GCN_EMULATOR_BATCH);
+
+	ALLOCATE_DEVICE_MEMORY(entropy_gpu, ctx, batch_size * ENTROPY_SIZE);
+	ALLOCATE_DEVICE_MEMORY(registers_gpu, ctx, batch_size * REGISTERS_SIZE);
+	ALLOCATE_DEVICE_MEMORY(intermediate_programs_gpu, ctx, batch_size * INTERMEDIATE_PROGRAM_SIZE);
+	ALLOCATE_DEVICE_MEMORY(compiled_programs_gpu, ctx, COMPILED_PROGRAM_ARENA_SIZE(batch_size));
+	ALLOCATE_DEVICE_MEMORY(jit_stats_gpu, ctx, JIT_STATS_COUNT * sizeof(uint32_t));
+
+	cl_kernel kernel = ctx.kernels[CL_RANDOMX_INIT];
+	if (!clSetKernelArgs(kernel, entropy_gpu, registers_gpu, intermediate_programs_gpu, compiled_programs_gpu, jit_stats_gpu, batch_size, 0U))
+	{
+		return false;
+	}
+
+	cl_int err;
+	const size_t global_work_size = batch_size * 32;
+	const size_t local_work_size = 64;
+
+	std::vector<uint8_t> entropy(batch_size * ENTROPY_SIZE);
+	std::vector<uint8_t> registers(batch_size * REGISTERS_SIZE);
+	std::vector<uint8_t> compiled_programs(COMPILED_PROGRAM_ARENA_SIZE(batch_size));
+	std::vector<uint32_t> jit_stats(JIT_STATS_COUNT);
+	const uint32_t zero = 0;
+
+	uint64_t executed = 0;
+	uint64_t iterations = 0;
+
+	for (uint32_t first = 0; first < num_hashes; first += batch_size)
+	{
+		const uint32_t n = std::min(batch_size, num_hashes - first);
+
+		std::vector<std::unique_ptr<EmulatedHash>> hashes(n);
+		for (uint32_t i = 0; i < n; ++i)
+			hashes[i].reset(new EmulatedHash(gcn_version));
+
+		parallel_for(n, [&](uint32_t i)
+		{
+			EmulatedHash& h = *hashes[i];
+
+			std::vector<uint8_t> blob = job.blob;
+			job.SetNonce(blob.data(), static_cast<uint64_t>(start_nonce) + first + i);
+
+			blake2b(h.gpu_temp_hash, sizeof(h.gpu_temp_hash), blob.data(), blob.size(), nullptr, 0);
+			memcpy(h.vm_temp_hash, h.gpu_temp_hash, sizeof(h.vm_temp_hash));
+			fillAes1Rx4<false>(h.gpu_temp_hash, RANDOMX_SCRATCHPAD_L3, h.scratchpad.data());
+
+			h.vm.reset(randomx_create_vm(RANDOMX_FLAG_HARD_AES, cache, nullptr));
+			h.vm->initScratchpad(h.vm_temp_hash);
+			h.vm->resetRoundingMode();
+			fegetenv(&h.vm_fenv);
+		});
+
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			if (!hashes[i]->vm)
+			{
+				std::cerr << "Failed to create RandomX VM" << std::endl;
+				return false;
+			}
+		}
+
+		for (uint32_t program = 0; program < RANDOMX_PROGRAM_COUNT; ++program)
+		{
+			for (uint32_t i = 0; i < n; ++i)
+				fillAes4Rx4<false>(hashes[i]->gpu_temp_hash, ENTROPY_SIZE, entropy.data() + i * ENTROPY_SIZE);
+
+			CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, entropy_gpu, CL_FALSE, 0, entropy.size(), entropy.data(), 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueFillBuffer, ctx.queue, jit_stats_gpu, &zero, sizeof(zero), 0, jit_stats.size() * sizeof(uint32_t), 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clSetKernelArg, kernel, 6, sizeof(uint32_t), &program);
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, registers_gpu, CL_FALSE, 0, registers.size(), registers.data(), 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, jit_stats_gpu, CL_FALSE, 0, jit_stats.size() * sizeof(uint32_t), jit_stats.data(), 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, compiled_programs_gpu, CL_TRUE, 0, compiled_programs.size(), compiled_programs.data(), 0, nullptr, nullptr);
+
+			if (jit_stats[JIT_STATS_DROPPED])
+			{
+				std::cerr << "GCN_VERSION " << gcn_version << ": " << jit_stats[JIT_STATS_DROPPED] << " programs didn't fit into compiled program slots" << std::endl;
+				return false;
+			}
+
+			parallel_for(n, [&](uint32_t i)
+			{
+				EmulatedHash& h = *hashes[i];
+				if (!h.error.empty())
+					return;
+
+				memcpy(h.registers.data(), registers.data() + i * REGISTERS_SIZE, REGISTERS_SIZE);
+
+				std::stringstream s;
+				s << "nonce " << (static_cast<uint64_t>(start_nonce) + first + i) << ", program " << program << ": ";
+
+				if (!copy_program(compiled_programs, h.registers.data(), batch_size, h.program))
+				{
+					h.error = s.str() + "invalid compiled program offset";
+					h.program.assign(PROGRAM_DWORDS, 0);
+					return;
+				}
+
+				const uint32_t* code = h.program.data();
+
+				const bool ok = h.emulator.Run(code, h.registers.data(), h.scratchpad.data(), h.rounding_mode, [cache](uint64_t item, uint8_t* out)
+				{
+					randomx::initDatasetItem(cache, out, item);
+				});
+
+				fesetenv(&h.vm_fenv);
+				h.vm->run(h.vm_temp_hash);
+				fegetenv(&h.vm_fenv);
+
+				if (!ok)
+				{
+					h.error = s.str() + h.emulator.Error();
+					return;
+				}
+
+				const uint64_t* gpu_registers = reinterpret_cast<const uint64_t*>(h.registers.data());
+				const uint64_t* vm_registers = reinterpret_cast<const uint64_t*>(h.vm->getRegisterFile());
+				for (uint32_t k = 0; k < REGISTERS_SIZE / sizeof(uint64_t); ++k)
+				{
+					if (gpu_registers[k] != vm_registers[k])
+					{
+						s << register_name(k) << " is 0x" << std::hex << std::setw(16) << std::setfill('0') << gpu_registers[k];
+						s << " instead of 0x" << std::setw(16) << vm_registers[k];
+						h.error = s.str();
+						return;
+					}
+				}
+
+				const uint8_t* vm_scratchpad = reinterpret_cast<const uint8_t*>(h.vm->getScratchpad());
+				const auto mismatch = std::mismatch(h.scratchpad.begin(), h.scratchpad.end(), vm_scratchpad);
+				if (mismatch.first != h.scratchpad.end())
+				{
+					s << "scratchpad differs at offset " << (mismatch.first - h.scratchpad.begin());
+					h.error = s.str();
+					return;
+				}
+
+				if (program + 1 < RANDOMX_PROGRAM_COUNT)
+				{
+					blake2b(h.gpu_temp_hash, sizeof(h.gpu_temp_hash), h.registers.data(), REGISTERS_SIZE, nullptr, 0);
+					blake2b(h.vm_temp_hash, sizeof(h.vm_temp_hash), h.vm->getRegisterFile(), REGISTERS_SIZE, nullptr, 0);
+				}
+			});
+
+			for (uint32_t i = 0; i < n; ++i)
+			{
+				if (!hashes[i]->error.empty())
+				{
+					std::cerr << "GCN_VERSION " << gcn_version << ": " << hashes[i]->error << std::endl;
+
+					std::ofstream f("gcn_emulator_program.bin", std::ios::binary);
+					f.write(reinterpret_cast<const char*>(hashes[i]->program.data()), COMPILED_PROGRAM_SIZE);
+					std::cerr << "Compiled program saved to gcn_emulator_program.bin" << std::endl;
+					return false;
+				}
+			}
+		}
+
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			EmulatedHash& h = *hashes[i];
+
+			uint8_t gpu_hash[32];
+			hashAes1Rx4<false>(h.scratchpad.data(), RANDOMX_SCRATCHPAD_L3, h.registers.data() + REGISTERS_SIZE - 64);
+			blake2b(gpu_hash, sizeof(gpu_hash), h.registers.data(), REGISTERS_SIZE, nullptr, 0);
+
+			uint8_t vm_hash[32];
+			h.vm->getFinalResult(vm_hash, sizeof(vm_hash));
+
+			if (memcmp(gpu_hash, vm_hash, sizeof(gpu_hash)) != 0)
+			{
+				std::cerr << "GCN_VERSION " << gcn_version << ": final hash of nonce " << (static_cast<uint64_t>(start_nonce) + first + i) << " doesn't match" << std::endl;
+				return false;
+			}
+
+			executed += h.emulator.Executed();
+		}
+
+		iterations += static_cast<uint64_t>(n) * RANDOMX_PROGRAM_COUNT * RANDOMX_PROGRAM_ITERATIONS;
+	}
+
+	std::cout << "GCN_VERSION " << gcn_version << ": " << num_hashes << " hashes matched, " << std::fixed << std::setprecision(1) << (static_cast<double>(executed) / iterations) << " GCN instructions per program iteration" << std::endl;
+	return true;
+}
+
+bool gcn_emulator_test(uint32_t platform_id, uint32_t device_id, cl_device_type device_type, int gcn_version, uint32_t num_hashes, uint32_t start_nonce, const Job& job)
+{
+	if (gcn_version && (gcn_version != 12) && (gcn_version != 14) && (gcn_version != 15))
+	{
+		std::cerr << "Invalid GCN version " << gcn_version << ", it must be 12, 14 or 15" << std::endl;
+		return false;
+	}
+
+	if (!num_hashes)
+	{
+		std::cerr << "Number of hashes must be greater than 0" << std::endl;
+		return false;
+	}
+
+	for (int version : { 12, 14, 15 })
+	{
+		if ((!gcn_version || (gcn_version == version)) && !gcn_emulator_self_test(version))
+			return false;
+	}
+
+	std::cout << "Initializing device #" << device_id << " on OpenCL platform #" << platform_id << std::endl << std::endl;
+
+	OpenCLContext ctx;
+	if (!ctx.Init(platform_id, device_id, device_type))
+	{
+		return false;
+	}
+
+	std::unique_ptr<randomx_cache, void(*)(randomx_cache*)> cache(randomx_alloc_cache(RANDOMX_FLAG_DEFAULT), randomx_release_cache);
+	if (!cache)
+	{
+		std::cerr << "Failed to allocate RandomX cache" << std::endl;
+		return false;
+	}
+	randomx_init_cache(cache.get(), job.seed.data(), job.seed.size());
+
+	for (int version : { 12, 14, 15 })
+	{
+		if ((!gcn_version || (gcn_version == version)) && !gcn_emulator_test_version(ctx, cache.get(), version, num_hashes, start_nonce, job))
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+#include "job.h"
+
+// Computes dataset item "item" (64 bytes) into "out"
+typedef std::function<void(uint64_t item, uint8_t* out)> DatasetItemReader;
+
+// Runs code generated by randomx_init (CL/randomx_init.cl) on the CPU the way randomx_run (GCNASM/randomx_run_*.asm) runs it,
+// so JIT changes can be checked on any OpenCL device. Only the instructions the JIT emits are supported. randomx_run's main loop
+// and its IMULH_R, ISMULH_R, FDIV_M and FSQRT_R subroutines are emulated by what they compute, not instruction by instruction.
+// It also catches what the GPU wouldn't report: reads of registers that aren't set or are still loading (a missing s_waitcnt),
+// writes to registers randomx_run keeps its state in and memory accesses outside of the scratchpad.
+class GcnEmulator
+{
+public:
+	// "gcn_version" is the GCN_VERSION randomx_init was built with: 12 (gfx803), 14 (gfx900) or 15 (gfx1010)
+	explicit GcnEmulator(int gcn_version);
+
+	// One randomx_run launch for one hash: RANDOMX_PROGRAM_ITERATIONS iterations of "program" (COMPILED_PROGRAM_SIZE bytes,
+	// its slot of compiled_programs padded with zeroes). "registers" (REGISTERS_SIZE bytes from randomx_init) and "rounding_mode" are updated like
+	// randomx_run updates them. Returns false if the code fails a check, Error() says where.
+	bool Run(const uint32_t* program, uint8_t* registers, uint8_t* scratchpad, uint32_t& rounding_mode, const DatasetItemReader& dataset_item);
+
+	const std::string& Error() const { return error; }
+
+	// GCN instructions executed by all Run() calls
+	uint64_t Executed() const { return executed; }
+
+private:
+	enum { NUM_SGPRS = 108, NUM_VGPRS = 128, NUM_LANES = 2 };
+
+	// Decoded instruction. Source operands are 9-bit operand codes (256 and up are VGPRs), "op" is 0 until it's decoded.
+	struct Instruction
+	{
+		uint32_t op;
+		uint32_t size;
+		uint32_t dst;
+		uint32_t sdst;
+		uint32_t src[3];
+		uint32_t literal;
+		int32_t imm;
+		uint32_t neg;
+		uint32_t abs;
+		uint32_t saddr;
+	};
+
+	// Load or ds_swizzle result that isn't written yet, and stores while they're counted by vmcnt
+	struct PendingWrite
+	{
+		uint32_t vgpr;
+		uint32_t count;
+		uint32_t data[NUM_LANES][2];
+		uint64_t address[NUM_LANES];
+	};
+
+	bool Call(uint64_t (&r)[8], uint64_t (&f)[8], uint64_t (&e)[8], const uint64_t (&a)[8], const uint64_t (&e_mask)[2]);
+	bool Execute();
+	bool Decode(uint32_t pc, Instruction& inst);
+	void CallSubroutine(uint32_t index);
+
+	uint32_t ReadScalar(uint32_t code, const Instruction& inst);
+	uint64_t ReadScalar64(uint32_t code, const Instruction& inst);
+	void WriteScalar(uint32_t index, uint32_t value);
+	void WriteScalar64(uint32_t index, uint64_t value);
+	bool ReadSCC();
+
+	uint32_t ReadVector(uint32_t code, uint32_t lane, const Instruction& inst);
+	uint64_t ReadDouble(uint32_t code, uint32_t lane, const Instruction& inst);
+	void WriteVector(uint32_t index, uint32_t lane, uint32_t value);
+	void Clobber(uint32_t vgpr);
+
+	// FLAT/global address of "lane", Memory() returns nullptr if it's outside of the scratchpad
+	uint64_t Address(const Instruction& inst, uint32_t lane);
+	uint8_t* Memory(uint64_t address, uint32_t size);
+
+	void Issue(std::deque<PendingWrite>& queue, const PendingWrite& w);
+	void WaitCount(uint32_t simm16);
+	void Retire(std::deque<PendingWrite>& queue);
+
+	bool Fail(const std::string& message);
+	std::string Name(uint32_t code) const;
+
+	const int gcn_version;
+	const uint32_t version_index;
+
+	const uint32_t* program;
+	uint8_t* scratchpad;
+	std::vector<Instruction> decoded;
+	uint32_t pc;
+
+	uint32_t sgpr[NUM_SGPRS];
+	bool sgpr_set[NUM_SGPRS];
+	bool sgpr_writable[NUM_SGPRS];
+	bool scc;
+	bool scc_set;
+
+	enum VgprState { VGPR_UNDEFINED, VGPR_SET, VGPR_LOADING };
+	uint32_t vgpr[NUM_VGPRS][NUM_LANES];
+	VgprState vgpr_state[NUM_VGPRS];
+	bool vgpr_writable[NUM_VGPRS];
+
+	// Round mode field of the MODE register and s66, randomx_run keeps the rounding mode it stores at the end in s66
+	uint32_t mode;
+	uint32_t s66;
+
+	std::deque<PendingWrite> vm_queue;
+	std::deque<PendingWrite> lgkm_queue;
+
+	std::string error;
+	uint64_t executed;
+};
+
+// Runs a recorded GCN program for "gcn_version" in GcnEmulator and compares registers and the scratchpad with known-good results,
+// no OpenCL device needed
+bool gcn_emulator_self_test(int gcn_version);
+
+// --gcn_emulator: hashes "num_hashes" nonces of "job" from "start_nonce" with code compiled by randomx_init for "gcn_version"
+// (0 = 12, 14 and 15) on any OpenCL device of "device_type", runs it in GcnEmulator and compares registers and scratchpads
+// with the RandomX VM after every program
+bool gcn_emulator_test(uint32_t platform_id, uint32_t device_id, cl_device_type device_type, int gcn_version, uint32_t num_hashes, uint32_t start_nonce, const Job& job);
@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sstream>
+#include "jit_stats.h"
+#include "definitions.h"
+
+#include "../RandomX/src/configuration.h"
+
+static_assert(RANDOMX_PROGRAM_COUNT <= JIT_STATS_PROGRAMS, "Not enough fallback slot counters");
+
+JitStats::JitStats()
+	: totals(JIT_STATS_COUNT, 0)
+	, programs(0)
+{
+}
+
+void JitStats::Add(const std::vector<uint32_t>& stats, size_t num_hashes)
+{
+	for (size_t i = 0; i < JIT_STATS_COUNT; ++i)
+		totals[i] += stats[i];
+	programs += num_hashes * RANDOMX_PROGRAM_COUNT;
+}
+
+std::string JitStats::Report() const
+{
+	if (!programs)
+		return "JIT stats: no programs yet";
+
+	// Fallback slot counters also count programs that didn't get one
+	uint64_t fallbacks = 0;
+	for (size_t i = 0; i < JIT_STATS_PROGRAMS; ++i)
+		fallbacks += totals[JIT_STATS_FALLBACK_SLOTS + i];
+
+	const uint64_t dropped = totals[JIT_STATS_DROPPED];
+	const uint64_t compiled = programs - dropped;
+
+	std::stringstream s;
+	s.precision(4);
+	s << "JIT stats over " << programs << " programs: ";
+	if (compiled)
+		s << (static_cast<double>(totals[JIT_STATS_CODE_SIZE]) / compiled) << " bytes of code on average, ";
+	s << (fallbacks * 100.0 / programs) << "% didn't fit into " << COMPILED_PROGRAM_SLOT_SIZE << " bytes, " << dropped << " dropped\n";
+
+	s << "  code size:";
+	for (size_t i = 0; i < JIT_STATS_BUCKETS; ++i)
+	{
+		if (totals[JIT_STATS_HISTOGRAM + i] && compiled)
+			s << " " << (i * JIT_STATS_BUCKET_SIZE) << "+: " << (totals[JIT_STATS_HISTOGRAM + i] * 100.0 / compiled) << "%";
+	}
+
+	return s.str();
+}
@@ -0,0 +1,41 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Totals of randomx_init's counters (JIT_STATS_COUNT in CL/randomx_constants_jit.h) over all batches of one device:
+// how big compiled programs are, how many needed a fallback slot and how many didn't fit at all
+class JitStats
+{
+public:
+	JitStats();
+
+	// Counters of one batch of "num_hashes" hashes
+	void Add(const std::vector<uint32_t>& stats, size_t num_hashes);
+
+	std::string Report() const;
+
+private:
+	std::vector<uint64_t> totals;
+	uint64_t programs;
+};
@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+// Hashing input: a blob of any length with the nonce stored at nonce_offset as a nonce_width-byte little-endian number.
+// "seed" is the RandomX key the dataset is built from, "next_seed" (if known) lets the miner prepare the next epoch's dataset in advance.
+struct Job
+{
+	Job()
+		: nonce_offset(39)
+		, nonce_width(4)
+		, id(0)
+	{}
+
+	bool IsValid() const
+	{
+		return (nonce_width >= 1) && (nonce_width <= 8) && (nonce_offset + nonce_width <= blob.size());
+	}
+
+	static bool ParseHex(const char* hex, std::vector<uint8_t>& out)
+	{
+		out.clear();
+		for (; hex[0] && hex[1]; hex += 2)
+		{
+			const int hi = HexDigit(hex[0]);
+			const int lo = HexDigit(hex[1]);
+			if ((hi < 0) || (lo < 0))
+				return false;
+
+			out.push_back(static_cast<uint8_t>((hi << 4) | lo));
+		}
+		return (hex[0] == '\0');
+	}
+
+	void SetNonce(uint8_t* buf, uint64_t nonce) const
+	{
+		for (uint32_t i = 0; i < nonce_width; ++i)
+			buf[nonce_offset + i] = static_cast<uint8_t>(nonce >> (i * 8));
+	}
+
+	std::vector<uint8_t> blob;
+	std::vector<uint8_t> seed;
+	std::vector<uint8_t> next_seed;
+	uint32_t nonce_offset;
+	uint32_t nonce_width;
+	uint32_t id;
+
+private:
+	static int HexDigit(char c)
+	{
+		if ((c >= '0') && (c <= '9')) return c - '0';
+		if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+		if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+		return -1;
+	}
+};
+
+// Current job. It can be replaced from any thread, the miner picks up the new job before enqueueing its next batch.
+// Blobs are uploaded as kernel data, so switching jobs never recompiles anything.
+class JobSource
+{
+public:
+	explicit JobSource(const Job& job) : m_job(job) { m_job.id = 1; }
+
+	void Set(const Job& job)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		const uint32_t id = m_job.id + 1;
+		m_job = job;
+		m_job.id = id;
+	}
+
+	// Returns true and updates "job" if it's not the current job anymore
+	bool Get(Job& job)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (job.id == m_job.id)
+			return false;
+
+		job = m_job;
+		return true;
+	}
+
+private:
+	std::mutex m_lock;
+	Job m_job;
+};
@@ -0,0 +1,117 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include "kernel_slicer.h"
+
+// Weight of the newest batch in the moving averages
+static constexpr double SLICER_SMOOTHING = 0.25;
+
+// Iterations per launch are changed only if the new value differs by more than this, so they don't jitter from batch to batch
+static constexpr double SLICER_HYSTERESIS = 0.05;
+
+KernelSlicer::KernelSlicer(double target_ms, uint32_t max_iterations, uint32_t initial_iterations, bool adaptive)
+	: target_ns(target_ms * 1e6)
+	, max_iterations(max_iterations)
+	, adaptive(adaptive)
+	, iterations(std::max(std::min(initial_iterations, max_iterations), 1U))
+	, ns_per_iteration(0.0)
+	, launch_ns(0.0)
+	, overhead_ns(0.0)
+	, max_launch_ns(0.0)
+{
+}
+
+void KernelSlicer::Update(std::vector<cl_event>& events, std::vector<uint32_t>& launch_iterations)
+{
+	double busy_ns = 0.0;
+	double gap_ns = 0.0;
+	uint64_t total_iterations = 0;
+	uint32_t num_launches = 0;
+	uint32_t num_gaps = 0;
+	double longest_ns = 0.0;
+	cl_ulong prev_end = 0;
+
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		cl_ulong start, end;
+		if ((clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) == CL_SUCCESS) &&
+			(clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) == CL_SUCCESS) && (end >= start))
+		{
+			busy_ns += static_cast<double>(end - start);
+			longest_ns = std::max(longest_ns, static_cast<double>(end - start));
+			total_iterations += launch_iterations[i];
+			++num_launches;
+
+			// Launches of one program run back to back in the same queue, the idle time between them is what every extra launch costs
+			if (prev_end && (start >= prev_end))
+			{
+				gap_ns += static_cast<double>(start - prev_end);
+				++num_gaps;
+			}
+			prev_end = end;
+		}
+		else
+		{
+			prev_end = 0;
+		}
+
+		if (events[i])
+			clReleaseEvent(events[i]);
+	}
+
+	events.clear();
+	launch_iterations.clear();
+
+	if (!num_launches || !total_iterations)
+		return;
+
+	auto smooth = [](double& value, double sample)
+	{
+		value = (value > 0.0) ? (value + (sample - value) * SLICER_SMOOTHING) : sample;
+	};
+
+	smooth(ns_per_iteration, busy_ns / total_iterations);
+	smooth(launch_ns, busy_ns / num_launches);
+	if (num_gaps)
+		smooth(overhead_ns, gap_ns / num_gaps);
+	max_launch_ns = longest_ns;
+
+	if (!adaptive)
+		return;
+
+	const double wanted = std::max(std::min(target_ns / ns_per_iteration, static_cast<double>(max_iterations)), 1.0);
+	if (std::abs(wanted - iterations) > iterations * SLICER_HYSTERESIS)
+		iterations = static_cast<uint32_t>(wanted);
+}
+
+std::string KernelSlicer::Stats() const
+{
+	std::stringstream s;
+	s.precision(3);
+	if (adaptive)
+		s << iterations << " iterations per launch (" << ((max_iterations + iterations - 1) / iterations) << " launches), ";
+	s << (launch_ns / 1e6) << " ms per launch (longest " << (max_launch_ns / 1e6) << " ms";
+	if (target_ns > 0.0)
+		s << ", target " << (target_ns / 1e6) << " ms";
+	s << "), launch overhead " << (overhead_ns / 1e3) << " us";
+	return s.str();
+}
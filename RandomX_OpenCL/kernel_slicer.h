@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+// Time-based replacement for bfactor: execute_vm launches are timed with profiling events, and the number of
+// program iterations per launch is adjusted after every batch so launches take "target_ms" (to keep the desktop responsive
+// or stay below a driver watchdog) without splitting the main loop more than needed.
+// GCN assembly code can't be split, its launches are only measured and reported.
+class KernelSlicer
+{
+public:
+	KernelSlicer(double target_ms, uint32_t max_iterations, uint32_t initial_iterations, bool adaptive);
+
+	uint32_t Iterations() const { return iterations; }
+	bool Adaptive() const { return adaptive; }
+
+	// Profiling events of consecutive launches of one program and how many iterations each of them ran. Events are released.
+	void Update(std::vector<cl_event>& events, std::vector<uint32_t>& launch_iterations);
+
+	// Current state for the log: iterations per launch, launch duration and launch overhead
+	std::string Stats() const;
+
+private:
+	const double target_ns;
+	const uint32_t max_iterations;
+	const bool adaptive;
+
+	uint32_t iterations;
+
+	// Exponential moving averages, 0 until the first measurement
+	double ns_per_iteration;
+	double launch_ns;
+	double overhead_ns;
+	double max_launch_ns;
+};
@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <sstream>
+#include "memory_plan.h"
+#include "definitions.h"
+
+// Automatic reserve: 1/32 of device memory, but at least this much
+static constexpr size_t MIN_MEMORY_RESERVE = 128 << 20;
+
+// Device memory of one hash in all batch buffers
+static size_t batch_hash_memory(bool portable)
+{
+	return RANDOMX_SCRATCHPAD_L3 + 64 + INITIAL_HASH_SIZE + ENTROPY_SIZE + sizeof(uint32_t) +
+		(portable ? VM_STATE_SIZE : (REGISTERS_SIZE + INTERMEDIATE_PROGRAM_SIZE + COMPILED_PROGRAM_SLOT_SIZE + COMPILED_PROGRAM_SIZE / 64));
+}
+
+// Shards are multiples of 64 hashes, so AES and GCN work groups don't depend on them. GCN code gets one launch per shard
+// with sub-buffers of the other batch buffers, so shards must also start at a sub-buffer boundary of rounding modes,
+// the buffer with the least memory per hash.
+static size_t shard_alignment(const OpenCLContext& ctx)
+{
+	return std::max<size_t>(64, ctx.device_mem_base_addr_align / sizeof(uint32_t));
+}
+
+static size_t max_shard_size(const OpenCLContext& ctx)
+{
+	const size_t n = ctx.device_max_alloc_size / (RANDOMX_SCRATCHPAD_L3 + 64);
+	return n - n % shard_alignment(ctx);
+}
+
+size_t scratchpad_shard_size(const OpenCLContext& ctx, size_t batch_size)
+{
+	const size_t max_size = max_shard_size(ctx);
+	if (batch_size <= max_size)
+		return batch_size;
+
+	if (!max_size)
+		return 0;
+
+	const size_t num_shards = (batch_size + max_size - 1) / max_size;
+	if (num_shards > MAX_SCRATCHPAD_SHARDS)
+		return 0;
+
+	// Shards of about the same size, rounding up keeps them below the maximum because it's aligned too
+	const size_t align = shard_alignment(ctx);
+	const size_t n = (batch_size + num_shards - 1) / num_shards;
+	return ((n + align - 1) / align) * align;
+}
+
+MemoryPlan::MemoryPlan(const OpenCLContext& ctx, bool portable, size_t dataset_size, size_t init_memory, uint32_t num_slots, size_t intensity_step, size_t reserve)
+	: global_mem_size(ctx.device_global_mem_size)
+	, reserve(reserve ? reserve : std::max<size_t>(ctx.device_global_mem_size / 32, MIN_MEMORY_RESERVE))
+	, dataset_size(dataset_size)
+	, init_memory(init_memory)
+	, num_slots(num_slots)
+	, hash_memory(batch_hash_memory(portable))
+	, max_intensity(0)
+	, intensity(0)
+	, num_datasets(1)
+	, scratchpad_shards(0)
+	, ctx(ctx)
+{
+	const size_t fixed = this->reserve + dataset_size + init_memory;
+
+	size_t n = (global_mem_size > fixed) ? ((global_mem_size - fixed) / hash_memory) : 0;
+	n = std::min(n, max_shard_size(ctx) * MAX_SCRATCHPAD_SHARDS * num_slots);
+
+	max_intensity = n - n % intensity_step;
+}
+
+bool MemoryPlan::Fit(size_t new_intensity)
+{
+	intensity = new_intensity;
+	num_datasets = 1;
+	scratchpad_shards = 0;
+
+	const size_t batch_size = intensity / num_slots;
+	const size_t shard_size = scratchpad_shard_size(ctx, batch_size);
+	if (!shard_size)
+		return false;
+
+	scratchpad_shards = static_cast<uint32_t>((batch_size + shard_size - 1) / shard_size);
+
+	if (Used() + reserve > global_mem_size)
+		return false;
+
+	// Memory goes to scratchpads first. Without a second dataset mining only pauses for a rebuild when the seed changes.
+	if (!dataset_size || (Used() + dataset_size + reserve <= global_mem_size))
+		num_datasets = 2;
+
+	return true;
+}
+
+size_t MemoryPlan::Used() const
+{
+	return dataset_size * num_datasets + init_memory + intensity * hash_memory;
+}
+
+std::string MemoryPlan::ToString() const
+{
+	const size_t used = Used() + reserve;
+
+	std::stringstream s;
+	s.precision(4);
+	s << "Memory plan: ";
+	if (dataset_size)
+		s << num_datasets << " x " << (dataset_size >> 20) << " MB dataset, ";
+	if (init_memory)
+		s << (init_memory >> 20) << " MB for dataset initialization, ";
+	s << intensity << " x " << (hash_memory / 1048576.0) << " MB batch buffers";
+	if (scratchpad_shards > 1)
+		s << " (scratchpads in " << scratchpad_shards << " buffers per batch)";
+	s << ", " << (reserve >> 20) << " MB reserve, ";
+	if (used <= global_mem_size)
+		s << ((global_mem_size - used) >> 20) << " MB free";
+	else
+		s << ((used - global_mem_size) >> 20) << " MB over";
+	s << " of " << (global_mem_size >> 20) << " MB";
+
+	return s.str();
+}
@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include "opencl_helpers.h"
+
+// Device memory of one device, budgeted before anything is allocated. The dataset, memory that's only needed while
+// a dataset is built on GPU and a reserve for the driver come first, batch buffers of every hash get what's left.
+// Scratchpads aren't limited by the largest allocation: a batch can spread them over MAX_SCRATCHPAD_SHARDS buffers.
+struct MemoryPlan
+{
+	// "dataset_size" is 0 if the dataset is in host memory, "reserve" is in bytes (0 = automatic).
+	// Intensity is a multiple of "intensity_step", split evenly between "num_slots" batches.
+	MemoryPlan(const OpenCLContext& ctx, bool portable, size_t dataset_size, size_t init_memory, uint32_t num_slots, size_t intensity_step, size_t reserve);
+
+	// Plans "intensity" scratchpads and a second dataset if there's room for it. Returns false if they don't fit.
+	bool Fit(size_t intensity);
+
+	// Device memory the plan uses
+	size_t Used() const;
+
+	std::string ToString() const;
+
+	const size_t global_mem_size;
+	const size_t reserve;
+	const size_t dataset_size;
+	const size_t init_memory;
+	const uint32_t num_slots;
+
+	// Device memory of one hash in all batch buffers
+	const size_t hash_memory;
+
+	// Most scratchpads that fit next to one dataset
+	size_t max_intensity;
+
+	// Set by Fit()
+	size_t intensity;
+	uint32_t num_datasets;
+	uint32_t scratchpad_shards;
+
+private:
+	const OpenCLContext& ctx;
+};
+
+// Scratchpads per buffer for a batch of "batch_size" hashes: "batch_size" if they fit into one buffer,
+// 0 if they don't fit into MAX_SCRATCHPAD_SHARDS buffers
+size_t scratchpad_shard_size(const OpenCLContext& ctx, size_t batch_size);
@@ -0,0 +1,642 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "metrics.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+#define close_socket closesocket
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define close_socket close
+#endif
+
+// A scraper that disconnects early mustn't kill the miner with SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+using namespace std::chrono;
+
+// Time constant of the hashrate moving average, in seconds
+static constexpr double METRICS_EMA_SECONDS = 30.0;
+
+// Hashrate windows, the longest one also limits how much history is kept
+static constexpr double METRICS_SHORT_WINDOW = 10.0;
+static constexpr double METRICS_LONG_WINDOW = 60.0;
+
+// Percentiles are computed over this many latest batches
+static constexpr size_t METRICS_LATENCY_SAMPLES = 1024;
+
+// Requests are small, anything longer is cut off
+static constexpr size_t METRICS_MAX_REQUEST = 4096;
+
+// How often the server thread checks if it should stop
+static constexpr int METRICS_POLL_MS = 100;
+
+Metrics* Metrics::instance = nullptr;
+
+// Device names go into label values and JSON strings
+static std::string escape(const std::string& s)
+{
+	std::string result;
+	for (char c : s)
+	{
+		if ((c == '"') || (c == '\\'))
+			result += '\\';
+		if (c >= ' ')
+			result += c;
+	}
+	return result;
+}
+
+Metrics::DeviceMetrics::DeviceMetrics()
+	: global_mem_size(0)
+	, memory_used(0)
+	, hashes(0)
+	, shares(0)
+	, batches(0)
+	, hashrate_ema(0.0)
+	, last_batch_time(-1.0)
+	, latency_pos(0)
+	, latency_sum(0.0)
+	, validated(0)
+	, failed(0)
+	, skipped_hashes(0)
+	, cpu_limited_batches(0)
+	, dataset_builds(0)
+	, dataset_build_time(0.0)
+	, dataset_upload_time(0.0)
+	, dataset_build_time_total(0.0)
+	, dataset_upload_time_total(0.0)
+{
+}
+
+Metrics::Metrics(uint32_t num_devices)
+	: start(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count())
+	, devices(num_devices)
+	, listen_socket(static_cast<intptr_t>(INVALID_SOCKET))
+	, snapshot_interval_ms(0)
+	, stop(false)
+{
+#ifdef _WIN32
+	WSADATA wsa;
+	WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+
+	instance = this;
+}
+
+Metrics::~Metrics()
+{
+	instance = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(stop_mutex);
+		stop = true;
+	}
+	stop_cv.notify_all();
+
+	for (SThread& t : threads)
+		t.join();
+
+	if (listen_socket != static_cast<intptr_t>(INVALID_SOCKET))
+		close_socket(static_cast<socket_t>(listen_socket));
+
+#ifndef _WIN32
+	if (!unix_path.empty())
+		unlink(unix_path.c_str());
+#endif
+
+	// Final values, so the last snapshot shows how mining ended
+	if (!snapshot_path.empty())
+		WriteSnapshot();
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+double Metrics::Now() const
+{
+	return (duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count() - start) / 1e9;
+}
+
+bool Metrics::Listen(const std::string& address)
+{
+	socket_t s = INVALID_SOCKET;
+
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+#ifdef _WIN32
+		std::cerr << "Unix sockets are not supported on Windows, use --metrics PORT" << std::endl;
+		return false;
+#else
+		const std::string path = address.substr(5);
+
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || (path.length() >= sizeof(addr.sun_path)))
+		{
+			std::cerr << "Invalid unix socket path: " << path << std::endl;
+			return false;
+		}
+		strcpy(addr.sun_path, path.c_str());
+
+		// A socket file left by a previous run would make bind() fail, anything else at that path is left alone
+		struct stat st;
+		if (lstat(path.c_str(), &st) == 0)
+		{
+			if (!S_ISSOCK(st.st_mode))
+			{
+				std::cerr << "Couldn't listen on " << address << ": path exists and is not a socket" << std::endl;
+				return false;
+			}
+			unlink(path.c_str());
+		}
+
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if ((s == INVALID_SOCKET) || (bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) || (listen(s, 16) != 0))
+		{
+			std::cerr << "Couldn't listen on " << address << ": " << strerror(errno) << std::endl;
+			if (s != INVALID_SOCKET)
+				close_socket(s);
+			return false;
+		}
+
+		unix_path = path;
+#endif
+	}
+	else
+	{
+		// Just a port number means localhost, metrics are only exposed to other hosts when asked for
+		std::string host = "127.0.0.1";
+		std::string port = address;
+
+		const size_t colon = address.rfind(':');
+		if (colon != std::string::npos)
+		{
+			host = address.substr(0, colon);
+			port = address.substr(colon + 1);
+
+			// [::1]:PORT
+			if ((host.length() >= 2) && (host.front() == '[') && (host.back() == ']'))
+				host = host.substr(1, host.length() - 2);
+		}
+
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+
+		addrinfo* result = nullptr;
+		if ((getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0) || !result)
+		{
+			std::cerr << "Invalid metrics address: " << address << std::endl;
+			return false;
+		}
+
+		for (addrinfo* a = result; a && (s == INVALID_SOCKET); a = a->ai_next)
+		{
+			s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (s == INVALID_SOCKET)
+				continue;
+
+			// Restarting the miner shouldn't have to wait for old connections to time out
+			const int reuse = 1;
+			setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+			if ((bind(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) != 0) || (listen(s, 16) != 0))
+			{
+				close_socket(s);
+				s = INVALID_SOCKET;
+			}
+		}
+		freeaddrinfo(result);
+
+		if (s == INVALID_SOCKET)
+		{
+			std::cerr << "Couldn't listen on " << address << std::endl;
+			return false;
+		}
+	}
+
+	listen_socket = static_cast<intptr_t>(s);
+	threads.emplace_back([this]() { Server(); });
+
+	std::cout << "Serving metrics on " << address << std::endl;
+	return true;
+}
+
+void Metrics::StartSnapshots(const std::string& path, uint32_t interval_ms)
+{
+	snapshot_path = path;
+	snapshot_interval_ms = std::max(interval_ms, 1U);
+	threads.emplace_back([this]() { Snapshots(); });
+}
+
+void Metrics::DeviceInfo(uint32_t device, const std::string& name, uint64_t global_mem_size)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	devices[device].name = name;
+	devices[device].global_mem_size = global_mem_size;
+}
+
+void Metrics::DeviceMemory(uint32_t device, uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	devices[device].memory_used = bytes;
+}
+
+void Metrics::BatchDone(uint32_t device, uint64_t hashes, uint32_t shares, double latency)
+{
+	const double now = Now();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	DeviceMetrics& d = devices[device];
+
+	// Batches don't finish at a fixed rate, so the average is weighted by time instead of by batch
+	if (d.last_batch_time >= 0.0)
+	{
+		const double dt = now - d.last_batch_time;
+		if (dt > 0.0)
+		{
+			const double w = 1.0 - std::exp(-dt / METRICS_EMA_SECONDS);
+			d.hashrate_ema = (d.hashrate_ema > 0.0) ? (d.hashrate_ema + (hashes / dt - d.hashrate_ema) * w) : (hashes / dt);
+		}
+	}
+	d.last_batch_time = now;
+
+	d.hashes += hashes;
+	d.shares += shares;
+	++d.batches;
+
+	// One sample older than the longest window is kept as its starting point
+	if (d.history.empty())
+		d.history.emplace_back(now - latency, 0);
+	d.history.emplace_back(now, d.hashes);
+	while ((d.history.size() > 2) && (d.history[1].first <= now - METRICS_LONG_WINDOW))
+		d.history.pop_front();
+
+	if (d.latencies.size() < METRICS_LATENCY_SAMPLES)
+	{
+		d.latencies.push_back(latency);
+	}
+	else
+	{
+		d.latencies[d.latency_pos] = latency;
+		d.latency_pos = (d.latency_pos + 1) % METRICS_LATENCY_SAMPLES;
+	}
+	d.latency_sum += latency;
+}
+
+void Metrics::Validation(uint32_t device, uint64_t validated, uint64_t failed, uint64_t skipped_hashes, uint64_t cpu_limited_batches)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	DeviceMetrics& d = devices[device];
+	d.validated = validated;
+	d.failed = failed;
+	d.skipped_hashes = skipped_hashes;
+	d.cpu_limited_batches = cpu_limited_batches;
+}
+
+void Metrics::DatasetBuilt(uint32_t device, double build_time, double upload_time)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	DeviceMetrics& d = devices[device];
+	++d.dataset_builds;
+	d.dataset_build_time = build_time;
+	d.dataset_upload_time = upload_time;
+	d.dataset_build_time_total += build_time;
+	d.dataset_upload_time_total += upload_time;
+}
+
+Metrics::DeviceSnapshot Metrics::Snapshot(const DeviceMetrics& d, double now) const
+{
+	DeviceSnapshot s = {};
+
+	// Hashes since the last sample before the window started, so a stalled device drops to 0 instead of keeping its last rate
+	auto windowed_hashrate = [&d, now](double window)
+	{
+		if (d.history.empty())
+			return 0.0;
+
+		auto base = d.history.front();
+		for (const auto& h : d.history)
+		{
+			if (h.first > now - window)
+				break;
+			base = h;
+		}
+
+		const double dt = now - base.first;
+		return (dt > 0.0) ? ((d.history.back().second - base.second) / dt) : 0.0;
+	};
+
+	s.hashrate_10s = windowed_hashrate(METRICS_SHORT_WINDOW);
+	s.hashrate_60s = windowed_hashrate(METRICS_LONG_WINDOW);
+
+	if (!d.latencies.empty())
+	{
+		std::vector<double> sorted = d.latencies;
+		std::sort(sorted.begin(), sorted.end());
+
+		auto percentile = [&sorted](double p) { return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * p))]; };
+		s.latency_p50 = percentile(0.5);
+		s.latency_p90 = percentile(0.9);
+		s.latency_p99 = percentile(0.99);
+	}
+
+	return s;
+}
+
+std::string Metrics::Prometheus()
+{
+	const double now = Now();
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::stringstream s;
+	s.precision(9);
+
+	auto header = [&s](const char* name, const char* type, const char* help)
+	{
+		s << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+	};
+
+	std::vector<DeviceSnapshot> snapshots;
+	for (const DeviceMetrics& d : devices)
+		snapshots.push_back(Snapshot(d, now));
+
+	// One metric with all devices at a time, as the format requires
+	auto per_device = [&](const char* name, const char* type, const char* help, double (*value)(const DeviceMetrics&, const DeviceSnapshot&))
+	{
+		header(name, type, help);
+		for (size_t i = 0; i < devices.size(); ++i)
+			s << name << "{device=\"" << i << "\"} " << value(devices[i], snapshots[i]) << '\n';
+	};
+
+	header("randomx_uptime_seconds", "gauge", "Time since the miner started");
+	s << "randomx_uptime_seconds " << now << '\n';
+
+	header("randomx_device_info", "gauge", "OpenCL device name of every device index");
+	for (size_t i = 0; i < devices.size(); ++i)
+		s << "randomx_device_info{device=\"" << i << "\",name=\"" << escape(devices[i].name) << "\"} 1\n";
+
+	per_device("randomx_hashes_total", "counter", "Hashes computed on the GPU",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.hashes); });
+	per_device("randomx_shares_total", "counter", "Hashes below the target found on the GPU",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.shares); });
+	per_device("randomx_batches_total", "counter", "Batches finished",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.batches); });
+
+	header("randomx_hashrate", "gauge", "Hashes per second: time-weighted moving average (30 s) and over the last 10 s and 60 s");
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		s << "randomx_hashrate{device=\"" << i << "\",window=\"ema\"} " << devices[i].hashrate_ema << '\n';
+		s << "randomx_hashrate{device=\"" << i << "\",window=\"10s\"} " << snapshots[i].hashrate_10s << '\n';
+		s << "randomx_hashrate{device=\"" << i << "\",window=\"60s\"} " << snapshots[i].hashrate_60s << '\n';
+	}
+
+	header("randomx_batch_latency_seconds", "summary", "Time from enqueue to readback of a batch, quantiles of the last 1024 batches");
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		s << "randomx_batch_latency_seconds{device=\"" << i << "\",quantile=\"0.5\"} " << snapshots[i].latency_p50 << '\n';
+		s << "randomx_batch_latency_seconds{device=\"" << i << "\",quantile=\"0.9\"} " << snapshots[i].latency_p90 << '\n';
+		s << "randomx_batch_latency_seconds{device=\"" << i << "\",quantile=\"0.99\"} " << snapshots[i].latency_p99 << '\n';
+		s << "randomx_batch_latency_seconds_sum{device=\"" << i << "\"} " << devices[i].latency_sum << '\n';
+		s << "randomx_batch_latency_seconds_count{device=\"" << i << "\"} " << devices[i].batches << '\n';
+	}
+
+	per_device("randomx_validated_hashes_total", "counter", "Hashes checked on the CPU",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.validated); });
+	per_device("randomx_validation_failures_total", "counter", "Hashes that didn't match the CPU result",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.failed); });
+	per_device("randomx_validation_skipped_hashes_total", "counter", "Hashes not validated because validation was behind",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.skipped_hashes); });
+	per_device("randomx_cpu_limited_batches_total", "counter", "Batches skipped by validation because the CPU didn't keep up",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.cpu_limited_batches); });
+
+	per_device("randomx_dataset_builds_total", "counter", "Datasets (or caches in light mode) built or loaded",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.dataset_builds); });
+	per_device("randomx_dataset_build_seconds", "gauge", "Build time of the latest dataset",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return d.dataset_build_time; });
+	per_device("randomx_dataset_upload_seconds", "gauge", "Upload time of the latest dataset",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return d.dataset_upload_time; });
+	per_device("randomx_dataset_build_seconds_total", "counter", "Build time of all datasets",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return d.dataset_build_time_total; });
+	per_device("randomx_dataset_upload_seconds_total", "counter", "Upload time of all datasets",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return d.dataset_upload_time_total; });
+
+	per_device("randomx_device_memory_used_bytes", "gauge", "Device memory allocated for datasets and batch buffers",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.memory_used); });
+	per_device("randomx_device_memory_total_bytes", "gauge", "Global memory size of the device",
+		[](const DeviceMetrics& d, const DeviceSnapshot&) { return static_cast<double>(d.global_mem_size); });
+
+	return s.str();
+}
+
+std::string Metrics::Json()
+{
+	const double now = Now();
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::stringstream s;
+	s.precision(9);
+
+	s << "{\"uptime\":" << now << ",\"timestamp\":" << duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() << ",\"devices\":[";
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		const DeviceMetrics& d = devices[i];
+		const DeviceSnapshot snapshot = Snapshot(d, now);
+
+		s << ((i == 0) ? "\n" : ",\n");
+		s << "{\"device\":" << i << ",\"name\":\"" << escape(d.name) << '"';
+		s << ",\"hashes\":" << d.hashes << ",\"shares\":" << d.shares << ",\"batches\":" << d.batches;
+		s << ",\"hashrate\":{\"ema\":" << d.hashrate_ema << ",\"10s\":" << snapshot.hashrate_10s << ",\"60s\":" << snapshot.hashrate_60s << '}';
+		s << ",\"batch_latency\":{\"p50\":" << snapshot.latency_p50 << ",\"p90\":" << snapshot.latency_p90 << ",\"p99\":" << snapshot.latency_p99 << '}';
+		s << ",\"validation\":{\"validated\":" << d.validated << ",\"failed\":" << d.failed << ",\"skipped_hashes\":" << d.skipped_hashes << ",\"cpu_limited_batches\":" << d.cpu_limited_batches << '}';
+		s << ",\"dataset\":{\"builds\":" << d.dataset_builds << ",\"build_time\":" << d.dataset_build_time << ",\"upload_time\":" << d.dataset_upload_time << '}';
+		s << ",\"memory\":{\"used\":" << d.memory_used << ",\"total\":" << d.global_mem_size << "}}";
+	}
+	s << "\n]}\n";
+
+	return s.str();
+}
+
+void Metrics::Server()
+{
+	const socket_t s = static_cast<socket_t>(listen_socket);
+
+	while (!stop)
+	{
+		// Short timeout, so the thread notices when mining is done
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(s, &fds);
+
+		timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = METRICS_POLL_MS * 1000;
+
+		if (select(static_cast<int>(s) + 1, &fds, nullptr, nullptr, &timeout) <= 0)
+			continue;
+
+		const socket_t client = accept(s, nullptr, nullptr);
+		if (client == INVALID_SOCKET)
+			continue;
+
+		// Scrapes are rare and answered right away, one connection at a time is enough
+		Serve(static_cast<intptr_t>(client));
+		close_socket(client);
+	}
+}
+
+void Metrics::Serve(intptr_t client)
+{
+	const socket_t c = static_cast<socket_t>(client);
+
+	// A client that connects and sends nothing mustn't block the server
+#ifdef _WIN32
+	const DWORD recv_timeout = 1000;
+#else
+	timeval recv_timeout;
+	recv_timeout.tv_sec = 1;
+	recv_timeout.tv_usec = 0;
+#endif
+	setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&recv_timeout), sizeof(recv_timeout));
+
+	std::string request;
+	char buf[1024];
+	while ((request.find("\r\n\r\n") == std::string::npos) && (request.length() < METRICS_MAX_REQUEST))
+	{
+		const int n = static_cast<int>(recv(c, buf, sizeof(buf), 0));
+		if (n <= 0)
+			break;
+		request.append(buf, n);
+	}
+
+	// "GET /path HTTP/1.1", query strings are ignored
+	std::string method, path;
+	std::istringstream(request.substr(0, request.find("\r\n"))) >> method >> path;
+	path = path.substr(0, path.find('?'));
+
+	const char* status = "200 OK";
+	const char* content_type = "text/plain; version=0.0.4; charset=utf-8";
+	std::string body;
+
+	if ((method != "GET") && (method != "HEAD"))
+	{
+		status = "405 Method Not Allowed";
+		body = "Only GET is supported\n";
+	}
+	else if ((path == "/metrics") || (path == "/"))
+	{
+		body = Prometheus();
+	}
+	else if (path == "/metrics.json")
+	{
+		content_type = "application/json";
+		body = Json();
+	}
+	else
+	{
+		status = "404 Not Found";
+		body = "Use /metrics or /metrics.json\n";
+	}
+
+	std::stringstream response;
+	response << "HTTP/1.1 " << status << "\r\nContent-Type: " << content_type << "\r\nContent-Length: " << body.length() << "\r\nConnection: close\r\n\r\n";
+	if (method != "HEAD")
+		response << body;
+
+	const std::string data = response.str();
+	for (size_t sent = 0; sent < data.length();)
+	{
+		const int n = static_cast<int>(send(c, data.data() + sent, static_cast<int>(data.length() - sent), SEND_FLAGS));
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+}
+
+void Metrics::Snapshots()
+{
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(stop_mutex);
+			if (stop_cv.wait_for(lock, milliseconds(snapshot_interval_ms), [this]() { return stop.load(); }))
+				break;
+		}
+
+		WriteSnapshot();
+	}
+}
+
+bool Metrics::WriteSnapshot()
+{
+	const std::string data = Json();
+
+	// Readers never see a half-written file
+	const std::string tmp_path = snapshot_path + ".tmp";
+	{
+		std::ofstream f(tmp_path, std::ios::binary);
+		f << data;
+		if (!f.good())
+		{
+			std::cerr << "Couldn't write " << tmp_path << std::endl;
+			return false;
+		}
+	}
+
+#ifdef _WIN32
+	std::remove(snapshot_path.c_str());
+#endif
+	if (std::rename(tmp_path.c_str(), snapshot_path.c_str()) != 0)
+	{
+		std::cerr << "Couldn't write " << snapshot_path << std::endl;
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include "opencl_helpers.h"
+
+// Live mining metrics (--metrics ADDRESS, --metrics_json FILE): counters and gauges of every device, served in Prometheus
+// text format over HTTP on a TCP port or a unix socket, and written as JSON snapshots. Mining threads report into it,
+// scrapes and snapshots only read. Metrics are process-wide, Instance() is nullptr when they're off.
+class Metrics
+{
+public:
+	explicit Metrics(uint32_t num_devices);
+	~Metrics();
+
+	static Metrics* Instance() { return instance; }
+
+	// "PORT" (localhost only), "HOST:PORT" or "unix:PATH". GET /metrics returns Prometheus text, GET /metrics.json a snapshot.
+	bool Listen(const std::string& address);
+
+	// Writes a snapshot to "path" every "interval_ms" and once more when metrics are destroyed
+	void StartSnapshots(const std::string& path, uint32_t interval_ms);
+
+	void DeviceInfo(uint32_t device, const std::string& name, uint64_t global_mem_size);
+	void DeviceMemory(uint32_t device, uint64_t bytes);
+
+	// "latency" is the time from enqueue to the finished readback of the batch
+	void BatchDone(uint32_t device, uint64_t hashes, uint32_t shares, double latency);
+
+	// Totals of the device's validator
+	void Validation(uint32_t device, uint64_t validated, uint64_t failed, uint64_t skipped_hashes, uint64_t cpu_limited_batches);
+
+	void DatasetBuilt(uint32_t device, double build_time, double upload_time);
+
+	std::string Prometheus();
+	std::string Json();
+
+private:
+	struct DeviceMetrics
+	{
+		DeviceMetrics();
+
+		std::string name;
+		uint64_t global_mem_size;
+		uint64_t memory_used;
+
+		uint64_t hashes;
+		uint64_t shares;
+		uint64_t batches;
+
+		// Time-weighted moving average of the hashrate and cumulative hashes over the longest window, both updated per batch
+		double hashrate_ema;
+		double last_batch_time;
+		std::deque<std::pair<double, uint64_t>> history;
+
+		// Latest batch latencies for the percentiles, as a ring buffer
+		std::vector<double> latencies;
+		size_t latency_pos;
+		double latency_sum;
+
+		uint64_t validated;
+		uint64_t failed;
+		uint64_t skipped_hashes;
+		uint64_t cpu_limited_batches;
+
+		uint64_t dataset_builds;
+		double dataset_build_time;
+		double dataset_upload_time;
+		double dataset_build_time_total;
+		double dataset_upload_time_total;
+	};
+
+	// Per-device values computed at read time
+	struct DeviceSnapshot
+	{
+		double hashrate_10s;
+		double hashrate_60s;
+		double latency_p50;
+		double latency_p90;
+		double latency_p99;
+	};
+
+	// Seconds since the metrics were created
+	double Now() const;
+
+	DeviceSnapshot Snapshot(const DeviceMetrics& d, double now) const;
+
+	void Server();
+	void Serve(intptr_t client);
+	void Snapshots();
+	bool WriteSnapshot();
+
+	static Metrics* instance;
+
+	const uint64_t start;
+
+	std::mutex mutex;
+	std::vector<DeviceMetrics> devices;
+
+	intptr_t listen_socket;
+	std::string unix_path;
+
+	std::string snapshot_path;
+	uint32_t snapshot_interval_ms;
+
+	std::mutex stop_mutex;
+	std::condition_variable stop_cv;
+	std::atomic<bool> stop;
+
+	// Must be the last member
+	std::vector<SThread> threads;
+};
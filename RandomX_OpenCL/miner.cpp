@@ -20,11 +20,24 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 #include <algorithm>
 #include <chrono>
 #include <atomic>
+#include <memory>
 #include <sstream>
 #include <cctype>
+#include <mutex>
 #include "miner.h"
 #include "opencl_helpers.h"
 #include "definitions.h"
+#include "job.h"
+#include "dataset.h"
+#include "autotune.h"
+#include "kernel_slicer.h"
+#include "validator.h"
+#include "trace.h"
+#include "metrics.h"
+#include "startup.h"
+#include "memory_plan.h"
+#include "vm_counters.h"
+#include "jit_stats.h"
 
 #include "../RandomX/src/randomx.h"
 #include "../RandomX/src/configuration.h"
@@ -32,17 +45,339 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 
 using namespace std::chrono;
 
-bool test_mining(uint32_t platform_id, uint32_t device_id, size_t intensity, uint32_t start_nonce, uint32_t workers_per_hash, uint32_t bfactor, bool portable, bool dataset_host_allocated, bool validate)
+// Everything one batch of hashes needs while it's in flight. With --pipeline there are two of them,
+// so the host can validate and report one batch while the GPU is busy with the other.
+// Scratchpads are split into shards when one buffer can't hold all of them, see scratchpad_shard_size().
+struct BatchSlot
 {
-	std::cout << "Initializing GPU #" << device_id << " on OpenCL platform #" << platform_id << std::endl << std::endl;
+	// "vm_counters" adds a buffer for counters of the instrumented execute_vm, see VmCounters
+	BatchSlot(const OpenCLContext& ctx, size_t batch_size, bool portable, bool vm_counters)
+		: queue(nullptr)
+		, batch_size(batch_size)
+		, shard_size(scratchpad_shard_size(ctx, batch_size))
+		, hashes_gpu(ctx, batch_size * INITIAL_HASH_SIZE, "hashes_gpu")
+		, entropy_gpu(ctx, batch_size * ENTROPY_SIZE, "entropy_gpu")
+		, vm_states_gpu(ctx, portable ? (batch_size * VM_STATE_SIZE) : (batch_size * REGISTERS_SIZE), "vm_states_gpu")
+		, rounding_gpu(ctx, batch_size * sizeof(uint32_t), "rounding_gpu")
+		, intermediate_programs_gpu(ctx, portable ? 0 : (batch_size * INTERMEDIATE_PROGRAM_SIZE), "intermediate_programs_gpu")
+		, compiled_programs_gpu(ctx, portable ? 0 : COMPILED_PROGRAM_ARENA_SIZE(batch_size), "compiled_programs_gpu")
+		, jit_stats_gpu(ctx, portable ? 0 : (JIT_STATS_COUNT * sizeof(uint32_t)), "jit_stats_gpu")
+		, shares_gpu(ctx, SHARES_BUFFER_SIZE, "shares_gpu")
+		, counters_gpu(ctx, vm_counters ? (batch_size * VM_COUNTERS_COUNT * sizeof(uint32_t)) : 0, "counters_gpu")
+		, shares_pinned(nullptr)
+		, shares(nullptr)
+		, blob_gpu(nullptr)
+		, blob_gpu_size(0)
+		, nonce(0)
+		, dataset_index(0)
+		, done_event(nullptr)
+		, portable(portable)
+		, hashes(batch_size * 32)
+		, vm_counters(vm_counters ? (batch_size * VM_COUNTERS_COUNT) : 0)
+		, jit_stats(portable ? 0 : JIT_STATS_COUNT)
+	{
+		for (size_t begin = 0; shard_size && (begin < batch_size); begin += shard_size)
+			scratchpads_gpu.emplace_back(new DevicePtr(ctx, std::min(shard_size, batch_size - begin) * (RANDOMX_SCRATCHPAD_L3 + 64), "scratchpads_gpu"));
+	}
 
-	OpenCLContext ctx;
-	if (!ctx.Init(platform_id, device_id))
+	~BatchSlot()
 	{
-		return false;
+		if (queue)
+		{
+			clFinish(queue);
+			if (shares)
+			{
+				clEnqueueUnmapMemObject(queue, shares_pinned, shares, 0, nullptr, nullptr);
+				clFinish(queue);
+			}
+			clReleaseCommandQueue(queue);
+		}
+		if (shares_pinned)
+			clReleaseMemObject(shares_pinned);
+		if (blob_gpu)
+			clReleaseMemObject(blob_gpu);
+		if (done_event)
+			clReleaseEvent(done_event);
+		for (cl_event e : profile_events)
+		{
+			if (e)
+				clReleaseEvent(e);
+		}
+		for (TraceCommand& c : trace)
+		{
+			if (c.event)
+				clReleaseEvent(c.event);
+		}
+		for (cl_mem m : sub_buffers)
+			clReleaseMemObject(m);
+	}
+
+	// Profiling makes launches slightly slower, so it's enabled only when launches are timed (see KernelSlicer)
+	bool Init(const OpenCLContext& ctx, bool profiling)
+	{
+		if (!shard_size)
+		{
+			std::cerr << "Can't fit " << batch_size << " scratchpads into " << MAX_SCRATCHPAD_SHARDS << " buffers" << std::endl;
+			return false;
+		}
+
+		for (const std::unique_ptr<DevicePtr>& p : scratchpads_gpu)
+		{
+			if (!*p)
+				return false;
+		}
+
+		if (!hashes_gpu || !entropy_gpu || !vm_states_gpu || !rounding_gpu || !shares_gpu)
+			return false;
+
+		if (!portable && (!intermediate_programs_gpu || !compiled_programs_gpu || !jit_stats_gpu))
+			return false;
+
+		if (!vm_counters.empty() && !counters_gpu)
+			return false;
+
+		// Kernels get MAX_SCRATCHPAD_SHARDS buffers, the ones past the last shard are never accessed
+		for (size_t i = 0; i < MAX_SCRATCHPAD_SHARDS; ++i)
+			scratchpads[i] = *scratchpads_gpu[(i < scratchpads_gpu.size()) ? i : 0];
+
+		cl_int err;
+
+		// GCN code doesn't know about shards, randomx_run gets one launch per shard with sub-buffers of the other batch buffers.
+		// Compiled programs are found by their offset in registers, so all shards get the whole buffer.
+		if (!portable)
+		{
+			for (size_t i = 0, begin = 0; i < scratchpads_gpu.size(); ++i, begin += shard_size)
+			{
+				GcnShard shard;
+				shard.size = std::min(shard_size, batch_size - begin);
+				shard.scratchpads = scratchpads[i];
+				shard.compiled = compiled_programs_gpu;
+
+				if (scratchpads_gpu.size() == 1)
+				{
+					shard.registers = vm_states_gpu;
+					shard.rounding = rounding_gpu;
+				}
+				else
+				{
+					cl_mem* sub[2] = { &shard.registers, &shard.rounding };
+					const cl_mem parents[2] = { vm_states_gpu, rounding_gpu };
+					const size_t hash_sizes[2] = { REGISTERS_SIZE, sizeof(uint32_t) };
+
+					for (size_t j = 0; j < 2; ++j)
+					{
+						const cl_buffer_region region = { begin * hash_sizes[j], shard.size * hash_sizes[j] };
+						*sub[j] = clCreateSubBuffer(parents[j], CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+						CL_CHECK_RESULT(clCreateSubBuffer);
+						sub_buffers.push_back(*sub[j]);
+					}
+				}
+
+				gcn_shards.push_back(shard);
+			}
+		}
+
+		queue = clCreateCommandQueue(ctx.context, ctx.device, profiling ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+		CL_CHECK_RESULT(clCreateCommandQueue);
+
+		// Shares are copied into pinned host memory which stays mapped. Every batch reads back the share counter, shares only if there are any.
+		shares_pinned = clCreateBuffer(ctx.context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, SHARES_BUFFER_SIZE, nullptr, &err);
+		CL_CHECK_RESULT(clCreateBuffer);
+
+		shares = reinterpret_cast<uint32_t*>(clEnqueueMapBuffer(queue, shares_pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, SHARES_BUFFER_SIZE, 0, nullptr, nullptr, &err));
+		CL_CHECK_RESULT(clEnqueueMapBuffer);
+
+		return true;
+	}
+
+	cl_command_queue queue;
+
+	const size_t batch_size;
+
+	// Scratchpads per shard, 0 if they don't fit into MAX_SCRATCHPAD_SHARDS buffers
+	const size_t shard_size;
+
+	std::vector<std::unique_ptr<DevicePtr>> scratchpads_gpu;
+	cl_mem scratchpads[MAX_SCRATCHPAD_SHARDS];
+
+	struct GcnShard
+	{
+		size_t size;
+		cl_mem scratchpads;
+		cl_mem registers;
+		cl_mem rounding;
+		cl_mem compiled;
+	};
+
+	std::vector<GcnShard> gcn_shards;
+	std::vector<cl_mem> sub_buffers;
+
+	DevicePtr hashes_gpu;
+	DevicePtr entropy_gpu;
+	DevicePtr vm_states_gpu;
+	DevicePtr rounding_gpu;
+	DevicePtr intermediate_programs_gpu;
+	DevicePtr compiled_programs_gpu;
+	DevicePtr jit_stats_gpu;
+	DevicePtr shares_gpu;
+	DevicePtr counters_gpu;
+
+	cl_mem shares_pinned;
+	uint32_t* shares;
+
+	// Job this slot is hashing. The blob is uploaded to blob_gpu only when the job changes, and it grows as needed.
+	Job job;
+	cl_mem blob_gpu;
+	size_t blob_gpu_size;
+
+	size_t nonce;
+	uint32_t dataset_index;
+	cl_event done_event;
+	bool portable;
+
+	// When the batch was enqueued, for the batch latency metric
+	high_resolution_clock::time_point enqueue_time;
+
+	// Timed launches of the batch's first program and their iteration counts
+	std::vector<cl_event> profile_events;
+	std::vector<uint32_t> profile_iterations;
+
+	// With --trace, where to store the event of the next command, nullptr otherwise. The pointer is valid until the next call.
+	cl_event* Trace(const char* name)
+	{
+		Tracer* tracer = Tracer::Instance();
+		if (!tracer)
+			return nullptr;
+
+		trace.push_back({ name, nullptr, tracer->Now() });
+		return &trace.back().event;
+	}
+
+	std::vector<TraceCommand> trace;
+
+	// GPU hashes of the batch, read back only for validation
+	std::vector<uint8_t> hashes;
+
+	// With --vm_counters, VM_COUNTERS_COUNT counters of every hash in the batch, empty otherwise
+	std::vector<uint32_t> vm_counters;
+
+	// JIT_STATS_COUNT counters of randomx_init, empty in portable mode
+	std::vector<uint32_t> jit_stats;
+};
+
+// Counters of one device's mining thread. With more than one device they're reported by the main thread, see test_mining().
+struct DeviceStats
+{
+	DeviceStats()
+		: hashes(0)
+		, shares(0)
+		, validated(0)
+		, failed(0)
+		, cpu_limited(false)
+		, done(false)
+		, result(false)
+	{}
+
+	std::atomic<uint64_t> hashes;
+	std::atomic<uint64_t> shares;
+	std::atomic<uint64_t> validated;
+	std::atomic<uint64_t> failed;
+	std::atomic<bool> cpu_limited;
+	std::atomic<bool> done;
+	std::atomic<bool> result;
+};
+
+
+// Tuning profiles are separate for every kernel set and memory layout
+static std::string tuning_mode(const MinerSettings& settings)
+{
+	std::string mode = settings.portable ? (settings.light_mode ? "light" : "portable") : "gcn";
+	if (settings.pipeline)
+		mode += "_pipeline";
+	if (settings.dataset_host_allocated)
+		mode += "_host";
+	else if (settings.dataset_hybrid)
+		mode += "_hybrid";
+	return mode;
+}
+
+// Replaces values the kernels can't run with by their defaults
+static void check_tuning_params(TuningParams& params, bool portable)
+{
+	switch (params.workers_per_hash)
+	{
+	case 2:
+	case 4:
+	case 8:
+	case 16:
+		break;
+
+	default:
+		params.workers_per_hash = 8;
+		break;
+	}
+
+	if (params.bfactor > 10)
+		params.bfactor = 10;
+
+	switch (params.aes_local_size)
+	{
+	case 64:
+	case 128:
+	case 256:
+		break;
+
+	default:
+		params.aes_local_size = 64;
+		break;
+	}
+
+	if ((params.blake2b_local_size != 32) && (params.blake2b_local_size != 64))
+		params.blake2b_local_size = 64;
+
+	// Blocks of interleaved VM states must divide every batch (a multiple of 64 hashes) and hold both hashes of an execute_vm work group
+	switch (params.vm_state_interleave)
+	{
+	case 2:
+	case 4:
+	case 8:
+	case 16:
+	case 32:
+	case 64:
+		if (!portable)
+			params.vm_state_interleave = 1;
+		break;
+
+	default:
+		params.vm_state_interleave = 1;
+		break;
 	}
+}
 
-	if (!ctx.Compile("base_kernels.bin",
+uint32_t vm_subgroups(const OpenCLContext& ctx)
+{
+	// cl_intel_subgroups has everything, cl_khr_subgroup_shuffle only adds shuffles to cl_khr_subgroups
+	if (ctx.HasExtension("cl_intel_subgroups"))
+		return 2;
+
+	if (!ctx.HasExtension("cl_khr_subgroups"))
+		return 0;
+
+	return ctx.HasExtension("cl_khr_subgroup_shuffle") ? 2 : 1;
+}
+
+// Compiles kernels that depend on tuning parameters. Cached binaries are keyed by build options anyway,
+// parameters in binary names only make the cache directory easier to read.
+// "vm_counters" builds the instrumented execute_vm, see VM_COUNTERS in CL/randomx_vm.cl. "subgroups" is VM_SUBGROUPS.
+static bool compile_tunable_kernels(OpenCLContext& ctx, const TuningParams& params, bool portable, bool light_mode, bool vm_counters, uint32_t subgroups)
+{
+	TraceScope trace("compile");
+
+	std::stringstream name, options;
+	name << "base_kernels_aes" << params.aes_local_size << "_blake" << params.blake2b_local_size << "_vm" << params.vm_state_interleave << ".bin";
+	options << "-D AES_WORKGROUP_SIZE=" << params.aes_local_size << " -D BLAKE2B_WORKGROUP_SIZE=" << params.blake2b_local_size << " -D VM_STATE_INTERLEAVE=" << params.vm_state_interleave;
+
+	if (!ctx.Compile(name.str().c_str(),
 		{
 			AES_CL,
 			BLAKE2B_CL
@@ -54,431 +389,1391 @@ bool test_mining(uint32_t platform_id, uint32_t device_id, size_t intensity, uin
 			CL_BLAKE2B_INITIAL_HASH,
 			CL_BLAKE2B_HASH_REGISTERS_32,
 			CL_BLAKE2B_HASH_REGISTERS_64,
+			CL_BLAKE2B_HASH_REGISTERS_32_TARGET,
 			CL_BLAKE2B_512_SINGLE_BLOCK_BENCH,
 			CL_BLAKE2B_512_DOUBLE_BLOCK_BENCH
 		},
-		"", COMPILE_CACHE_BINARY))
+		options.str(), COMPILE_CACHE_BINARY))
 	{
 		return false;
 	}
 
-	int gcn_version = 12;
-
 	if (portable)
 	{
-		switch (workers_per_hash)
-		{
-		case 2:
-		case 4:
-		case 8:
-		case 16:
-			break;
+		name.str("");
+		name << (light_mode ? "randomx_vm_light_w" : "randomx_vm_w") << params.workers_per_hash << "_vm" << params.vm_state_interleave << (vm_counters ? "_counters" : "") << "_sg" << subgroups << ".bin";
 
-		default:
-			workers_per_hash = 8;
-			break;
-		}
-
-		if (bfactor > 10)
-			bfactor = 10;
+		options.str("");
+		options << "-D WORKERS_PER_HASH=" << params.workers_per_hash << " -D LIGHT_MODE=" << (light_mode ? 1 : 0) << " -D VM_STATE_INTERLEAVE=" << params.vm_state_interleave << " -D VM_COUNTERS=" << (vm_counters ? 1 : 0) << " -D VM_SUBGROUPS=" << subgroups << " -Werror";
 
-		std::stringstream options;
-		options << "-D WORKERS_PER_HASH=" << workers_per_hash << " -Werror";
-		if (!ctx.Compile("randomx_vm.bin", { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, options.str(), COMPILE_CACHE_BINARY))
+		if (!ctx.Compile(name.str().c_str(), { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, options.str(), COMPILE_CACHE_BINARY))
 		{
 			return false;
 		}
 	}
-	else
-	{
-		const char* gcn_binary = "randomx_run_gfx803.bin";
 
-		std::vector<char> t;
-		std::transform(ctx.device_name.begin(), ctx.device_name.end(), std::back_inserter(t), [](char c) { return static_cast<char>(std::toupper(c)); });
-		if ((strcmp(t.data(), "GFX900") == 0) || (strcmp(t.data(), "GFX906") == 0))
-		{
-			gcn_binary = "randomx_run_gfx900.bin";
-			gcn_version = 14;
-		}
-		else if ((strcmp(t.data(), "GFX1010") == 0) || (strcmp(t.data(), "GFX1011") == 0) || (strcmp(t.data(), "GFX1012") == 0))
-		{
-			gcn_binary = "randomx_run_gfx1010.bin";
-			gcn_version = 15;
-		}
+	return true;
+}
 
-		std::stringstream options;
-		options << "-D GCN_VERSION=" << gcn_version;
-		if (!ctx.Compile("randomx_init.bin", { RANDOMX_INIT_CL }, { CL_RANDOMX_INIT }, options.str(), ALWAYS_COMPILE))
-		{
-			return false;
-		}
+// GCN assembly code comes as a prebuilt binary, randomx_init is compiled first because the binary gets its ELF flags
+static bool compile_gcn_kernels(OpenCLContext& ctx, const char* gcn_binary, int gcn_version)
+{
+	TraceScope trace("compile");
 
-		options.str("");
-		options << "-D RANDOMX_PROGRAM_ITERATIONS=" << RANDOMX_PROGRAM_ITERATIONS;
-		if (!ctx.Compile(gcn_binary, { RANDOMX_RUN_CL }, { CL_RANDOMX_RUN }, options.str(), ALWAYS_USE_BINARY, ctx.elf_binary_flags))
-		{
-			return false;
-		}
+	std::stringstream options;
+	options << "-D GCN_VERSION=" << gcn_version;
+	uint32_t elf_binary_flags = 0;
+	if (!ctx.Compile("randomx_init.bin", { RANDOMX_INIT_CL }, { CL_RANDOMX_INIT }, options.str(), COMPILE_CACHE_BINARY, 0, &elf_binary_flags))
+	{
+		return false;
 	}
 
-	if (!intensity)
-		intensity = std::min(ctx.device_max_alloc_size, ctx.device_global_mem_size) / RANDOMX_SCRATCHPAD_L3;
+	options.str("");
+	options << "-D RANDOMX_PROGRAM_ITERATIONS=" << RANDOMX_PROGRAM_ITERATIONS;
+	if (!ctx.Compile(gcn_binary, { RANDOMX_RUN_CL }, { CL_RANDOMX_RUN }, options.str(), ALWAYS_USE_BINARY, elf_binary_flags))
+	{
+		return false;
+	}
 
-	intensity -= (intensity & 63);
+	return true;
+}
 
-	const size_t dataset_size = randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE;
-	cl_int err;
-	cl_mem dataset_gpu = nullptr;
-	if (!dataset_host_allocated)
+// Kernels and batch slots of one launch configuration. The autotuner creates one for every candidate, mining uses the final one.
+// Kernel arguments are captured at enqueue time, so the same kernel objects are reused for all batch slots.
+class BatchEngine
+{
+public:
+	// "kernel_ms" > 0 replaces bfactor with a time-based split of execute_vm, see KernelSlicer.
+	// "device" is the device's number in traces. "vm_counters" needs kernels compiled with it, portable mode only.
+	BatchEngine(const OpenCLContext& ctx, const TuningParams& params, bool portable, bool light_mode, int gcn_version, uint32_t num_slots, uint64_t target, double kernel_ms, uint32_t device, bool vm_counters)
+		: params(params)
+		, num_slots(num_slots)
+		, batch_size(params.intensity / num_slots)
+		, ctx(ctx)
+		, portable(portable)
+		, light_mode(light_mode)
+		, gcn_version(gcn_version)
+		, target(target)
+		, device(device)
 	{
-		dataset_gpu = clCreateBuffer(ctx.context, CL_MEM_READ_ONLY, dataset_size, nullptr, &err);
-		CL_CHECK_RESULT(clCreateBuffer);
-		std::cout << "Allocated " << (dataset_size / 1048576.0) << " MB dataset on GPU" << std::endl;
+		if (kernel_ms > 0.0)
+			slicer.reset(new KernelSlicer(kernel_ms, RANDOMX_PROGRAM_ITERATIONS, RANDOMX_PROGRAM_ITERATIONS >> params.bfactor, portable));
+
+		if (vm_counters && portable)
+			counters.reset(new VmCounters());
+
+		if (!portable)
+			jit_stats.reset(new JitStats());
+
+		kernel_blake2b_initial_hash = Kernel(CL_BLAKE2B_INITIAL_HASH);
+		kernel_fillaes1rx4_scratchpad = Kernel(CL_FILLAES1RX4_SCRATCHPAD);
+		kernel_fillaes1rx4_entropy = Kernel(CL_FILLAES4RX4_ENTROPY);
+		kernel_randomx_init = Kernel(portable ? CL_INIT_VM : CL_RANDOMX_INIT);
+		kernel_randomx_run = Kernel(portable ? CL_EXECUTE_VM : CL_RANDOMX_RUN);
+		kernel_hashaes1rx4 = Kernel(CL_HASHAES1RX4);
+		kernel_blake2b_hash_registers_32_target = Kernel(CL_BLAKE2B_HASH_REGISTERS_32_TARGET);
+		kernel_blake2b_hash_registers_64 = Kernel(CL_BLAKE2B_HASH_REGISTERS_64);
 	}
-	std::cout << "Initializing dataset...";
 
-	randomx_dataset *myDataset;
-	bool large_pages_available = true;
+	// Batch buffers don't depend on kernels, so they can be allocated while kernels are being compiled
+	static bool AllocSlots(const OpenCLContext& ctx, size_t batch_size, uint32_t num_slots, bool portable, bool profiling, bool vm_counters, std::vector<std::unique_ptr<BatchSlot>>& slots)
 	{
-		auto t1 = high_resolution_clock::now();
-
-		myDataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
-		if (!myDataset)
+		for (uint32_t i = 0; i < num_slots; ++i)
 		{
-			std::cout << "\nCouldn't allocate dataset using large pages" << std::endl;
-			myDataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
-			large_pages_available = false;
+			slots.emplace_back(new BatchSlot(ctx, batch_size, portable, vm_counters));
+			if (!slots.back()->Init(ctx, profiling))
+			{
+				return false;
+			}
 		}
+		return true;
+	}
 
-		char* dataset_memory = reinterpret_cast<char*>(randomx_get_dataset_memory(myDataset));
-		bool read_ok = false;
+	bool Init()
+	{
+		return AllocSlots(ctx, batch_size, num_slots, portable, slicer || Tracer::Instance(), counters != nullptr, slots);
+	}
 
-		FILE* fp = fopen("dataset.bin", "rb");
-		if (fp)
-		{
-			read_ok = (fread(dataset_memory, 1, randomx::DatasetSize, fp) == randomx::DatasetSize);
-			fclose(fp);
-		}
+	// Slots allocated by AllocSlots() for this configuration
+	bool Init(std::vector<std::unique_ptr<BatchSlot>>&& allocated)
+	{
+		slots = std::move(allocated);
+		return (slots.size() == num_slots) && (slots[0]->vm_counters.empty() == !counters);
+	}
 
-		if (!read_ok)
-		{
-			randomx_cache *myCache = randomx_alloc_cache((randomx_flags)(RANDOMX_FLAG_JIT | (large_pages_available ? RANDOMX_FLAG_LARGE_PAGES : 0)));
-			if (!myCache)
-			{
-				std::cout << "\nCouldn't allocate cache using large pages" << std::endl;
-				myCache = randomx_alloc_cache(RANDOMX_FLAG_JIT);
-				large_pages_available = false;
-			}
+	// With "validate" all hashes of the batch are read back into slot.hashes
+	bool Enqueue(BatchSlot& slot, size_t nonce, const Job& job, const DatasetBuffer& dataset, uint32_t dataset_index, bool validate);
 
-			const char mySeed[] = "RandomX example seed";
-			randomx_init_cache(myCache, mySeed, sizeof(mySeed));
+	bool Wait(BatchSlot& slot)
+	{
+		cl_int err;
+		CL_CHECKED_CALL(clWaitForEvents, 1, &slot.done_event);
+		clReleaseEvent(slot.done_event);
+		slot.done_event = nullptr;
 
-			std::vector<SThread> threads;
-			for (uint32_t i = 0, n = std::thread::hardware_concurrency(); i < n; ++i)
-				threads.emplace_back([myDataset, myCache, i, n]() { randomx_init_dataset(myDataset, myCache, (i * randomx_dataset_item_count()) / n, ((i + 1) * randomx_dataset_item_count()) / n - (i * randomx_dataset_item_count()) / n); });
+		if (slicer)
+			slicer->Update(slot.profile_events, slot.profile_iterations);
 
-			for (auto& t : threads)
-				t.join();
+		if (counters)
+			counters->Add(slot.vm_counters, batch_size);
 
-			randomx_release_cache(myCache);
+		if (jit_stats)
+		{
+			// Dropped programs ran as empty programs, hashes of the batch are wrong
+			if (slot.jit_stats[JIT_STATS_DROPPED])
+				slot.shares[0] = 0;
+			jit_stats->Add(slot.jit_stats, batch_size);
+		}
 
-			fp = fopen("dataset.bin", "wb");
-			if (fp)
-			{
-				fwrite(dataset_memory, 1, randomx::DatasetSize, fp);
-				fclose(fp);
-			}
+		const uint32_t num_shares = std::min<uint32_t>(slot.shares[0], MAX_SHARES);
+		if (num_shares)
+		{
+			CL_CHECKED_CALL(clEnqueueReadBuffer, slot.queue, slot.shares_gpu, CL_TRUE, sizeof(uint32_t), num_shares * SHARE_SIZE, slot.shares + 1, 0, nullptr, nullptr);
 		}
 
-		if (!dataset_host_allocated)
+		if (Tracer* tracer = Tracer::Instance())
 		{
-			CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, dataset_gpu, CL_TRUE, 0, dataset_size, randomx_get_dataset_memory(myDataset), 0, nullptr, nullptr);
+			const uint32_t slot_index = static_cast<uint32_t>(std::find_if(slots.begin(), slots.end(), [&slot](const std::unique_ptr<BatchSlot>& s) { return s.get() == &slot; }) - slots.begin());
+			tracer->DeviceBatch(device, slot_index, slot.trace);
 		}
 
-		std::cout << "done in " << (duration_cast<nanoseconds>(high_resolution_clock::now() - t1).count() / 1e9) << " seconds" << std::endl;
+		return true;
 	}
 
-	if (dataset_host_allocated)
+	const TuningParams params;
+	const uint32_t num_slots;
+	const size_t batch_size;
+
+	std::vector<std::unique_ptr<BatchSlot>> slots;
+
+	// nullptr if launches are split by bfactor
+	std::unique_ptr<KernelSlicer> slicer;
+
+	// nullptr without --vm_counters
+	std::unique_ptr<VmCounters> counters;
+
+	// nullptr in portable mode
+	std::unique_ptr<JitStats> jit_stats;
+
+private:
+	cl_kernel Kernel(const std::string& name) const
 	{
-		dataset_gpu = clCreateBuffer(ctx.context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, dataset_size, randomx_get_dataset_memory(myDataset), &err);
-		CL_CHECK_RESULT(clCreateBuffer);
-		std::cout << "Using host-allocated " << (dataset_size / 1048576.0) << " MB dataset" << std::endl;
+		auto it = ctx.kernels.find(name);
+		return (it != ctx.kernels.end()) ? it->second : nullptr;
 	}
 
-	ALLOCATE_DEVICE_MEMORY(scratchpads_gpu, ctx, intensity * (RANDOMX_SCRATCHPAD_L3 + 64));
-	std::cout << "Allocated " << intensity << " scratchpads\n" << std::endl;
+	const OpenCLContext& ctx;
+	const bool portable;
+	const bool light_mode;
+	const int gcn_version;
+	const uint64_t target;
+	const uint32_t device;
+
+	cl_kernel kernel_blake2b_initial_hash;
+	cl_kernel kernel_fillaes1rx4_scratchpad;
+	cl_kernel kernel_fillaes1rx4_entropy;
+	cl_kernel kernel_randomx_init;
+	cl_kernel kernel_randomx_run;
+	cl_kernel kernel_hashaes1rx4;
+	cl_kernel kernel_blake2b_hash_registers_32_target;
+	cl_kernel kernel_blake2b_hash_registers_64;
+};
+
+bool BatchEngine::Enqueue(BatchSlot& slot, size_t nonce, const Job& job, const DatasetBuffer& dataset, uint32_t dataset_index, bool validate)
+{
+	constexpr uint32_t rx_parameters =
+		(PowerOf2(RANDOMX_SCRATCHPAD_L1) << 0) |
+		(PowerOf2(RANDOMX_SCRATCHPAD_L2) << 5) |
+		(PowerOf2(RANDOMX_SCRATCHPAD_L3) << 10) |
+		(PowerOf2(RANDOMX_PROGRAM_ITERATIONS) << 15);
+
+	const uint32_t batch_size32 = static_cast<uint32_t>(batch_size);
+	const uint32_t shard_size32 = static_cast<uint32_t>(slot.shard_size);
+	const size_t global_work_size = batch_size;
+	const size_t global_work_size4 = batch_size * 4;
+	const size_t global_work_size8 = batch_size * 8;
+	const size_t global_work_size16 = batch_size * 16;
+	const size_t global_work_size32 = batch_size * 32;
+	const size_t local_work_size = 64;
+	const size_t local_work_size32 = 32;
+	const size_t local_work_size16 = 16;
+	const size_t local_work_size_aes = params.aes_local_size;
+	const size_t local_work_size_blake2b = params.blake2b_local_size;
+	const uint32_t workers_per_hash = params.workers_per_hash;
+	const uint32_t iterations = slicer ? slicer->Iterations() : (RANDOMX_PROGRAM_ITERATIONS >> params.bfactor);
+	const uint32_t zero = 0;
+
+	cl_int err;
+	cl_command_queue queue = slot.queue;
 
-	ALLOCATE_DEVICE_MEMORY(hashes_gpu, ctx, intensity * INITIAL_HASH_SIZE);
-	ALLOCATE_DEVICE_MEMORY(entropy_gpu, ctx, intensity * ENTROPY_SIZE);
-	ALLOCATE_DEVICE_MEMORY(vm_states_gpu, ctx, portable ? (intensity * VM_STATE_SIZE) : (intensity * REGISTERS_SIZE));
-	ALLOCATE_DEVICE_MEMORY(rounding_gpu, ctx, intensity * sizeof(uint32_t));
-	ALLOCATE_DEVICE_MEMORY(blocktemplate_gpu, ctx, intensity * sizeof(blockTemplate));
-	ALLOCATE_DEVICE_MEMORY(intermediate_programs_gpu, ctx, portable ? 0 : (intensity * INTERMEDIATE_PROGRAM_SIZE));
-	ALLOCATE_DEVICE_MEMORY(compiled_programs_gpu, ctx, portable ? 0 : (intensity * COMPILED_PROGRAM_SIZE));
+	slot.nonce = nonce;
+	slot.dataset_index = dataset_index;
+	slot.enqueue_time = high_resolution_clock::now();
 
-	CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, blocktemplate_gpu, CL_TRUE, 0, sizeof(blockTemplate), blockTemplate, 0, nullptr, nullptr);
+	cl_mem dataset_gpu = dataset.parts[0].mem;
 
-	auto prev_time = high_resolution_clock::now();
+	if (slot.job.id != job.id)
+	{
+		slot.job = job;
 
-	std::vector<uint8_t> hashes, hashes_check;
-	hashes.resize(intensity * 32);
-	hashes_check.resize(intensity * 32);
+		// blake2b_initial_hash reads whole 64-bit words, so round the buffer size up
+		const size_t size = std::max<size_t>((slot.job.blob.size() + 7) & ~size_t(7), 8);
+		if (slot.blob_gpu_size < size)
+		{
+			if (slot.blob_gpu)
+				clReleaseMemObject(slot.blob_gpu);
 
-	std::vector<SThread> threads;
-	std::atomic<uint32_t> nonce_counter;
-	bool cpu_limited = false;
+			slot.blob_gpu = clCreateBuffer(ctx.context, CL_MEM_READ_ONLY, size, nullptr, &err);
+			CL_CHECK_RESULT(clCreateBuffer);
+			slot.blob_gpu_size = size;
+		}
 
-	uint32_t failed_nonces = 0;
+		// Non-blocking: slot.job isn't modified until this slot's batch is finished
+		if (!slot.job.blob.empty())
+		{
+			CL_CHECKED_CALL(clEnqueueWriteBuffer, queue, slot.blob_gpu, CL_FALSE, 0, slot.job.blob.size(), slot.job.blob.data(), 0, nullptr, slot.Trace("write blob"));
+		}
+	}
 
-	cl_kernel kernel_blake2b_initial_hash = ctx.kernels[CL_BLAKE2B_INITIAL_HASH];
-	if (!clSetKernelArgs(kernel_blake2b_initial_hash, hashes_gpu, blocktemplate_gpu, 0U))
+	if (!clSetKernelArgs(kernel_blake2b_initial_hash, slot.hashes_gpu, slot.blob_gpu, static_cast<uint32_t>(slot.job.blob.size()), static_cast<uint32_t>(nonce), slot.job.nonce_offset, slot.job.nonce_width))
 	{
 		return false;
 	}
 
-	cl_kernel kernel_fillaes1rx4_scratchpad = ctx.kernels[CL_FILLAES1RX4_SCRATCHPAD];
-	if (!clSetKernelArgs(kernel_fillaes1rx4_scratchpad, hashes_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity)))
+	if (!clSetKernelArgs(kernel_fillaes1rx4_scratchpad, slot.hashes_gpu, slot.scratchpads[0], batch_size32, slot.scratchpads[1], slot.scratchpads[2], slot.scratchpads[3], shard_size32))
 	{
 		return false;
 	}
 
-	cl_kernel kernel_fillaes1rx4_entropy = ctx.kernels[CL_FILLAES4RX4_ENTROPY];
-	if (!clSetKernelArgs(kernel_fillaes1rx4_entropy, hashes_gpu, entropy_gpu, static_cast<uint32_t>(intensity)))
+	if (!clSetKernelArgs(kernel_fillaes1rx4_entropy, slot.hashes_gpu, slot.entropy_gpu, batch_size32))
 	{
 		return false;
 	}
 
-	cl_kernel kernel_randomx_init, kernel_randomx_run;
 	if (portable)
 	{
-		kernel_randomx_init = ctx.kernels[CL_INIT_VM];
-		if (!clSetKernelArgs(kernel_randomx_init, entropy_gpu, vm_states_gpu))
+		if (!clSetKernelArgs(kernel_randomx_init, slot.entropy_gpu, slot.vm_states_gpu))
 		{
 			return false;
 		}
 
-		kernel_randomx_run = ctx.kernels[CL_EXECUTE_VM];
-		if (!clSetKernelArgs(kernel_randomx_run, vm_states_gpu, rounding_gpu, scratchpads_gpu, dataset_gpu, static_cast<uint32_t>(intensity), static_cast<uint32_t>(RANDOMX_PROGRAM_ITERATIONS >> bfactor), 1U, 1U))
+		if (!clSetKernelArgs(kernel_randomx_run, slot.vm_states_gpu, slot.rounding_gpu, slot.scratchpads[0], dataset_gpu, batch_size32, iterations, 1U, 1U))
 		{
 			return false;
 		}
-	}
-	else
-	{
-		kernel_randomx_init = ctx.kernels[CL_RANDOMX_INIT];
-		if (!clSetKernelArgs(kernel_randomx_init, entropy_gpu, vm_states_gpu, intermediate_programs_gpu, compiled_programs_gpu, static_cast<uint32_t>(intensity)))
+
+		if (light_mode)
 		{
-			return false;
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 8, sizeof(cl_mem), &dataset.programs_gpu);
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 9, sizeof(cl_mem), &dataset.reciprocals_gpu);
 		}
 
-		kernel_randomx_run = ctx.kernels[CL_RANDOMX_RUN];
+		// Other scratchpad shards come after light mode arguments
+		const cl_uint shard_args = light_mode ? 10 : 8;
+		for (cl_uint k = 1; k < MAX_SCRATCHPAD_SHARDS; ++k)
+		{
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, shard_args + k - 1, sizeof(cl_mem), &slot.scratchpads[k]);
+		}
+		CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, shard_args + MAX_SCRATCHPAD_SHARDS - 1, sizeof(uint32_t), &shard_size32);
 
-		constexpr uint32_t rx_parameters =
-			(PowerOf2(RANDOMX_SCRATCHPAD_L1) << 0) |
-			(PowerOf2(RANDOMX_SCRATCHPAD_L2) << 5) |
-			(PowerOf2(RANDOMX_SCRATCHPAD_L3) << 10) |
-			(PowerOf2(RANDOMX_PROGRAM_ITERATIONS) << 15);
+		// Other dataset parts and byte offsets where they start, missing parts are never read
+		const cl_uint part_args = shard_args + MAX_SCRATCHPAD_SHARDS;
+		for (cl_uint k = 1; k < MAX_DATASET_PARTS; ++k)
+		{
+			const bool present = !light_mode && (k < dataset.parts.size());
+			const cl_mem part = present ? dataset.parts[k].mem : dataset_gpu;
+			const uint32_t split = present ? (dataset.parts[k].first_item * RANDOMX_DATASET_ITEM_SIZE) : 0xFFFFFFFFU;
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, part_args + k - 1, sizeof(cl_mem), &part);
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, part_args + MAX_DATASET_PARTS + k - 2, sizeof(uint32_t), &split);
+		}
 
-		if (!clSetKernelArgs(kernel_randomx_run, dataset_gpu, scratchpads_gpu, vm_states_gpu, rounding_gpu, compiled_programs_gpu, static_cast<uint32_t>(intensity), rx_parameters))
+		if (counters)
+		{
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, part_args + (MAX_DATASET_PARTS - 1) * 2, sizeof(cl_mem), &slot.counters_gpu);
+		}
+	}
+	else
+	{
+		if (!clSetKernelArgs(kernel_randomx_init, slot.entropy_gpu, slot.vm_states_gpu, slot.intermediate_programs_gpu, slot.compiled_programs_gpu, slot.jit_stats_gpu, batch_size32, 0U))
 		{
 			return false;
 		}
 	}
 
-	cl_kernel kernel_hashaes1rx4 = ctx.kernels[CL_HASHAES1RX4];
-	if (!clSetKernelArgs(kernel_hashaes1rx4, scratchpads_gpu, vm_states_gpu, 192U, static_cast<uint32_t>(portable ? VM_STATE_SIZE : REGISTERS_SIZE), static_cast<uint32_t>(intensity)))
+	if (!clSetKernelArgs(kernel_hashaes1rx4, slot.scratchpads[0], slot.vm_states_gpu, 192U, static_cast<uint32_t>(portable ? VM_STATE_SIZE : REGISTERS_SIZE), batch_size32, slot.scratchpads[1], slot.scratchpads[2], slot.scratchpads[3], shard_size32))
 	{
 		return false;
 	}
 
-	cl_kernel kernel_blake2b_hash_registers_32 = ctx.kernels[CL_BLAKE2B_HASH_REGISTERS_32];
-	if (!clSetKernelArgs(kernel_blake2b_hash_registers_32, hashes_gpu, vm_states_gpu, static_cast<uint32_t>(portable ? VM_STATE_SIZE : REGISTERS_SIZE)))
+	if (!clSetKernelArgs(kernel_blake2b_hash_registers_32_target, slot.hashes_gpu, slot.vm_states_gpu, static_cast<uint32_t>(portable ? VM_STATE_SIZE : REGISTERS_SIZE), static_cast<uint32_t>(nonce), target, slot.shares_gpu))
 	{
 		return false;
 	}
 
-	cl_kernel kernel_blake2b_hash_registers_64 = ctx.kernels[CL_BLAKE2B_HASH_REGISTERS_64];
-	if (!clSetKernelArgs(kernel_blake2b_hash_registers_64, hashes_gpu, vm_states_gpu, static_cast<uint32_t>(portable ? VM_STATE_SIZE : REGISTERS_SIZE)))
+	if (!clSetKernelArgs(kernel_blake2b_hash_registers_64, slot.hashes_gpu, slot.vm_states_gpu, static_cast<uint32_t>(portable ? VM_STATE_SIZE : REGISTERS_SIZE)))
 	{
 		return false;
 	}
 
-	const size_t global_work_size = intensity;
-	const size_t global_work_size4 = intensity * 4;
-	const size_t global_work_size8 = intensity * 8;
-	const size_t global_work_size16 = intensity * 16;
-	const size_t global_work_size32 = intensity * 32;
-	const size_t global_work_size64 = intensity * 64;
-	const size_t local_work_size = 64;
-	const size_t local_work_size32 = 32;
-	const size_t local_work_size16 = 16;
-	const uint32_t zero = 0;
-
-	for (size_t nonce = start_nonce, k = 0; nonce < 0xFFFFFFFFUL; nonce += intensity, ++k)
+	CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_blake2b_initial_hash, 1, nullptr, &global_work_size, &local_work_size_blake2b, 0, nullptr, slot.Trace(CL_BLAKE2B_INITIAL_HASH.c_str()));
+	CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_fillaes1rx4_scratchpad, 1, nullptr, &global_work_size4, &local_work_size_aes, 0, nullptr, slot.Trace(CL_FILLAES1RX4_SCRATCHPAD.c_str()));
+	CL_CHECKED_CALL(clEnqueueFillBuffer, queue, slot.rounding_gpu, &zero, sizeof(zero), 0, batch_size * sizeof(uint32_t), 0, nullptr, slot.Trace("fill rounding"));
+	CL_CHECKED_CALL(clEnqueueFillBuffer, queue, slot.shares_gpu, &zero, sizeof(zero), 0, sizeof(zero), 0, nullptr, slot.Trace("fill shares"));
+	if (counters)
 	{
-		auto validation_thread = [&nonce_counter, myDataset, &hashes_check, intensity, nonce, &large_pages_available]() {
-			const randomx_flags flags = (randomx_flags)(RANDOMX_FLAG_FULL_MEM | RANDOMX_FLAG_JIT | RANDOMX_FLAG_HARD_AES);
-			randomx_vm *myMachine = randomx_create_vm((randomx_flags)(flags | (large_pages_available ? RANDOMX_FLAG_LARGE_PAGES : 0)), nullptr, myDataset);
-
-			if (!myMachine && large_pages_available)
-			{
-				large_pages_available = false;
-				myMachine = randomx_create_vm(flags, nullptr, myDataset);
-			}
-
-			uint8_t buf[sizeof(blockTemplate)];
-			memcpy(buf, blockTemplate, sizeof(buf));
-
-			for (;;)
-			{
-				const uint32_t i = nonce_counter.fetch_add(1);
-				if (i >= intensity)
-					break;
-
-				*(uint32_t*)(buf + 39) = static_cast<uint32_t>(nonce + i);
-
-				randomx_calculate_hash(myMachine, buf, sizeof(buf), (hashes_check.data() + i * 32));
-			}
-			randomx_destroy_vm(myMachine);
-		};
-
-		if (validate)
-		{
-			nonce_counter = 0;
-
-			const uint32_t n = std::max(std::thread::hardware_concurrency() / 2, 1U);
-
-			threads.clear();
-			for (uint32_t i = 0; i < n; ++i)
-				threads.emplace_back(validation_thread);
-		}
-
-		auto cur_time = high_resolution_clock::now();
-		if (k > 0)
-		{
-			const double dt = duration_cast<nanoseconds>(cur_time - prev_time).count() / 1e9;
-
-			if (validate)
-			{
-				const size_t n = nonce - start_nonce;
-				printf("%zu (%.3f%%) hashes validated successfully, %u (%.3f%%) hashes failed, %.0f h/s%s\n",
-					n - failed_nonces,
-					static_cast<double>(n - failed_nonces) / n * 100.0,
-					failed_nonces,
-					static_cast<double>(failed_nonces) / n * 100.0,
-					intensity / dt,
-					cpu_limited ? ", limited by CPU" : "                "
-				);
-			}
-			else
-			{
-				printf("%.0f h/s\t\r", intensity / dt);
-			}
-		}
-		prev_time = cur_time;
-
-		CL_CHECKED_CALL(clSetKernelArg, kernel_blake2b_initial_hash, 2, sizeof(uint32_t), &nonce);
-		CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_blake2b_initial_hash, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
-		CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_fillaes1rx4_scratchpad, 1, nullptr, &global_work_size4, &local_work_size, 0, nullptr, nullptr);
-		CL_CHECKED_CALL(clEnqueueFillBuffer, ctx.queue, rounding_gpu, &zero, sizeof(zero), 0, intensity * sizeof(uint32_t), 0, nullptr, nullptr);
+		CL_CHECKED_CALL(clEnqueueFillBuffer, queue, slot.counters_gpu, &zero, sizeof(zero), 0, slot.vm_counters.size() * sizeof(uint32_t), 0, nullptr, slot.Trace("fill counters"));
+	}
+	if (jit_stats)
+	{
+		CL_CHECKED_CALL(clEnqueueFillBuffer, queue, slot.jit_stats_gpu, &zero, sizeof(zero), 0, slot.jit_stats.size() * sizeof(uint32_t), 0, nullptr, slot.Trace("fill JIT stats"));
+	}
 
-		for (size_t i = 0; i < RANDOMX_PROGRAM_COUNT; ++i)
+	for (size_t i = 0; i < RANDOMX_PROGRAM_COUNT; ++i)
+	{
+		CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_fillaes1rx4_entropy, 1, nullptr, &global_work_size4, &local_work_size_aes, 0, nullptr, slot.Trace(CL_FILLAES4RX4_ENTROPY.c_str()));
+		if (portable)
 		{
-			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_fillaes1rx4_entropy, 1, nullptr, &global_work_size4, &local_work_size, 0, nullptr, nullptr);
-			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_randomx_init, 1, nullptr, portable ? &global_work_size8 : &global_work_size32, portable ? &local_work_size32 : &local_work_size, 0, nullptr, nullptr);
-			if (portable)
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_randomx_init, 1, nullptr, &global_work_size8, &local_work_size32, 0, nullptr, slot.Trace(CL_INIT_VM.c_str()));
+
+			//if (i == 0)
+			//{
+			//	CL_CHECKED_CALL(clFinish, queue);
+			//	std::vector<char> buf(batch_size * VM_STATE_SIZE);
+			//	CL_CHECKED_CALL(clEnqueueReadBuffer, queue, slot.vm_states_gpu, CL_TRUE, 0, buf.size(), buf.data(), 0, nullptr, nullptr);
+			//	FILE* fp;
+			//	fopen_s(&fp, "vm_states.bin", "wb");
+			//	fwrite(buf.data(), 1, buf.size(), fp);
+			//	fclose(fp);
+			//	return false;
+			//}
+			uint32_t first = 1;
+			uint32_t last = 0;
+			uint32_t n = iterations;
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 5, sizeof(uint32_t), &n);
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 6, sizeof(uint32_t), &first);
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 7, sizeof(uint32_t), &last);
+
+			// The VM state is kept in vm_states between launches, so any split works. The last launch runs what's left.
+			for (uint32_t done = 0; done < RANDOMX_PROGRAM_ITERATIONS; done += n)
 			{
-				//if (i == 0)
-				//{
-				//	CL_CHECKED_CALL(clFinish, ctx.queue);
-				//	std::vector<char> buf(intensity * VM_STATE_SIZE);
-				//	CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, vm_states_gpu, CL_TRUE, 0, buf.size(), buf.data(), 0, nullptr, nullptr);
-				//	FILE* fp;
-				//	fopen_s(&fp, "vm_states.bin", "wb");
-				//	fwrite(buf.data(), 1, buf.size(), fp);
-				//	fclose(fp);
-				//	return false;
-				//}
-				uint32_t first = 1;
-				uint32_t last = 0;
-				CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 6, sizeof(uint32_t), &first);
-				CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 7, sizeof(uint32_t), &last);
-				for (int j = 0, n = 1 << bfactor; j < n; ++j)
+				if (done + n >= RANDOMX_PROGRAM_ITERATIONS)
 				{
-					if (j == n - 1)
+					if (done + n > RANDOMX_PROGRAM_ITERATIONS)
 					{
-						last = 1;
-						CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 7, sizeof(uint32_t), &last);
-					}
-
-					CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_randomx_run, 1, nullptr, (workers_per_hash == 16) ? &global_work_size16 : &global_work_size8, (workers_per_hash == 16) ? &local_work_size32 : &local_work_size16, 0, nullptr, nullptr);
-
-					if (j == 0)
-					{
-						first = 0;
-						CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 6, sizeof(uint32_t), &first);
+						n = RANDOMX_PROGRAM_ITERATIONS - done;
+						CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 5, sizeof(uint32_t), &n);
 					}
+					last = 1;
+					CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 7, sizeof(uint32_t), &last);
 				}
-			}
-			else
-			{
-				//if (i == 0)
-				//{
-				//	CL_CHECKED_CALL(clFinish, ctx.queue);
-				//	std::vector<char> buf(intensity * COMPILED_PROGRAM_SIZE);
-				//	CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, compiled_programs_gpu, CL_TRUE, 0, buf.size(), buf.data(), 0, nullptr, nullptr);
-				//	FILE* fp;
-				//	fopen_s(&fp, "compiled_program.bin", "wb");
-				//	fwrite(buf.data(), 1, buf.size(), fp);
-				//	fclose(fp);
-				//	return false;
-				//}
-				CL_CHECKED_CALL(clFinish, ctx.queue);
-				if (gcn_version == 15)
+
+				cl_event* profile_event = nullptr;
+				if (slicer && (i == 0))
 				{
-					CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_randomx_run, 1, nullptr, &global_work_size32, &local_work_size32, 0, nullptr, nullptr);
+					slot.profile_events.emplace_back(nullptr);
+					slot.profile_iterations.emplace_back(n);
+					profile_event = &slot.profile_events.back();
 				}
-				else
+
+				// Slicing and tracing can both time this launch, they get one event each
+				cl_event* trace_event = slot.Trace(CL_EXECUTE_VM.c_str());
+				CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_randomx_run, 1, nullptr, (workers_per_hash == 16) ? &global_work_size16 : &global_work_size8, (workers_per_hash == 16) ? &local_work_size32 : &local_work_size16, 0, nullptr, profile_event ? profile_event : trace_event);
+				if (profile_event && trace_event)
 				{
-					CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_randomx_run, 1, nullptr, &global_work_size64, &local_work_size, 0, nullptr, nullptr);
+					*trace_event = *profile_event;
+					clRetainEvent(*trace_event);
 				}
-			}
 
-			if (i == RANDOMX_PROGRAM_COUNT - 1)
-			{
-				CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_hashaes1rx4, 1, nullptr, &global_work_size4, &local_work_size, 0, nullptr, nullptr);
-				CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_blake2b_hash_registers_32, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
-			}
-			else
-			{
-				CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel_blake2b_hash_registers_64, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+				if (done == 0)
+				{
+					first = 0;
+					CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_run, 6, sizeof(uint32_t), &first);
+				}
 			}
 		}
-
-		CL_CHECKED_CALL(clFinish, ctx.queue);
-
-		if (validate)
+		else
 		{
-			CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, hashes_gpu, CL_TRUE, 0, intensity * 32, hashes.data(), 0, nullptr, nullptr);
+			// Fallback slots of each program have their own counter
+			const uint32_t program_index = static_cast<uint32_t>(i);
+			CL_CHECKED_CALL(clSetKernelArg, kernel_randomx_init, 6, sizeof(uint32_t), &program_index);
+
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_randomx_init, 1, nullptr, &global_work_size32, &local_work_size, 0, nullptr, slot.Trace(CL_RANDOMX_INIT.c_str()));
+
+			//if (i == 0)
+			//{
+			//	CL_CHECKED_CALL(clFinish, queue);
+			//	std::vector<char> buf(COMPILED_PROGRAM_ARENA_SIZE(batch_size));
+			//	CL_CHECKED_CALL(clEnqueueReadBuffer, queue, slot.compiled_programs_gpu, CL_TRUE, 0, buf.size(), buf.data(), 0, nullptr, nullptr);
+			//	FILE* fp;
+			//	fopen_s(&fp, "compiled_program.bin", "wb");
+			//	fwrite(buf.data(), 1, buf.size(), fp);
+			//	fclose(fp);
+			//	return false;
+			//}
+
+			// No wait for the JIT compiler here: the slot's queue is in-order, so randomx_run starts after randomx_init has finished
+			// and its writes of the generated code are visible. The host doesn't block, other slots keep the GPU busy in the meantime.
+			err = CL_SUCCESS;
+
+			// randomx_run runs the whole program in one launch per scratchpad shard, it's only timed.
+			// Timed iterations are scaled by the shard's part of the batch, so they add up to one program of the whole batch.
+			for (const BatchSlot::GcnShard& shard : slot.gcn_shards)
+			{
+				if (!clSetKernelArgs(kernel_randomx_run, dataset_gpu, shard.scratchpads, shard.registers, shard.rounding, shard.compiled, static_cast<uint32_t>(shard.size), rx_parameters))
+				{
+					return false;
+				}
+
+				cl_event* profile_event = nullptr;
+				if (slicer && (i == 0))
+				{
+					slot.profile_events.emplace_back(nullptr);
+					slot.profile_iterations.emplace_back(static_cast<uint32_t>(RANDOMX_PROGRAM_ITERATIONS * shard.size / batch_size));
+					profile_event = &slot.profile_events.back();
+				}
 
-			cpu_limited = nonce_counter.load() < intensity;
+				cl_event* trace_event = slot.Trace(CL_RANDOMX_RUN.c_str());
+				cl_event* run_event = profile_event ? profile_event : trace_event;
 
-			for (auto& thread : threads)
-				thread.join();
+				const size_t shard_work_size = shard.size * ((gcn_version == 15) ? 32 : 64);
+				err = clEnqueueNDRangeKernel(queue, kernel_randomx_run, 1, nullptr, &shard_work_size, (gcn_version == 15) ? &local_work_size32 : &local_work_size, 0, nullptr, run_event);
+				if (err != CL_SUCCESS)
+					break;
 
-			if (memcmp(hashes.data(), hashes_check.data(), intensity * 32) != 0)
-			{
-				for (uint32_t i = 0; i < intensity * 32; i += 32)
+				if (profile_event && trace_event)
 				{
-					if (memcmp(hashes.data() + i, hashes_check.data() + i, 32))
-					{
-						std::cerr << "CPU validation error, failing nonce = " << (nonce + i / 32) << std::endl;
-						++failed_nonces;
-					}
+					*trace_event = *profile_event;
+					clRetainEvent(*trace_event);
 				}
 			}
+
+			CL_CHECK_RESULT(clEnqueueNDRangeKernel);
 		}
-	}
 
-	return true;
+		if (i == RANDOMX_PROGRAM_COUNT - 1)
+		{
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_hashaes1rx4, 1, nullptr, &global_work_size4, &local_work_size_aes, 0, nullptr, slot.Trace(CL_HASHAES1RX4.c_str()));
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_blake2b_hash_registers_32_target, 1, nullptr, &global_work_size, &local_work_size_blake2b, 0, nullptr, slot.Trace(CL_BLAKE2B_HASH_REGISTERS_32_TARGET.c_str()));
+		}
+		else
+		{
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, queue, kernel_blake2b_hash_registers_64, 1, nullptr, &global_work_size, &local_work_size_blake2b, 0, nullptr, slot.Trace(CL_BLAKE2B_HASH_REGISTERS_64.c_str()));
+		}
+	}
+
+	if (validate)
+	{
+		CL_CHECKED_CALL(clEnqueueReadBuffer, queue, slot.hashes_gpu, CL_FALSE, 0, batch_size * 32, slot.hashes.data(), 0, nullptr, slot.Trace("read hashes"));
+	}
+
+	if (counters)
+	{
+		CL_CHECKED_CALL(clEnqueueReadBuffer, queue, slot.counters_gpu, CL_FALSE, 0, slot.vm_counters.size() * sizeof(uint32_t), slot.vm_counters.data(), 0, nullptr, slot.Trace("read counters"));
+	}
+
+	if (jit_stats)
+	{
+		CL_CHECKED_CALL(clEnqueueReadBuffer, queue, slot.jit_stats_gpu, CL_FALSE, 0, slot.jit_stats.size() * sizeof(uint32_t), slot.jit_stats.data(), 0, nullptr, slot.Trace("read JIT stats"));
+	}
+
+	// Only the share counter, most batches have no shares. Wait() reads the shares if there are any.
+	cl_event* shares_trace = slot.Trace("read shares");
+	CL_CHECKED_CALL(clEnqueueReadBuffer, queue, slot.shares_gpu, CL_FALSE, 0, sizeof(uint32_t), slot.shares, 0, nullptr, &slot.done_event);
+	if (shares_trace)
+	{
+		*shares_trace = slot.done_event;
+		clRetainEvent(slot.done_event);
+	}
+
+	CL_CHECKED_CALL(clFlush, queue);
+	return true;
+}
+
+// Runs one warm-up batch per slot, then times TUNING_BATCHES more. Returns their hashrates, or nothing if the configuration failed.
+static std::vector<double> benchmark(BatchEngine& engine, const Job& job, const DatasetBuffer& dataset, size_t nonce)
+{
+	const uint32_t num_batches = engine.num_slots + TUNING_BATCHES;
+	uint32_t enqueued = 0;
+
+	std::vector<double> hashrates;
+
+	for (auto& slot : engine.slots)
+	{
+		if (!engine.Enqueue(*slot, nonce, job, dataset, 0, false))
+		{
+			return std::vector<double>();
+		}
+		++enqueued;
+	}
+
+	auto prev_time = high_resolution_clock::now();
+
+	for (uint32_t k = 0; k < num_batches; ++k)
+	{
+		BatchSlot& slot = *engine.slots[k % engine.num_slots];
+		if (!engine.Wait(slot))
+		{
+			return std::vector<double>();
+		}
+
+		auto cur_time = high_resolution_clock::now();
+		const double dt = duration_cast<nanoseconds>(cur_time - prev_time).count() / 1e9;
+		prev_time = cur_time;
+
+		if (k >= engine.num_slots)
+			hashrates.push_back(engine.batch_size / dt);
+
+		if (enqueued < num_batches)
+		{
+			if (!engine.Enqueue(slot, nonce, job, dataset, 0, false))
+			{
+				return std::vector<double>();
+			}
+			++enqueued;
+		}
+	}
+
+	return hashrates;
+}
+
+// Mines on one device with nonces from [nonce_begin, nonce_end). Device initialization and allocation messages are serialized
+// by "setup_mutex", so logs of different devices don't mix. Kernel builds and batch buffer allocation run on worker threads
+// while the dataset is built (see Startup), and a breakdown of startup time is printed after the first batch. Datasets come from the shared pool.
+// Launch configuration comes from the device's tuning profile, the command line, or --autotune, which benchmarks it on the first dataset.
+// With --validate, finished batches are handed to the shared "validators" pool.
+static bool mine_device(uint32_t index, const MinerSettings& settings, size_t nonce_begin, size_t nonce_end, HostDatasetPool& pool, ValidatorPool* validators, std::mutex& setup_mutex, DeviceStats& stats, JobSource& jobs)
+{
+	const uint32_t platform_id = settings.devices[index].platform_id;
+	const uint32_t device_id = settings.devices[index].device_id;
+	const uint32_t num_devices = static_cast<uint32_t>(settings.devices.size());
+
+	const bool portable = settings.portable;
+	const bool dataset_host_allocated = settings.dataset_host_allocated;
+	const bool dataset_gpu = settings.dataset_gpu;
+	const bool dataset_hybrid = pool.settings.hybrid;
+	const bool light_mode = settings.light_mode;
+	const bool vm_counters = settings.vm_counters && portable;
+	const std::string& store_dir = settings.store_dir;
+	const bool validate = settings.validate;
+	const bool pipeline = settings.pipeline;
+	const uint64_t difficulty = settings.difficulty;
+
+	// Messages printed after setup can come from several devices at once
+	const std::string prefix = (num_devices > 1) ? ("GPU #" + std::to_string(index) + ": ") : std::string();
+
+	const auto setup_begin = high_resolution_clock::now();
+
+	std::unique_lock<std::mutex> setup_lock(setup_mutex);
+
+	std::cout << "Initializing GPU #" << device_id << " on OpenCL platform #" << platform_id << std::endl << std::endl;
+
+	OpenCLContext ctx;
+	ctx.cache_dir = settings.kernel_cache_dir;
+	if (!ctx.Init(platform_id, device_id, settings.device_type))
+	{
+		return false;
+	}
+
+	// Scratchpad shards and dataset parts follow from the largest allocation, see --max_alloc
+	if (settings.max_alloc)
+		ctx.device_max_alloc_size = std::min<cl_ulong>(ctx.device_max_alloc_size, static_cast<cl_ulong>(settings.max_alloc) << 20);
+
+	Metrics* metrics = Metrics::Instance();
+	if (metrics)
+		metrics->DeviceInfo(index, ctx.device_name.data(), ctx.device_global_mem_size);
+
+	int gcn_version = 12;
+
+	const char* gcn_binary = "randomx_run_gfx803.bin";
+	if (!portable)
+	{
+		std::vector<char> t;
+		std::transform(ctx.device_name.begin(), ctx.device_name.end(), std::back_inserter(t), [](char c) { return static_cast<char>(std::toupper(c)); });
+		if ((strcmp(t.data(), "GFX900") == 0) || (strcmp(t.data(), "GFX906") == 0))
+		{
+			gcn_binary = "randomx_run_gfx900.bin";
+			gcn_version = 14;
+		}
+		else if ((strcmp(t.data(), "GFX1010") == 0) || (strcmp(t.data(), "GFX1011") == 0) || (strcmp(t.data(), "GFX1012") == 0))
+		{
+			gcn_binary = "randomx_run_gfx1010.bin";
+			gcn_version = 15;
+		}
+	}
+
+	const uint32_t subgroups = (portable && settings.subgroups) ? vm_subgroups(ctx) : 0;
+	if (subgroups)
+		std::cout << "execute_vm synchronizes workers with sub-group " << ((subgroups > 1) ? "barriers and shuffles" : "barriers") << " if all workers of a hash fit in one sub-group" << std::endl << std::endl;
+
+	const auto init_end = high_resolution_clock::now();
+
+	// Dataset in host memory is always built on the CPU. GPU initialization needs its kernel before the dataset build,
+	// so it's the only one that isn't compiled in parallel with it.
+	cl_kernel kernel_init_dataset = nullptr;
+	if (dataset_gpu && !dataset_host_allocated)
+	{
+		if (!ctx.Compile("randomx_dataset.bin", { RANDOMX_DATASET_CL }, { CL_INIT_DATASET }, "", COMPILE_CACHE_BINARY))
+		{
+			return false;
+		}
+		kernel_init_dataset = ctx.kernels[CL_INIT_DATASET];
+	}
+
+	// Command line values override the tuning profile, --autotune starts from them
+	const std::string tuning_profile = tuning_mode(settings);
+	TuningParams params;
+	if (!settings.autotune && load_tuning_profile(ctx, tuning_profile, params))
+	{
+		std::cout << "Loaded " << tuning_profile_path(ctx, tuning_profile) << ": " << params.ToString() << std::endl;
+	}
+
+	if (settings.intensity)
+		params.intensity = settings.intensity;
+	if (settings.workers_per_hash != TUNABLE_AUTO)
+		params.workers_per_hash = settings.workers_per_hash;
+	if (settings.bfactor != TUNABLE_AUTO)
+		params.bfactor = settings.bfactor;
+	if (settings.vm_state_interleave != TUNABLE_AUTO)
+		params.vm_state_interleave = settings.vm_state_interleave;
+
+	check_tuning_params(params, portable);
+
+	// Each pipelined batch gets its own scratchpads, so split the intensity evenly between them
+	const uint32_t num_slots = pipeline ? 2 : 1;
+	const size_t intensity_step = 64 * num_slots;
+
+	// Light mode keeps only the cache in VRAM
+	const size_t dataset_size = light_mode ? CACHE_SIZE : (randomx_dataset_item_count() * RANDOMX_DATASET_ITEM_SIZE);
+
+	// GPU initialization needs the cache in VRAM while the second dataset is being built
+	const size_t dataset_init_memory = kernel_init_dataset ? CACHE_SIZE : 0;
+
+	// Every buffer is budgeted before anything is allocated, intensity is computed from what's left.
+	// With a hybrid placement only the part of the dataset in VRAM is budgeted.
+	auto make_memory_plan = [&](uint32_t percent)
+	{
+		const size_t device_size = (dataset_hybrid && !light_mode) ? (static_cast<size_t>(DatasetBuffer::DeviceItems(percent)) * RANDOMX_DATASET_ITEM_SIZE) : dataset_size;
+		return std::unique_ptr<MemoryPlan>(new MemoryPlan(ctx, portable, dataset_host_allocated ? 0 : device_size, dataset_init_memory, num_slots, intensity_step, static_cast<size_t>(settings.memory_reserve) << 20));
+	};
+
+	// --dataset_hybrid auto starts with the most of the dataset in VRAM that leaves room for scratchpads, and benchmarks other splits later
+	uint32_t dataset_percent = dataset_hybrid ? settings.dataset_vram_percent : 100;
+	if (dataset_hybrid && !dataset_percent)
+	{
+		dataset_percent = 100;
+		while ((dataset_percent > DATASET_HYBRID_STEP) && (make_memory_plan(dataset_percent)->max_intensity == 0))
+			dataset_percent -= DATASET_HYBRID_STEP;
+	}
+
+	std::unique_ptr<MemoryPlan> memory_plan = make_memory_plan(dataset_percent);
+
+	// Jobs with a new seed are only picked up after their dataset is ready, see update_datasets below
+	Job current_job;
+	jobs.Get(current_job);
+	Job latest_job = current_job;
+
+	std::unique_ptr<DatasetBuffer> datasets[2];
+	datasets[0].reset(new DatasetBuffer());
+	if (!datasets[0]->Alloc(ctx, pool.settings, kernel_init_dataset, DatasetBuffer::DeviceItems(dataset_percent)))
+	{
+		return false;
+	}
+
+	if (light_mode)
+		std::cout << "Light mode: allocated " << (dataset_size / 1048576.0) << " MB cache on GPU, dataset items will be computed on demand" << std::endl;
+	else if (dataset_host_allocated)
+		std::cout << "Using host-allocated " << (dataset_size / 1048576.0) << " MB dataset" << std::endl;
+	else if (dataset_hybrid)
+		std::cout << "Allocated " << (memory_plan->dataset_size / 1048576.0) << " MB of the " << (dataset_size / 1048576.0) << " MB dataset on GPU, the rest is read from host memory" << std::endl;
+	else
+		std::cout << "Allocated " << (dataset_size / 1048576.0) << " MB dataset on GPU" << std::endl;
+
+	setup_lock.unlock();
+
+	// Hashes are compared against the target on the GPU, only the ones below it are read back
+	const uint64_t target = difficulty ? (0xFFFFFFFFFFFFFFFFULL / difficulty) : 0;
+
+	const bool profiling = (settings.kernel_ms > 0.0) || Tracer::Instance();
+
+	auto set_intensity = [&]()
+	{
+		if (!params.intensity)
+			params.intensity = memory_plan->max_intensity;
+
+		params.intensity -= (params.intensity % intensity_step);
+		memory_plan->Fit(params.intensity);
+
+		if (!params.intensity)
+		{
+			std::cerr << prefix << "Not enough GPU memory for any scratchpads, " << memory_plan->ToString() << std::endl;
+			return false;
+		}
+		return true;
+	};
+
+	// Kernels are compiled and batch buffers are allocated while the dataset is being built. With --autotune or --dataset_hybrid auto
+	// the final configuration is known only after tuning, so only GCN code is compiled in parallel.
+	const bool tune_dataset_split = dataset_hybrid && !settings.dataset_vram_percent;
+	std::vector<std::unique_ptr<BatchSlot>> allocated_slots;
+
+	Startup startup(setup_begin);
+	startup.Record("init", setup_begin, init_end);
+
+	if (!portable)
+		startup.Launch("compile GCN", [&]() { return compile_gcn_kernels(ctx, gcn_binary, gcn_version); });
+
+	if (!settings.autotune && !tune_dataset_split)
+	{
+		if (!set_intensity())
+		{
+			return false;
+		}
+		startup.Launch("compile", [&]() { return compile_tunable_kernels(ctx, params, portable, light_mode, vm_counters, subgroups); });
+		startup.Launch("allocate", [&]() { return BatchEngine::AllocSlots(ctx, params.intensity / num_slots, num_slots, portable, profiling, vm_counters, allocated_slots); });
+	}
+
+	// Dataset threads run next to validation threads, and host threads that feed GPUs mostly wait for events
+	const uint32_t num_cpu_threads = std::thread::hardware_concurrency();
+	const uint32_t reserved_threads = validate ? (num_cpu_threads / 2) : num_devices;
+	const uint32_t dataset_threads = (num_cpu_threads > reserved_threads) ? (num_cpu_threads - reserved_threads) : 1U;
+
+	// All devices wait for the same host dataset here, and upload it in parallel while it's being built
+	{
+		auto t1 = high_resolution_clock::now();
+
+		if (!startup.Run("dataset", [&]() { return datasets[0]->Build(ctx.queue, pool, current_job.seed, num_cpu_threads); }))
+		{
+			return false;
+		}
+
+		std::stringstream s;
+		s << prefix << (light_mode ? "Cache " : "Dataset ") << (datasets[0]->stored ? ("loaded from " + store_dir) : (kernel_init_dataset ? "initialized on GPU" : "initialized"));
+		s << " in " << (duration_cast<nanoseconds>(high_resolution_clock::now() - t1).count() / 1e9) << " seconds";
+		s << " (build " << datasets[0]->build_time << " s, upload " << datasets[0]->upload_time << " s)\n";
+		std::cout << s.str() << std::flush;
+
+		if (metrics)
+			metrics->DatasetBuilt(index, datasets[0]->build_time, datasets[0]->upload_time);
+	}
+
+	if (!startup.Wait())
+	{
+		return false;
+	}
+
+	// Every split is benchmarked with as many scratchpads as fit next to its part of the dataset in VRAM.
+	// Items move between VRAM and host memory only by upload, the host dataset stays in the pool.
+	if (tune_dataset_split)
+	{
+		const auto split_begin = high_resolution_clock::now();
+
+		std::cout << (prefix + "Benchmarking dataset splits between VRAM and host memory\n") << std::flush;
+		TraceScope trace("dataset split");
+
+		uint32_t best_percent = 0;
+		double best_hashrate = 0.0;
+
+		for (uint32_t percent = 100; percent >= DATASET_HYBRID_STEP; percent -= DATASET_HYBRID_STEP)
+		{
+			std::unique_ptr<MemoryPlan> plan = make_memory_plan(percent);
+
+			TuningParams candidate = params;
+			candidate.intensity = plan->max_intensity;
+			if (settings.intensity)
+				candidate.intensity = std::min(candidate.intensity, settings.intensity);
+			candidate.intensity -= candidate.intensity % intensity_step;
+
+			if (!candidate.intensity)
+				continue;
+
+			if (percent != dataset_percent)
+			{
+				datasets[0].reset(new DatasetBuffer());
+				dataset_percent = percent;
+				if (!datasets[0]->Alloc(ctx, pool.settings, kernel_init_dataset, DatasetBuffer::DeviceItems(percent)) || !datasets[0]->Build(ctx.queue, pool, current_job.seed, num_cpu_threads))
+				{
+					return false;
+				}
+			}
+
+			std::vector<double> hashrates;
+			if (compile_tunable_kernels(ctx, candidate, portable, light_mode, false, subgroups))
+			{
+				BatchEngine engine(ctx, candidate, portable, light_mode, gcn_version, num_slots, target, settings.kernel_ms, index, false);
+				if (engine.Init())
+					hashrates = benchmark(engine, current_job, *datasets[0], nonce_begin);
+			}
+
+			std::stringstream s;
+			s << prefix << "  " << percent << "% in VRAM, " << candidate.intensity << " scratchpads: ";
+			if (hashrates.empty())
+			{
+				s << "failed\n";
+			}
+			else
+			{
+				std::sort(hashrates.begin(), hashrates.end());
+				const double median = hashrates[hashrates.size() / 2];
+				s << static_cast<uint64_t>(median) << " h/s\n";
+
+				if (median > best_hashrate)
+				{
+					best_percent = percent;
+					best_hashrate = median;
+				}
+			}
+			std::cout << s.str() << std::flush;
+		}
+
+		if (!best_percent)
+		{
+			std::cerr << prefix << "No dataset split worked" << std::endl;
+			return false;
+		}
+
+		std::cout << (prefix + "Best dataset split: " + std::to_string(best_percent) + "% in VRAM\n") << std::flush;
+
+		if (best_percent != dataset_percent)
+		{
+			datasets[0].reset(new DatasetBuffer());
+			dataset_percent = best_percent;
+			if (!datasets[0]->Alloc(ctx, pool.settings, kernel_init_dataset, DatasetBuffer::DeviceItems(best_percent)) || !datasets[0]->Build(ctx.queue, pool, current_job.seed, num_cpu_threads))
+			{
+				return false;
+			}
+		}
+
+		memory_plan = make_memory_plan(best_percent);
+
+		if (!settings.autotune)
+		{
+			if (!compile_tunable_kernels(ctx, params, portable, light_mode, vm_counters, subgroups) || !set_intensity())
+			{
+				return false;
+			}
+		}
+		startup.Record("dataset split", split_begin, high_resolution_clock::now());
+	}
+
+	if (settings.autotune)
+	{
+		const auto autotune_begin = high_resolution_clock::now();
+
+		// Only one dataset is kept while tuning
+		size_t max_intensity = memory_plan->max_intensity;
+		if (settings.intensity)
+			max_intensity = std::min(max_intensity, settings.intensity);
+		max_intensity -= max_intensity % intensity_step;
+
+		if (!max_intensity)
+		{
+			std::cerr << prefix << "Not enough GPU memory to autotune" << std::endl;
+			return false;
+		}
+
+		std::cout << (prefix + "Autotuning, up to " + std::to_string(max_intensity) + " scratchpads\n") << std::flush;
+
+		TraceScope trace("autotune");
+		Autotuner tuner(params, max_intensity, intensity_step, portable, prefix + "  ");
+
+		TuningParams candidate;
+		while (tuner.Next(candidate))
+		{
+			std::vector<double> hashrates;
+
+			if (compile_tunable_kernels(ctx, candidate, portable, light_mode, false, subgroups))
+			{
+				BatchEngine engine(ctx, candidate, portable, light_mode, gcn_version, num_slots, target, settings.kernel_ms, index, false);
+				if (engine.Init())
+					hashrates = benchmark(engine, current_job, *datasets[0], nonce_begin);
+			}
+
+			tuner.Report(candidate, hashrates);
+		}
+
+		if (tuner.BestHashrate() <= 0.0)
+		{
+			std::cerr << prefix << "Autotuning failed, no configuration worked" << std::endl;
+			return false;
+		}
+
+		params = tuner.Best();
+
+		std::stringstream s;
+		s << prefix << "Best configuration: " << params.ToString() << ", " << static_cast<uint64_t>(tuner.BestHashrate()) << " h/s\n";
+		std::cout << s.str() << std::flush;
+
+		if (save_tuning_profile(ctx, tuning_profile, params, tuner.BestHashrate()))
+			std::cout << (prefix + "Saved " + tuning_profile_path(ctx, tuning_profile) + "\n") << std::flush;
+
+		if (!compile_tunable_kernels(ctx, params, portable, light_mode, vm_counters, subgroups))
+		{
+			return false;
+		}
+
+		if (!set_intensity())
+		{
+			return false;
+		}
+		startup.Record("autotune", autotune_begin, high_resolution_clock::now());
+	}
+
+	const size_t intensity = params.intensity;
+
+	BatchEngine engine(ctx, params, portable, light_mode, gcn_version, num_slots, target, settings.kernel_ms, index, vm_counters);
+	if (!(allocated_slots.empty() ? engine.Init() : engine.Init(std::move(allocated_slots))))
+	{
+		return false;
+	}
+
+	setup_lock.lock();
+
+	const size_t batch_size = engine.batch_size;
+	auto& slots = engine.slots;
+
+	std::cout << prefix << memory_plan->ToString() << std::endl;
+	if (memory_plan->Used() + memory_plan->reserve > memory_plan->global_mem_size)
+		std::cout << prefix << "Warning: intensity " << intensity << " doesn't fit into the memory plan" << std::endl;
+
+	std::cout << prefix << "Allocated " << intensity << " scratchpads";
+	if (num_slots > 1)
+		std::cout << " (" << num_slots << " pipelined batches of " << batch_size << ")";
+	std::cout << std::endl;
+
+	uint32_t num_datasets = 1;
+	if (memory_plan->num_datasets == 2)
+	{
+		datasets[1].reset(new DatasetBuffer());
+		if (datasets[1]->Alloc(ctx, pool.settings, kernel_init_dataset, DatasetBuffer::DeviceItems(dataset_percent)))
+			num_datasets = 2;
+		else
+			datasets[1].reset();
+	}
+
+	if (num_datasets == 2)
+		std::cout << prefix << "Allocated second dataset, it will be built in background on seed change\n" << std::endl;
+	else
+		std::cout << prefix << "Not enough memory for a second dataset, mining will pause on seed change\n" << std::endl;
+
+	if (metrics)
+		metrics->DeviceMemory(index, memory_plan->dataset_size * num_datasets + dataset_init_memory + intensity * memory_plan->hash_memory);
+
+	setup_lock.unlock();
+
+	// Batches are validated in background by the shared pool, a few of them can be in progress before new ones are skipped
+	std::unique_ptr<DeviceValidator> validator;
+	if (validate)
+		validator.reset(new DeviceValidator(*validators, settings.validate_rate, VALIDATION_MAX_LAG * num_slots, prefix));
+
+	uint32_t active_dataset = 0;
+	bool draining = false;
+
+	size_t total_shares = 0;
+	uint64_t cpu_limited_batches = 0;
+
+	auto enqueue_batch = [&](BatchSlot& slot, size_t nonce)
+	{
+		return engine.Enqueue(slot, nonce, current_job, *datasets[active_dataset], active_dataset, validate);
+	};
+
+	// Seed changes: a job with a new seed is picked up only when its dataset is ready.
+	// With two datasets the new one is built and uploaded in background while mining continues on the current one,
+	// otherwise all batches in flight are finished first and the only dataset is rebuilt in place.
+	auto update_datasets = [&]()
+	{
+		jobs.Get(latest_job);
+
+		if (num_datasets == 1)
+		{
+			if (latest_job.seed != datasets[0]->seed)
+			{
+				draining = true;
+				for (auto& s : slots)
+				{
+					if (s->done_event)
+						return true;
+				}
+
+				std::cout << "\n" << prefix << "Seed changed, rebuilding dataset" << std::endl;
+				TraceScope trace("dataset build");
+				auto t1 = high_resolution_clock::now();
+
+				if (!datasets[0]->Build(ctx.queue, pool, latest_job.seed, num_cpu_threads))
+				{
+					return false;
+				}
+
+				std::stringstream s;
+				s << prefix << "Dataset rebuilt in " << (duration_cast<nanoseconds>(high_resolution_clock::now() - t1).count() / 1e9) << " seconds";
+				s << " (build " << datasets[0]->build_time << " s, upload " << datasets[0]->upload_time << " s)\n";
+				std::cout << s.str() << std::flush;
+				draining = false;
+
+				if (metrics)
+					metrics->DatasetBuilt(index, datasets[0]->build_time, datasets[0]->upload_time);
+			}
+		}
+		else
+		{
+			DatasetBuffer& active = *datasets[active_dataset];
+			DatasetBuffer& spare = *datasets[active_dataset ^ 1];
+
+			if (!spare.Update(ctx.queue))
+			{
+				return false;
+			}
+
+			const std::vector<uint8_t>& wanted_seed = (latest_job.seed != active.seed) ? latest_job.seed : latest_job.next_seed;
+			if (!wanted_seed.empty() && (wanted_seed != active.seed) && (wanted_seed != spare.seed) && (spare.state != DatasetBuffer::BUILDING) && (spare.state != DatasetBuffer::UPLOADING))
+			{
+				// Right after a switch the spare dataset can still be used by batches in flight
+				bool spare_in_use = false;
+				for (auto& s : slots)
+				{
+					if (s->done_event && (s->dataset_index != active_dataset))
+						spare_in_use = true;
+				}
+
+				if (!spare_in_use)
+				{
+					std::cout << "\n" << prefix << "Building dataset for the new seed in background" << std::endl;
+					spare.BuildAsync(pool, wanted_seed, dataset_threads);
+				}
+			}
+
+			if ((latest_job.seed != active.seed) && (spare.state == DatasetBuffer::READY) && (spare.seed == latest_job.seed))
+			{
+				active_dataset ^= 1;
+				std::stringstream s;
+				s << "\n" << prefix << "Switched to the new dataset (build " << spare.build_time << " s, upload " << spare.upload_time << " s)\n";
+				std::cout << s.str() << std::flush;
+
+				if (metrics)
+					metrics->DatasetBuilt(index, spare.build_time, spare.upload_time);
+			}
+		}
+
+		if (latest_job.seed == datasets[active_dataset]->seed)
+			current_job = latest_job;
+
+		return true;
+	};
+
+	const auto first_enqueue = high_resolution_clock::now();
+	bool first_batch = true;
+
+	size_t next_nonce = nonce_begin;
+	for (auto& slot : slots)
+	{
+		if (!enqueue_batch(*slot, next_nonce))
+		{
+			return false;
+		}
+		next_nonce += batch_size;
+	}
+
+	auto prev_time = high_resolution_clock::now();
+	auto slicer_report_time = prev_time;
+
+	for (size_t k = 0;; ++k)
+	{
+		BatchSlot& slot = *slots[k % num_slots];
+
+		const bool batch_done = (slot.done_event != nullptr);
+		if (batch_done)
+		{
+			if (!engine.Wait(slot))
+			{
+				return false;
+			}
+
+			const double latency = duration_cast<nanoseconds>(high_resolution_clock::now() - slot.enqueue_time).count() / 1e9;
+
+			if (first_batch)
+			{
+				first_batch = false;
+				const auto t = high_resolution_clock::now();
+				startup.Record("first batch", first_enqueue, t);
+				std::cout << ("\n" + prefix + startup.Report(t)) << std::flush;
+			}
+
+			if (!slot.jit_stats.empty() && slot.jit_stats[JIT_STATS_DROPPED])
+			{
+				std::cerr << prefix << slot.jit_stats[JIT_STATS_DROPPED] << " programs didn't fit into compiled program slots, shares of the batch were discarded" << std::endl;
+			}
+
+			// Sampled hashes and shares are copied, so the slot can be reused right away
+			if (validator)
+			{
+				const uint64_t skipped = validator->skipped;
+				validator->Submit(datasets[slot.dataset_index]->source, light_mode, slot.job, slot.nonce, slot.hashes.data(), batch_size, slot.shares, target);
+				if (validator->skipped != skipped)
+					++cpu_limited_batches;
+			}
+
+			if (slot.shares[0] > MAX_SHARES)
+			{
+				std::cerr << prefix << slot.shares[0] << " shares found in one batch, only " << MAX_SHARES << " were saved. Increase difficulty." << std::endl;
+			}
+			total_shares += std::min<uint32_t>(slot.shares[0], MAX_SHARES);
+
+			stats.hashes += batch_size;
+			stats.shares = total_shares;
+			if (validator)
+			{
+				stats.validated = validator->validated.load();
+				stats.failed = validator->failed.load();
+				stats.cpu_limited = (validator->skipped > 0);
+			}
+
+			if (metrics)
+			{
+				metrics->BatchDone(index, batch_size, std::min<uint32_t>(slot.shares[0], MAX_SHARES), latency);
+				if (validator)
+					metrics->Validation(index, validator->validated, validator->failed, validator->skipped, cpu_limited_batches);
+			}
+		}
+
+		if (!update_datasets())
+		{
+			return false;
+		}
+
+		// Keep the other slots busy: enqueue the next batch before spending any more time on the host
+		if (!draining && (next_nonce + batch_size <= nonce_end))
+		{
+			if (!enqueue_batch(slot, next_nonce))
+			{
+				return false;
+			}
+			next_nonce += batch_size;
+		}
+
+		if (batch_done && (num_devices == 1))
+		{
+			auto cur_time = high_resolution_clock::now();
+			const double dt = duration_cast<nanoseconds>(cur_time - prev_time).count() / 1e9;
+			prev_time = cur_time;
+
+			if (validator)
+			{
+				printf("%s, %.0f h/s\n", validator->Summary().c_str(), batch_size / dt);
+			}
+			else
+			{
+				printf("%.0f h/s, %zu shares\t\r", batch_size / dt, total_shares);
+			}
+		}
+
+		// Launch timings change slowly, so they're reported less often than the hashrate
+		if (batch_done && engine.slicer && (high_resolution_clock::now() - slicer_report_time >= seconds(10)))
+		{
+			slicer_report_time = high_resolution_clock::now();
+			std::cout << ("\n" + prefix + "Kernel launches: " + engine.slicer->Stats() + "\n") << std::flush;
+		}
+
+		// Nothing in flight and nothing enqueued means everything has been processed
+		if (std::none_of(slots.begin(), slots.end(), [](const std::unique_ptr<BatchSlot>& s) { return s->done_event != nullptr; }))
+			break;
+	}
+
+	if (validator)
+	{
+		validator->Drain();
+		stats.validated = validator->validated.load();
+		stats.failed = validator->failed.load();
+
+		if (metrics)
+			metrics->Validation(index, validator->validated, validator->failed, validator->skipped, cpu_limited_batches);
+		std::cout << ("\n" + prefix + validator->Summary() + "\n") << std::flush;
+	}
+
+	if (engine.counters)
+		std::cout << ("\n" + prefix + engine.counters->Report() + "\n") << std::flush;
+
+	if (engine.jit_stats)
+		std::cout << ("\n" + prefix + engine.jit_stats->Report() + "\n") << std::flush;
+
+	return true;
+}
+
+
+bool test_mining(const MinerSettings& settings, JobSource& jobs)
+{
+	MinerSettings s = settings;
+
+	// Created first and destroyed last: all threads that record into it are gone by then
+	std::unique_ptr<Tracer> tracer;
+	if (!s.trace_file.empty())
+		tracer.reset(new Tracer(s.trace_file));
+
+	// Computing dataset items on demand is implemented only in execute_vm, GCN assembly code reads them from the dataset
+	if (s.light_mode)
+	{
+		if (!s.portable)
+			std::cout << "Light mode works only with portable code, switching to it" << std::endl;
+
+		s.portable = true;
+		s.dataset_host_allocated = false;
+		s.dataset_gpu = false;
+		s.dataset_hybrid = false;
+	}
+
+	// Counters are only in execute_vm, GCN assembly code can't be instrumented
+	if (s.vm_counters && !s.portable)
+	{
+		std::cout << "VM counters work only with portable code, switching to it" << std::endl;
+		s.portable = true;
+	}
+
+	// The whole dataset in host memory wins over a split
+	if (s.dataset_host_allocated)
+		s.dataset_hybrid = false;
+
+	// Same for a dataset split between buffers, GCN assembly code reads it from one buffer
+	if (s.dataset_hybrid)
+	{
+		if (!s.portable)
+			std::cout << "Hybrid dataset placement works only with portable code, switching to it" << std::endl;
+
+		s.portable = true;
+		s.dataset_gpu = false;
+	}
+
+	// Host datasets are built once and shared by all devices
+	DatasetSettings dataset_settings;
+	dataset_settings.light = s.light_mode;
+	dataset_settings.gpu_init = s.dataset_gpu;
+	dataset_settings.host_memory = s.dataset_host_allocated;
+	dataset_settings.hybrid = s.dataset_hybrid;
+	dataset_settings.max_parts = s.portable ? MAX_DATASET_PARTS : 1;
+	dataset_settings.host_copy = s.validate;
+	dataset_settings.store_dir = s.store_dir;
+
+	HostDatasetPool pool(dataset_settings);
+
+	const uint32_t num_devices = static_cast<uint32_t>(s.devices.size());
+	if (!num_devices)
+	{
+		std::cerr << "No devices to mine on" << std::endl;
+		return false;
+	}
+
+	// Scrapes can come at any time, so metrics must outlive all mining threads
+	std::unique_ptr<Metrics> metrics;
+	if (!s.metrics_address.empty() || !s.metrics_json.empty())
+	{
+		metrics.reset(new Metrics(num_devices));
+		if (!s.metrics_address.empty() && !metrics->Listen(s.metrics_address))
+		{
+			return false;
+		}
+		if (!s.metrics_json.empty())
+			metrics->StartSnapshots(s.metrics_json, std::max(s.metrics_interval, 1U) * 1000);
+	}
+
+	// Nonces are 32-bit on GPU, every device gets an equal part of what's left after start_nonce
+	const size_t nonce_range = (0x100000000ULL - s.start_nonce) / num_devices;
+
+	std::mutex setup_mutex;
+	std::unique_ptr<DeviceStats[]> stats(new DeviceStats[num_devices]);
+
+	// Validation threads are shared by all devices and live as long as mining does, half of the CPU is left for them
+	std::unique_ptr<ValidatorPool> validators;
+	if (s.validate)
+		validators.reset(new ValidatorPool(std::max(std::thread::hardware_concurrency() / 2, 1U)));
+
+	// The CPU part of the first dataset doesn't depend on any device, so it's started before devices are initialized
+	{
+		Job job;
+		jobs.Get(job);
+		pool.Get(job.seed, std::thread::hardware_concurrency());
+	}
+
+	std::vector<SThread> threads;
+	for (uint32_t i = 0; i < num_devices; ++i)
+	{
+		const size_t nonce_begin = s.start_nonce + i * nonce_range;
+		const size_t nonce_end = nonce_begin + nonce_range;
+
+		threads.emplace_back([&s, &pool, &validators, &setup_mutex, &stats, &jobs, i, nonce_begin, nonce_end]()
+		{
+			stats[i].result = mine_device(i, s, nonce_begin, nonce_end, pool, validators.get(), setup_mutex, stats[i], jobs);
+			stats[i].done = true;
+		});
+	}
+
+	// A single device prints its hashrate after every batch, otherwise per-device and total hashrate is printed here
+	if (num_devices > 1)
+	{
+		constexpr int REPORT_INTERVAL_MS = 10000;
+
+		std::vector<uint64_t> prev_hashes(num_devices, 0);
+		auto prev_time = high_resolution_clock::now();
+
+		for (;;)
+		{
+			bool all_done = true;
+			for (int t = 0; (t < REPORT_INTERVAL_MS) && all_done; t += 100)
+			{
+				std::this_thread::sleep_for(milliseconds(100));
+
+				all_done = true;
+				for (uint32_t i = 0; i < num_devices; ++i)
+				{
+					if (!stats[i].done)
+						all_done = false;
+				}
+			}
+
+			auto cur_time = high_resolution_clock::now();
+			const double dt = duration_cast<nanoseconds>(cur_time - prev_time).count() / 1e9;
+			prev_time = cur_time;
+
+			std::stringstream report;
+			double total_hashrate = 0.0;
+			uint64_t total_shares = 0;
+			uint64_t validated = 0;
+			uint64_t failed = 0;
+			bool cpu_limited = false;
+
+			for (uint32_t i = 0; i < num_devices; ++i)
+			{
+				const uint64_t hashes = stats[i].hashes;
+				const double hashrate = (hashes - prev_hashes[i]) / dt;
+				prev_hashes[i] = hashes;
+
+				total_hashrate += hashrate;
+				total_shares += stats[i].shares;
+				validated += stats[i].validated;
+				failed += stats[i].failed;
+				cpu_limited |= stats[i].cpu_limited;
+
+				report << ((i == 0) ? " (" : ", ") << "GPU #" << i << ": " << static_cast<uint64_t>(hashrate);
+			}
+
+			std::cout << "Total " << static_cast<uint64_t>(total_hashrate) << " h/s" << report.str() << "), " << total_shares << " shares";
+			if (s.validate)
+			{
+				std::cout << ", " << (validated - std::min(validated, failed)) << " hashes validated, " << failed << " failed";
+				if (validated)
+					std::cout << ", failure rate < " << (failure_rate_upper_bound(validated, failed) * 100.0) << "% (95% confidence)";
+				std::cout << (cpu_limited ? ", limited by CPU" : "");
+			}
+			std::cout << std::endl;
+
+			if (all_done)
+				break;
+		}
+	}
+
+	bool result = true;
+	for (uint32_t i = 0; i < num_devices; ++i)
+	{
+		threads[i].join();
+		if (!stats[i].result)
+			result = false;
+	}
+
+	return result;
 }
@@ -19,4 +19,125 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 
 #pragma once
 
-bool test_mining(uint32_t platform_id, uint32_t device_id, size_t intensity, uint32_t start_nonce, uint32_t workers_per_hash, uint32_t bfactor, bool portable, bool dataset_host_allocated, bool validate);
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+class JobSource;
+struct OpenCLContext;
+
+// Settings that are taken from the tuning profile (or their defaults) when they're not set on the command line
+constexpr uint32_t TUNABLE_AUTO = 0xFFFFFFFFU;
+
+struct DeviceID
+{
+	uint32_t platform_id;
+	uint32_t device_id;
+};
+
+// Mining settings, the same for all devices
+struct MinerSettings
+{
+	MinerSettings()
+		: device_type(CL_DEVICE_TYPE_GPU)
+		, intensity(0)
+		, memory_reserve(0)
+		, max_alloc(0)
+		, start_nonce(0)
+		, workers_per_hash(TUNABLE_AUTO)
+		, bfactor(TUNABLE_AUTO)
+		, vm_state_interleave(TUNABLE_AUTO)
+		, kernel_ms(0.0)
+		, autotune(false)
+		, portable(false)
+		, dataset_host_allocated(false)
+		, dataset_gpu(false)
+		, dataset_hybrid(false)
+		, dataset_vram_percent(0)
+		, light_mode(false)
+		, vm_counters(false)
+		, subgroups(true)
+		, store_dir(".")
+		, kernel_cache_dir("cache")
+		, validate(false)
+		, validate_rate(1)
+		, pipeline(false)
+		, difficulty(0)
+		, metrics_interval(10)
+	{}
+
+	// Every device mines in its own thread with its own OpenCL context and a disjoint part of the nonce range
+	std::vector<DeviceID> devices;
+
+	// Device IDs count devices of this type, see --device_type
+	cl_device_type device_type;
+
+	// 0 = from the tuning profile or as many as possible
+	size_t intensity;
+
+	// MB of device memory left unused by the memory plan, 0 = automatic
+	uint32_t memory_reserve;
+
+	// Largest buffer in MB if it's less than the device allows, 0 = device limit
+	uint32_t max_alloc;
+
+	uint32_t start_nonce;
+	uint32_t workers_per_hash;
+	uint32_t bfactor;
+
+	// Hashes per block of the VM state layout, see VM_STATE_INTERLEAVE in CL/randomx_constants.h
+	uint32_t vm_state_interleave;
+
+	// Target duration of one execute_vm launch in milliseconds, 0 = split launches by bfactor instead
+	double kernel_ms;
+
+	// Search for the best launch configuration of every device before mining and save it to its tuning profile
+	bool autotune;
+
+	bool portable;
+	bool dataset_host_allocated;
+	bool dataset_gpu;
+
+	// Keep "dataset_vram_percent" of the dataset in VRAM and read the rest from host memory, 0 = benchmark splits and use the fastest
+	bool dataset_hybrid;
+	uint32_t dataset_vram_percent;
+
+	bool light_mode;
+
+	// Count executed instructions, branches and scratchpad accesses of every hash with an instrumented execute_vm and
+	// print them when mining ends. Much slower, for profiling only.
+	bool vm_counters;
+
+	// Let execute_vm synchronize workers of a hash with sub-group functions if the device has them, see VM_SUBGROUPS in CL/randomx_vm.cl
+	bool subgroups;
+
+	std::string store_dir;
+
+	// Compiled OpenCL binaries, empty = always compile
+	std::string kernel_cache_dir;
+
+	bool validate;
+
+	// Validate 1 in N hashes of every batch, 0 = as many as the CPU keeps up with
+	uint32_t validate_rate;
+
+	bool pipeline;
+	uint64_t difficulty;
+
+	// Chrome trace-event JSON file with device timings of every batch and host phases, empty = no tracing
+	std::string trace_file;
+
+	// Where to serve Prometheus metrics: "PORT", "HOST:PORT" or "unix:PATH", empty = off
+	std::string metrics_address;
+
+	// JSON file with the same metrics, rewritten every "metrics_interval" seconds, empty = off
+	std::string metrics_json;
+	uint32_t metrics_interval;
+};
+
+bool test_mining(const MinerSettings& settings, JobSource& jobs);
+
+// Sub-group functions execute_vm can use on this device instead of work-group barriers and local memory:
+// VM_SUBGROUPS in CL/randomx_vm.cl, 0 if the device has none
+uint32_t vm_subgroups(const OpenCLContext& ctx);
@@ -19,9 +19,149 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <functional>
 #include <vector>
+#include <cstdio>
+#include <chrono>
+#include <cerrno>
+#include <algorithm>
+#include <thread>
 #include "opencl_helpers.h"
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "../RandomX/src/blake2/blake2.h"
+
+// Changes every cache key, bump it when the way binaries are built changes
+static constexpr uint32_t BINARY_CACHE_VERSION = 1;
+
+static bool read_file(const std::string& path, std::string& data)
+{
+	std::ifstream f(path, std::ios::binary);
+	if (!f.is_open())
+		return false;
+
+	data.assign((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	return true;
+}
+
+// Appends every file "source" includes with #include "...", recursively. Files are looked up next to the including file first,
+// then in CL (the -I directory). Files that can't be found are left to the compiler, they can't change the key anyway.
+static void add_includes(const std::string& source, const std::string& dir, std::vector<std::string>& visited, std::string& key)
+{
+	std::istringstream lines(source);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		const size_t pos = line.find_first_not_of(" \t");
+		if ((pos == std::string::npos) || (line.compare(pos, 8, "#include") != 0))
+			continue;
+
+		const size_t begin = line.find('"', pos + 8);
+		const size_t end = (begin != std::string::npos) ? line.find('"', begin + 1) : std::string::npos;
+		if (end == std::string::npos)
+			continue;
+
+		const std::string name = line.substr(begin + 1, end - begin - 1);
+		for (const std::string& path : { dir + name, "CL/" + name })
+		{
+			std::string data;
+			if (!read_file(path, data))
+				continue;
+
+			if (std::find(visited.begin(), visited.end(), path) == visited.end())
+			{
+				visited.emplace_back(path);
+				key += path + '\n' + std::to_string(data.size()) + '\n' + data;
+				add_includes(data, path.substr(0, path.find_last_of('/') + 1), visited, key);
+			}
+			break;
+		}
+	}
+}
+
+// Only the last directory of the path is created
+static bool create_directory(const std::string& path)
+{
+#ifdef _WIN32
+	return (_mkdir(path.c_str()) == 0) || (errno == EEXIST);
+#else
+	return (mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST);
+#endif
+}
+
+// Writes to a temporary file first and renames it, so other processes never load a half-written binary.
+// The temporary name has the process and thread ID and is created exclusively, so concurrent writers never share it.
+static bool write_file_atomic(const std::string& path, const char* data, size_t size)
+{
+	std::stringstream tmp;
+#ifdef _WIN32
+	tmp << path << ".tmp" << GetCurrentProcessId();
+#else
+	tmp << path << ".tmp" << getpid();
+#endif
+	tmp << '.' << std::hash<std::thread::id>()(std::this_thread::get_id());
+	const std::string tmp_path = tmp.str();
+
+#ifdef _WIN32
+	HANDLE f = CreateFileA(tmp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (f == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool written = true;
+	for (size_t pos = 0; written && (pos < size);)
+	{
+		DWORD n = 0;
+		written = (WriteFile(f, data + pos, static_cast<DWORD>(std::min<size_t>(size - pos, 1 << 30)), &n, nullptr) != 0) && (n > 0);
+		pos += n;
+	}
+	written = (CloseHandle(f) != 0) && written;
+#else
+	const int f = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (f < 0)
+		return false;
+
+	bool written = true;
+	for (size_t pos = 0; written && (pos < size);)
+	{
+		const ssize_t n = write(f, data + pos, size - pos);
+		if (n < 0)
+			written = (errno == EINTR);
+		else
+			pos += static_cast<size_t>(n);
+	}
+	written = (close(f) == 0) && written;
+#endif
+
+	if (!written)
+	{
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	const bool ok = MoveFileExA(tmp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	const bool ok = (std::rename(tmp_path.c_str(), path.c_str()) == 0);
+#endif
+
+	if (!ok)
+		std::remove(tmp_path.c_str());
+
+	return ok;
+}
+
 OpenCLContext::~OpenCLContext()
 {
 	for (auto& k : kernels)
@@ -31,7 +171,7 @@ OpenCLContext::~OpenCLContext()
 	clReleaseContext(context);
 }
 
-bool OpenCLContext::Init(uint32_t platform_id, uint32_t device_id)
+bool OpenCLContext::Init(uint32_t platform_id, uint32_t device_id, cl_device_type device_type)
 {
 	cl_int err;
 
@@ -47,11 +187,16 @@ bool OpenCLContext::Init(uint32_t platform_id, uint32_t device_id)
 
 	cl_device_id devices[32];
 	cl_uint num_devices;
-	CL_CHECKED_CALL(clGetDeviceIDs, platforms[platform_id], CL_DEVICE_TYPE_GPU, 32, devices, &num_devices);
+	err = clGetDeviceIDs(platforms[platform_id], device_type, 32, devices, &num_devices);
+	if (err == CL_DEVICE_NOT_FOUND)
+		num_devices = 0;
+	else
+		CL_CHECK_RESULT(clGetDeviceIDs);
 
 	if (device_id >= num_devices)
 	{
-		std::cerr << "Invalid device ID (" << device_id << "), " << num_devices << " OpenCL GPU devices available" << std::endl;
+		const char* type_name = (device_type == CL_DEVICE_TYPE_GPU) ? "GPU " : ((device_type == CL_DEVICE_TYPE_CPU) ? "CPU " : "");
+		std::cerr << "Invalid device ID (" << device_id << "), " << num_devices << " OpenCL " << type_name << "devices available" << std::endl;
 		return false;
 	}
 
@@ -59,6 +204,14 @@ bool OpenCLContext::Init(uint32_t platform_id, uint32_t device_id)
 
 	size_t size;
 
+	CL_CHECKED_CALL(clGetPlatformInfo, platforms[platform_id], CL_PLATFORM_NAME, 0, nullptr, &size);
+	platform_name.resize(size);
+	CL_CHECKED_CALL(clGetPlatformInfo, platforms[platform_id], CL_PLATFORM_NAME, size, platform_name.data(), nullptr);
+
+	CL_CHECKED_CALL(clGetPlatformInfo, platforms[platform_id], CL_PLATFORM_VERSION, 0, nullptr, &size);
+	platform_version.resize(size);
+	CL_CHECKED_CALL(clGetPlatformInfo, platforms[platform_id], CL_PLATFORM_VERSION, size, platform_version.data(), nullptr);
+
 	CL_CHECKED_CALL(clGetDeviceInfo, device, CL_DEVICE_NAME, 0, nullptr, &size);
 	device_name.resize(size);
 	CL_CHECKED_CALL(clGetDeviceInfo, device, CL_DEVICE_NAME, size, device_name.data(), nullptr);
@@ -69,6 +222,9 @@ bool OpenCLContext::Init(uint32_t platform_id, uint32_t device_id)
 	CL_CHECKED_CALL(clGetDeviceInfo, device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(device_compute_units), &device_compute_units, nullptr);
 	CL_CHECKED_CALL(clGetDeviceInfo, device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(device_max_alloc_size), &device_max_alloc_size, nullptr);
 
+	CL_CHECKED_CALL(clGetDeviceInfo, device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(device_mem_base_addr_align), &device_mem_base_addr_align, nullptr);
+	device_mem_base_addr_align /= 8;
+
 	CL_CHECKED_CALL(clGetDeviceInfo, device, CL_DEVICE_VENDOR, 0, nullptr, &size);
 	device_vendor.resize(size);
 	CL_CHECKED_CALL(clGetDeviceInfo, device, CL_DEVICE_VENDOR, size, device_vendor.data(), nullptr);
@@ -104,7 +260,24 @@ bool OpenCLContext::Init(uint32_t platform_id, uint32_t device_id)
 	return true;
 }
 
-bool OpenCLContext::Compile(const char* binary_name, const std::initializer_list<std::string>& source_files, const std::initializer_list<std::string>& kernel_names, const std::string& options, CachingParameters caching, uint32_t force_elf_binary_flags)
+bool OpenCLContext::HasExtension(const char* name) const
+{
+	if (device_extensions.empty())
+		return false;
+
+	// Names are separated by spaces, one can be a prefix of another
+	std::istringstream s(device_extensions.data());
+	std::string extension;
+	while (s >> extension)
+	{
+		if (extension == name)
+			return true;
+	}
+
+	return false;
+}
+
+bool OpenCLContext::Compile(const char* binary_name, const std::initializer_list<std::string>& source_files, const std::initializer_list<std::string>& kernel_names, const std::string& options, CachingParameters caching, uint32_t force_elf_binary_flags, uint32_t* elf_binary_flags)
 {
 	std::vector<std::string> source;
 	source.reserve(source_files.size());
@@ -127,11 +300,35 @@ bool OpenCLContext::Compile(const char* binary_name, const std::initializer_list
 	const char** p = data.data();
 	cl_int err;
 
+	std::string s = "-Werror -I CL";
+	if (!options.empty())
+	{
+		s += ' ';
+		s += options;
+	}
+
+	// Cached binaries are named after everything that was used to build them, any change means a different file.
+	// GCN binaries are assembled outside of the miner, so they're always loaded by name.
+	std::string binary_path = binary_name;
+	if (caching == COMPILE_CACHE_BINARY)
+	{
+		if (cache_dir.empty() || !create_directory(cache_dir))
+		{
+			if (!cache_dir.empty())
+				std::cerr << "Couldn't create " << cache_dir << ", compiling without cache" << std::endl;
+			caching = ALWAYS_COMPILE;
+		}
+		else
+		{
+			binary_path = BinaryCachePath(binary_name, source_files, source, s);
+		}
+	}
+
 	cl_program program = nullptr;
 	bool created_with_binary = false;
 	if (caching != ALWAYS_COMPILE)
 	{
-		std::ifstream f(binary_name, std::ios::binary);
+		std::ifstream f(binary_path, std::ios::binary);
 		if (f.is_open())
 		{
 			std::vector<char> buf;
@@ -144,13 +341,21 @@ bool OpenCLContext::Compile(const char* binary_name, const std::initializer_list
 			const unsigned char* binary_data = reinterpret_cast<const unsigned char*>(buf.data());
 
 			program = clCreateProgramWithBinary(context, 1, &device, &data_length, &binary_data, nullptr, &err);
-			CL_CHECK_RESULT(clCreateProgramWithBinary);
 
-			created_with_binary = true;
+			// Cached binaries are shared by all devices, a binary compiled for a different GPU is just compiled again from source
+			if ((err != CL_SUCCESS) && (caching == COMPILE_CACHE_BINARY))
+			{
+				program = nullptr;
+			}
+			else
+			{
+				CL_CHECK_RESULT(clCreateProgramWithBinary);
+				created_with_binary = true;
+			}
 		}
 		else if (caching == ALWAYS_USE_BINARY)
 		{
-			std::cerr << "Couldn't open " << binary_name << std::endl;
+			std::cerr << "Couldn't open " << binary_path << std::endl;
 			return false;
 		}
 	}
@@ -166,17 +371,25 @@ bool OpenCLContext::Compile(const char* binary_name, const std::initializer_list
 		CL_CHECK_RESULT(clCreateProgramWithSource);
 	}
 
-	std::cout << "Compiling " << binary_name << "...";
-	std::string s = "-Werror -I CL";
-	if (!options.empty())
+	// Programs can be built by several threads at once (see Startup), so every message is printed as a whole line
+	const auto build_start = std::chrono::high_resolution_clock::now();
+
+	err = clBuildProgram(program, 1, &device, s.c_str(), nullptr, nullptr);
+	if ((err != CL_SUCCESS) && created_with_binary && (caching == COMPILE_CACHE_BINARY))
 	{
-		s += ' ';
-		s += options;
+		std::cout << ("Cached binary " + binary_path + " doesn't work on this device, compiling from source\n") << std::flush;
+
+		clReleaseProgram(program);
+		program = clCreateProgramWithSource(context, static_cast<cl_uint>(source_files.size()), p, nullptr, &err);
+		CL_CHECK_RESULT(clCreateProgramWithSource);
+
+		created_with_binary = false;
+		err = clBuildProgram(program, 1, &device, s.c_str(), nullptr, nullptr);
 	}
-	err = clBuildProgram(program, 1, &device, s.c_str(), nullptr, nullptr);
+
 	if (err != CL_SUCCESS)
 	{
-		std::cerr << "clBuildProgram failed: error " << err << std::endl;
+		std::cerr << "clBuildProgram failed for " << binary_path << ": error " << err << std::endl;
 
 		size_t size;
 		CL_CHECKED_CALL(clGetProgramBuildInfo, program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &size);
@@ -189,7 +402,10 @@ bool OpenCLContext::Compile(const char* binary_name, const std::initializer_list
 
 		return false;
 	}
-	std::cout << "done" << std::endl;
+
+	std::stringstream msg;
+	msg << (created_with_binary ? "Loaded " : "Compiled ") << binary_path << " in " << (std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - build_start).count() / 1e9) << " s\n";
+	std::cout << msg.str() << std::flush;
 
 	size_t bin_size;
 	CL_CHECKED_CALL(clGetProgramInfo, program, CL_PROGRAM_BINARY_SIZES, sizeof(bin_size), &bin_size, nullptr);
@@ -198,23 +414,68 @@ bool OpenCLContext::Compile(const char* binary_name, const std::initializer_list
 	char* tmp[1] = { binary_data.data() };
 	CL_CHECKED_CALL(clGetProgramInfo, program, CL_PROGRAM_BINARIES, sizeof(tmp), tmp, NULL);
 
-	elf_binary_flags = (bin_size >= 0x34) ? *(uint32_t*)(binary_data.data() + 0x30) : 0;
-
-	if (!created_with_binary)
+	if (!created_with_binary && !write_file_atomic(binary_path, tmp[0], bin_size))
 	{
-		std::ofstream f(binary_name, std::ios::binary);
-		f.write(tmp[0], bin_size);
-		f.close();
+		std::cerr << "Couldn't write " << binary_path << std::endl;
 	}
 
+	if (elf_binary_flags)
+		*elf_binary_flags = (bin_size >= 0x34) ? *(uint32_t*)(binary_data.data() + 0x30) : 0;
+
+	std::lock_guard<std::mutex> lock(kernels_mutex);
+
 	for (const std::string& name : kernel_names)
 	{
 		cl_kernel kernel = clCreateKernel(program, name.c_str(), &err);
 		CL_CHECK_RESULT(clCreateKernel);
 
-		kernels.emplace(name, kernel);
+		// Recompiling with different options (see --autotune) replaces kernels with the same name
+		auto it = kernels.find(name);
+		if (it != kernels.end())
+		{
+			clReleaseKernel(it->second);
+			it->second = kernel;
+		}
+		else
+		{
+			kernels.emplace(name, kernel);
+		}
 	}
 
 	CL_CHECKED_CALL(clReleaseProgram, program);
 	return true;
 }
+
+std::string OpenCLContext::BinaryCachePath(const char* binary_name, const std::initializer_list<std::string>& source_files, const std::vector<std::string>& sources, const std::string& build_options) const
+{
+	std::string key = std::to_string(BINARY_CACHE_VERSION) + '\n';
+	for (const std::vector<char>* v : { &platform_name, &platform_version, &device_name, &device_version, &device_driver_version })
+		key.append(v->data(), strnlen(v->data(), v->size())) += '\n';
+	key += build_options + '\n';
+
+	std::vector<std::string> visited;
+	size_t i = 0;
+	for (const std::string& source_file : source_files)
+	{
+		const std::string& data = sources[i++];
+		key += source_file + '\n' + std::to_string(data.size()) + '\n' + data;
+		add_includes(data, source_file.substr(0, source_file.find_last_of('/') + 1), visited, key);
+	}
+
+	uint8_t hash[8];
+	blake2b(hash, sizeof(hash), key.data(), key.size(), nullptr, 0);
+
+	// The original name stays in front, so it's clear what's in the cache directory
+	std::string name = binary_name;
+	const size_t ext = name.rfind(".bin");
+	if (ext != std::string::npos)
+		name.resize(ext);
+
+	std::stringstream path;
+	path << cache_dir << '/' << name << '_';
+	for (uint8_t b : hash)
+		path << std::hex << std::setw(2) << std::setfill('0') << static_cast<uint32_t>(b);
+	path << ".bin";
+
+	return path.str();
+}
@@ -25,6 +25,7 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <thread>
 #include <map>
+#include <mutex>
 #include <vector>
 #include <CL/cl.h>
 
@@ -56,30 +57,49 @@ struct OpenCLContext
 	OpenCLContext()
 		: context(0)
 		, queue(0)
-		, elf_binary_flags(0)
+		, cache_dir("cache")
 	{}
 
 	~OpenCLContext();
 
-	bool Init(uint32_t platform_id, uint32_t device_id);
-	bool Compile(const char* binary_name, const std::initializer_list<std::string>& source_files, const std::initializer_list<std::string>& kernel_names, const std::string& options = std::string(), CachingParameters caching = ALWAYS_COMPILE, uint32_t force_elf_binary_flags = 0);
+	// "device_id" counts only devices of "device_type" (CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_CPU or CL_DEVICE_TYPE_ALL)
+	bool Init(uint32_t platform_id, uint32_t device_id, cl_device_type device_type = CL_DEVICE_TYPE_GPU);
+	// "elf_binary_flags" (if not null) gets the ELF flags of the built program, they describe the target GPU
+	bool Compile(const char* binary_name, const std::initializer_list<std::string>& source_files, const std::initializer_list<std::string>& kernel_names, const std::string& options = std::string(), CachingParameters caching = ALWAYS_COMPILE, uint32_t force_elf_binary_flags = 0, uint32_t* elf_binary_flags = nullptr);
+
+	// Where COMPILE_CACHE_BINARY binaries are stored: "binary_name" followed by a hash of the sources (with included files),
+	// build options, platform, device and driver version
+	std::string BinaryCachePath(const char* binary_name, const std::initializer_list<std::string>& source_files, const std::vector<std::string>& sources, const std::string& build_options) const;
+
+	// "name" is in the device's extension list
+	bool HasExtension(const char* name) const;
 
 	cl_device_id device;
 	cl_context context;
 	cl_command_queue queue;
-	uint32_t elf_binary_flags;
 	std::map<std::string, cl_kernel> kernels;
 
+	// Compile() can be called from several threads at once, it only locks to update "kernels"
+	std::mutex kernels_mutex;
+
 	std::vector<char> device_name;
 	cl_ulong device_global_mem_size;
 	cl_ulong device_local_mem_size;
 	cl_uint device_freq;
 	cl_uint device_compute_units;
 	cl_ulong device_max_alloc_size;
+
+	// Alignment of sub-buffer offsets in bytes
+	cl_uint device_mem_base_addr_align;
 	std::vector<char> device_vendor;
 	std::vector<char> device_version;
 	std::vector<char> device_driver_version;
 	std::vector<char> device_extensions;
+	std::vector<char> platform_name;
+	std::vector<char> platform_version;
+
+	// Binary cache directory, empty = don't cache binaries
+	std::string cache_dir;
 };
 
 struct DevicePtr
@@ -0,0 +1,332 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "scheduler_stats.h"
+#include "opencl_helpers.h"
+#include "definitions.h"
+#include "CL/randomx_scheduler.h"
+
+typedef Schedule (*Scheduler)(uint2* src_program, exec_t* execution_plan, const int32_t workers);
+
+static const struct
+{
+	const char* name;
+	Scheduler func;
+} SCHEDULERS[] = {
+	{ "in-order", schedule_in_order },
+	{ "critical path", schedule_critical_path },
+};
+
+static constexpr size_t NUM_SCHEDULERS = sizeof(SCHEDULERS) / sizeof(SCHEDULERS[0]);
+
+struct SchedulerTotals
+{
+	SchedulerTotals() : steps(0), instructions(0), slots(0), invalid(0) {}
+
+	void Add(const SchedulerTotals& other)
+	{
+		steps += other.steps;
+		instructions += other.instructions;
+		slots += other.slots;
+		invalid += other.invalid;
+	}
+
+	uint64_t steps;
+	uint64_t instructions;
+	uint64_t slots;
+	uint64_t invalid;
+};
+
+// Steps inner_loop needs for one pass over the program, 0 if the schedule is invalid: an instruction is missing or in the wrong slots,
+// runs before or together with something it must run after, or a CBRANCH doesn't jump exactly to the instructions of its loop
+static uint32_t check_schedule(const std::vector<uint2>& program, const std::vector<exec_t>& plan, const Schedule& s, int32_t workers, uint64_t& slots)
+{
+	std::vector<int32_t> step(RANDOMX_PROGRAM_SIZE, -1);
+	std::vector<int32_t> position(RANDOMX_PROGRAM_SIZE, -1);
+	std::vector<uint32_t> compiled;
+
+	auto occupied = [&](int32_t j) { return plan[j] || (j == s.first_instruction_slot) || ((j == s.first_instruction_slot + 1) && s.first_instruction_fp); };
+
+	// Same walk over the plan as in init_vm, FP instructions come first in their group and take 2 slots starting at an even one
+	int32_t steps = 0;
+	bool group_has_int = false;
+	slots = 0;
+	for (int32_t j = 0; j <= s.last_used_slot; ++j)
+	{
+		if (!occupied(j))
+			continue;
+
+		if ((j % workers == 0) || !occupied(j - 1))
+		{
+			++steps;
+			group_has_int = false;
+		}
+
+		const uint32_t i = plan[j];
+		const bool is_fp = (program[i].x & (0x20 << 8)) != 0;
+		if (position[i] >= 0)
+			return 0;
+
+		if (is_fp)
+		{
+			if ((j & 1) || group_has_int || (j + 1 > s.last_used_slot) || (plan[j + 1] != i) || ((j + 1) % workers == 0))
+				return 0;
+			++j;
+			++slots;
+		}
+		else
+		{
+			group_has_int = true;
+		}
+
+		++slots;
+		step[i] = steps;
+		position[i] = static_cast<int32_t>(compiled.size());
+		compiled.push_back(i);
+	}
+
+	// Latest step of every earlier instruction that later ones depend on
+	int32_t reg_write[8] = {}, reg_read[8] = {}, fp_write[8] = {};
+	int32_t store = 0, store_l3 = 0, memory = 0, cfround = 0, fp = 0, branch = 0, any = 0;
+
+	int32_t prev_branch = -1;
+	for (uint32_t i = 0; i < RANDOMX_PROGRAM_SIZE; ++i)
+	{
+		const uint32_t d = schedule_decode(program[i]);
+		if (d & SCHED_NOP)
+		{
+			if (position[i] >= 0)
+				return 0;
+			continue;
+		}
+
+		const int32_t t = step[i];
+		if (t < 0)
+			return 0;
+
+		int32_t after = branch;
+		int32_t not_before = 0;
+		for (uint32_t r = 0; r < 8; ++r)
+		{
+			if (d & (0x101U << r))
+				update_max(after, reg_write[r]);
+			if (d & (0x10000U << r))
+				update_max(after, fp_write[r]);
+			if (d & (0x100U << r))
+				update_max(not_before, reg_read[r]);
+		}
+		if (d & SCHED_STORE)
+			update_max(after, memory);
+		if (d & SCHED_LOAD)
+			update_max(after, (d & SCHED_LOAD_HIGH) ? store_l3 : store);
+		if (d & (SCHED_FP | SCHED_CFROUND))
+			update_max(after, cfround);
+		if (d & SCHED_CFROUND)
+			update_max(not_before, fp);
+		if (d & SCHED_BRANCH)
+			update_max(not_before, any);
+
+		if ((t <= after) || (t < not_before))
+			return 0;
+
+		for (uint32_t r = 0; r < 8; ++r)
+		{
+			if (d & (0x1U << r))
+				update_max(reg_read[r], t);
+			if (d & (0x100U << r))
+				update_max(reg_write[r], t);
+			if (d & (0x10000U << r))
+				update_max(fp_write[r], t);
+		}
+		if (d & SCHED_STORE)
+			update_max(store, t);
+		if (d & SCHED_STORE_L3)
+			update_max(store_l3, t);
+		if (d & (SCHED_LOAD | SCHED_STORE))
+			update_max(memory, t);
+		if (d & SCHED_CFROUND)
+			update_max(cfround, t);
+		if (d & SCHED_FP)
+			update_max(fp, t);
+		update_max(any, t);
+
+		if (d & SCHED_BRANCH)
+		{
+			update_max(branch, t);
+
+			// init_vm jumps to the first instruction marked as a branch target after the previous CBRANCH, or to the start
+			const int32_t p = position[i];
+			int32_t target = 0;
+			for (int32_t k = prev_branch + 1; k <= p; ++k)
+			{
+				if (program[compiled[k]].x & (0x40 << 8))
+				{
+					target = k;
+					break;
+				}
+			}
+
+			// mark_branches() stored the last instruction before the loop in src, 0x80 if the loop starts at instruction 0
+			const uint32_t first = (program[i].x & (0x80 << 8)) ? 0 : (((program[i].x >> 16) & 0xFF) + 1);
+			for (int32_t k = target; k <= p; ++k)
+			{
+				if ((compiled[k] < first) || (compiled[k] > i))
+					return 0;
+			}
+			for (uint32_t k = first; k < i; ++k)
+			{
+				if ((position[k] >= 0) && ((position[k] < target) || (position[k] > p)))
+					return 0;
+			}
+
+			prev_branch = p;
+		}
+	}
+
+	return static_cast<uint32_t>(steps);
+}
+
+bool scheduler_stats(uint64_t num_programs, uint32_t workers)
+{
+	std::vector<int32_t> workers_list;
+	if (workers)
+		workers_list.push_back(static_cast<int32_t>(workers));
+	else
+		workers_list = { 2, 4, 8, 16 };
+
+	for (int32_t w : workers_list)
+	{
+		if ((w != 2) && (w != 4) && (w != 8) && (w != 16))
+		{
+			fprintf(stderr, "Invalid number of workers: %d\n", w);
+			return false;
+		}
+	}
+
+	const uint32_t num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+	printf("Scheduling %llu random programs per configuration on %u threads\n\n", static_cast<unsigned long long>(num_programs), num_threads);
+	printf("workers  scheduler       steps  instructions/step  slots filled  invalid\n");
+
+	bool result = true;
+
+	for (int32_t w : workers_list)
+	{
+		std::vector<SchedulerTotals> totals(num_threads * NUM_SCHEDULERS);
+
+		// Programs where the last scheduler needs fewer or more steps than the first one
+		std::vector<uint64_t> fewer(num_threads), more(num_threads);
+
+		std::vector<SThread> threads;
+		for (uint32_t t = 0; t < num_threads; ++t)
+		{
+			threads.emplace_back([&, t]()
+			{
+				// Entropy from AES is indistinguishable from random numbers, the seed makes runs repeatable
+				std::mt19937_64 rng(t);
+
+				std::vector<uint2> random_program(RANDOMX_PROGRAM_SIZE);
+				std::vector<uint2> program(RANDOMX_PROGRAM_SIZE);
+				std::vector<exec_t> plan(RANDOMX_PROGRAM_SIZE * w);
+
+				for (uint64_t n = t; n < num_programs; n += num_threads)
+				{
+					for (uint2& inst : random_program)
+					{
+						const uint64_t r = rng();
+						inst.x = static_cast<uint32_t>(r);
+						inst.y = static_cast<uint32_t>(r >> 32);
+					}
+
+					uint32_t steps[NUM_SCHEDULERS];
+					for (size_t k = 0; k < NUM_SCHEDULERS; ++k)
+					{
+						program = random_program;
+						mark_branches(program.data());
+
+						std::fill(plan.begin(), plan.end(), 0);
+						const Schedule s = SCHEDULERS[k].func(program.data(), plan.data(), w);
+
+						uint64_t slots;
+						steps[k] = check_schedule(program, plan, s, w, slots);
+
+						SchedulerTotals& total = totals[t * NUM_SCHEDULERS + k];
+						if (steps[k])
+						{
+							total.steps += steps[k];
+							total.slots += slots;
+							for (const uint2& inst : program)
+							{
+								if (!(schedule_decode(inst) & SCHED_NOP))
+									++total.instructions;
+							}
+						}
+						else
+						{
+							++total.invalid;
+						}
+					}
+
+					if (steps[0] && steps[NUM_SCHEDULERS - 1])
+					{
+						if (steps[NUM_SCHEDULERS - 1] < steps[0])
+							++fewer[t];
+						else if (steps[NUM_SCHEDULERS - 1] > steps[0])
+							++more[t];
+					}
+				}
+			});
+		}
+		for (SThread& t : threads)
+			t.join();
+
+		uint64_t total_fewer = 0, total_more = 0;
+		for (uint32_t t = 0; t < num_threads; ++t)
+		{
+			total_fewer += fewer[t];
+			total_more += more[t];
+		}
+
+		for (size_t k = 0; k < NUM_SCHEDULERS; ++k)
+		{
+			SchedulerTotals total;
+			for (uint32_t t = 0; t < num_threads; ++t)
+				total.Add(totals[t * NUM_SCHEDULERS + k]);
+
+			const uint64_t valid = num_programs - total.invalid;
+			printf("%7d  %-13s  %6.2f  %17.3f  %11.2f%%  %7llu\n", w, SCHEDULERS[k].name,
+				valid ? (static_cast<double>(total.steps) / valid) : 0.0,
+				total.steps ? (static_cast<double>(total.instructions) / total.steps) : 0.0,
+				total.steps ? (total.slots * 100.0 / (total.steps * w)) : 0.0,
+				static_cast<unsigned long long>(total.invalid));
+
+			if (total.invalid)
+				result = false;
+		}
+
+		printf("         %s needs fewer steps for %.2f%% of programs, more for %.2f%%\n\n", SCHEDULERS[NUM_SCHEDULERS - 1].name,
+			total_fewer * 100.0 / num_programs, total_more * 100.0 / num_programs);
+	}
+
+	return result;
+}
@@ -0,0 +1,107 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include "startup.h"
+#include "trace.h"
+
+using namespace std::chrono;
+
+Startup::Startup(TimePoint begin)
+	: begin(begin)
+	, failed(false)
+{
+}
+
+Startup::~Startup()
+{
+	Wait();
+}
+
+double Startup::Seconds(TimePoint t) const
+{
+	return duration_cast<nanoseconds>(t - begin).count() / 1e9;
+}
+
+void Startup::Record(const char* name, TimePoint phase_begin, TimePoint phase_end)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	phases.push_back({ name, Seconds(phase_begin), Seconds(phase_end) });
+}
+
+bool Startup::Run(const char* name, const std::function<bool()>& func)
+{
+	TraceScope trace(name);
+
+	const TimePoint t1 = high_resolution_clock::now();
+	const bool result = func();
+	Record(name, t1, high_resolution_clock::now());
+
+	return result;
+}
+
+void Startup::Launch(const char* name, std::function<bool()> func)
+{
+	workers.emplace_back([this, name, func]()
+	{
+		if (!Run(name, func))
+			failed = true;
+	});
+}
+
+bool Startup::Wait()
+{
+	for (SThread& t : workers)
+		t.join();
+	workers.clear();
+
+	return !failed;
+}
+
+std::string Startup::Report(TimePoint first_hash)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const double total = Seconds(first_hash);
+
+	std::vector<Phase> sorted = phases;
+	std::stable_sort(sorted.begin(), sorted.end(), [](const Phase& a, const Phase& b) { return a.begin < b.begin; });
+
+	char buf[256];
+	snprintf(buf, sizeof(buf), "Startup took %.3f s to first hash:\n", total);
+	std::string report = buf;
+
+	double sum = 0.0;
+	for (const Phase& p : sorted)
+	{
+		snprintf(buf, sizeof(buf), "  %-16s %8.3f .. %8.3f s %8.3f s\n", p.name.c_str(), p.begin, p.end, p.end - p.begin);
+		report += buf;
+		sum += p.end - p.begin;
+	}
+
+	// Time phases spent running at the same time as other phases, it would have been added to startup if they ran one after another
+	if (sum > total)
+	{
+		snprintf(buf, sizeof(buf), "  %.3f s saved by running phases in parallel\n", sum - total);
+		report += buf;
+	}
+
+	return report;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "opencl_helpers.h"
+
+// Startup of one device. Phases that don't depend on each other (kernel builds, buffer allocation, dataset build)
+// run at the same time on worker threads, and a per-phase breakdown of time to first hash is reported when mining starts.
+// Workers are joined when it's destroyed, so it must be declared after everything they use.
+class Startup
+{
+public:
+	typedef std::chrono::high_resolution_clock::time_point TimePoint;
+
+	// "begin" is when the device's startup began
+	explicit Startup(TimePoint begin);
+	~Startup();
+
+	// Phase that already finished
+	void Record(const char* name, TimePoint begin, TimePoint end);
+
+	// Runs "func" on the calling thread
+	bool Run(const char* name, const std::function<bool()>& func);
+
+	// Starts "func" on a worker thread
+	void Launch(const char* name, std::function<bool()> func);
+
+	// Waits for all launched phases, returns false if any of them failed
+	bool Wait();
+
+	// "Startup took X s: ..." with start, end and duration of every phase, and how much time running them in parallel saved
+	std::string Report(TimePoint first_hash);
+
+private:
+	struct Phase
+	{
+		std::string name;
+		double begin;
+		double end;
+	};
+
+	double Seconds(TimePoint t) const;
+
+	const TimePoint begin;
+
+	std::mutex mutex;
+	std::vector<Phase> phases;
+	std::atomic<bool> failed;
+
+	// Must be the last member
+	std::vector<SThread> workers;
+};
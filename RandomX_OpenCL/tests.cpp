@@ -21,9 +21,15 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 #include <iomanip>
 #include <algorithm>
 #include <fstream>
+#include <memory>
+#include <random>
 #include "opencl_helpers.h"
 #include "tests.h"
 #include "definitions.h"
+#include "job.h"
+#include "dataset.h"
+#include "gcn_emulator.h"
+#include "miner.h"
 
 #ifdef _MSC_VER
 #pragma warning(push)
@@ -32,6 +38,8 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 
 #include "../RandomX/src/blake2/blake2.h"
 #include "../RandomX/src/aes_hash.hpp"
+#include "../RandomX/src/dataset.hpp"
+#include "../RandomX/src/intrin_portable.h"
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -41,17 +49,160 @@ constexpr size_t BLAKE2B_STEP = 1 << 28;
 
 using namespace std::chrono;
 
-bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
+// Hashes nonces 0 .. num_hashes - 1 of the block template with the portable kernels in ctx.kernels, the same way BatchEngine::Enqueue
+// does with all iterations in one launch. In light mode "dataset_gpu" is the cache and execute_vm must be built with LIGHT_MODE=1.
+// Scratchpads are split into buffers of "shard_size" hashes. "seconds" is how long it took on the device.
+// In full mode "dataset_parts" and "dataset_splits" can pass dataset parts 1-3 and their start offsets in bytes, "dataset_gpu" is part 0 then.
+static bool portable_hashes(OpenCLContext& ctx, cl_mem dataset_gpu, cl_mem programs_gpu, cl_mem reciprocals_gpu, bool light_mode, uint32_t num_hashes, uint32_t shard_size, std::vector<uint8_t>& hashes, double& seconds,
+	const cl_mem* dataset_parts = nullptr, const uint32_t* dataset_splits = nullptr)
 {
-	std::cout << "Initializing GPU #" << device_id << " on OpenCL platform #" << platform_id << std::endl << std::endl;
+	ALLOCATE_DEVICE_MEMORY(blob_gpu, ctx, (sizeof(blockTemplate) + 7) & ~size_t(7));
+	ALLOCATE_DEVICE_MEMORY(hashes_gpu, ctx, num_hashes * INITIAL_HASH_SIZE);
+	ALLOCATE_DEVICE_MEMORY(entropy_gpu, ctx, num_hashes * ENTROPY_SIZE);
+	ALLOCATE_DEVICE_MEMORY(vm_states_gpu, ctx, num_hashes * VM_STATE_SIZE);
+	ALLOCATE_DEVICE_MEMORY(rounding_gpu, ctx, num_hashes * sizeof(uint32_t));
+	ALLOCATE_DEVICE_MEMORY(output_gpu, ctx, num_hashes * 32);
+
+	std::vector<std::unique_ptr<DevicePtr>> shards;
+	for (uint32_t begin = 0; begin < num_hashes; begin += shard_size)
+	{
+		shards.emplace_back(new DevicePtr(ctx, std::min(shard_size, num_hashes - begin) * (RANDOMX_SCRATCHPAD_L3 + 64), "scratchpads_gpu"));
+		if (!*shards.back())
+			return false;
+	}
 
-	OpenCLContext ctx;
-	if (!ctx.Init(platform_id, device_id))
+	if (shards.size() > MAX_SCRATCHPAD_SHARDS)
+	{
+		std::cerr << num_hashes << " hashes don't fit into " << MAX_SCRATCHPAD_SHARDS << " shards of " << shard_size << " scratchpads" << std::endl;
+		return false;
+	}
+
+	cl_mem s[MAX_SCRATCHPAD_SHARDS];
+	for (size_t i = 0; i < MAX_SCRATCHPAD_SHARDS; ++i)
+		s[i] = *shards[(i < shards.size()) ? i : 0];
+
+	cl_kernel blake2b_initial_hash = ctx.kernels[CL_BLAKE2B_INITIAL_HASH];
+	cl_kernel fillaes1rx4_scratchpad = ctx.kernels[CL_FILLAES1RX4_SCRATCHPAD];
+	cl_kernel fillaes4rx4_entropy = ctx.kernels[CL_FILLAES4RX4_ENTROPY];
+	cl_kernel init_vm = ctx.kernels[CL_INIT_VM];
+	cl_kernel execute_vm = ctx.kernels[CL_EXECUTE_VM];
+	cl_kernel hashaes1rx4 = ctx.kernels[CL_HASHAES1RX4];
+	cl_kernel blake2b_hash_registers_32 = ctx.kernels[CL_BLAKE2B_HASH_REGISTERS_32];
+	cl_kernel blake2b_hash_registers_64 = ctx.kernels[CL_BLAKE2B_HASH_REGISTERS_64];
+
+	const uint32_t no_split = 0xFFFFFFFFU;
+
+	if (!clSetKernelArgs(blake2b_initial_hash, hashes_gpu, blob_gpu, static_cast<uint32_t>(sizeof(blockTemplate)), 0U, 39U, 4U) ||
+		!clSetKernelArgs(fillaes1rx4_scratchpad, hashes_gpu, s[0], num_hashes, s[1], s[2], s[3], shard_size) ||
+		!clSetKernelArgs(fillaes4rx4_entropy, hashes_gpu, entropy_gpu, num_hashes) ||
+		!clSetKernelArgs(init_vm, entropy_gpu, vm_states_gpu) ||
+		!clSetKernelArgs(execute_vm, vm_states_gpu, rounding_gpu, s[0], dataset_gpu, num_hashes, static_cast<uint32_t>(RANDOMX_PROGRAM_ITERATIONS), 1U, 1U) ||
+		!clSetKernelArgs(hashaes1rx4, s[0], vm_states_gpu, 192U, static_cast<uint32_t>(VM_STATE_SIZE), num_hashes, s[1], s[2], s[3], shard_size) ||
+		!clSetKernelArgs(blake2b_hash_registers_32, output_gpu, vm_states_gpu, static_cast<uint32_t>(VM_STATE_SIZE)) ||
+		!clSetKernelArgs(blake2b_hash_registers_64, hashes_gpu, vm_states_gpu, static_cast<uint32_t>(VM_STATE_SIZE)))
+	{
+		return false;
+	}
+
+	cl_int err;
+
+	// Light mode arguments come before the other scratchpad shards and dataset parts
+	cl_uint arg = 8;
+	if (light_mode)
+	{
+		CL_CHECKED_CALL(clSetKernelArg, execute_vm, arg++, sizeof(cl_mem), &programs_gpu);
+		CL_CHECKED_CALL(clSetKernelArg, execute_vm, arg++, sizeof(cl_mem), &reciprocals_gpu);
+	}
+	for (cl_uint k = 1; k < MAX_SCRATCHPAD_SHARDS; ++k)
+	{
+		CL_CHECKED_CALL(clSetKernelArg, execute_vm, arg++, sizeof(cl_mem), &s[k]);
+	}
+	CL_CHECKED_CALL(clSetKernelArg, execute_vm, arg++, sizeof(uint32_t), &shard_size);
+	for (cl_uint k = 1; k < MAX_DATASET_PARTS; ++k)
+	{
+		CL_CHECKED_CALL(clSetKernelArg, execute_vm, arg++, sizeof(cl_mem), dataset_parts ? &dataset_parts[k - 1] : &dataset_gpu);
+	}
+	for (cl_uint k = 1; k < MAX_DATASET_PARTS; ++k)
+	{
+		CL_CHECKED_CALL(clSetKernelArg, execute_vm, arg++, sizeof(uint32_t), dataset_splits ? &dataset_splits[k - 1] : &no_split);
+	}
+
+	const size_t global_work_size = num_hashes;
+	const size_t global_work_size4 = num_hashes * 4;
+	const size_t global_work_size8 = num_hashes * 8;
+	const size_t local_work_size = 64;
+	const size_t local_work_size32 = 32;
+	const size_t local_work_size16 = 16;
+	const uint32_t zero = 0;
+
+	CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, blob_gpu, CL_TRUE, 0, sizeof(blockTemplate), blockTemplate, 0, nullptr, nullptr);
+
+	const auto start_time = high_resolution_clock::now();
+
+	CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, blake2b_initial_hash, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+	CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, fillaes1rx4_scratchpad, 1, nullptr, &global_work_size4, &local_work_size, 0, nullptr, nullptr);
+	CL_CHECKED_CALL(clEnqueueFillBuffer, ctx.queue, rounding_gpu, &zero, sizeof(zero), 0, num_hashes * sizeof(uint32_t), 0, nullptr, nullptr);
+
+	for (size_t i = 0; i < RANDOMX_PROGRAM_COUNT; ++i)
+	{
+		CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, fillaes4rx4_entropy, 1, nullptr, &global_work_size4, &local_work_size, 0, nullptr, nullptr);
+		CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, init_vm, 1, nullptr, &global_work_size8, &local_work_size32, 0, nullptr, nullptr);
+		CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, execute_vm, 1, nullptr, &global_work_size8, &local_work_size16, 0, nullptr, nullptr);
+
+		if (i == RANDOMX_PROGRAM_COUNT - 1)
+		{
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, hashaes1rx4, 1, nullptr, &global_work_size4, &local_work_size, 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, blake2b_hash_registers_32, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+		}
+		else
+		{
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, blake2b_hash_registers_64, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+		}
+	}
+
+	CL_CHECKED_CALL(clFinish, ctx.queue);
+	seconds = duration_cast<nanoseconds>(high_resolution_clock::now() - start_time).count() / 1e9;
+
+	hashes.resize(num_hashes * 32);
+	CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, output_gpu, CL_TRUE, 0, hashes.size(), hashes.data(), 0, nullptr, nullptr);
+
+	return true;
+}
+
+// Compares hashes from portable_hashes() with light mode RandomX VM hashes, which are the same as full mode hashes
+static bool check_portable_hashes(randomx_cache* cache, const std::vector<uint8_t>& hashes, const char* test_name)
+{
+	std::unique_ptr<randomx_vm, void(*)(randomx_vm*)> vm(randomx_create_vm((randomx_flags)(RANDOMX_FLAG_JIT | RANDOMX_FLAG_HARD_AES), cache, nullptr), randomx_destroy_vm);
+	if (!vm)
 	{
+		std::cerr << "Failed to create RandomX VM" << std::endl;
 		return false;
 	}
 
-	if (!ctx.Compile("base_kernels.bin",
+	std::vector<uint8_t> blob(blockTemplate, blockTemplate + sizeof(blockTemplate));
+	for (uint32_t i = 0; i < hashes.size() / 32; ++i)
+	{
+		memcpy(blob.data() + 39, &i, sizeof(i));
+
+		uint8_t hash[32];
+		randomx_calculate_hash(vm.get(), blob.data(), blob.size(), hash);
+		if (memcmp(hash, hashes.data() + i * 32, sizeof(hash)) != 0)
+		{
+			std::cerr << test_name << " test failed: hash of nonce " << i << " differs from the CPU" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// AES and BLAKE2B kernels with VM states interleaved by "interleave" (see VM_STATE_INTERLEAVE), kernels with the same names are replaced
+static bool compile_base_kernels(OpenCLContext& ctx, uint32_t interleave)
+{
+	const std::string binary_name = (interleave > 1) ? ("base_kernels_vm" + std::to_string(interleave) + ".bin") : std::string("base_kernels.bin");
+	const std::string options = (interleave > 1) ? ("-D VM_STATE_INTERLEAVE=" + std::to_string(interleave)) : std::string();
+
+	return ctx.Compile(binary_name.c_str(),
 		{
 			AES_CL,
 			BLAKE2B_CL
@@ -63,14 +214,42 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 			CL_BLAKE2B_INITIAL_HASH,
 			CL_BLAKE2B_HASH_REGISTERS_32,
 			CL_BLAKE2B_HASH_REGISTERS_64,
+			CL_BLAKE2B_HASH_REGISTERS_32_TARGET,
 			CL_BLAKE2B_512_SINGLE_BLOCK_BENCH,
 			CL_BLAKE2B_512_DOUBLE_BLOCK_BENCH
-		}, "", COMPILE_CACHE_BINARY))
+		}, options, COMPILE_CACHE_BINARY);
+}
+
+bool tests(uint32_t platform_id, uint32_t device_id, cl_device_type device_type, size_t intensity)
+{
+	std::cout << "Initializing device #" << device_id << " on OpenCL platform #" << platform_id << std::endl << std::endl;
+
+	OpenCLContext ctx;
+	if (!ctx.Init(platform_id, device_id, device_type))
+	{
+		return false;
+	}
+
+	for (int gcn_version : { 12, 14, 15 })
+	{
+		if (!gcn_emulator_self_test(gcn_version))
+		{
+			return false;
+		}
+	}
+	std::cout << "GCN emulator self-test passed" << std::endl;
+
+	if (!compile_base_kernels(ctx, 1))
 	{
 		return false;
 	}
 
-	if (!ctx.Compile("randomx_vm.bin", { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, "-D WORKERS_PER_HASH=8 -cl-std=CL1.2 -Werror", ALWAYS_COMPILE))
+	if (!ctx.Compile("randomx_vm.bin", { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM, CL_FP_OPS_TEST }, "-D WORKERS_PER_HASH=8 -cl-std=CL1.2 -Werror", ALWAYS_COMPILE))
+	{
+		return false;
+	}
+
+	if (!ctx.Compile("randomx_dataset.bin", { RANDOMX_DATASET_CL }, { CL_INIT_DATASET }, "", ALWAYS_COMPILE))
 	{
 		return false;
 	}
@@ -111,6 +290,10 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 
 	CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, entropy_gpu, CL_FALSE, 0, intensity * ENTROPY_SIZE, entropy.data(), 0, nullptr, nullptr);
 
+	// init_vm doesn't write every word of the state, they're compared with interleaved states below
+	const uint32_t vm_states_fill = 0;
+	CL_CHECKED_CALL(clEnqueueFillBuffer, ctx.queue, vm_states_gpu, &vm_states_fill, sizeof(vm_states_fill), 0, intensity * VM_STATE_SIZE, 0, nullptr, nullptr);
+
 	CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
 	CL_CHECKED_CALL(clFinish, ctx.queue);
 
@@ -121,20 +304,168 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 		f.write((const char*) vm_states.data(), vm_states.size());
 	}
 
+	{
+		// Interleaved VM states must hold exactly the same words as contiguous ones. This replaces init_vm and execute_vm,
+		// they're built again before the next test that runs them.
+		const uint32_t interleave = 64;
+		if (!ctx.Compile("randomx_vm_interleaved.bin", { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, "-D WORKERS_PER_HASH=8 -D VM_STATE_INTERLEAVE=64 -cl-std=CL1.2 -Werror", ALWAYS_COMPILE))
+		{
+			return false;
+		}
+
+		kernel = ctx.kernels[CL_INIT_VM];
+		if (!clSetKernelArgs(kernel, entropy_gpu, vm_states_gpu))
+		{
+			return false;
+		}
+
+		CL_CHECKED_CALL(clEnqueueFillBuffer, ctx.queue, vm_states_gpu, &vm_states_fill, sizeof(vm_states_fill), 0, intensity * VM_STATE_SIZE, 0, nullptr, nullptr);
+		CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+
+		std::vector<uint8_t> interleaved(intensity * VM_STATE_SIZE);
+		CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, vm_states_gpu, CL_TRUE, 0, intensity * VM_STATE_SIZE, interleaved.data(), 0, nullptr, nullptr);
+
+		const size_t stride = VM_STATE_SIZE / sizeof(uint64_t);
+		const uint64_t* p1 = reinterpret_cast<const uint64_t*>(vm_states.data());
+		const uint64_t* p2 = reinterpret_cast<const uint64_t*>(interleaved.data());
+
+		for (size_t i = 0; i < intensity; ++i)
+		{
+			for (size_t w = 0; w < stride; ++w)
+			{
+				const size_t k = (w < REGISTERS_SIZE / sizeof(uint64_t)) ? VM_STATE_REG(i, w, stride, interleave) : (VM_STATE_PROGRAM(i, stride, interleave) + w - REGISTERS_SIZE / sizeof(uint64_t));
+				if (p1[i * stride + w] != p2[k])
+				{
+					std::cerr << "init_vm test failed for interleaved VM states: hash " << i << ", word " << w << std::endl;
+					return false;
+				}
+			}
+		}
+
+		std::cout << "init_vm interleaved VM states test passed" << std::endl;
+	}
+
+	{
+		// FP operations of execute_vm must give the same bits as the CPU in every rounding mode. Operands are in the ranges
+		// VM registers have: add/sub operands of any sign with exact and cancelling sums, positive ones for mul/div/sqrt.
+		const size_t n = 1 << 16;
+
+		std::vector<double> inputs(n * 4);
+		std::vector<double> results(n * 4);
+		std::vector<double> results_cpu(n * 4);
+
+		uint64_t r = 456;
+		auto rnd = [&r]()
+		{
+			r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+			return r;
+		};
+
+		auto rnd_double = [&rnd](bool positive)
+		{
+			const uint64_t x = rnd();
+			const uint64_t exponent = 1023 - 300 + (x >> 32) % 601;
+			const uint64_t sign = positive ? 0 : (x >> 63);
+			const uint64_t bits = (sign << 63) | (exponent << 52) | (rnd() & ((uint64_t(1) << 52) - 1));
+			double result;
+			memcpy(&result, &bits, sizeof(result));
+			return result;
+		};
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			double* p = inputs.data() + i * 4;
+			p[0] = ((i & 7) == 0) ? static_cast<double>(static_cast<int32_t>(rnd())) : rnd_double(false);
+			switch (i % 3)
+			{
+			case 0:
+				p[1] = rnd_double(false);
+				break;
+
+			case 1:
+				p[1] = -p[0];
+				break;
+
+			default:
+				{
+					uint64_t bits;
+					memcpy(&bits, &p[0], sizeof(bits));
+					bits ^= (uint64_t(1) << 63) | 1;
+					memcpy(&p[1], &bits, sizeof(bits));
+				}
+				break;
+			}
+			p[2] = rnd_double(true);
+			p[3] = rnd_double(true);
+		}
+
+		ALLOCATE_DEVICE_MEMORY(fp_inputs_gpu, ctx, inputs.size() * sizeof(double));
+		ALLOCATE_DEVICE_MEMORY(fp_results_gpu, ctx, results.size() * sizeof(double));
+
+		CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, fp_inputs_gpu, CL_TRUE, 0, inputs.size() * sizeof(double), inputs.data(), 0, nullptr, nullptr);
+
+		for (uint32_t fprc = 0; fprc < 4; ++fprc)
+		{
+			kernel = ctx.kernels[CL_FP_OPS_TEST];
+			if (!clSetKernelArgs(kernel, fp_inputs_gpu, fp_results_gpu, fprc))
+			{
+				return false;
+			}
+
+			const size_t fp_global_work_size = n;
+			const size_t fp_local_work_size = 64;
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &fp_global_work_size, &fp_local_work_size, 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, fp_results_gpu, CL_TRUE, 0, results.size() * sizeof(double), results.data(), 0, nullptr, nullptr);
+
+			rx_set_rounding_mode(fprc);
+			for (size_t i = 0; i < n; ++i)
+			{
+				const uint64_t* p = reinterpret_cast<const uint64_t*>(inputs.data() + i * 4);
+				const rx_vec_f128 f0 = rx_set_vec_f128(p[0], p[0]);
+				const rx_vec_f128 f1 = rx_set_vec_f128(p[1], p[1]);
+				const rx_vec_f128 e0 = rx_set_vec_f128(p[2], p[2]);
+				const rx_vec_f128 e1 = rx_set_vec_f128(p[3], p[3]);
+
+				double tmp[2];
+				rx_store_vec_f128(tmp, rx_add_vec_f128(f0, f1));
+				results_cpu[i * 4 + 0] = tmp[0];
+				rx_store_vec_f128(tmp, rx_mul_vec_f128(e0, e1));
+				results_cpu[i * 4 + 1] = tmp[0];
+				rx_store_vec_f128(tmp, rx_div_vec_f128(e0, e1));
+				results_cpu[i * 4 + 2] = tmp[0];
+				rx_store_vec_f128(tmp, rx_sqrt_vec_f128(e0));
+				results_cpu[i * 4 + 3] = tmp[0];
+			}
+			rx_reset_float_state();
+
+			static const char* op_names[4] = { "add", "mul", "div", "sqrt" };
+			for (size_t i = 0; i < n * 4; ++i)
+			{
+				if (memcmp(&results[i], &results_cpu[i], sizeof(double)) != 0)
+				{
+					std::cerr << "fp_ops test failed: rounding mode " << fprc << ", " << op_names[i % 4] << ", input " << (i / 4) << std::endl;
+					return false;
+				}
+			}
+		}
+
+		std::cout << "fp_ops test passed" << std::endl;
+	}
+
 	ALLOCATE_DEVICE_MEMORY(registers_gpu, ctx, intensity * REGISTERS_SIZE);
 
 	uint32_t zero = 0;
 	CL_CHECKED_CALL(clEnqueueFillBuffer, ctx.queue, registers_gpu, &zero, sizeof(zero), 0, intensity * REGISTERS_SIZE, 0, nullptr, nullptr);
 
 	ALLOCATE_DEVICE_MEMORY(hash_gpu, ctx, intensity * INITIAL_HASH_SIZE);
-	ALLOCATE_DEVICE_MEMORY(blockTemplate_gpu, ctx, sizeof(blockTemplate));
+	ALLOCATE_DEVICE_MEMORY(blockTemplate_gpu, ctx, (sizeof(blockTemplate) + 7) & ~size_t(7));
 
 	CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, blockTemplate_gpu, CL_FALSE, 0, sizeof(blockTemplate), blockTemplate, 0, nullptr, nullptr);
 
 	ALLOCATE_DEVICE_MEMORY(nonce_gpu, ctx, sizeof(uint64_t));
 
 	kernel = ctx.kernels[CL_BLAKE2B_INITIAL_HASH];
-	if (!clSetKernelArgs(kernel, hash_gpu, blockTemplate_gpu, 0))
+	if (!clSetKernelArgs(kernel, hash_gpu, blockTemplate_gpu, static_cast<uint32_t>(sizeof(blockTemplate)), 0U, 39U, 4U))
 	{
 		return false;
 	}
@@ -164,10 +495,70 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 		return false;
 	}
 
+	{
+		// Variable length blobs (multiple blocks, nonce crossing block boundaries, nonce wider than 32 bits) with the same compiled kernel
+		const struct { uint32_t size, nonce_offset, nonce_width; } blob_tests[] = {
+			{  43,  39, 4 },
+			{ 128, 120, 8 },
+			{ 129, 125, 4 },
+			{ 200, 126, 5 },
+			{ 300,   0, 8 },
+			{ 384, 381, 3 },
+		};
+
+		std::vector<uint8_t> blob(384);
+		uint64_t r = 123;
+		for (uint8_t& b : blob)
+		{
+			r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+			b = static_cast<uint8_t>(r >> 56);
+		}
+
+		ALLOCATE_DEVICE_MEMORY(blob_gpu, ctx, blob.size());
+		ALLOCATE_DEVICE_MEMORY(blob_hash_gpu, ctx, intensity * INITIAL_HASH_SIZE);
+
+		const uint32_t start_nonce = 0xFFFFFFC0U;
+
+		for (const auto& t : blob_tests)
+		{
+			Job job;
+			job.blob.assign(blob.begin(), blob.begin() + t.size);
+			job.nonce_offset = t.nonce_offset;
+			job.nonce_width = t.nonce_width;
+
+			CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, blob_gpu, CL_TRUE, 0, job.blob.size(), job.blob.data(), 0, nullptr, nullptr);
+
+			if (!clSetKernelArgs(kernel, blob_hash_gpu, blob_gpu, static_cast<uint32_t>(job.blob.size()), start_nonce, job.nonce_offset, job.nonce_width))
+			{
+				return false;
+			}
+
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, blob_hash_gpu, CL_TRUE, 0, intensity * INITIAL_HASH_SIZE, hashes.data(), 0, nullptr, nullptr);
+
+			std::vector<uint8_t> buf = job.blob;
+			for (uint32_t i = 0; i < intensity; ++i)
+			{
+				job.SetNonce(buf.data(), static_cast<uint64_t>(start_nonce) + i);
+				blake2b(hashes2.data() + static_cast<size_t>(i) * INITIAL_HASH_SIZE, INITIAL_HASH_SIZE, buf.data(), buf.size(), nullptr, 0);
+			}
+
+			if (hashes != hashes2)
+			{
+				std::cerr << "blake2b_initial_hash test failed for " << job.blob.size() << " byte blob, nonce offset " << job.nonce_offset << ", nonce width " << job.nonce_width << std::endl;
+				return false;
+			}
+		}
+
+		// Restore the hashes of the default block template which the next tests use
+		CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, hash_gpu, CL_TRUE, 0, intensity * INITIAL_HASH_SIZE, hashes.data(), 0, nullptr, nullptr);
+	}
+
 	std::cout << "blake2b_initial_hash test passed" << std::endl;
 
 	kernel = ctx.kernels[CL_FILLAES1RX4_SCRATCHPAD];
-	if (!clSetKernelArgs(kernel, hash_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity)))
+	// All scratchpads in one shard
+	if (!clSetKernelArgs(kernel, hash_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity), scratchpads_gpu, scratchpads_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity)))
 	{
 		return false;
 	}
@@ -238,7 +629,7 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 	std::cout << "fillAes4Rx4_entropy test passed" << std::endl;
 
 	kernel = ctx.kernels[CL_HASHAES1RX4];
-	if (!clSetKernelArgs(kernel, scratchpads_gpu, registers_gpu, 192, REGISTERS_SIZE, static_cast<uint32_t>(intensity)))
+	if (!clSetKernelArgs(kernel, scratchpads_gpu, registers_gpu, 192, REGISTERS_SIZE, static_cast<uint32_t>(intensity), scratchpads_gpu, scratchpads_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity)))
 	{
 		return false;
 	}
@@ -296,6 +687,53 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 
 	std::cout << "blake2b_hash_registers (32 byte hash) test passed" << std::endl;
 
+	kernel = ctx.kernels[CL_BLAKE2B_HASH_REGISTERS_32_TARGET];
+	ALLOCATE_DEVICE_MEMORY(shares_gpu, ctx, SHARES_BUFFER_SIZE);
+	CL_CHECKED_CALL(clEnqueueFillBuffer, ctx.queue, shares_gpu, &zero, sizeof(zero), 0, sizeof(zero), 0, nullptr, nullptr);
+
+	{
+		const uint32_t start_nonce = 0x12345678U;
+		const uint64_t target = 0xFFFFFFFFFFFFFFFFULL / 64;
+		if (!clSetKernelArgs(kernel, hash_gpu, registers_gpu, REGISTERS_SIZE, start_nonce, target, shares_gpu))
+		{
+			return false;
+		}
+
+		global_work_size = intensity;
+		local_work_size = 64;
+		CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+		CL_CHECKED_CALL(clFinish, ctx.queue);
+
+		std::vector<uint32_t> shares(SHARES_BUFFER_SIZE / sizeof(uint32_t));
+		CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, shares_gpu, CL_TRUE, 0, SHARES_BUFFER_SIZE, shares.data(), 0, nullptr, nullptr);
+
+		uint32_t expected_shares = 0;
+		for (size_t i = 0; i < intensity; ++i)
+		{
+			if (*(uint64_t*)(hashes2.data() + i * 32 + 24) < target)
+				++expected_shares;
+		}
+
+		if (shares[0] != expected_shares)
+		{
+			std::cerr << "blake2b_hash_registers_32_target test failed: " << shares[0] << " shares found, expected " << expected_shares << std::endl;
+			return false;
+		}
+
+		for (uint32_t i = 0, n = std::min<uint32_t>(shares[0], MAX_SHARES); i < n; ++i)
+		{
+			const uint32_t* share = shares.data() + 1 + i * (SHARE_SIZE / sizeof(uint32_t));
+			const uint32_t index = share[0] - start_nonce;
+			if ((index >= intensity) || (*(uint64_t*)(hashes2.data() + index * 32 + 24) >= target) || memcmp(share + 1, hashes2.data() + index * 32, 32))
+			{
+				std::cerr << "blake2b_hash_registers_32_target test failed!" << std::endl;
+				return false;
+			}
+		}
+	}
+
+	std::cout << "blake2b_hash_registers_32_target test passed" << std::endl;
+
 	kernel = ctx.kernels[CL_BLAKE2B_HASH_REGISTERS_64];
 	if (!clSetKernelArgs(kernel, hash_gpu, registers_gpu, REGISTERS_SIZE))
 	{
@@ -322,9 +760,269 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 
 	std::cout << "blake2b_hash_registers (64 byte hash) test passed" << std::endl;
 
+	{
+		// First and last items (the last ones come from RANDOMX_DATASET_EXTRA_SIZE) and a random range in each of DATASET_TEST_SAMPLES
+		// equal parts of the rest. Ranges are different every run, the whole dataset would take too long on the CPU.
+		constexpr uint32_t DATASET_TEST_ITEMS = 16384;
+		constexpr uint32_t DATASET_TEST_SAMPLES = 256;
+		constexpr uint32_t DATASET_TEST_SAMPLE_ITEMS = 256;
+
+		ALLOCATE_DEVICE_MEMORY(cache_gpu, ctx, CACHE_SIZE);
+		ALLOCATE_DEVICE_MEMORY(programs_gpu, ctx, RANDOMX_CACHE_ACCESSES * SUPERSCALAR_PROGRAM_SIZE);
+		ALLOCATE_DEVICE_MEMORY(reciprocals_gpu, ctx, RANDOMX_CACHE_ACCESSES * SUPERSCALAR_MAX_SIZE * sizeof(uint64_t));
+		ALLOCATE_DEVICE_MEMORY(dataset_items_gpu, ctx, DATASET_TEST_ITEMS * RANDOMX_DATASET_ITEM_SIZE);
+
+		std::unique_ptr<randomx_cache, void(*)(randomx_cache*)> cache(randomx_alloc_cache(RANDOMX_FLAG_DEFAULT), randomx_release_cache);
+		if (!cache)
+		{
+			std::cerr << "Couldn't allocate cache" << std::endl;
+			return false;
+		}
+
+		const char seed[] = "RandomX example seed";
+		randomx_init_cache(cache.get(), seed, sizeof(seed));
+
+		std::vector<uint32_t> programs;
+		std::vector<uint64_t> reciprocals;
+		pack_superscalar_programs(cache.get(), programs, reciprocals);
+
+		CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, cache_gpu, CL_TRUE, 0, CACHE_SIZE, cache->memory, 0, nullptr, nullptr);
+		CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, programs_gpu, CL_TRUE, 0, programs.size() * sizeof(uint32_t), programs.data(), 0, nullptr, nullptr);
+		if (!reciprocals.empty())
+		{
+			CL_CHECKED_CALL(clEnqueueWriteBuffer, ctx.queue, reciprocals_gpu, CL_TRUE, 0, reciprocals.size() * sizeof(uint64_t), reciprocals.data(), 0, nullptr, nullptr);
+		}
+
+		kernel = ctx.kernels[CL_INIT_DATASET];
+
+		const uint32_t item_count = static_cast<uint32_t>(randomx_dataset_item_count());
+
+		const uint32_t random_seed = std::random_device()();
+		std::mt19937 rng(random_seed);
+
+		// Ranges of items to test in ascending order, so the first one that fails is the first wrong item
+		std::vector<std::pair<uint32_t, uint32_t>> ranges;
+		ranges.emplace_back(0, DATASET_TEST_ITEMS);
+		const uint32_t part_size = (item_count - DATASET_TEST_ITEMS * 2) / DATASET_TEST_SAMPLES;
+		for (uint32_t i = 0; i < DATASET_TEST_SAMPLES; ++i)
+		{
+			const uint32_t start_item = DATASET_TEST_ITEMS + i * part_size + rng() % (part_size - DATASET_TEST_SAMPLE_ITEMS);
+			ranges.emplace_back(start_item, DATASET_TEST_SAMPLE_ITEMS);
+		}
+		ranges.emplace_back(item_count - DATASET_TEST_ITEMS, DATASET_TEST_ITEMS);
+
+		std::vector<uint8_t> dataset_items(DATASET_TEST_ITEMS * RANDOMX_DATASET_ITEM_SIZE);
+		std::vector<uint8_t> dataset_items2(RANDOMX_DATASET_ITEM_SIZE);
+		uint64_t num_tested = 0;
+
+		for (const std::pair<uint32_t, uint32_t>& range : ranges)
+		{
+			const uint32_t start_item = range.first;
+			const uint32_t end_item = start_item + range.second;
+			if (!clSetKernelArgs(kernel, cache_gpu, dataset_items_gpu, programs_gpu, reciprocals_gpu, start_item, end_item, start_item))
+			{
+				return false;
+			}
+
+			global_work_size = range.second;
+			local_work_size = 64;
+			CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+			CL_CHECKED_CALL(clEnqueueReadBuffer, ctx.queue, dataset_items_gpu, CL_TRUE, 0, range.second * RANDOMX_DATASET_ITEM_SIZE, dataset_items.data(), 0, nullptr, nullptr);
+
+			for (uint32_t i = 0; i < range.second; ++i)
+			{
+				randomx::initDatasetItem(cache.get(), dataset_items2.data(), start_item + i);
+				if (memcmp(dataset_items.data() + i * RANDOMX_DATASET_ITEM_SIZE, dataset_items2.data(), RANDOMX_DATASET_ITEM_SIZE) != 0)
+				{
+					std::cerr << "init_dataset test failed: item " << (start_item + i) << " of " << item_count << " differs from the CPU (sample seed " << random_seed << ")" << std::endl;
+					return false;
+				}
+			}
+			num_tested += range.second;
+		}
+
+		std::cout << "init_dataset test passed (" << num_tested << " items checked)" << std::endl;
+
+		// Light mode execute_vm against the CPU, then against full mode with a dataset built on the device if it fits into one buffer
+		constexpr uint32_t LIGHT_TEST_HASHES = 64;
+
+		if (!ctx.Compile("randomx_vm_light.bin", { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, "-D WORKERS_PER_HASH=8 -D LIGHT_MODE=1 -cl-std=CL1.2 -Werror", ALWAYS_COMPILE))
+		{
+			return false;
+		}
+
+		std::vector<uint8_t> light_hashes;
+		double light_seconds;
+		if (!portable_hashes(ctx, cache_gpu, programs_gpu, reciprocals_gpu, true, LIGHT_TEST_HASHES, LIGHT_TEST_HASHES, light_hashes, light_seconds) ||
+			!check_portable_hashes(cache.get(), light_hashes, "execute_vm light mode"))
+		{
+			return false;
+		}
+
+		std::cout << "execute_vm light mode test passed, " << (LIGHT_TEST_HASHES / light_seconds) << " H/s with " << LIGHT_TEST_HASHES << " hashes" << std::endl;
+
+		// The same hashes with scratchpads split into shards, the last one smaller than the others. Mining only splits them
+		// when one buffer can't hold all scratchpads, so it's the only place where the sharded paths run on most GPUs.
+		constexpr uint32_t SHARD_TEST_SIZE = 24;
+		static_assert((LIGHT_TEST_HASHES + SHARD_TEST_SIZE - 1) / SHARD_TEST_SIZE <= MAX_SCRATCHPAD_SHARDS, "Too many shards");
+
+		std::vector<uint8_t> sharded_hashes;
+		double sharded_seconds;
+		if (!portable_hashes(ctx, cache_gpu, programs_gpu, reciprocals_gpu, true, LIGHT_TEST_HASHES, SHARD_TEST_SIZE, sharded_hashes, sharded_seconds) ||
+			!check_portable_hashes(cache.get(), sharded_hashes, "Scratchpad shards"))
+		{
+			return false;
+		}
+
+		std::cout << "Scratchpad shards test passed (" << ((LIGHT_TEST_HASHES + SHARD_TEST_SIZE - 1) / SHARD_TEST_SIZE) << " shards of " << SHARD_TEST_SIZE << " hashes)" << std::endl;
+
+		// Every sub-group level the device supports must give the same hashes as work-group barriers (VM_SUBGROUPS=0 above)
+		const uint32_t subgroups = vm_subgroups(ctx);
+		if (!subgroups)
+			std::cout << "execute_vm sub-group test skipped, the device has no sub-group functions" << std::endl;
+
+		for (uint32_t level = 1; level <= subgroups; ++level)
+		{
+			const std::string test_name = "execute_vm VM_SUBGROUPS=" + std::to_string(level);
+			const std::string binary_name = "randomx_vm_light_sg" + std::to_string(level) + ".bin";
+			const std::string options = "-D WORKERS_PER_HASH=8 -D LIGHT_MODE=1 -D VM_SUBGROUPS=" + std::to_string(level) + " -Werror";
+			if (!ctx.Compile(binary_name.c_str(), { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, options, ALWAYS_COMPILE))
+			{
+				return false;
+			}
+
+			std::vector<uint8_t> subgroup_hashes;
+			double subgroup_seconds;
+			if (!portable_hashes(ctx, cache_gpu, programs_gpu, reciprocals_gpu, true, LIGHT_TEST_HASHES, LIGHT_TEST_HASHES, subgroup_hashes, subgroup_seconds) ||
+				!check_portable_hashes(cache.get(), subgroup_hashes, test_name.c_str()))
+			{
+				return false;
+			}
+
+			if (subgroup_hashes != light_hashes)
+			{
+				std::cerr << test_name << " test failed: hashes differ from VM_SUBGROUPS=0" << std::endl;
+				return false;
+			}
+
+			std::cout << test_name << " test passed, " << (LIGHT_TEST_HASHES / subgroup_seconds) << " H/s" << std::endl;
+		}
+
+		// With interleaved VM states execute_vm, hashAes1Rx4 and blake2b_hash_registers find registers in other places
+		{
+			if (!compile_base_kernels(ctx, 64) ||
+				!ctx.Compile("randomx_vm_light_vm64.bin", { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, "-D WORKERS_PER_HASH=8 -D LIGHT_MODE=1 -D VM_STATE_INTERLEAVE=64 -cl-std=CL1.2 -Werror", ALWAYS_COMPILE))
+			{
+				return false;
+			}
+
+			std::vector<uint8_t> interleaved_hashes;
+			double interleaved_seconds;
+			if (!portable_hashes(ctx, cache_gpu, programs_gpu, reciprocals_gpu, true, LIGHT_TEST_HASHES, LIGHT_TEST_HASHES, interleaved_hashes, interleaved_seconds) ||
+				!check_portable_hashes(cache.get(), interleaved_hashes, "VM_STATE_INTERLEAVE=64"))
+			{
+				return false;
+			}
+
+			// Contiguous VM states again for full mode and the benchmarks below
+			if (!compile_base_kernels(ctx, 1))
+			{
+				return false;
+			}
+
+			std::cout << "VM_STATE_INTERLEAVE=64 test passed, " << (LIGHT_TEST_HASHES / interleaved_seconds) << " H/s" << std::endl;
+		}
+
+		const size_t dataset_size = static_cast<size_t>(item_count) * RANDOMX_DATASET_ITEM_SIZE;
+		if ((dataset_size > ctx.device_max_alloc_size) || (dataset_size + (256 << 20) > ctx.device_global_mem_size))
+		{
+			std::cout << "Full mode comparison skipped, the dataset doesn't fit into one buffer" << std::endl;
+		}
+		else
+		{
+			ALLOCATE_DEVICE_MEMORY(dataset_gpu, ctx, dataset_size);
+
+			constexpr uint32_t DATASET_BUILD_ITEMS = 1 << 18;
+			for (uint32_t start_item = 0; start_item < item_count; start_item += DATASET_BUILD_ITEMS)
+			{
+				if (!clSetKernelArgs(kernel, cache_gpu, dataset_gpu, programs_gpu, reciprocals_gpu, start_item, item_count, 0U))
+				{
+					return false;
+				}
+
+				global_work_size = DATASET_BUILD_ITEMS;
+				local_work_size = 64;
+				CL_CHECKED_CALL(clEnqueueNDRangeKernel, ctx.queue, kernel, 1, nullptr, &global_work_size, &local_work_size, 0, nullptr, nullptr);
+				CL_CHECKED_CALL(clFinish, ctx.queue);
+			}
+
+			if (!ctx.Compile("randomx_vm.bin", { RANDOMX_VM_CL }, { CL_INIT_VM, CL_EXECUTE_VM }, "-D WORKERS_PER_HASH=8 -cl-std=CL1.2 -Werror", ALWAYS_COMPILE))
+			{
+				return false;
+			}
+
+			std::vector<uint8_t> full_hashes;
+			double full_seconds;
+			if (!portable_hashes(ctx, dataset_gpu, nullptr, nullptr, false, LIGHT_TEST_HASHES, LIGHT_TEST_HASHES, full_hashes, full_seconds))
+			{
+				return false;
+			}
+
+			if (full_hashes != light_hashes)
+			{
+				std::cerr << "execute_vm light mode test failed: hashes differ from full mode" << std::endl;
+				return false;
+			}
+
+			std::cout << "execute_vm light mode matches full mode, full mode is " << (light_seconds / full_seconds) << " times faster (" << (LIGHT_TEST_HASHES / full_seconds) << " H/s)" << std::endl;
+
+			// Split the same dataset into 3 sub-buffers like a multi-part dataset, at item boundaries the device can start a sub-buffer at
+			const uint32_t align_items = std::max<uint32_t>(ctx.device_mem_base_addr_align / RANDOMX_DATASET_ITEM_SIZE, 1);
+			const uint32_t split_items[3] = { 0, (item_count / 3) / align_items * align_items, (item_count / 3 * 2) / align_items * align_items };
+
+			cl_mem parts[3] = {};
+			for (int i = 0; i < 3; ++i)
+			{
+				const uint32_t end_item = (i < 2) ? split_items[i + 1] : item_count;
+				const cl_buffer_region region = { static_cast<size_t>(split_items[i]) * RANDOMX_DATASET_ITEM_SIZE, static_cast<size_t>(end_item - split_items[i]) * RANDOMX_DATASET_ITEM_SIZE };
+				parts[i] = clCreateSubBuffer(dataset_gpu, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+				if (err != CL_SUCCESS)
+				{
+					std::cerr << "clCreateSubBuffer failed (dataset part " << i << "): error " << err << std::endl;
+					for (int j = 0; j < i; ++j)
+						clReleaseMemObject(parts[j]);
+					return false;
+				}
+			}
+
+			const cl_mem dataset_parts[3] = { parts[1], parts[2], parts[2] };
+			const uint32_t dataset_splits[3] = { split_items[1] * RANDOMX_DATASET_ITEM_SIZE, split_items[2] * RANDOMX_DATASET_ITEM_SIZE, 0xFFFFFFFFU };
+
+			std::vector<uint8_t> split_hashes;
+			double split_seconds;
+			const bool split_ok = portable_hashes(ctx, parts[0], nullptr, nullptr, false, LIGHT_TEST_HASHES, LIGHT_TEST_HASHES, split_hashes, split_seconds, dataset_parts, dataset_splits);
+
+			for (int i = 0; i < 3; ++i)
+				clReleaseMemObject(parts[i]);
+
+			if (!split_ok || !check_portable_hashes(cache.get(), split_hashes, "Dataset parts"))
+			{
+				return false;
+			}
+
+			std::cout << "Dataset parts test passed, splits at items " << split_items[1] << " and " << split_items[2] << std::endl;
+		}
+	}
+
 	auto start_time = high_resolution_clock::now();
 
+	// Tests above set other arguments (or built the kernels again), benchmarks use the buffers of the first tests
 	kernel = ctx.kernels[CL_FILLAES1RX4_SCRATCHPAD];
+	if (!clSetKernelArgs(kernel, hash_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity), scratchpads_gpu, scratchpads_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity)))
+	{
+		return false;
+	}
+
 	for (int i = 0; i < 100; ++i)
 	{
 		std::cout << "Benchmarking fillAes1Rx4 " << (i + 1) << "/100";
@@ -347,6 +1045,11 @@ bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity)
 	start_time = high_resolution_clock::now();
 
 	kernel = ctx.kernels[CL_HASHAES1RX4];
+	if (!clSetKernelArgs(kernel, scratchpads_gpu, registers_gpu, 192, REGISTERS_SIZE, static_cast<uint32_t>(intensity), scratchpads_gpu, scratchpads_gpu, scratchpads_gpu, static_cast<uint32_t>(intensity)))
+	{
+		return false;
+	}
+
 	for (int i = 0; i < 100; ++i)
 	{
 		std::cout << "Benchmarking hashAes1Rx4 " << (i + 1) << "/100";
@@ -19,4 +19,7 @@ along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
 
 #pragma once
 
-bool tests(uint32_t platform_id, uint32_t device_id, size_t intensity);
+#include <stdint.h>
+#include <CL/cl.h>
+
+bool tests(uint32_t platform_id, uint32_t device_id, cl_device_type device_type, size_t intensity);
@@ -0,0 +1,230 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include "trace.h"
+
+using namespace std::chrono;
+
+// The timeline stops growing after this many events (about 40 MB of JSON), the summary keeps counting
+static constexpr size_t TRACE_MAX_EVENTS = 1 << 20;
+
+// Host events are shown as process 0, devices as processes 1, 2, ...
+static constexpr uint32_t TRACE_HOST_PID = 0;
+
+Tracer* Tracer::instance = nullptr;
+
+Tracer::Tracer(const std::string& path)
+	: path(path)
+	, start(duration_cast<nanoseconds>(high_resolution_clock::now().time_since_epoch()).count())
+	, written(false)
+{
+	instance = this;
+}
+
+Tracer::~Tracer()
+{
+	if (!written)
+		Write();
+
+	instance = nullptr;
+}
+
+uint64_t Tracer::Now() const
+{
+	return duration_cast<nanoseconds>(high_resolution_clock::now().time_since_epoch()).count() - start;
+}
+
+void Tracer::HostEvent(const char* name, uint64_t begin, uint64_t end)
+{
+	const uint64_t thread_id = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Small thread numbers are easier to read than hashes
+	auto it = host_threads.find(thread_id);
+	if (it == host_threads.end())
+		it = host_threads.emplace(thread_id, static_cast<uint32_t>(host_threads.size())).first;
+
+	if (events.size() < TRACE_MAX_EVENTS)
+		events.push_back({ name, TRACE_HOST_PID, it->second, begin, end });
+}
+
+void Tracer::DeviceBatch(uint32_t device, uint32_t slot, std::vector<TraceCommand>& commands)
+{
+	struct Timing
+	{
+		const char* name;
+		cl_ulong queued, start, end;
+		uint64_t host_enqueue;
+	};
+
+	std::vector<Timing> timings;
+	timings.reserve(commands.size());
+
+	for (TraceCommand& c : commands)
+	{
+		Timing t = { c.name, 0, 0, 0, c.host_enqueue };
+		if (c.event &&
+			(clGetEventProfilingInfo(c.event, CL_PROFILING_COMMAND_QUEUED, sizeof(t.queued), &t.queued, nullptr) == CL_SUCCESS) &&
+			(clGetEventProfilingInfo(c.event, CL_PROFILING_COMMAND_START, sizeof(t.start), &t.start, nullptr) == CL_SUCCESS) &&
+			(clGetEventProfilingInfo(c.event, CL_PROFILING_COMMAND_END, sizeof(t.end), &t.end, nullptr) == CL_SUCCESS) &&
+			(t.end >= t.start))
+		{
+			timings.push_back(t);
+		}
+
+		if (c.event)
+			clReleaseEvent(c.event);
+	}
+	commands.clear();
+
+	if (timings.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	DeviceStats& d = devices[device];
+
+	// Device timestamps use their own clock. A command is queued during its enqueue call, so host time before the call minus
+	// the queued timestamp is never more than the real offset: the largest of these estimates is the closest one.
+	for (const Timing& t : timings)
+	{
+		const int64_t offset = static_cast<int64_t>(t.host_enqueue) - static_cast<int64_t>(t.queued);
+		if (!d.clock_offset_valid || (offset > d.clock_offset))
+		{
+			d.clock_offset = offset;
+			d.clock_offset_valid = true;
+		}
+	}
+
+	cl_ulong batch_start = timings.front().start;
+	cl_ulong batch_end = timings.front().end;
+	std::map<std::string, double> stage_ns;
+
+	for (const Timing& t : timings)
+	{
+		batch_start = std::min(batch_start, t.start);
+		batch_end = std::max(batch_end, t.end);
+		stage_ns[t.name] += static_cast<double>(t.end - t.start);
+
+		if (events.size() < TRACE_MAX_EVENTS)
+		{
+			const int64_t begin = static_cast<int64_t>(t.start) + d.clock_offset;
+			const int64_t end = static_cast<int64_t>(t.end) + d.clock_offset;
+			events.push_back({ t.name, device + 1, slot, static_cast<uint64_t>(std::max<int64_t>(begin, 0)), static_cast<uint64_t>(std::max<int64_t>(end, 0)) });
+		}
+	}
+
+	const double batch_ns = static_cast<double>(batch_end - batch_start);
+	if (batch_ns <= 0.0)
+		return;
+
+	++d.batches;
+	d.total_batch_ns += batch_ns;
+
+	for (const auto& s : stage_ns)
+	{
+		StageStats& stats = d.stages[s.first];
+		if (stats.shares.empty())
+			stats.total_ns = 0.0;
+
+		stats.shares.push_back(s.second / batch_ns);
+		stats.total_ns += s.second;
+	}
+}
+
+bool Tracer::Write()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	written = true;
+
+	PrintSummary();
+
+	std::ofstream f(path);
+	if (!f.is_open())
+	{
+		std::cerr << "Couldn't create " << path << std::endl;
+		return false;
+	}
+
+	f << "{\"traceEvents\":[\n";
+	f << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << TRACE_HOST_PID << ",\"args\":{\"name\":\"Host\"}}";
+	for (const auto& d : devices)
+		f << ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << (d.first + 1) << ",\"args\":{\"name\":\"GPU #" << d.first << "\"}}";
+
+	char buf[256];
+	for (const Event& e : events)
+	{
+		// Timestamps are in microseconds
+		snprintf(buf, sizeof(buf), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			e.name, e.pid, e.tid, e.begin / 1e3, (e.end - std::min(e.begin, e.end)) / 1e3);
+		f << buf;
+	}
+	f << "\n]}\n";
+
+	if (!f.good())
+	{
+		std::cerr << "Couldn't write " << path << std::endl;
+		return false;
+	}
+
+	std::cout << "Trace with " << events.size() << " events written to " << path << std::endl;
+	return true;
+}
+
+void Tracer::PrintSummary()
+{
+	for (auto& d : devices)
+	{
+		if (!d.second.batches)
+			continue;
+
+		printf("\nGPU #%u: %llu batches, %.3f ms per batch on the GPU\n", d.first, static_cast<unsigned long long>(d.second.batches), d.second.total_batch_ns / d.second.batches / 1e6);
+		printf("%-36s %12s %8s %8s %8s\n", "stage", "ms/batch", "mean", "p50", "p99");
+
+		// Most expensive stages first
+		std::vector<std::pair<std::string, StageStats*>> stages;
+		for (auto& s : d.second.stages)
+			stages.emplace_back(s.first, &s.second);
+
+		std::sort(stages.begin(), stages.end(), [](const std::pair<std::string, StageStats*>& a, const std::pair<std::string, StageStats*>& b) { return a.second->total_ns > b.second->total_ns; });
+
+		for (auto& s : stages)
+		{
+			std::vector<double>& shares = s.second->shares;
+			std::sort(shares.begin(), shares.end());
+
+			double mean = 0.0;
+			for (double x : shares)
+				mean += x;
+			mean /= shares.size();
+
+			const double p50 = shares[shares.size() / 2];
+			const double p99 = shares[std::min(shares.size() - 1, shares.size() * 99 / 100)];
+
+			printf("%-36s %12.3f %7.2f%% %7.2f%% %7.2f%%\n", s.first.c_str(), s.second->total_ns / d.second.batches / 1e6, mean * 100.0, p50 * 100.0, p99 * 100.0);
+		}
+	}
+}
@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+// One device command of a traced batch: its profiling event and when the host enqueued it
+struct TraceCommand
+{
+	const char* name;
+	cl_event event;
+	uint64_t host_enqueue;
+};
+
+// Profiling mode (--trace FILE): device timings of every command of every batch and host phases (compile, dataset build,
+// validation) on one timeline. It's written as a Chrome trace-event JSON file (chrome://tracing, Perfetto), and a per-stage
+// summary of batch time is printed when mining ends. Tracing is process-wide, Instance() is nullptr when it's off.
+class Tracer
+{
+public:
+	explicit Tracer(const std::string& path);
+	~Tracer();
+
+	static Tracer* Instance() { return instance; }
+
+	// Host time in nanoseconds since the tracer was created
+	uint64_t Now() const;
+
+	// Host phase on the calling thread
+	void HostEvent(const char* name, uint64_t begin, uint64_t end);
+
+	// Commands of one finished batch of "device", in enqueue order. Events are released.
+	void DeviceBatch(uint32_t device, uint32_t slot, std::vector<TraceCommand>& commands);
+
+	// Writes the timeline and prints the summary, called by the destructor
+	bool Write();
+
+private:
+	struct Event
+	{
+		const char* name;
+		uint32_t pid;
+		uint32_t tid;
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	// Share of batch time for every stage of every batch
+	struct StageStats
+	{
+		std::vector<double> shares;
+		double total_ns;
+	};
+
+	struct DeviceStats
+	{
+		DeviceStats() : clock_offset(0), clock_offset_valid(false), batches(0), total_batch_ns(0.0) {}
+
+		// Host time = device time + clock_offset, estimated from enqueue times
+		int64_t clock_offset;
+		bool clock_offset_valid;
+
+		uint64_t batches;
+		double total_batch_ns;
+		std::map<std::string, StageStats> stages;
+	};
+
+	void PrintSummary();
+
+	static Tracer* instance;
+
+	const std::string path;
+	const uint64_t start;
+	bool written;
+
+	std::mutex mutex;
+	std::vector<Event> events;
+	std::map<uint32_t, DeviceStats> devices;
+	std::map<uint64_t, uint32_t> host_threads;
+};
+
+// Records the time between its construction and destruction as a host phase, does nothing if tracing is off
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name) : tracer(Tracer::Instance()), name(name), begin(tracer ? tracer->Now() : 0) {}
+	~TraceScope() { if (tracer) tracer->HostEvent(name, begin, tracer->Now()); }
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	Tracer* tracer;
+	const char* name;
+	uint64_t begin;
+};
@@ -0,0 +1,366 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include "validator.h"
+#include "definitions.h"
+#include "dataset.h"
+#include "trace.h"
+
+// Queue entries per pool, every batch takes at most one entry per thread
+static constexpr size_t VALIDATION_QUEUE_SIZE = 1024;
+
+// Hashes per work item, small enough to spread a sampled batch over all threads
+static constexpr uint32_t VALIDATION_CHUNK_SIZE = 16;
+
+// Automatic sampling never goes below 1 in this many hashes
+static constexpr uint32_t VALIDATION_MAX_RATE = 1 << 16;
+
+// One hash to check: the CPU result for "index" must match "hash"
+struct ValidationEntry
+{
+	uint32_t index;
+	bool share;
+	uint8_t hash[32];
+};
+
+// Sampled part of one finished batch. Threads take chunks of entries until there are none left,
+// and the thread that finishes the last chunk reports the batch.
+struct ValidationBatch
+{
+	std::shared_ptr<HostDataset> source;
+	bool light;
+	Job job;
+	size_t nonce;
+	size_t batch_size;
+	uint64_t target;
+
+	// All hashes of the batch are sampled, so the number of shares the GPU found can be checked too
+	bool full;
+	uint32_t gpu_shares;
+
+	std::vector<ValidationEntry> entries;
+	uint32_t num_chunks;
+	std::atomic<uint32_t> next_chunk;
+	std::atomic<uint32_t> chunks_done;
+	std::atomic<uint32_t> cpu_shares;
+	std::atomic<uint32_t> failed;
+
+	DeviceValidator* owner;
+};
+
+ValidatorPool::ValidatorPool(uint32_t num_threads)
+	: queue(VALIDATION_QUEUE_SIZE)
+	, stop(false)
+	, large_pages_available(true)
+{
+	for (uint32_t i = 0; i < std::max(num_threads, 1U); ++i)
+		threads.emplace_back([this]() { Worker(); });
+}
+
+ValidatorPool::~ValidatorPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	work_available.notify_all();
+
+	for (SThread& t : threads)
+		t.join();
+}
+
+bool ValidatorPool::Push(const std::shared_ptr<ValidationBatch>& batch)
+{
+	// Threads keep taking chunks of a batch until there are none left, so one entry is enough to finish it and more just add threads
+	const uint32_t n = std::min(batch->num_chunks, NumThreads());
+
+	uint32_t pushed = 0;
+	while ((pushed < n) && queue.Push(batch))
+		++pushed;
+
+	if (!pushed)
+		return false;
+
+	// Threads check the queue again under the mutex before they wait, so notifying under it can't be missed
+	std::lock_guard<std::mutex> lock(mutex);
+	if (pushed > 1)
+		work_available.notify_all();
+	else
+		work_available.notify_one();
+
+	return true;
+}
+
+void ValidatorPool::Worker()
+{
+	randomx_vm* vm = nullptr;
+	std::shared_ptr<HostDataset> vm_source;
+
+	for (;;)
+	{
+		std::shared_ptr<ValidationBatch> batch;
+		if (!queue.Pop(batch))
+		{
+			// Lock-free pops, the mutex is only needed to sleep without missing a notification
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stop && !queue.Pop(batch))
+				work_available.wait(lock);
+
+			if (!batch)
+				break;
+		}
+
+		if (batch->source != vm_source)
+		{
+			if (vm)
+				randomx_destroy_vm(vm);
+
+			randomx_cache* cache = batch->light ? batch->source->cache : nullptr;
+			randomx_dataset* dataset = batch->light ? nullptr : batch->source->dataset;
+
+			const randomx_flags flags = (randomx_flags)((cache ? 0 : RANDOMX_FLAG_FULL_MEM) | RANDOMX_FLAG_JIT | RANDOMX_FLAG_HARD_AES);
+			vm = randomx_create_vm((randomx_flags)(flags | (large_pages_available ? RANDOMX_FLAG_LARGE_PAGES : 0)), cache, dataset);
+
+			if (!vm && large_pages_available)
+			{
+				large_pages_available = false;
+				vm = randomx_create_vm(flags, cache, dataset);
+			}
+
+			vm_source = vm ? batch->source : nullptr;
+		}
+
+		TraceScope trace("validate");
+
+		DeviceValidator& owner = *batch->owner;
+		std::vector<uint8_t> buf = batch->job.blob;
+
+		for (;;)
+		{
+			const uint32_t chunk = batch->next_chunk.fetch_add(1);
+			if (chunk >= batch->num_chunks)
+				break;
+
+			const size_t begin = static_cast<size_t>(chunk) * VALIDATION_CHUNK_SIZE;
+			const size_t end = std::min(begin + VALIDATION_CHUNK_SIZE, batch->entries.size());
+
+			for (size_t i = begin; i < end; ++i)
+			{
+				const ValidationEntry& e = batch->entries[i];
+				const size_t nonce = batch->nonce + e.index;
+
+				uint8_t hash[32];
+				if (vm)
+				{
+					batch->job.SetNonce(buf.data(), nonce);
+					randomx_calculate_hash(vm, buf.data(), buf.size(), hash);
+				}
+
+				if (!vm || memcmp(hash, e.hash, sizeof(hash)))
+				{
+					std::stringstream s;
+					s << owner.prefix << "CPU validation error, " << (e.share ? "invalid share for nonce = " : "failing nonce = ") << nonce << "\n";
+					std::cerr << s.str() << std::flush;
+					++batch->failed;
+				}
+				else if (!e.share && (*(uint64_t*)(hash + 24) < batch->target))
+				{
+					++batch->cpu_shares;
+				}
+			}
+
+			if (batch->chunks_done.fetch_add(1) + 1 < batch->num_chunks)
+				continue;
+
+			// Last chunk: every hash below the target must have been reported by the GPU. Every missing or extra share is a failure.
+			if (batch->full && (batch->gpu_shares != batch->cpu_shares))
+			{
+				std::stringstream s;
+				s << owner.prefix << "CPU validation error, " << batch->gpu_shares << " shares found on GPU, expected " << batch->cpu_shares << "\n";
+				std::cerr << s.str() << std::flush;
+
+				const uint32_t gpu_shares = batch->gpu_shares;
+				const uint32_t cpu_shares = batch->cpu_shares;
+				batch->failed += (gpu_shares > cpu_shares) ? (gpu_shares - cpu_shares) : (cpu_shares - gpu_shares);
+			}
+
+			uint64_t num_validated = 0;
+			for (const ValidationEntry& e : batch->entries)
+			{
+				if (!e.share)
+					++num_validated;
+			}
+
+			owner.failed += batch->failed;
+			owner.validated += num_validated;
+			--owner.pending;
+		}
+	}
+
+	if (vm)
+		randomx_destroy_vm(vm);
+}
+
+DeviceValidator::DeviceValidator(ValidatorPool& pool, uint32_t rate, uint32_t max_lag, const std::string& prefix)
+	: hashes(0)
+	, validated(0)
+	, failed(0)
+	, skipped(0)
+	, pending(0)
+	, prefix(prefix)
+	, pool(pool)
+	, auto_rate(rate == 0)
+	, max_lag(std::max(max_lag, 1U))
+	, rate(std::max(rate, 1U))
+	, rng(0x9E3779B97F4A7C15ULL ^ reinterpret_cast<uintptr_t>(this))
+{
+}
+
+DeviceValidator::~DeviceValidator()
+{
+	Drain();
+}
+
+void DeviceValidator::Submit(const std::shared_ptr<HostDataset>& source, bool light, const Job& job, size_t nonce, const uint8_t* gpu_hashes, size_t batch_size, const uint32_t* shares, uint64_t target)
+{
+	hashes += batch_size;
+
+	const uint32_t lag = pending;
+
+	// Automatic sampling halves the work per batch while the pool is behind, and doubles it back when it's idle
+	if (auto_rate)
+	{
+		if ((lag * 2 >= max_lag) && (rate < VALIDATION_MAX_RATE))
+			rate *= 2;
+		else if ((lag == 0) && (rate > 1))
+			rate /= 2;
+	}
+
+	if (lag >= max_lag)
+	{
+		skipped += batch_size;
+		return;
+	}
+
+	std::shared_ptr<ValidationBatch> batch = std::make_shared<ValidationBatch>();
+	batch->source = source;
+	batch->light = light;
+	batch->job = job;
+	batch->nonce = nonce;
+	batch->batch_size = batch_size;
+	batch->target = target;
+	batch->full = (rate == 1);
+	batch->gpu_shares = shares[0];
+	batch->next_chunk = 0;
+	batch->chunks_done = 0;
+	batch->cpu_shares = 0;
+	batch->failed = 0;
+	batch->owner = this;
+
+	// Systematic sampling from a random offset: every hash has the same chance to be checked, and batches don't always check the same nonces
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+
+	batch->entries.reserve(batch_size / rate + MAX_SHARES + 1);
+	for (size_t i = rng % rate; i < batch_size; i += rate)
+	{
+		ValidationEntry e;
+		e.index = static_cast<uint32_t>(i);
+		e.share = false;
+		memcpy(e.hash, gpu_hashes + i * 32, sizeof(e.hash));
+		batch->entries.emplace_back(e);
+	}
+
+	// Shares are always checked, they're the hashes that matter
+	for (uint32_t i = 0, n = std::min<uint32_t>(shares[0], MAX_SHARES); i < n; ++i)
+	{
+		const uint32_t* share = shares + 1 + i * (SHARE_SIZE / sizeof(uint32_t));
+		const uint32_t index = share[0] - static_cast<uint32_t>(nonce);
+		if (index >= batch_size)
+		{
+			std::cerr << prefix << "CPU validation error, invalid share for nonce = " << share[0] << std::endl;
+			++failed;
+			continue;
+		}
+
+		ValidationEntry e;
+		e.index = index;
+		e.share = true;
+		memcpy(e.hash, share + 1, sizeof(e.hash));
+		batch->entries.emplace_back(e);
+	}
+
+	if (batch->entries.empty())
+		return;
+
+	batch->num_chunks = static_cast<uint32_t>((batch->entries.size() + VALIDATION_CHUNK_SIZE - 1) / VALIDATION_CHUNK_SIZE);
+
+	++pending;
+	if (!pool.Push(batch))
+	{
+		--pending;
+		skipped += batch_size;
+	}
+}
+
+void DeviceValidator::Drain()
+{
+	while (pending)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+std::string DeviceValidator::Summary() const
+{
+	const uint64_t n = validated;
+	const uint64_t f = failed;
+
+	std::stringstream s;
+	s << (n - std::min(n, f)) << " of " << hashes << " hashes validated successfully";
+	if (auto_rate || (rate > 1))
+		s << " (1 in " << rate << ")";
+	s << ", " << f << " failed";
+
+	if (n)
+	{
+		s.precision(3);
+		s << ", failure rate < " << (failure_rate_upper_bound(n, f) * 100.0) << "% (95% confidence)";
+	}
+
+	if (skipped)
+		s << ", " << skipped << " skipped, limited by CPU";
+
+	return s.str();
+}
+
+double failure_rate_upper_bound(uint64_t validated, uint64_t failed)
+{
+	if (!validated)
+		return 1.0;
+
+	constexpr double z = 1.96;
+	const double n = static_cast<double>(validated);
+	const double p = std::min(static_cast<double>(failed), n) / n;
+
+	return std::min((p + z * z / (2 * n) + z * std::sqrt(p * (1.0 - p) / n + z * z / (4 * n * n))) / (1.0 + z * z / n), 1.0);
+}
@@ -0,0 +1,206 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include "opencl_helpers.h"
+#include "job.h"
+
+class HostDataset;
+
+// Batches per pipelined slot that can wait for validation before new ones are skipped
+static constexpr uint32_t VALIDATION_MAX_LAG = 4;
+
+// Bounded multi-producer multi-consumer queue (D. Vyukov's algorithm): every cell has a sequence number
+// that tells producers and consumers whose turn it is, so Push() and Pop() never take a lock.
+template<typename T>
+class MPMCQueue
+{
+public:
+	// "capacity" must be a power of 2
+	explicit MPMCQueue(size_t capacity)
+		: cells(new Cell[capacity])
+		, mask(capacity - 1)
+		, head(0)
+		, tail(0)
+	{
+		for (size_t i = 0; i < capacity; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	MPMCQueue(const MPMCQueue&) = delete;
+	MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+	// Returns false if the queue is full
+	bool Push(const T& value)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Cell& cell = cells[pos & mask];
+			const size_t seq = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0)
+			{
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					cell.data = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Returns false if the queue is empty
+	bool Pop(T& value)
+	{
+		size_t pos = head.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Cell& cell = cells[pos & mask];
+			const size_t seq = cell.sequence.load(std::memory_order_acquire);
+			const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+			if (diff == 0)
+			{
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					value = std::move(cell.data);
+					cell.data = T();
+					cell.sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	const size_t mask;
+
+	// Producers and consumers update different cache lines
+	char pad0[64];
+	std::atomic<size_t> head;
+	char pad1[64];
+	std::atomic<size_t> tail;
+};
+
+struct ValidationBatch;
+
+// Long-lived CPU validation threads shared by all devices. Every thread keeps its randomx_vm between batches
+// and only creates a new one when the dataset (or the cache in light mode) changes.
+class ValidatorPool
+{
+public:
+	explicit ValidatorPool(uint32_t num_threads);
+	~ValidatorPool();
+
+	uint32_t NumThreads() const { return static_cast<uint32_t>(threads.size()); }
+
+	// Queues a batch for all threads that are free to work on it, returns false if the queue is full
+	bool Push(const std::shared_ptr<ValidationBatch>& batch);
+
+private:
+	void Worker();
+
+	MPMCQueue<std::shared_ptr<ValidationBatch>> queue;
+
+	// Only used to sleep while the queue is empty
+	std::mutex mutex;
+	std::condition_variable work_available;
+	std::atomic<bool> stop;
+
+	std::atomic<bool> large_pages_available;
+
+	// Must be the last member
+	std::vector<SThread> threads;
+};
+
+// One device's validation: picks which hashes of every finished batch are checked, hands them to the pool
+// and collects the results. Batches are validated asynchronously, at most "max_lag" of them can be in progress.
+// When the pool falls behind, new batches are skipped instead of stalling the GPU, and with automatic sampling
+// (rate 0) fewer hashes of every batch are checked until the pool keeps up again.
+class DeviceValidator
+{
+public:
+	// 1 in "rate" hashes of every batch are validated, 0 = choose the rate automatically
+	DeviceValidator(ValidatorPool& pool, uint32_t rate, uint32_t max_lag, const std::string& prefix);
+	~DeviceValidator();
+
+	// "hashes" are all GPU hashes of the batch, "shares" is the shares buffer. Both are copied, only the sampled part.
+	void Submit(const std::shared_ptr<HostDataset>& source, bool light, const Job& job, size_t nonce, const uint8_t* hashes, size_t batch_size, const uint32_t* shares, uint64_t target);
+
+	// Blocks until all submitted batches are validated
+	void Drain();
+
+	// Current sampling rate (1 in N hashes)
+	uint32_t Rate() const { return rate; }
+
+	// "X of Y hashes validated (1 in N), F failed, failure rate < P% (95% confidence)"
+	std::string Summary() const;
+
+	// Hashes the GPU computed, hashes checked on the CPU, mismatches and hashes skipped because validation was behind
+	std::atomic<uint64_t> hashes;
+	std::atomic<uint64_t> validated;
+	std::atomic<uint64_t> failed;
+	std::atomic<uint64_t> skipped;
+
+	// Batches submitted but not finished yet
+	std::atomic<uint32_t> pending;
+
+	const std::string prefix;
+
+private:
+	ValidatorPool& pool;
+	const bool auto_rate;
+	const uint32_t max_lag;
+	uint32_t rate;
+	uint64_t rng;
+};
+
+// Upper bound of the real failure rate with 95% confidence (Wilson score interval) after "failed" of "validated" hashes failed
+double failure_rate_upper_bound(uint64_t validated, uint64_t failed);
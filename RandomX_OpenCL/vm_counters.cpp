@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sstream>
+#include "vm_counters.h"
+#include "definitions.h"
+
+// execute_vm's opcodes, see inner_loop() in CL/randomx_vm.cl
+static const char* const OPCODE_NAMES[16] =
+{
+	"IADD_RS+imm", "IADD/ISUB", "IMUL", "IXOR/FSCAL", "ISMULH", "INEG", "IMULH", "IROR/IROL",
+	"ISWAP/NOP", "CBRANCH", "ISTORE", "FSWAP", "FADD/FSUB/FMUL", "CFROUND", "FSQRT", "FDIV_M",
+};
+
+VmCounters::VmCounters()
+	: totals(VM_COUNTERS_COUNT, 0)
+	, hashes(0)
+{
+}
+
+void VmCounters::Add(const std::vector<uint32_t>& counters, size_t num_hashes)
+{
+	for (size_t i = 0; i < num_hashes; ++i)
+	{
+		for (size_t j = 0; j < VM_COUNTERS_COUNT; ++j)
+			totals[j] += counters[i * VM_COUNTERS_COUNT + j];
+	}
+	hashes += num_hashes;
+}
+
+std::string VmCounters::Report() const
+{
+	if (!hashes)
+		return "VM counters: no hashes yet";
+
+	const double n = static_cast<double>(hashes);
+	const double program_slots = static_cast<double>(totals[VM_COUNTER_PROGRAM_SLOTS]);
+	const double executed_slots = static_cast<double>(totals[VM_COUNTER_EXECUTED_SLOTS]);
+
+	uint64_t instructions = 0;
+	for (size_t i = 0; i < 16; ++i)
+		instructions += totals[VM_COUNTER_OPCODES + i];
+
+	std::stringstream s;
+	s.precision(4);
+	s << "VM counters over " << hashes << " hashes, per hash:\n";
+
+	s << "  " << (executed_slots / n) << " instructions executed, " << (program_slots / n) << " in programs";
+	if (program_slots > 0.0)
+		s << " (" << ((executed_slots - program_slots) * 100.0 / program_slots) << "% replayed)";
+	s << ", " << (totals[VM_COUNTER_CBRANCH_TAKEN] / n) << " CBRANCH taken, " << (totals[VM_COUNTER_CFROUND_CHANGES] / n) << " rounding mode changes\n";
+
+	s << "  opcodes:";
+	for (size_t i = 0; i < 16; ++i)
+	{
+		if (totals[VM_COUNTER_OPCODES + i] && instructions)
+			s << " " << OPCODE_NAMES[i] << " " << (totals[VM_COUNTER_OPCODES + i] * 100.0 / instructions) << "%";
+	}
+	s << "\n";
+
+	// Width is the number of workers a group of instructions runs on, FP instructions take 2 of them
+	uint64_t groups = 0;
+	uint64_t workers = 0;
+	for (size_t i = 0; i < 16; ++i)
+	{
+		groups += totals[VM_COUNTER_GROUP_WIDTHS + i];
+		workers += totals[VM_COUNTER_GROUP_WIDTHS + i] * (i + 1);
+	}
+	s << "  " << (groups / n) << " groups";
+	if (groups)
+	{
+		s << ", " << (static_cast<double>(workers) / groups) << " workers on average:";
+		for (size_t i = 0; i < 16; ++i)
+		{
+			if (totals[VM_COUNTER_GROUP_WIDTHS + i])
+				s << " " << (i + 1) << ": " << (totals[VM_COUNTER_GROUP_WIDTHS + i] * 100.0 / groups) << "%";
+		}
+	}
+	s << "\n";
+
+	s << "  scratchpad reads L1/L2/L3: " << (totals[VM_COUNTER_READS_L1] / n) << " / " << (totals[VM_COUNTER_READS_L2] / n) << " / " << (totals[VM_COUNTER_READS_L3] / n);
+	s << ", stores L1/L2/L3: " << (totals[VM_COUNTER_STORES_L1] / n) << " / " << (totals[VM_COUNTER_STORES_L2] / n) << " / " << (totals[VM_COUNTER_STORES_L3] / n);
+
+	return s.str();
+}
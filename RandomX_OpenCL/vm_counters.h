@@ -0,0 +1,41 @@
+/*
+Copyright (c) 2019 SChernykh
+
+This file is part of RandomX OpenCL.
+
+RandomX OpenCL is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RandomX OpenCL is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with RandomX OpenCL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Totals of the instrumented execute_vm's per-hash counters (--vm_counters, see VM_COUNTERS_COUNT in CL/randomx_constants.h)
+// over all batches of one device, and a per-hash summary of them for the log
+class VmCounters
+{
+public:
+	VmCounters();
+
+	// Counters of "num_hashes" hashes, VM_COUNTERS_COUNT each
+	void Add(const std::vector<uint32_t>& counters, size_t num_hashes);
+
+	std::string Report() const;
+
+private:
+	std::vector<uint64_t> totals;
+	uint64_t hashes;
+};